@@ -1,4 +1,7 @@
+#include "string.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "scheduler.h"
 #include "nimble/nimble_port.h"
 #include "nimble/nimble_port_freertos.h"
 #include "host/ble_hs.h"
@@ -7,7 +10,13 @@
 
 #include "lywsd02.h"
 
-#define MAC_ADDR (CONFIG_LYWSD02_MAC_ADDR)
+#define MAC_ADDRS (CONFIG_LYWSD02_MAC_ADDRS)
+#define ADV_TIMEOUT_MILLIS   (CONFIG_LYWSD02_ADV_TIMEOUT_SECS * 1000)
+#define SLICE_MILLIS         (20 * 1000)  // Longest a connection may take
+#define POLL_INTERVAL_MILLIS (5 * 1000)
+
+// Xiaomi MiBeacon, service data of UUID 0xfe95
+#define MIBEACON_UUID         (0xfe95)
 
 static const char* TAG = "lywsd02";
 
@@ -15,79 +24,193 @@ static uint16_t CHAR_NOTI_HANDLE  = 0x004c;
 static uint8_t  CHAR_NOTI_VALUE[] = { 0x01, 0x00 };
 static uint16_t CHAR_DATA_HANDLE  = 0x004b;
 
-static ble_addr_t    peer_addr;
+// Last known readings of each clock, from advertisements or connections.
+// Only the NimBLE host task touches these and the connection state below:
+// GAP events arrive there and polls are run there too, see poll_callout.
+typedef struct {
+    ble_addr_t addr;
+    char name[18];
+    int16_t temp_centi;
+    int16_t humi_deci;     // -1 until known
+    int8_t battery;        // -1 until known
+    int64_t seen_at;       // Last reading, in milliseconds since boot
+    int64_t tried_at;      // Last connection attempt
+} lywsd02_device_t;
+
+static lywsd02_device_t devices[LYWSD02_MAX_DEVICES];
+static size_t devices_len = 0;
+static int connected = -1;         // Device holding the connection slot, or -1
+static int64_t connected_at = 0;
+static uint16_t conn_handle = 0;
+static size_t next_poll = 0;       // Round robin of connections
+static struct ble_npl_callout poll_callout;
 static QueueHandle_t data_queue = NULL;
+static StaticQueue_t data_queue_buf;
+static uint8_t data_queue_storage[LYWSD02_MAX_DEVICES * 2 * sizeof(lywsd02_data_t)];
+static scheduler_job_t *listener = NULL;
+static lywsd02_stats_t stats = {};
 
 void ble_scan();
 
+static int lywsd02_find(const ble_addr_t *addr) {
+    for (size_t i = 0; i < devices_len; i++)
+        if (memcmp(devices[i].addr.val, addr->val, sizeof(addr->val)) == 0) return i;
+    return -1;
+}
+
+static void lywsd02_publish(size_t idx) {
+    lywsd02_device_t *dev = &devices[idx];
+    if (dev->humi_deci < 0) return;
+    lywsd02_data_t data = {
+        .temp_centi = dev->temp_centi,
+        .humi = (dev->humi_deci + 5) / 10,
+        .battery = dev->battery,
+        .device = idx,
+    };
+    dev->seen_at = esp_timer_get_time() / 1000;
+    ESP_LOGD(TAG, "[%s] Temp=%.2f Humi=%d%%", dev->name, data.temp_centi / 100.0f, data.humi);
+    stats.notifications++;
+    if (xQueueSend(data_queue, &data, 0) != pdTRUE) ESP_LOGW(TAG, "Queue full, drop reading");
+    scheduler_wake(listener);
+}
+
+static void lywsd02_on_adv(const struct ble_gap_disc_desc *disc) {
+    int idx = lywsd02_find(&disc->addr);
+    if (idx < 0) return;
+    struct ble_hs_adv_fields fields;
+    if (ble_hs_adv_parse_fields(&fields, disc->data, disc->length_data) != 0) return;
+    if (fields.svc_data_uuid16 == NULL || fields.svc_data_uuid16_len < 2) return;
+    uint16_t uuid = fields.svc_data_uuid16[0] | fields.svc_data_uuid16[1] << 8;
+    if (uuid != MIBEACON_UUID) return;
+
+    lywsd02_adv_t adv;
+    if (!lywsd02_parse_mibeacon(&fields.svc_data_uuid16[2], fields.svc_data_uuid16_len - 2, &adv))
+        return;
+    lywsd02_device_t *dev = &devices[idx];
+    stats.advertisements++;
+    if (adv.has_temp) dev->temp_centi = adv.temp_centi;
+    if (adv.has_humi) dev->humi_deci = adv.humi_deci;
+    if (adv.has_battery) dev->battery = adv.battery;
+    if (adv.has_temp || adv.has_humi) lywsd02_publish(idx);
+}
+
 int ble_on_gap_event(struct ble_gap_event *event, void *arg) {
     if (event->type == BLE_GAP_EVENT_CONNECT) {
         if (event->connect.status == 0) {
-            ESP_LOGI(TAG, "BLE connected");
+            ESP_LOGI(TAG, "BLE connected to %s", devices[connected].name);
+            stats.connects++;
+            conn_handle = event->connect.conn_handle;
             // Subscribe notification
-            int ret = ble_gattc_write_flat(event->connect.conn_handle, 
+            int ret = ble_gattc_write_flat(event->connect.conn_handle,
                 CHAR_NOTI_HANDLE, CHAR_NOTI_VALUE, sizeof(CHAR_NOTI_VALUE), NULL, NULL);
             if (ret) ESP_LOGW(TAG, "Fail to write char (%d)", ret);
         } else {
             ESP_LOGW(TAG, "BLE connect fail with %d", event->connect.status);
+            stats.connect_errors++;
+            connected = -1;
             ble_scan();
         }
 
     } else if (event->type == BLE_GAP_EVENT_DISCONNECT) {
         ESP_LOGI(TAG, "BLE disconnected (%d)", event->disconnect.reason);
+        stats.disconnects++;
+        connected = -1;
         ble_scan();
 
     } else if (event->type == BLE_GAP_EVENT_DISC) {
-        ESP_LOGI(TAG, "Device discovered: RSSI=%d", event->disc.rssi);
-        ESP_ERROR_CHECK(ble_gap_disc_cancel());
-        uint8_t own_addr_type;
-        ESP_ERROR_CHECK(ble_hs_id_infer_auto(0, &own_addr_type));
-        int ret = ble_gap_connect(own_addr_type, &event->disc.addr, 30000, NULL, ble_on_gap_event, NULL);
-        if (ret) ESP_LOGE(TAG, "ble_gap_connect fail: %d", ret);
+        lywsd02_on_adv(&event->disc);
 
     } else if (event->type == BLE_GAP_EVENT_NOTIFY_RX) {
         uint16_t attr_handle = event->notify_rx.attr_handle;
         uint16_t om_len = event->notify_rx.om->om_len;
         uint8_t* om_data = event->notify_rx.om->om_data;
         ESP_LOGD(TAG, "Notification received from %d, %d bytes", attr_handle, om_len);
-        if (attr_handle != CHAR_DATA_HANDLE) {
+        if (attr_handle != CHAR_DATA_HANDLE || connected < 0) {
             ESP_LOGI(TAG, "Unexpected char %d, ignored", attr_handle);
             return 0;
         }
-        if (om_len != 3) {
+        lywsd02_data_t data;
+        if (!lywsd02_parse_data(om_data, om_len, &data)) {
             ESP_LOGW(TAG, "Unexpected char data length %d", om_len);
             return 0;
         }
-        lywsd02_data_t* data = (lywsd02_data_t*) om_data;
-        ESP_LOGD(TAG, "Temp=%.2f Humi=%d%%", data->temp_centi / 100.0f, data->humi);
-        xQueueOverwrite(data_queue, data);
+        devices[connected].temp_centi = data.temp_centi;
+        devices[connected].humi_deci = data.humi * 10;
+        lywsd02_publish(connected);
+        // One reading is enough, free the slot for the next clock
+        ble_gap_terminate(event->notify_rx.conn_handle, BLE_ERR_REM_USER_CONN_TERM);
     }
     return 0;
 }
 
+// Connect to a clock silent in advertisements for too long, one at a time.
+// Abort a connection that takes longer than its slice.
+static void lywsd02_poll() {
+    int64_t now = esp_timer_get_time() / 1000;
+    if (connected >= 0) {
+        if (now - connected_at < SLICE_MILLIS) return;
+        ESP_LOGW(TAG, "Connection to %s took too long", devices[connected].name);
+        if (ble_gap_conn_active()) ble_gap_conn_cancel();
+        else ble_gap_terminate(conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+        return;
+    }
+    for (size_t n = 0; n < devices_len; n++) {
+        size_t i = (next_poll + n) % devices_len;
+        lywsd02_device_t *dev = &devices[i];
+        if (now - dev->seen_at < ADV_TIMEOUT_MILLIS || now - dev->tried_at < ADV_TIMEOUT_MILLIS)
+            continue;
+        next_poll = i + 1;
+        dev->tried_at = now;
+        connected = i;
+        connected_at = now;
+        if (ble_gap_disc_active()) ble_gap_disc_cancel();
+        uint8_t own_addr_type;
+        ESP_ERROR_CHECK(ble_hs_id_infer_auto(0, &own_addr_type));
+        ESP_LOGI(TAG, "No advertisement from %s, connecting", dev->name);
+        int ret = ble_gap_connect(own_addr_type, &dev->addr, SLICE_MILLIS, NULL, ble_on_gap_event, NULL);
+        if (ret) {
+            ESP_LOGE(TAG, "ble_gap_connect fail: %d", ret);
+            connected = -1;
+            ble_scan();
+        }
+        return;
+    }
+}
+
+// Run on the host task every POLL_INTERVAL_MILLIS, once synced
+static void lywsd02_poll_event(struct ble_npl_event *ev) {
+    lywsd02_poll();
+    ble_npl_callout_reset(&poll_callout, ble_npl_time_ms_to_ticks32(POLL_INTERVAL_MILLIS));
+}
+
 static void ble_on_reset(int reason) {
     MODLOG_DFLT(ERROR, "Resetting state; reason=%d\n", reason);
 }
 
 static void ble_on_sync() {
     ESP_ERROR_CHECK(ble_hs_util_ensure_addr(0));
-    ESP_LOGI(TAG, "Scanning for [%s]...", MAC_ADDR);
+    ESP_LOGI(TAG, "Scanning for [%s]...", MAC_ADDRS);
 
     ble_scan();
+    ble_npl_callout_reset(&poll_callout, ble_npl_time_ms_to_ticks32(POLL_INTERVAL_MILLIS));
 }
 
 void ble_scan() {
     uint8_t own_addr_type;
     ESP_ERROR_CHECK(ble_hs_id_infer_auto(true, &own_addr_type));
 
+    // Every advertisement counts, they carry the readings
     struct ble_gap_disc_params disc_params = {
         .filter_policy = BLE_HCI_SCAN_FILT_USE_WL,
         .passive = true,
-        .filter_duplicates = true,
+        .filter_duplicates = false,
     };
+    ble_addr_t addrs[LYWSD02_MAX_DEVICES];
+    for (size_t i = 0; i < devices_len; i++) addrs[i] = devices[i].addr;
 
-    ESP_ERROR_CHECK(ble_gap_wl_set(&peer_addr, 1));
-    ESP_ERROR_CHECK(ble_gap_disc(own_addr_type, BLE_HS_FOREVER, &disc_params, ble_on_gap_event, NULL));
+    ESP_ERROR_CHECK(ble_gap_wl_set(addrs, devices_len));
+    int ret = ble_gap_disc(own_addr_type, BLE_HS_FOREVER, &disc_params, ble_on_gap_event, NULL);
+    if (ret != 0 && ret != BLE_HS_EALREADY) ESP_LOGE(TAG, "ble_gap_disc fail: %d", ret);
 }
 
 void blecent_host_task(void *param) {
@@ -96,14 +219,33 @@ void blecent_host_task(void *param) {
     nimble_port_freertos_deinit();
 }
 
-void lywsd02_init() {
-    sscanf(MAC_ADDR, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
-        &peer_addr.val[5], &peer_addr.val[4], &peer_addr.val[3],
-        &peer_addr.val[2], &peer_addr.val[1], &peer_addr.val[0]);
-    data_queue = xQueueCreate(1, sizeof(lywsd02_data_t));
-    assert(data_queue != 0);
+void lywsd02_init(scheduler_job_t *on_data) {
+    // Comma separated MAC addresses
+    const char *p = MAC_ADDRS;
+    while (*p != '\0' && devices_len < LYWSD02_MAX_DEVICES) {
+        lywsd02_device_t *dev = &devices[devices_len];
+        int consumed = 0;
+        if (sscanf(p, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx%n",
+                &dev->addr.val[5], &dev->addr.val[4], &dev->addr.val[3],
+                &dev->addr.val[2], &dev->addr.val[1], &dev->addr.val[0], &consumed) != 6) {
+            ESP_LOGE(TAG, "Invalid MAC address list: %s", MAC_ADDRS);
+            break;
+        }
+        snprintf(dev->name, sizeof(dev->name), "%.17s", p);
+        dev->humi_deci = -1;
+        dev->battery = -1;
+        // Let advertisements come first
+        dev->seen_at = dev->tried_at = esp_timer_get_time() / 1000;
+        devices_len++;
+        p += consumed;
+        while (*p == ',' || *p == ' ') p++;
+    }
+    data_queue = xQueueCreateStatic(LYWSD02_MAX_DEVICES * 2, sizeof(lywsd02_data_t),
+                                    data_queue_storage, &data_queue_buf);
+    listener = on_data;
 
     ESP_ERROR_CHECK(nimble_port_init());
+    ble_npl_callout_init(&poll_callout, nimble_port_get_dflt_eventq(), lywsd02_poll_event, NULL);
     ble_hs_cfg.reset_cb = ble_on_reset;
     ble_hs_cfg.sync_cb = ble_on_sync;
     ble_hs_cfg.store_status_cb = ble_store_util_status_rr;
@@ -118,4 +260,16 @@ bool lywsd02_read_data(lywsd02_data_t* data, TickType_t xTicksToWait) {
     }
     BaseType_t ret = xQueueReceive(data_queue, data, xTicksToWait);
     return ret == pdTRUE;
+}
+
+size_t lywsd02_devices() {
+    return devices_len;
+}
+
+const char* lywsd02_device_name(uint8_t device) {
+    return device < devices_len ? devices[device].name : NULL;
+}
+
+void lywsd02_get_stats(lywsd02_stats_t* out) {
+    *out = stats;
 }
\ No newline at end of file
@@ -1,13 +1,54 @@
 #ifndef _LIB_LYWSD02_H_
 #define _LIB_LYWSD02_H_
+#include "stdint.h"
+#include "stdbool.h"
+#include "stddef.h"
+#include "freertos/FreeRTOS.h"
+#include "scheduler.h"
+
+#define LYWSD02_MAX_DEVICES (8)
 
 typedef struct {
-    uint16_t temp_centi;
+    int16_t temp_centi;
     uint8_t humi;
-} __attribute__((packed)) lywsd02_data_t;
+    int8_t battery;            // Percent, -1 if unknown
+    uint8_t device;            // Index into CONFIG_LYWSD02_MAC_ADDRS
+} lywsd02_data_t;
+
+// Readings carried by a single MiBeacon advertisement
+typedef struct {
+    int16_t temp_centi;
+    uint16_t humi_deci;
+    uint8_t battery;
+    bool has_temp;
+    bool has_humi;
+    bool has_battery;
+} lywsd02_adv_t;
+
+typedef struct {
+    uint32_t connects;         // Fallback connections to clocks silent in advertisements
+    uint32_t connect_errors;
+    uint32_t disconnects;
+    uint32_t notifications;    // Readings delivered, from advertisements or connections
+    uint32_t advertisements;   // Valid MiBeacon advertisements received
+} lywsd02_stats_t;
 
-void lywsd02_init();
+// Wake `on_data` (may be NULL) whenever a reading is queued
+void lywsd02_init(scheduler_job_t *on_data);
+
+// Decode a notification of the temperature & humidity characteristic
+bool lywsd02_parse_data(const uint8_t* value, size_t len, lywsd02_data_t* data);
+
+// Decode the service data (after the 0xfe95 UUID) of an unencrypted MiBeacon
+// advertisement. Return false if it carries no reading.
+bool lywsd02_parse_mibeacon(const uint8_t* value, size_t len, lywsd02_adv_t* adv);
 
 bool lywsd02_read_data(lywsd02_data_t* data, TickType_t xTicksToWait);
 
+// Number of configured clocks, and the MAC address of each
+size_t lywsd02_devices();
+const char* lywsd02_device_name(uint8_t device);
+
+void lywsd02_get_stats(lywsd02_stats_t* stats);
+
 #endif /* _LIB_LYWSD02_H_ */
@@ -0,0 +1,54 @@
+#include "lywsd02.h"
+
+// Xiaomi MiBeacon object ids & frame control bits
+#define MIBEACON_ENCRYPTED    (1 << 3)
+#define MIBEACON_HAS_MAC      (1 << 4)
+#define MIBEACON_HAS_CAP      (1 << 5)
+#define MIBEACON_HAS_OBJECT   (1 << 6)
+#define MIBEACON_CAP_IO       (0x20)
+#define MIBEACON_TEMP         (0x1004)
+#define MIBEACON_HUMI         (0x1006)
+#define MIBEACON_BATTERY      (0x100a)
+#define MIBEACON_TEMP_HUMI    (0x100d)
+
+bool lywsd02_parse_data(const uint8_t* value, size_t len, lywsd02_data_t* data) {
+    if (len != 3) return false;
+    data->temp_centi = (int16_t) (value[0] | value[1] << 8);
+    data->humi = value[2];
+    data->battery = -1;
+    return true;
+}
+
+bool lywsd02_parse_mibeacon(const uint8_t* value, size_t len, lywsd02_adv_t* adv) {
+    adv->has_temp = adv->has_humi = adv->has_battery = false;
+    if (len < 5) return false;
+    uint16_t frame = value[0] | value[1] << 8;
+    if (frame & MIBEACON_ENCRYPTED || !(frame & MIBEACON_HAS_OBJECT)) return false;
+    size_t pos = 5; // Frame control, product ID, frame counter
+    if (frame & MIBEACON_HAS_MAC) pos += 6;
+    if (frame & MIBEACON_HAS_CAP) {
+        if (pos >= len) return false;
+        if (value[pos++] & MIBEACON_CAP_IO) pos += 2;
+    }
+    if (pos + 3 > len) return false;
+    uint16_t type = value[pos] | value[pos + 1] << 8;
+    uint8_t size = value[pos + 2];
+    const uint8_t *obj = &value[pos + 3];
+    if (pos + 3 + size > len) return false;
+
+    if (type == MIBEACON_TEMP && size == 2) {
+        adv->temp_centi = (int16_t) (obj[0] | obj[1] << 8) * 10;
+        adv->has_temp = true;
+    } else if (type == MIBEACON_HUMI && size == 2) {
+        adv->humi_deci = obj[0] | obj[1] << 8;
+        adv->has_humi = true;
+    } else if (type == MIBEACON_TEMP_HUMI && size == 4) {
+        adv->temp_centi = (int16_t) (obj[0] | obj[1] << 8) * 10;
+        adv->humi_deci = obj[2] | obj[3] << 8;
+        adv->has_temp = adv->has_humi = true;
+    } else if (type == MIBEACON_BATTERY && size == 1) {
+        adv->battery = obj[0];
+        adv->has_battery = true;
+    }
+    return adv->has_temp || adv->has_humi || adv->has_battery;
+}
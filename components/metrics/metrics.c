@@ -1,16 +1,35 @@
 #include "math.h"
+#include "stdarg.h"
+#include "time.h"
+#include "sys/time.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
 #include "freertos/event_groups.h"
 #include "esp_log.h"
 #include "esp_mac.h"
+#include "esp_system.h"
+#include "esp_random.h"
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_timer.h"
-#include "nvs_flash.h"
 #include "esp_http_server.h"
+#include "esp_sntp.h"
+#include "esp_http_client.h"
+#include "esp_rom_crc.h"
+#include "esp_heap_caps.h"
 #include "metrics.h"
+#include "metrics_deflate.h"
+#include "metrics_http.h"
+#include "scheduler.h"
+#include "metrics_remote_write.h"
+#ifdef CONFIG_METRICS_LOG
+#include "esp_partition.h"
+#include "metrics_log.h"
+#endif
+#ifdef CONFIG_METRICS_ARENA
+#include "multi_heap.h"
+#endif
 
 
 #define WIFI_CONNECTED_BIT      BIT0
@@ -20,83 +39,1200 @@
 #define WIFI_SSID (CONFIG_METRICS_WIFI_SSID)
 #define WIFI_PSK  (CONFIG_METRICS_WIFI_PSK)
 #define HTTP_PATH (CONFIG_METRICS_HTTP_PATH)
+#define HTTP_MAX_CLIENTS (CONFIG_METRICS_HTTP_MAX_CLIENTS)
+#if HTTP_MAX_CLIENTS > CONFIG_LWIP_MAX_SOCKETS - 3
+#error "METRICS_HTTP_MAX_CLIENTS needs LWIP_MAX_SOCKETS of at least 3 more, httpd keeps 3 for itself"
+#endif
+#ifdef CONFIG_METRICS_HISTORY
+#define HISTORY_PATH (CONFIG_METRICS_HISTORY_PATH)
+#define HISTORY_INTERVAL_SECS (CONFIG_METRICS_HISTORY_INTERVAL_SECS)
+#endif
+#ifdef CONFIG_METRICS_LOG
+#define LOG_PATH (CONFIG_METRICS_LOG_PATH)
+#define LOG_FLUSH_SECS (CONFIG_METRICS_LOG_FLUSH_SECS)
+#define LOG_PARTITION "metrics"
+#define LOG_TASK_STACK_SIZE (4096)
+#endif
+#ifdef CONFIG_METRICS_PUSH
+#define PUSH_URL (CONFIG_METRICS_PUSH_URL)
+#define PUSH_INTERVAL_SECS (CONFIG_METRICS_PUSH_INTERVAL_SECS)
+#define PUSH_BATCH_SIZE (CONFIG_METRICS_PUSH_BATCH_SIZE)
+#define PUSH_BUFFER_SIZE (CONFIG_METRICS_PUSH_BUFFER_SIZE)
+#define PUSH_MAX_RETRIES (5)
+#define PUSH_TASK_STACK_SIZE (6144)
+#endif
+#ifdef CONFIG_METRICS_ARENA
+#define ARENA_SIZE (CONFIG_METRICS_ARENA_SIZE)
+// A page taken as a line of 128 bytes per item, family headers included
+#define ARENA_PAGE_SIZE (METRICS_MAX_NUM * 128)
+#ifdef CONFIG_METRICS_PUSH
+#define ARENA_PUSH_SIZE (PUSH_BUFFER_SIZE + METRICS_SNAPPY_MAX_LEN(PUSH_BUFFER_SIZE) + \
+                         sizeof(metrics_snappy_state_t))
+#else
+#define ARENA_PUSH_SIZE (0)
+#endif
+#ifdef CONFIG_METRICS_LOG
+#define ARENA_LOG_SIZE (2 * sizeof(metric_history_page_t))
+#else
+#define ARENA_LOG_SIZE (0)
+#endif
+// Held at once at worst: the cached page and one being rendered, the
+// compressed page and the deflate state, and what the push and log tasks
+// keep for good. Half a page more covers the compressed page and blocks.
+_Static_assert(ARENA_SIZE >= ARENA_PAGE_SIZE * 5 / 2 + sizeof(metrics_deflate_state_t) +
+                             ARENA_PUSH_SIZE + ARENA_LOG_SIZE,
+               "METRICS_ARENA_SIZE too small for the buffers of scrapes, push & log");
+#endif
+#if defined(CONFIG_METRICS_HISTORY) || defined(CONFIG_METRICS_PUSH)
+#define NTP_SERVER (CONFIG_METRICS_NTP_SERVER)
+#define TIME_VALID_SINCE (1600000000) // Wall clock before that is not synced yet
+#endif
+
+#define RENDER_TRIES            (3) // Renders torn by a batch or list change before giving up
+#define WIFI_BACKOFF_MAX_EXP    (14) // Longest wait between attempts is 2^14 ms
+#define STATS_INTERVAL_MILLIS   (10 * 1000)
+#define STATS_VALID_MILLIS      (STATS_INTERVAL_MILLIS * 3)
+#define STATS_MAX_AGE_MILLIS    (60 * 1000) // New stat values change a page older than that
 
 static const char* TAG       = "metrics";
 
 static int wifi_retry_num    = 0;
-static nvs_handle_t nvs_esp  = 0;
+static uint32_t wifi_retries = 0;
+static esp_timer_handle_t wifi_retry_timer = NULL;
+static int64_t wifi_lost_at   = 0;  // When the link went down, 0 while up
+static int64_t wifi_up_at     = 0;  // When it came back, until the next scrape
+static bool wifi_scrape_due   = false;
+static uint32_t wifi_outage_us = 0;       // Last link loss until the address is back
+static uint32_t wifi_first_scrape_us = 0; // ...and from then on until a scrape succeeds
 static httpd_handle_t httpd  = NULL;
 static metric_list_t metrics = {};
+static char mac_str[13];
+static uint32_t boot_id;       // Keeps ETags of previous boots from matching
+#ifdef CONFIG_METRICS_ARENA
+// Buffers of scrapes & tasks come from here instead of the heap, so they
+// never fragment what Wi-Fi & lwIP allocate from
+static uint8_t arena_buf[ARENA_SIZE] __attribute__((aligned(8)));
+static multi_heap_handle_t arena = NULL;
+static portMUX_TYPE arena_lock = portMUX_INITIALIZER_UNLOCKED;
+#define metrics_malloc(size)     multi_heap_malloc(arena, (size))
+#define metrics_free(p)          multi_heap_free(arena, (p))
+#else
+#define metrics_malloc(size)     malloc(size)
+#define metrics_free(p)          free(p)
+#endif
+#ifdef CONFIG_METRICS_LOG
+static struct {
+    metrics_log_t log;
+    metrics_log_flash_t flash;
+    const esp_partition_t *partition;
+    SemaphoreHandle_t semphr;         // Guards `log`, the task writes while endpoint reads
+    StaticSemaphore_t semphr_buf;
+    TaskHandle_t task;
+    StaticTask_t task_buf;
+    StackType_t stack[LOG_TASK_STACK_SIZE];
+    uint16_t logged[METRICS_HISTORY_PAGES];       // Samples of each page already written
+    uint32_t logged_start[METRICS_HISTORY_PAGES]; // ...while the page starts then
+    uint16_t logged_family[METRICS_HISTORY_PAGES];
+    uint32_t replay_us;
+} history_log = {};
+#endif
+
+// Writes the page in chunks of one render block. Filled blocks are kept
+// as the cache of the page, or the staging buffer is reused if caching
+// is not possible (out of memory).
+typedef struct {
+    httpd_req_t *req;
+    metric_render_t *render;
+    metric_render_block_t *block;
+    int64_t exipred_at;
+    size_t sent;
+    char *buf;
+    size_t len;
+    char staging[METRICS_RENDER_BLOCK_SIZE];
+} metrics_writer_t;
+
+static void metrics_seq_write_begin(uint32_t *seq) {
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void metrics_seq_write_end(uint32_t *seq) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+}
 
-#define buf_printf(...) {\
-        int n = snprintf(&buf[buf_pos], buf_size - buf_pos, __VA_ARGS__);\
-        if (n < 0) {\
-            xSemaphoreGive(metrics.semphr);\
-            free(buf);\
-            ESP_LOGE(TAG, "Failed to write buffer: %d", n);\
-            return ESP_FAIL;\
-        } else {\
-            buf_pos += n;\
-        }\
+static uint32_t metrics_seq_read_begin(const uint32_t *seq) {
+    uint32_t s;
+    for (int spins = 1; (s = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1; spins++) {
+        __atomic_add_fetch(&metrics.reader_retries, 1, __ATOMIC_RELAXED);
+        // Let a preempted writer on this core finish
+        if (spins % 16 == 0) vTaskDelay(1);
     }
+    return s;
+}
 
-static esp_err_t http_request_handler(httpd_req_t *req) {
-    size_t buf_size = 8;
-    size_t buf_pos = 0;
-    char* buf = NULL;
-    int64_t now = esp_timer_get_time() / 1000;
-    uint8_t mac[6];
-    char mac_str[18];
+static bool metrics_seq_read_retry(const uint32_t *seq, uint32_t s) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(seq, __ATOMIC_RELAXED) == s) return false;
+    __atomic_add_fetch(&metrics.reader_retries, 1, __ATOMIC_RELAXED);
+    return true;
+}
 
-    esp_read_mac(mac, ESP_MAC_WIFI_STA);
-    snprintf(mac_str, sizeof(mac_str), "%02x%02x%02x%02x%02x%02x",
-             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+// Publish that rendered output changed.
+static void metrics_list_changed(metric_list_t *list) {
+    __atomic_store_n(&list->changed_at, (uint32_t) (esp_timer_get_time() / 1000), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&list->generation, 1, __ATOMIC_RELEASE);
+}
 
-    httpd_resp_set_type(req, "application/openmetrics-text; version=1.0.0; charset=utf-8");
-    xSemaphoreTake(metrics.semphr, portMAX_DELAY);
+static metric_render_block_t* metrics_render_block_new() {
+    metric_render_block_t *block = metrics_malloc(sizeof(metric_render_block_t));
+    if (block == NULL) return NULL;
+    block->next = NULL;
+    block->len = 0;
+    return block;
+}
 
-    for (size_t i = 0; i < metrics.len; i++)
-        if (now < metrics.meta[i].exipred_at)
-            buf_size += metrics.meta[i].buf_size;
-    buf = malloc(buf_size);
-    if (buf == NULL) {
-        ESP_LOGE(TAG, "Out of memory");
-        xSemaphoreGive(metrics.semphr);
-        return ESP_FAIL;
+static void metrics_render_blocks_free(metric_render_block_t *block) {
+    while (block != NULL) {
+        metric_render_block_t *next = block->next;
+        metrics_free(block);
+        block = next;
+    }
+}
+
+static void metrics_render_free(metric_render_t *render) {
+    metrics_render_blocks_free(render->head);
+    metrics_render_blocks_free(render->deflated);
+    metrics_free(render);
+}
+
+static void metrics_render_release(metric_render_t *render) {
+    xSemaphoreTake(metrics.render_semphr, portMAX_DELAY);
+    bool unused = --render->refs == 0;
+    xSemaphoreGive(metrics.render_semphr);
+    if (unused) metrics_render_free(render);
+}
+
+// Without `cache`, the page only passes through the staging buffer.
+static void metrics_writer_init(metrics_writer_t *w, httpd_req_t *req, uint32_t generation, bool cache) {
+    w->req = req;
+    w->len = 0;
+    w->sent = 0;
+    w->exipred_at = INT64_MAX;
+    w->render = NULL;
+    w->block = NULL;
+    w->buf = w->staging;
+    if (!cache) return;
+    w->render = metrics_malloc(sizeof(metric_render_t));
+    w->block = metrics_render_block_new();
+    if (w->render == NULL || w->block == NULL) {
+        ESP_LOGW(TAG, "Out of memory, render without cache");
+        metrics_free(w->render);
+        metrics_free(w->block);
+        w->render = NULL;
+        w->block = NULL;
+        return;
     }
+    w->render->refs = 1;
+    w->render->generation = generation;
+    w->render->head = w->block;
+    w->render->deflated = NULL;
+    w->buf = w->block->data;
+}
 
-    for (size_t i = 0; i < metrics.len; i++) {
-        metric_meta_t meta = metrics.meta[i];
-        metric_t m = metrics.items[i];
-        if (now >= meta.exipred_at) {
-            ESP_LOGD(TAG, "Metric %s expired (%lli >= %lli)", m.name, now, meta.exipred_at);
-            continue;
+static esp_err_t metrics_writer_flush(metrics_writer_t *w, bool last) {
+    esp_err_t ret = ESP_OK;
+    if (w->len > 0 && w->req != NULL) ret = httpd_resp_send_chunk(w->req, w->buf, w->len);
+    w->sent += w->len;
+    if (w->render != NULL) {
+        w->block->len = w->len;
+        if (!last && w->len > 0) {
+            metric_render_block_t *next = metrics_render_block_new();
+            if (next == NULL) {
+                ESP_LOGW(TAG, "Out of memory, give up render cache");
+                metrics_render_free(w->render);
+                w->render = NULL;
+                w->buf = w->staging;
+            } else {
+                w->block->next = next;
+                w->block = next;
+                w->buf = next->data;
+            }
         }
-        ESP_LOGD(TAG, "Print metric %s", m.name);
-        if (m.help != NULL) buf_printf("# HELP %s %s\n", m.name, m.help);
-        if (m.unit != NULL) buf_printf("# UNIT %s %s\n", m.name, m.unit);
-        buf_printf("# TYPE %s %s\n", m.name, m.type);
-        buf_printf("%s{host=\"%s\",mac=\"%s\"} %.*f\n", m.name, HOSTNAME, mac_str, m.precision, m.value);
     }
-    buf_printf("# EOF\n");
-    httpd_resp_send(req, buf, buf_pos);
-    xSemaphoreGive(metrics.semphr);
-    free(buf);
+    w->len = 0;
+    return ret;
+}
+
+static esp_err_t metrics_writer_printf(metrics_writer_t *w, const char *fmt, ...) {
+    for (int i = 0; i < 2; i++) {
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(&w->buf[w->len], METRICS_RENDER_BLOCK_SIZE - w->len, fmt, args);
+        va_end(args);
+        if (n < 0) {
+            ESP_LOGE(TAG, "Failed to write buffer: %d", n);
+            return ESP_FAIL;
+        }
+        if (w->len + n < METRICS_RENDER_BLOCK_SIZE) {
+            w->len += n;
+            return ESP_OK;
+        }
+        if (w->len == 0) break;
+        esp_err_t ret = metrics_writer_flush(w, false);
+        if (ret != ESP_OK) return ret;
+    }
+    ESP_LOGE(TAG, "Line longer than render block");
+    return ESP_ERR_INVALID_SIZE;
+}
+
+// Value of the item as a float, whichever way it was put
+static float metric_value(const metric_t *m) {
+    return m->fixed ? m->scaled / powf(10, m->precision) : m->value;
+}
+
+// Format the value of the item, integers without going through floats.
+// `buf` must hold METRICS_VALUE_MAX_LEN bytes. Return the length.
+static size_t metrics_format_value(char *buf, const metric_t *m) {
+    return m->fixed ? metrics_format_fixed(buf, m->scaled, m->precision)
+                    : metrics_format_float(buf, m->value, m->precision);
+}
+
+// Append `len` bytes, which must not be split between chunks
+static esp_err_t metrics_writer_write(metrics_writer_t *w, const char *buf, size_t len) {
+    if (w->len + len >= METRICS_RENDER_BLOCK_SIZE) {
+        esp_err_t ret = metrics_writer_flush(w, false);
+        if (ret != ESP_OK) return ret;
+        if (len >= METRICS_RENDER_BLOCK_SIZE) {
+            ESP_LOGE(TAG, "Line longer than render block");
+            return ESP_ERR_INVALID_SIZE;
+        }
+    }
+    memcpy(&w->buf[w->len], buf, len);
+    w->len += len;
     return ESP_OK;
 }
 
+// Print one sample line, its value formatted by metrics_format_value().
+// The timestamp is left out if zero.
+static esp_err_t metrics_writer_sample(metrics_writer_t *w, const char *name, const char *suffix,
+                                       const char *labels, const char *value, uint64_t timestamp) {
+    char prefix[128], line[METRICS_LABELS_MAX_LEN + 256];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "%s%s{host=\"%s\",mac=\"", name, suffix, HOSTNAME);
+    size_t len = 0;
+    if (prefix_len > 0 && prefix_len < sizeof(prefix))
+        len = metrics_format_sample(line, sizeof(line), prefix, prefix_len, mac_str, labels, value,
+                                    strlen(value), timestamp);
+    if (len == 0) {
+        ESP_LOGE(TAG, "Sample line of %s too long", name);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return metrics_writer_write(w, line, len);
+}
+
+// Same as metrics_writer_sample() for a family of the schema, only the
+// labels are left to copy.
+static esp_err_t metrics_writer_sample_schema(metrics_writer_t *w, const metric_schema_t *schema,
+                                              const char *labels, const char *value, size_t value_len) {
+    char line[METRICS_LABELS_MAX_LEN + 256];
+    size_t len = metrics_format_sample(line, sizeof(line), schema->prefix, schema->prefix_len, mac_str,
+                                       labels, value, value_len, 0);
+    if (len == 0) {
+        ESP_LOGE(TAG, "Sample line of %s too long", schema->name);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return metrics_writer_write(w, line, len);
+}
+
+#define writer_printf(...) {\
+        esp_err_t ret = metrics_writer_printf(&w, __VA_ARGS__);\
+        if (ret != ESP_OK) goto fail;\
+    }
+
+static uint32_t metrics_hash(const char *str) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    while (*str) hash = (hash ^ (uint8_t) *str++) * 16777619u;
+    return hash;
+}
+
+static char* metrics_arena_add(metric_list_t *list, const char *str) {
+    size_t len = strlen(str) + 1;
+    if (list->names_len + len > METRICS_NAMES_SIZE) return NULL;
+    char *copy = &list->names[list->names_len];
+    memcpy(copy, str, len);
+    list->names_len += len;
+    return copy;
+}
+
+// Return the copy of encoded label set `labels` in the arena, adding it if
+// not present. Return NULL if the arena is full.
+static char* metrics_labels_intern(metric_list_t *list, const char *labels, uint32_t hash) {
+    size_t i = hash % METRICS_INDEX_SIZE;
+    for (; list->labels_index[i] != METRICS_NONE; i = (i + 1) % METRICS_INDEX_SIZE) {
+        char *copy = &list->names[list->labels_index[i]];
+        if (strcmp(copy, labels) == 0) return copy;
+    }
+    if (list->labels_count + 1 >= METRICS_INDEX_SIZE) return NULL;
+    char *copy = metrics_arena_add(list, labels);
+    if (copy == NULL) return NULL;
+    list->labels_index[i] = copy - list->names;
+    list->labels_count++;
+    return copy;
+}
+
+// Return the id of family `metric->name`, registering it if not present.
+// Return METRICS_NONE if no more families fit.
+static uint16_t metrics_family_get(metric_list_t *list, const metric_t *metric, uint32_t hash) {
+    size_t i = hash % METRICS_FAMILY_INDEX_SIZE;
+    for (; list->family_index[i] != METRICS_NONE; i = (i + 1) % METRICS_FAMILY_INDEX_SIZE) {
+        uint16_t id = list->family_index[i];
+        if (strcmp(list->families[id].name, metric->name) == 0) return id;
+    }
+    if (list->families_len >= METRICS_MAX_FAMILIES) return METRICS_NONE;
+    char *name = metrics_arena_add(list, metric->name);
+    if (name == NULL) return METRICS_NONE;
+    uint16_t id = list->families_len;
+    metric_family_t *family = &list->families[id];
+    family->name = name;
+    family->help = metric->help;
+    family->unit = metric->unit;
+    family->type = metric->type;
+    family->schema = NULL;
+    family->hash = hash;
+    family->head = METRICS_NONE;
+    family->tail = METRICS_NONE;
+    list->family_index[i] = id;
+    __atomic_store_n(&list->families_len, id + 1, __ATOMIC_RELEASE);
+    return id;
+}
+
+// Register the schema as families 0 to `len - 1`, before any other family
+static void metrics_schema_register(metric_list_t *list, const metric_schema_t *schema, size_t len) {
+    assert(list->families_len == 0 && len <= METRICS_MAX_FAMILIES);
+    for (size_t id = 0; id < len; id++) {
+        uint32_t hash = metrics_hash(schema[id].name);
+        size_t i = hash % METRICS_FAMILY_INDEX_SIZE;
+        while (list->family_index[i] != METRICS_NONE) i = (i + 1) % METRICS_FAMILY_INDEX_SIZE;
+        metric_family_t *family = &list->families[id];
+        family->name = (char*) schema[id].name;
+        family->help = (char*) schema[id].help;
+        family->unit = (char*) schema[id].unit;
+        family->type = (char*) schema[id].type;
+        family->schema = &schema[id];
+        family->hash = hash;
+        family->head = METRICS_NONE;
+        family->tail = METRICS_NONE;
+        list->family_index[i] = id;
+    }
+    __atomic_store_n(&list->families_len, len, __ATOMIC_RELEASE);
+    list->schema_len = len;
+}
+
+// Return the bucket of the series of `family` with interned `labels`, or
+// the empty bucket where it would be inserted.
+static size_t metrics_index_find(metric_list_t *list, uint16_t family, const char *labels, uint32_t hash) {
+    size_t i = hash % METRICS_INDEX_SIZE;
+    for (; list->index[i] != METRICS_NONE; i = (i + 1) % METRICS_INDEX_SIZE) {
+        uint16_t idx = list->index[i];
+        if (list->meta[idx].family == family && list->items[idx].labels == labels) break;
+    }
+    return i;
+}
+
+// Linear probing removal with backward shift, leaves no tombstones.
+static void metrics_index_remove(metric_list_t *list, size_t i) {
+    for (size_t j = (i + 1) % METRICS_INDEX_SIZE; list->index[j] != METRICS_NONE;
+         j = (j + 1) % METRICS_INDEX_SIZE) {
+        size_t home = list->meta[list->index[j]].hash % METRICS_INDEX_SIZE;
+        bool movable = i <= j ? (home <= i || home > j) : (home <= i && home > j);
+        if (movable) {
+            list->index[i] = list->index[j];
+            i = j;
+        }
+    }
+    list->index[i] = METRICS_NONE;
+}
+
+// Family links of `idx` itself must be guarded by the caller.
+static void metrics_family_link(metric_list_t *list, uint16_t idx) {
+    metric_meta_t *meta = &list->meta[idx];
+    metric_family_t *family = &list->families[meta->family];
+    meta->family_prev = family->tail;
+    meta->family_next = METRICS_NONE;
+    metrics_seq_write_begin(&family->seq);
+    if (family->tail == METRICS_NONE) {
+        family->head = idx;
+    } else {
+        metric_meta_t *prev = &list->meta[family->tail];
+        metrics_seq_write_begin(&prev->seq);
+        prev->family_next = idx;
+        metrics_seq_write_end(&prev->seq);
+    }
+    family->tail = idx;
+    metrics_seq_write_end(&family->seq);
+}
+
+static void metrics_family_unlink(metric_list_t *list, uint16_t idx) {
+    metric_meta_t *meta = &list->meta[idx];
+    metric_family_t *family = &list->families[meta->family];
+    metrics_seq_write_begin(&family->seq);
+    if (meta->family_prev == METRICS_NONE) {
+        family->head = meta->family_next;
+    } else {
+        metric_meta_t *prev = &list->meta[meta->family_prev];
+        metrics_seq_write_begin(&prev->seq);
+        prev->family_next = meta->family_next;
+        metrics_seq_write_end(&prev->seq);
+    }
+    if (meta->family_next == METRICS_NONE) {
+        family->tail = meta->family_prev;
+    } else {
+        metric_meta_t *next = &list->meta[meta->family_next];
+        metrics_seq_write_begin(&next->seq);
+        next->family_prev = meta->family_prev;
+        metrics_seq_write_end(&next->seq);
+    }
+    metrics_seq_write_end(&family->seq);
+    meta->family = METRICS_NONE;
+}
+
+static void metrics_deadline_unlink(metric_list_t *list, uint16_t idx) {
+    metric_meta_t *meta = &list->meta[idx];
+    if (meta->prev == METRICS_NONE) list->deadline_head = meta->next;
+    else list->meta[meta->prev].next = meta->next;
+    if (meta->next == METRICS_NONE) list->deadline_tail = meta->prev;
+    else list->meta[meta->next].prev = meta->prev;
+}
+
+// Insert by `exipred_at`. Search from the tail, which is O(1) as long as
+// items are put with the same expiry duration.
+static void metrics_deadline_link(metric_list_t *list, uint16_t idx) {
+    metric_meta_t *meta = &list->meta[idx];
+    uint16_t prev = list->deadline_tail;
+    while (prev != METRICS_NONE && list->meta[prev].exipred_at > meta->exipred_at)
+        prev = list->meta[prev].prev;
+    meta->prev = prev;
+    meta->next = prev == METRICS_NONE ? list->deadline_head : list->meta[prev].next;
+    if (meta->prev == METRICS_NONE) list->deadline_head = idx;
+    else list->meta[meta->prev].next = idx;
+    if (meta->next == METRICS_NONE) list->deadline_tail = idx;
+    else list->meta[meta->next].prev = idx;
+}
+
+// Free expired items for reuse. Must be called with `list->semphr` held.
+static void metrics_list_sweep(metric_list_t *list, int64_t now) {
+    bool expired = false;
+    while (list->deadline_head != METRICS_NONE &&
+           now >= list->meta[list->deadline_head].exipred_at) {
+        uint16_t idx = list->deadline_head;
+        metric_meta_t *meta = &list->meta[idx];
+        ESP_LOGD(TAG, "Metric %s expired", list->items[idx].name);
+        metrics_deadline_unlink(list, idx);
+        metrics_index_remove(list, metrics_index_find(list, meta->family, list->items[idx].labels, meta->hash));
+        metrics_seq_write_begin(&meta->seq);
+        metrics_family_unlink(list, idx);
+        meta->exipred_at = 0;
+        metrics_seq_write_end(&meta->seq);
+#ifdef CONFIG_METRICS_HISTORY
+        // Its pages stay readable until reused, keyed by family & labels
+        list->history_open[idx] = METRICS_NONE;
+        list->history_at[idx] = 0;
+#endif
+        meta->next = list->free_head;
+        list->free_head = idx;
+        expired = true;
+    }
+    if (expired) metrics_list_changed(list);
+}
+
+#ifdef CONFIG_METRICS_HISTORY
+// Append the item to its history page, at most once per interval. Pages
+// are reused oldest first, whichever series they belong to. Must be called
+// with `list->semphr` held.
+static void metrics_history_record(metric_list_t *list, uint16_t idx, const metric_t *item, time_t now) {
+    if (now < TIME_VALID_SINCE) return;
+    if (list->history_at[idx] != 0 && now - list->history_at[idx] < HISTORY_INTERVAL_SECS) return;
+    list->history_at[idx] = now;
+
+    uint16_t p = list->history_open[idx];
+    if (p != METRICS_NONE) {
+        metric_history_page_t *page = &list->history[p];
+        metrics_seq_write_begin(&page->seq);
+        bool appended = metrics_history_page_append(page, now, metric_value(item));
+        metrics_seq_write_end(&page->seq);
+        if (appended) return;
+#ifdef CONFIG_METRICS_LOG
+        // Full, write it to flash while it is still around
+        if (history_log.task != NULL) xTaskNotifyGive(history_log.task);
+#endif
+    }
+
+    p = list->history_next;
+    list->history_next = (p + 1) % METRICS_HISTORY_PAGES;
+    metric_history_page_t *page = &list->history[p];
+    if (page->family != METRICS_NONE && list->history_open[page->slot] == p)
+        list->history_open[page->slot] = METRICS_NONE;
+    metrics_seq_write_begin(&page->seq);
+    metrics_history_page_reset(page, list->meta[idx].family, item->labels, idx, item->precision);
+    metrics_history_page_append(page, now, metric_value(item));
+    metrics_seq_write_end(&page->seq);
+    list->history_open[idx] = p;
+}
+#endif
+
+static float metrics_bucket_quantile(const metric_histogram_t *h, const uint32_t *counts,
+                                     uint32_t total, float q) {
+    float rank = q * total;
+    uint32_t cum = 0;
+    for (size_t i = 0; i < h->bounds_len; i++) {
+        if (counts[i] > 0 && cum + counts[i] >= rank) {
+            float lower = i > 0 ? h->bounds[i - 1] : fminf(0, h->bounds[0]);
+            return lower + (h->bounds[i] - lower) * (rank - cum) / counts[i];
+        }
+        cum += counts[i];
+    }
+    // Within the +Inf bucket, the best guess is the highest bound
+    return total > 0 ? h->bounds[h->bounds_len - 1] : NAN;
+}
+
+static esp_err_t metrics_render_histogram(metrics_writer_t *w, const metric_histogram_t *h) {
+    static const float QUANTILES[] = { 0.5f, 0.9f, 0.99f };
+    const metric_t *m = &h->metric;
+    uint32_t counts[METRICS_MAX_BOUNDS + 1];
+    uint32_t total = 0;
+    uint32_t sum_bits = __atomic_load_n(&h->sum_bits, __ATOMIC_RELAXED);
+    float sum;
+    esp_err_t ret;
+    for (size_t i = 0; i <= h->bounds_len; i++) {
+        counts[i] = __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+        total += counts[i];
+    }
+    memcpy(&sum, &sum_bits, sizeof(sum));
+
+    char labels[METRICS_LABELS_MAX_LEN + 64];
+    char value_str[METRICS_VALUE_MAX_LEN];
+    snprintf(labels, sizeof(labels), "host=\"%s\",mac=\"%s\"%s%s", HOSTNAME, mac_str,
+             m->labels != NULL ? "," : "", m->labels != NULL ? m->labels : "");
+
+    if (strcmp(m->type, "summary") == 0) {
+        for (size_t i = 0; i < sizeof(QUANTILES) / sizeof(QUANTILES[0]); i++) {
+            float value = metrics_bucket_quantile(h, counts, total, QUANTILES[i]);
+            metrics_format_float(value_str, value, m->precision);
+            ret = metrics_writer_printf(w, "%s{%s,quantile=\"%g\"} %s\n",
+                                        m->name, labels, QUANTILES[i], value_str);
+            if (ret != ESP_OK) return ret;
+        }
+    } else {
+        uint32_t cum = 0;
+        for (size_t i = 0; i < h->bounds_len; i++) {
+            cum += counts[i];
+            ret = metrics_writer_printf(w, "%s_bucket{%s,le=\"%g\"} %lu\n",
+                                        m->name, labels, h->bounds[i], cum);
+            if (ret != ESP_OK) return ret;
+        }
+        ret = metrics_writer_printf(w, "%s_bucket{%s,le=\"+Inf\"} %lu\n", m->name, labels, total);
+        if (ret != ESP_OK) return ret;
+    }
+    metrics_format_float(value_str, sum, m->precision);
+    ret = metrics_writer_printf(w, "%s_sum{%s} %s\n", m->name, labels, value_str);
+    if (ret != ESP_OK) return ret;
+    return metrics_writer_printf(w, "%s_count{%s} %lu\n", m->name, labels, total);
+}
+
+// Stream a freshly formatted page, then cache it unless the list
+// changed in the meantime. Families and items are copied one by one under
+// their sequence locks, so writers are never blocked by a scrape. Should
+// an item be moved under a family walk, the walk stops; the generation
+// has changed then and the page is not cached.
+//
+// Without `req`, the page is only rendered into cache. If `out` is given,
+// the page is also referenced there for the caller to release, only once
+// it is cached. Otherwise ESP_ERR_INVALID_STATE asks for another try.
+static esp_err_t metrics_render(httpd_req_t *req, uint32_t generation, int64_t now, size_t *sent,
+                                metric_render_t **out) {
+    metrics_writer_t w;
+    uint32_t batch = metrics_seq_read_begin(&metrics.batch_seq);
+    metrics_writer_init(&w, req, generation, true);
+    if (req == NULL && w.render == NULL) return ESP_ERR_NO_MEM;
+
+    size_t families_len = __atomic_load_n(&metrics.families_len, __ATOMIC_ACQUIRE);
+    for (uint16_t f = 0; f < families_len; f++) {
+        metric_family_t family;
+        uint32_t seq;
+        do {
+            seq = metrics_seq_read_begin(&metrics.families[f].seq);
+            family = metrics.families[f];
+        } while (metrics_seq_read_retry(&metrics.families[f].seq, seq));
+
+        const char *suffix = family.type != NULL && strcmp(family.type, "counter") == 0 ? "_total" : "";
+        bool header = false;
+        uint16_t idx = family.head;
+        for (size_t steps = 0; idx != METRICS_NONE && steps < METRICS_MAX_NUM; steps++) {
+            metric_t m;
+            metric_meta_t meta;
+            do {
+                seq = metrics_seq_read_begin(&metrics.meta[idx].seq);
+                m = metrics.items[idx];
+                meta = metrics.meta[idx];
+            } while (metrics_seq_read_retry(&metrics.meta[idx].seq, seq));
+            if (meta.family != f) break;
+            idx = meta.family_next;
+            if (now >= meta.exipred_at) continue;
+            if (!meta.quiet && meta.exipred_at < w.exipred_at) w.exipred_at = meta.exipred_at;
+
+            if (!header && family.schema != NULL) {
+                if (metrics_writer_write(&w, family.schema->meta, family.schema->meta_len) != ESP_OK)
+                    goto fail;
+                header = true;
+            } else if (!header) {
+                ESP_LOGD(TAG, "Print metric family %s", family.name);
+                if (family.help != NULL) writer_printf("# HELP %s %s\n", family.name, family.help);
+                if (family.unit != NULL) writer_printf("# UNIT %s %s\n", family.name, family.unit);
+                writer_printf("# TYPE %s %s\n", family.name, family.type);
+                header = true;
+            }
+            char value[METRICS_VALUE_MAX_LEN];
+            size_t value_len = metrics_format_value(value, &m);
+            esp_err_t ret = family.schema != NULL
+                ? metrics_writer_sample_schema(&w, family.schema, m.labels, value, value_len)
+                : metrics_writer_sample(&w, family.name, suffix, m.labels, value, 0);
+            if (ret != ESP_OK) goto fail;
+        }
+    }
+
+    size_t histograms_len = __atomic_load_n(&metrics.histograms_len, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < histograms_len; i++) {
+        const metric_histogram_t *h = &metrics.histograms[i];
+        if (!h->first) continue;
+        if (h->metric.help != NULL) writer_printf("# HELP %s %s\n", h->metric.name, h->metric.help);
+        if (h->metric.unit != NULL) writer_printf("# UNIT %s %s\n", h->metric.name, h->metric.unit);
+        writer_printf("# TYPE %s %s\n", h->metric.name, h->metric.type);
+        for (uint16_t j = i; j != METRICS_NONE; j = __atomic_load_n(&metrics.histograms[j].next, __ATOMIC_ACQUIRE))
+            if (metrics_render_histogram(&w, &metrics.histograms[j]) != ESP_OK) goto fail;
+    }
+    writer_printf("# EOF\n");
+    esp_err_t ret = metrics_writer_flush(&w, true);
+    if (ret == ESP_OK && req != NULL) ret = httpd_resp_send_chunk(req, NULL, 0);
+    *sent = w.sent;
+    if (w.render == NULL) return ret;
+    if (metrics_seq_read_retry(&metrics.batch_seq, batch)) {
+        // Cached pages must not mix old and new values of a batch; a page
+        // already sent is only as good as it gets.
+        metrics_render_release(w.render);
+        return req == NULL ? ESP_ERR_INVALID_STATE : ret;
+    }
+
+    metric_render_t *stale = NULL;
+    w.render->exipred_at = w.exipred_at;
+    w.render->len = w.sent;
+    xSemaphoreTake(metrics.render_semphr, portMAX_DELAY);
+    if (generation == __atomic_load_n(&metrics.generation, __ATOMIC_ACQUIRE)) {
+        stale = metrics.render;
+        metrics.render = w.render;
+        if (out != NULL) {
+            w.render->refs++;
+            *out = w.render;
+        }
+        w.render = NULL;
+    }
+    xSemaphoreGive(metrics.render_semphr);
+    if (stale != NULL) metrics_render_release(stale);
+    if (w.render == NULL) return ret;
+    // The list changed under the walk, which may have stopped half way.
+    // Only a page already sent is kept, as good as streaming gets.
+    metrics_render_release(w.render);
+    return req == NULL ? ESP_ERR_INVALID_STATE : ret;
+
+fail:
+    *sent = w.sent;
+    if (w.render != NULL) metrics_render_free(w.render);
+    return ESP_FAIL;
+}
+
+// Compressed page being built, a chain of render blocks
+typedef struct {
+    metric_render_block_t *head;
+    metric_render_block_t *tail;
+} metrics_deflated_t;
+
+// Append compressed output, see metrics_deflate_sink_t
+static bool metrics_deflated_append(const uint8_t *data, size_t len, void *arg) {
+    metrics_deflated_t *out = arg;
+    while (len > 0) {
+        if (out->tail == NULL || out->tail->len == METRICS_RENDER_BLOCK_SIZE) {
+            metric_render_block_t *block = metrics_render_block_new();
+            if (block == NULL) return false;
+            if (out->tail == NULL) out->head = block;
+            else out->tail->next = block;
+            out->tail = block;
+        }
+        size_t n = METRICS_RENDER_BLOCK_SIZE - out->tail->len;
+        if (n > len) n = len;
+        memcpy(&out->tail->data[out->tail->len], data, n);
+        out->tail->len += n;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Compress the page once, the first client accepting it pays for all.
+// Blocks are compressed where they are and the output is kept in blocks
+// too, no buffer of the whole page is needed. Return false if out of memory.
+static bool metrics_render_deflate(metric_render_t *render) {
+    xSemaphoreTake(metrics.render_semphr, portMAX_DELAY);
+    bool deflated = render->deflated != NULL;
+    xSemaphoreGive(metrics.render_semphr);
+    if (deflated) return true;
+
+    int64_t started = esp_timer_get_time();
+    size_t count = 0;
+    for (metric_render_block_t *b = render->head; b != NULL; b = b->next) count++;
+    metrics_deflate_segment_t *segments = metrics_malloc(count * sizeof(metrics_deflate_segment_t));
+    metrics_deflate_state_t *state = metrics_malloc(sizeof(metrics_deflate_state_t));
+    metrics_deflated_t out = {};
+    size_t out_len = 0;
+    uint32_t crc32 = 0, adler32 = 1;
+    if (segments != NULL && state != NULL) {
+        size_t i = 0;
+        for (metric_render_block_t *b = render->head; b != NULL; b = b->next, i++) {
+            segments[i] = (metrics_deflate_segment_t) { (const uint8_t*) b->data, b->len };
+            crc32 = esp_rom_crc32_le(crc32, (const uint8_t*) b->data, b->len);
+            adler32 = metrics_adler32(adler32, (const uint8_t*) b->data, b->len);
+        }
+        out_len = metrics_deflate(state, segments, count, metrics_deflated_append, &out);
+    }
+    metrics_free(state);
+    metrics_free(segments);
+    if (out_len == 0) {
+        ESP_LOGW(TAG, "Out of memory, send page uncompressed");
+        metrics_render_blocks_free(out.head);
+        return false;
+    }
+    metrics.deflate_us = esp_timer_get_time() - started;
+    metrics.deflate_in = render->len;
+    metrics.deflate_out = out_len;
+
+    xSemaphoreTake(metrics.render_semphr, portMAX_DELAY);
+    if (render->deflated == NULL) {
+        render->deflated_len = out_len;
+        render->crc32 = crc32;
+        render->adler32 = adler32;
+        render->deflated = out.head;
+        out.head = NULL;
+    }
+    xSemaphoreGive(metrics.render_semphr);
+    metrics_render_blocks_free(out.head);
+    return true;
+}
+
+// Wrap the deflate stream as gzip (RFC 1952) or zlib (RFC 1950) on the fly
+static esp_err_t metrics_send_deflated(httpd_req_t *req, const metric_render_t *render,
+                                       bool gzip, size_t *sent) {
+    static const uint8_t GZIP_HEADER[] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff };
+    static const uint8_t ZLIB_HEADER[] = { 0x78, 0x01 };
+    uint8_t trailer[8];
+    size_t trailer_len;
+    if (gzip) {
+        for (int i = 0; i < 4; i++) trailer[i] = render->crc32 >> (i * 8);
+        for (int i = 0; i < 4; i++) trailer[4 + i] = render->len >> (i * 8);
+        trailer_len = 8;
+    } else {
+        for (int i = 0; i < 4; i++) trailer[i] = render->adler32 >> (24 - i * 8);
+        trailer_len = 4;
+    }
+
+    httpd_resp_set_hdr(req, "Content-Encoding", gzip ? "gzip" : "deflate");
+    esp_err_t ret = httpd_resp_send_chunk(req, gzip ? (const char*) GZIP_HEADER : (const char*) ZLIB_HEADER,
+                                          gzip ? sizeof(GZIP_HEADER) : sizeof(ZLIB_HEADER));
+    for (metric_render_block_t *b = render->deflated; b != NULL && ret == ESP_OK; b = b->next)
+        ret = httpd_resp_send_chunk(req, b->data, b->len);
+    if (ret == ESP_OK) ret = httpd_resp_send_chunk(req, (const char*) trailer, trailer_len);
+    if (ret == ESP_OK) ret = httpd_resp_send_chunk(req, NULL, 0);
+    *sent = (gzip ? sizeof(GZIP_HEADER) : sizeof(ZLIB_HEADER)) + render->deflated_len + trailer_len;
+    return ret;
+}
+
+// Whether `If-None-Match` lists `etag`
+static bool metrics_etag_matches(httpd_req_t *req, const char *etag) {
+    char header[128];
+    esp_err_t found = httpd_req_get_hdr_value_str(req, "If-None-Match", header, sizeof(header));
+    if (found != ESP_OK && found != ESP_ERR_HTTPD_RESULT_TRUNC) return false;
+    return metrics_http_etag_listed(header, etag);
+}
+
+static esp_err_t http_request_handler(httpd_req_t *req) {
+    int64_t started = esp_timer_get_time();
+    int64_t now = started / 1000;
+    size_t sent = 0;
+    esp_err_t ret = ESP_OK;
+    metric_render_t *render = NULL;
+    uint32_t generation = __atomic_load_n(&metrics.generation, __ATOMIC_ACQUIRE);
+    char etag[METRICS_HTTP_ETAG_MAX_LEN];
+
+    char accept[64];
+    bool gzip = false, deflate = false;
+    esp_err_t found = httpd_req_get_hdr_value_str(req, "Accept-Encoding", accept, sizeof(accept));
+    if (found == ESP_OK || found == ESP_ERR_HTTPD_RESULT_TRUNC) {
+        gzip = metrics_http_encoding_accepted(accept, "gzip");
+        deflate = !gzip && metrics_http_encoding_accepted(accept, "deflate");
+    }
+
+    xSemaphoreTake(metrics.render_semphr, portMAX_DELAY);
+    render = metrics.render;
+    if (render != NULL && render->generation == generation && now < render->exipred_at) {
+        render->refs++;
+    } else {
+        render = NULL;
+    }
+    xSemaphoreGive(metrics.render_semphr);
+
+    httpd_resp_set_type(req, "application/openmetrics-text; version=1.0.0; charset=utf-8");
+    httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+    if (render == NULL) {
+        // Render into cache before sending, a page torn by metrics_put_many()
+        // or by items moving between families is rendered again. Compressed
+        // bodies are made from it too. Should every try be torn, the page
+        // is streamed below, uncached and without an ETag.
+        ESP_LOGD(TAG, "Render cache miss");
+        for (int i = 0; i < RENDER_TRIES && render == NULL; i++) {
+            generation = __atomic_load_n(&metrics.generation, __ATOMIC_ACQUIRE);
+            if (metrics_render(NULL, generation, now, &sent, &render) == ESP_ERR_NO_MEM) break;
+        }
+        sent = 0;
+    }
+    bool compressed = render != NULL && (gzip || deflate) && metrics_render_deflate(render);
+    if (render != NULL) {
+        // Only cached pages are tagged, a streamed one may not be whole
+        metrics_http_etag(etag, sizeof(etag), boot_id, render->generation, render->exipred_at,
+                          compressed ? (gzip ? "-gz" : "-df") : "");
+        httpd_resp_set_hdr(req, "ETag", etag);
+    }
+    if (render != NULL && metrics_etag_matches(req, etag)) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        ret = httpd_resp_send(req, NULL, 0);
+        metrics_render_release(render);
+        __atomic_add_fetch(&metrics.scrapes_not_modified, 1, __ATOMIC_RELAXED);
+    } else if (compressed) {
+        ret = metrics_send_deflated(req, render, gzip, &sent);
+        metrics_render_release(render);
+    } else if (render == NULL) {
+        // Out of memory for the cache or torn every time, stream the page
+        // as it is rendered
+        ret = metrics_render(req, generation, now, &sent, NULL);
+    } else {
+        for (metric_render_block_t *b = render->head; b != NULL && ret == ESP_OK; b = b->next) {
+            if (b->len > 0) ret = httpd_resp_send_chunk(req, b->data, b->len);
+            sent += b->len;
+        }
+        if (ret == ESP_OK) ret = httpd_resp_send_chunk(req, NULL, 0);
+        metrics_render_release(render);
+    }
+
+    // Plain stores, the stats timer tolerates a torn read of a single scrape
+    int64_t finished = esp_timer_get_time();
+    if (ret == ESP_OK && __atomic_exchange_n(&wifi_scrape_due, false, __ATOMIC_ACQUIRE))
+        wifi_first_scrape_us = finished - wifi_up_at;
+    metrics.scrape_us = finished - started;
+    metrics.scrape_bytes = sent;
+    __atomic_add_fetch(&metrics.scrapes, 1, __ATOMIC_RELAXED);
+    return ret;
+}
+
 static const httpd_uri_t endpoint_root_get = {
     .uri       = HTTP_PATH,
     .method    = HTTP_GET,
     .handler   = http_request_handler
 };
 
+#ifdef CONFIG_METRICS_HISTORY
+typedef struct {
+    metric_history_page_t page;
+    uint16_t family[METRICS_HISTORY_PAGES];
+    const char *labels[METRICS_HISTORY_PAGES];
+    bool done[METRICS_HISTORY_PAGES];
+} metrics_history_scratch_t;
+
+// Serve samples recorded since `?since=<unix seconds>`, with timestamps.
+// Keys of all pages are taken up front, then each series is written from
+// its oldest page on. A page reused in between no longer matches its key
+// and is skipped; so are samples appended after the page was copied.
+static esp_err_t history_request_handler(httpd_req_t *req) {
+    char query[32];
+    char since_str[16];
+    uint32_t since = 0;
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+            httpd_query_key_value(query, "since", since_str, sizeof(since_str)) == ESP_OK)
+        since = strtoul(since_str, NULL, 10);
+
+    metrics_history_scratch_t *s = metrics_malloc(sizeof(metrics_history_scratch_t));
+    if (s == NULL) {
+        ESP_LOGW(TAG, "Out of memory, refuse history request");
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+    }
+    uint16_t oldest = __atomic_load_n(&metrics.history_next, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < METRICS_HISTORY_PAGES; i++) {
+        metric_history_page_t *page = &metrics.history[(oldest + i) % METRICS_HISTORY_PAGES];
+        uint32_t seq;
+        do {
+            seq = metrics_seq_read_begin(&page->seq);
+            s->family[i] = page->family;
+            s->labels[i] = page->labels;
+        } while (metrics_seq_read_retry(&page->seq, seq));
+        s->done[i] = false;
+    }
+
+    metrics_writer_t w;
+    metrics_writer_init(&w, req, 0, false);
+    httpd_resp_set_type(req, "application/openmetrics-text; version=1.0.0; charset=utf-8");
+    size_t families_len = __atomic_load_n(&metrics.families_len, __ATOMIC_ACQUIRE);
+    for (uint16_t f = 0; f < families_len; f++) {
+        metric_family_t family;
+        uint32_t seq;
+        do {
+            seq = metrics_seq_read_begin(&metrics.families[f].seq);
+            family = metrics.families[f];
+        } while (metrics_seq_read_retry(&metrics.families[f].seq, seq));
+        const char *suffix = family.type != NULL && strcmp(family.type, "counter") == 0 ? "_total" : "";
+        bool header = false;
+
+        for (size_t i = 0; i < METRICS_HISTORY_PAGES; i++) {
+            if (s->family[i] != f || s->done[i]) continue;
+            for (size_t j = i; j < METRICS_HISTORY_PAGES; j++) {
+                if (s->family[j] != f || s->labels[j] != s->labels[i]) continue;
+                s->done[j] = true;
+                metric_history_page_t *page = &metrics.history[(oldest + j) % METRICS_HISTORY_PAGES];
+                do {
+                    seq = metrics_seq_read_begin(&page->seq);
+                    s->page = *page;
+                } while (metrics_seq_read_retry(&page->seq, seq));
+                if (s->page.family != f || s->page.labels != s->labels[i]) continue;
+                if (s->page.count == 0 || s->page.last < since) continue;
+
+                metric_history_iter_t it;
+                uint32_t time;
+                float value;
+                metrics_history_iter_init(&it, &s->page);
+                while (metrics_history_iter_next(&it, &time, &value)) {
+                    if (time < since) continue;
+                    if (!header) {
+                        if (family.help != NULL) writer_printf("# HELP %s %s\n", family.name, family.help);
+                        if (family.unit != NULL) writer_printf("# UNIT %s %s\n", family.name, family.unit);
+                        writer_printf("# TYPE %s %s\n", family.name, family.type);
+                        header = true;
+                    }
+                    char value_str[METRICS_VALUE_MAX_LEN];
+                    metrics_format_float(value_str, value, s->page.precision);
+                    if (metrics_writer_sample(&w, family.name, suffix, s->page.labels,
+                                              value_str, time) != ESP_OK)
+                        goto fail;
+                }
+            }
+        }
+    }
+    writer_printf("# EOF\n");
+    metrics_free(s);
+    esp_err_t ret = metrics_writer_flush(&w, true);
+    if (ret == ESP_OK) ret = httpd_resp_send_chunk(req, NULL, 0);
+    return ret;
+
+fail:
+    metrics_free(s);
+    return ESP_FAIL;
+}
+
+static const httpd_uri_t endpoint_history_get = {
+    .uri       = HISTORY_PATH,
+    .method    = HTTP_GET,
+    .handler   = history_request_handler
+};
+#endif
+
+#ifdef CONFIG_METRICS_LOG
+static bool metrics_log_flash_read(void *ctx, size_t offset, void *buf, size_t len) {
+    return esp_partition_read(ctx, offset, buf, len) == ESP_OK;
+}
+
+static bool metrics_log_flash_write(void *ctx, size_t offset, const void *buf, size_t len) {
+    return esp_partition_write(ctx, offset, buf, len) == ESP_OK;
+}
+
+static bool metrics_log_flash_erase(void *ctx, size_t offset, size_t len) {
+    return esp_partition_erase_range(ctx, offset, len) == ESP_OK;
+}
+
+// Write samples of history pages not in the log yet, as one record per
+// page. Pages still appended to are left for later unless `partial`.
+static void metrics_log_flush(metric_history_page_t *copy, metric_history_page_t *chunk, bool partial) {
+    for (size_t p = 0; p < METRICS_HISTORY_PAGES; p++) {
+        metric_history_page_t *page = &metrics.history[p];
+        uint32_t seq;
+        do {
+            seq = metrics_seq_read_begin(&page->seq);
+            *copy = *page;
+        } while (metrics_seq_read_retry(&page->seq, seq));
+        if (copy->family == METRICS_NONE || copy->count == 0) continue;
+        if (history_log.logged_start[p] != copy->start || history_log.logged_family[p] != copy->family) {
+            history_log.logged[p] = 0;
+            history_log.logged_start[p] = copy->start;
+            history_log.logged_family[p] = copy->family;
+        }
+        if (history_log.logged[p] >= copy->count) continue;
+        bool open = __atomic_load_n(&metrics.history_open[copy->slot], __ATOMIC_RELAXED) == p;
+        if (open && !partial) continue;
+
+        metric_family_t family;
+        do {
+            seq = metrics_seq_read_begin(&metrics.families[copy->family].seq);
+            family = metrics.families[copy->family];
+        } while (metrics_seq_read_retry(&metrics.families[copy->family].seq, seq));
+        char name[METRICS_LOG_NAME_MAX_LEN];
+        snprintf(name, sizeof(name), "%s%s", family.name,
+                 family.type != NULL && strcmp(family.type, "counter") == 0 ? "_total" : "");
+
+        // Encode the samples again from the first one not written yet
+        metric_history_iter_t it;
+        uint32_t time;
+        float value;
+        metrics_history_page_reset(chunk, copy->family, copy->labels, copy->slot, copy->precision);
+        metrics_history_iter_init(&it, copy);
+        for (uint16_t i = 0; metrics_history_iter_next(&it, &time, &value); i++) {
+            if (i < history_log.logged[p]) continue;
+            if (metrics_history_page_append(chunk, time, value)) continue;
+            xSemaphoreTake(history_log.semphr, portMAX_DELAY);
+            metrics_log_append(&history_log.log, name, copy->labels, chunk);
+            xSemaphoreGive(history_log.semphr);
+            metrics_history_page_reset(chunk, copy->family, copy->labels, copy->slot, copy->precision);
+            metrics_history_page_append(chunk, time, value);
+        }
+        xSemaphoreTake(history_log.semphr, portMAX_DELAY);
+        if (!metrics_log_append(&history_log.log, name, copy->labels, chunk))
+            ESP_LOGW(TAG, "Failed to log history of %s", name);
+        xSemaphoreGive(history_log.semphr);
+        history_log.logged[p] = copy->count;
+    }
+}
+
+// Full pages are written as soon as they are notified, the rest of the
+// samples every LOG_FLUSH_SECS. Those are lost on a power loss.
+static void metrics_log_task(void *arg) {
+    metric_history_page_t *copy = metrics_malloc(sizeof(metric_history_page_t));
+    metric_history_page_t *chunk = metrics_malloc(sizeof(metric_history_page_t));
+    assert(copy != NULL && chunk != NULL);
+    while (true) {
+        bool timeout = ulTaskNotifyTake(pdTRUE, LOG_FLUSH_SECS * 1000 / portTICK_PERIOD_MS) == 0;
+        metrics_log_flush(copy, chunk, timeout);
+    }
+}
+
+static void metrics_log_init() {
+    history_log.partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                                     LOG_PARTITION);
+    if (history_log.partition == NULL) {
+        ESP_LOGW(TAG, "No partition \"%s\", history is not logged to flash", LOG_PARTITION);
+        return;
+    }
+    history_log.flash = (metrics_log_flash_t) {
+        .read = metrics_log_flash_read,
+        .write = metrics_log_flash_write,
+        .erase = metrics_log_flash_erase,
+        .ctx = (void*) history_log.partition,
+        .size = history_log.partition->size,
+    };
+    history_log.semphr = xSemaphoreCreateMutexStatic(&history_log.semphr_buf);
+    int64_t started = esp_timer_get_time();
+    if (!metrics_log_open(&history_log.log, &history_log.flash)) {
+        ESP_LOGE(TAG, "Failed to open history log");
+        return;
+    }
+    history_log.replay_us = esp_timer_get_time() - started;
+    ESP_LOGI(TAG, "History log replayed in %luus, sector %lu of %lu",
+             history_log.replay_us, history_log.log.head, history_log.log.sectors);
+    history_log.task = xTaskCreateStatic(metrics_log_task, "metrics_log", LOG_TASK_STACK_SIZE, NULL, 3,
+                                         history_log.stack, &history_log.task_buf);
+}
+
+// Serve samples logged to flash between `?since=` and `?until=<unix
+// seconds>`, both optional. They come one page of a series at a time,
+// oldest first, so families are not grouped and no metadata is given.
+static esp_err_t log_request_handler(httpd_req_t *req) {
+    char query[48];
+    char param[16];
+    uint32_t since = 0;
+    uint32_t until = UINT32_MAX;
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        if (httpd_query_key_value(query, "since", param, sizeof(param)) == ESP_OK)
+            since = strtoul(param, NULL, 10);
+        if (httpd_query_key_value(query, "until", param, sizeof(param)) == ESP_OK)
+            until = strtoul(param, NULL, 10);
+    }
+    if (history_log.task == NULL)
+        return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No history log");
+
+    metric_log_entry_t *entry = metrics_malloc(sizeof(metric_log_entry_t));
+    if (entry == NULL) {
+        ESP_LOGW(TAG, "Out of memory, refuse log request");
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+    }
+    metrics_writer_t w;
+    metrics_writer_init(&w, req, 0, false);
+    // Records of all families come interleaved, which OpenMetrics forbids.
+    // The Prometheus text format allows it, its timestamps are milliseconds.
+    httpd_resp_set_type(req, "text/plain; version=0.0.4; charset=utf-8");
+    metrics_log_iter_t it;
+    xSemaphoreTake(history_log.semphr, portMAX_DELAY);
+    metrics_log_iter_init(&history_log.log, &it);
+    xSemaphoreGive(history_log.semphr);
+    while (true) {
+        // Not held while sending, the log keeps being written meanwhile
+        xSemaphoreTake(history_log.semphr, portMAX_DELAY);
+        bool found = metrics_log_iter_next(&history_log.log, &it, since, entry);
+        xSemaphoreGive(history_log.semphr);
+        if (!found) break;
+        if (entry->page.start > until) continue;
+
+        metric_history_iter_t hit;
+        uint32_t time;
+        float value;
+        metrics_history_iter_init(&hit, &entry->page);
+        while (metrics_history_iter_next(&hit, &time, &value)) {
+            if (time < since || time > until) continue;
+            char value_str[METRICS_VALUE_MAX_LEN];
+            metrics_format_float(value_str, value, entry->page.precision);
+            if (metrics_writer_sample(&w, entry->name, "", entry->page.labels, value_str,
+                                      time * 1000ULL) != ESP_OK)
+                goto fail;
+        }
+    }
+    metrics_free(entry);
+    esp_err_t ret = metrics_writer_flush(&w, true);
+    if (ret == ESP_OK) ret = httpd_resp_send_chunk(req, NULL, 0);
+    return ret;
+
+fail:
+    metrics_free(entry);
+    return ESP_FAIL;
+}
+
+static const httpd_uri_t endpoint_log_get = {
+    .uri       = LOG_PATH,
+    .method    = HTTP_GET,
+    .handler   = log_request_handler
+};
+#endif
+
 static httpd_handle_t start_webserver(void) {
     httpd_handle_t server = NULL;
 
     // Start the httpd server
     ESP_LOGI(TAG, "Starting server");
     httpd_config_t conf = HTTPD_DEFAULT_CONFIG();
+    // Scrapers keep their connections open between scrapes. Leave room for
+    // all of them; past that, the least recently used connection is closed
+    // rather than refusing the new one, which reclaims those of dead clients.
+    conf.max_open_sockets = HTTP_MAX_CLIENTS;
+    conf.backlog_conn = HTTP_MAX_CLIENTS;
+    conf.lru_purge_enable = true;
     esp_err_t ret = httpd_start(&server, &conf);
     if (ESP_OK != ret) {
         ESP_LOGE(TAG, "Error starting http server!");
@@ -106,31 +1242,48 @@ static httpd_handle_t start_webserver(void) {
     // Set URI handlers
     ESP_LOGI(TAG, "Registering URI handlers");
     httpd_register_uri_handler(server, &endpoint_root_get);
+#ifdef CONFIG_METRICS_HISTORY
+    httpd_register_uri_handler(server, &endpoint_history_get);
+#endif
+#ifdef CONFIG_METRICS_LOG
+    httpd_register_uri_handler(server, &endpoint_log_get);
+#endif
     return server;
 }
 
 
+// Runs on the esp_timer task once the backoff is over
+static void wifi_retry(void *arg) {
+    ESP_LOGI(TAG, "Retry to connect to the AP");
+    esp_wifi_connect();
+}
+
+// Runs on the default event loop, which every system event goes through;
+// retries are left to `wifi_retry_timer` instead of waiting here. The HTTP
+// server stays up over link losses, scrapers reconnect to it as it was.
 static void wifi_event_handler(void* arg, esp_event_base_t event_base,
                                 int32_t event_id, void* event_data)
 {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
         esp_wifi_connect();
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        if (httpd) {
-            httpd_stop(httpd);
-            httpd = NULL;
-        }
-        wifi_retry_num++;
-        if (wifi_retry_num > 14) wifi_retry_num = 14;
-        int delay_ms = powf(2.0f, wifi_retry_num);
+        if (wifi_lost_at == 0) wifi_lost_at = esp_timer_get_time();
+        if (wifi_retry_num < WIFI_BACKOFF_MAX_EXP) wifi_retry_num++;
+        wifi_retries++;
+        int delay_ms = 1 << wifi_retry_num;
         ESP_LOGI(TAG, "Failed to connect to AP %s, retry in %dms", WIFI_SSID, delay_ms);
-        vTaskDelay(delay_ms / portTICK_PERIOD_MS);
-        esp_wifi_connect();
-        ESP_LOGI(TAG, "Retry to connect to the AP");
+        esp_timer_stop(wifi_retry_timer); // Not running unless events came twice
+        ESP_ERROR_CHECK(esp_timer_start_once(wifi_retry_timer, delay_ms * 1000LL));
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
         ESP_LOGI(TAG, "Got ip: " IPSTR, IP2STR(&event->ip_info.ip));
         wifi_retry_num = 0;
+        if (wifi_lost_at != 0) {
+            wifi_up_at = esp_timer_get_time();
+            wifi_outage_us = wifi_up_at - wifi_lost_at;
+            wifi_lost_at = 0;
+            __atomic_store_n(&wifi_scrape_due, true, __ATOMIC_RELEASE);
+        }
         if (httpd == NULL) httpd = start_webserver();
     }
 }
@@ -143,6 +1296,12 @@ void init_wifi() {
     esp_netif_t* netif = esp_netif_create_default_wifi_sta();
     ESP_ERROR_CHECK(esp_netif_set_hostname(netif, HOSTNAME));
 
+    const esp_timer_create_args_t timer_args = {
+        .callback = &wifi_retry,
+        .name = "wifi_retry",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &wifi_retry_timer));
+
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
 
@@ -178,52 +1337,609 @@ void init_wifi() {
 }
 
 
-void metrics_init() {
-    ESP_ERROR_CHECK(nvs_open(TAG, NVS_READWRITE, &nvs_esp));
-    init_wifi();
+#ifdef CONFIG_METRICS_PUSH
+// POST one compressed WriteRequest, retrying with exponential backoff on
+// network errors, 5xx and 429. Other responses are final, as the spec says.
+static bool metrics_push_send(esp_http_client_handle_t client, const uint8_t *body, size_t len) {
+    uint32_t delay_ms = 1000;
+    for (int attempt = 0; attempt <= PUSH_MAX_RETRIES; attempt++) {
+        if (attempt > 0) {
+            ESP_LOGI(TAG, "Retry remote write in %lums", delay_ms);
+            vTaskDelay(delay_ms / portTICK_PERIOD_MS);
+            delay_ms *= 2;
+            if (delay_ms > PUSH_INTERVAL_SECS * 1000) delay_ms = PUSH_INTERVAL_SECS * 1000;
+        }
+        __atomic_add_fetch(&metrics.push_requests, 1, __ATOMIC_RELAXED);
+        esp_http_client_set_post_field(client, (const char*) body, len);
+        esp_err_t ret = esp_http_client_perform(client);
+        int status = ret == ESP_OK ? esp_http_client_get_status_code(client) : 0;
+        if (status >= 200 && status < 300) return true;
+        __atomic_add_fetch(&metrics.push_failures, 1, __ATOMIC_RELAXED);
+        if (ret != ESP_OK) {
+            ESP_LOGW(TAG, "Remote write failed: %s", esp_err_to_name(ret));
+        } else {
+            ESP_LOGW(TAG, "Remote write responded %d", status);
+            if (status < 500 && status != 429) return false;
+        }
+    }
+    return false;
+}
+
+typedef struct {
+    esp_http_client_handle_t client;
+    metrics_snappy_state_t *state;
+    uint8_t *snappy;
+} metrics_push_t;
+
+// Compress & send a batch, see metrics_pb_flush_cb_t
+static void metrics_push_flush(const metrics_pb_t *pb, void *arg) {
+    metrics_push_t *push = arg;
+    size_t len = metrics_snappy_compress(push->state, pb->buf, pb->len, push->snappy);
+    ESP_LOGD(TAG, "Remote write %d series, %d bytes compressed to %d",
+             pb->series, pb->len, len);
+    if (metrics_push_send(push->client, push->snappy, len))
+        __atomic_add_fetch(&metrics.push_samples, pb->series, __ATOMIC_RELAXED);
+}
+
+// Every interval, take the current value of every live item and push them
+// in batches. The connection is kept alive between requests.
+static void metrics_push_task(void *arg) {
+    uint8_t *buf = metrics_malloc(PUSH_BUFFER_SIZE);
+    metrics_push_t push = {
+        .state = metrics_malloc(sizeof(metrics_snappy_state_t)),
+        .snappy = metrics_malloc(METRICS_SNAPPY_MAX_LEN(PUSH_BUFFER_SIZE)),
+    };
+    assert(buf != NULL && push.state != NULL && push.snappy != NULL);
+    esp_http_client_config_t config = {
+        .url = PUSH_URL,
+        .method = HTTP_METHOD_POST,
+        .keep_alive_enable = true,
+    };
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    assert(client != NULL);
+    push.client = client;
+    esp_http_client_set_header(client, "Content-Encoding", "snappy");
+    esp_http_client_set_header(client, "Content-Type", "application/x-protobuf");
+    esp_http_client_set_header(client, "User-Agent", "espair");
+    esp_http_client_set_header(client, "X-Prometheus-Remote-Write-Version", "0.1.0");
+
+    metrics_pb_t pb;
+    metrics_pb_init(&pb, buf, PUSH_BUFFER_SIZE);
+    char name[METRICS_LABELS_MAX_LEN];
+    char decoded[METRICS_LABELS_MAX_LEN];
+    metric_label_t labels[CONFIG_METRICS_PUSH_MAX_LABELS + 3];
+    TickType_t wake = xTaskGetTickCount();
+    while (true) {
+        vTaskDelayUntil(&wake, PUSH_INTERVAL_SECS * 1000 / portTICK_PERIOD_MS);
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        if (tv.tv_sec < TIME_VALID_SINCE) continue;
+        int64_t timestamp_ms = (int64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+        int64_t now = esp_timer_get_time() / 1000;
+
+        size_t families_len = __atomic_load_n(&metrics.families_len, __ATOMIC_ACQUIRE);
+        for (uint16_t f = 0; f < families_len; f++) {
+            metric_family_t family;
+            uint32_t seq;
+            do {
+                seq = metrics_seq_read_begin(&metrics.families[f].seq);
+                family = metrics.families[f];
+            } while (metrics_seq_read_retry(&metrics.families[f].seq, seq));
+            bool counter = family.type != NULL && strcmp(family.type, "counter") == 0;
+            snprintf(name, sizeof(name), "%s%s", family.name, counter ? "_total" : "");
+
+            uint16_t idx = family.head;
+            for (size_t steps = 0; idx != METRICS_NONE && steps < METRICS_MAX_NUM; steps++) {
+                metric_t m;
+                metric_meta_t meta;
+                do {
+                    seq = metrics_seq_read_begin(&metrics.meta[idx].seq);
+                    m = metrics.items[idx];
+                    meta = metrics.meta[idx];
+                } while (metrics_seq_read_retry(&metrics.meta[idx].seq, seq));
+                if (meta.family != f) break;
+                idx = meta.family_next;
+                if (now >= meta.exipred_at) continue;
+
+                // Label names sorted: `__name__` first, then host & mac, then the rest
+                size_t count = 0;
+                labels[count++] = (metric_label_t) { "__name__", name };
+                labels[count++] = (metric_label_t) { "host", HOSTNAME };
+                labels[count++] = (metric_label_t) { "mac", mac_str };
+                if (m.labels != NULL) {
+                    int n = metrics_labels_decode(m.labels, decoded, sizeof(decoded),
+                                                  &labels[count], CONFIG_METRICS_PUSH_MAX_LABELS);
+                    if (n < 0) {
+                        ESP_LOGW(TAG, "Too many labels to push %s{%s}", name, m.labels);
+                        continue;
+                    }
+                    count += n;
+                }
+                metrics_pb_sort_labels(labels, count);
+
+                if (!metrics_pb_add_batched(&pb, PUSH_BATCH_SIZE, metrics_push_flush, &push,
+                                            labels, count, metric_value(&m), timestamp_ms))
+                    ESP_LOGW(TAG, "Series %s larger than push buffer", name);
+            }
+        }
+        if (pb.series > 0) metrics_push_flush(&pb, &push);
+        metrics_pb_init(&pb, buf, PUSH_BUFFER_SIZE);
+    }
+}
+#endif
+
+void metrics_get_stats(metrics_stats_t *stats) {
+    int64_t now = esp_timer_get_time() / 1000;
+    stats->writer_waits = __atomic_load_n(&metrics.writer_waits, __ATOMIC_RELAXED);
+    stats->writer_wait_us = __atomic_load_n(&metrics.writer_wait_us, __ATOMIC_RELAXED);
+    stats->reader_retries = __atomic_load_n(&metrics.reader_retries, __ATOMIC_RELAXED);
+    stats->scrapes = __atomic_load_n(&metrics.scrapes, __ATOMIC_RELAXED);
+    stats->scrapes_not_modified = __atomic_load_n(&metrics.scrapes_not_modified, __ATOMIC_RELAXED);
+    stats->scrape_us = metrics.scrape_us;
+    stats->scrape_bytes = metrics.scrape_bytes;
+    stats->wifi_retries = wifi_retries;
+    stats->wifi_outage_us = wifi_outage_us;
+    stats->wifi_first_scrape_us = wifi_first_scrape_us;
+    stats->push_requests = __atomic_load_n(&metrics.push_requests, __ATOMIC_RELAXED);
+    stats->push_failures = __atomic_load_n(&metrics.push_failures, __ATOMIC_RELAXED);
+    stats->push_samples = __atomic_load_n(&metrics.push_samples, __ATOMIC_RELAXED);
+    stats->deflate_us = metrics.deflate_us;
+    stats->deflate_in = metrics.deflate_in;
+    stats->deflate_out = metrics.deflate_out;
+#ifdef CONFIG_METRICS_LOG
+    // Plain loads, the log task only ever adds to them
+    stats->log_bytes = history_log.log.bytes;
+    stats->log_erases = history_log.log.erases;
+    stats->log_replay_us = history_log.replay_us;
+#endif
+
+    // Expired items are freed lazily by the next put, count them apart
+    stats->items_live = 0;
+    stats->items_expired = 0;
+    xSemaphoreTake(metrics.semphr, portMAX_DELAY);
+    for (uint16_t idx = metrics.deadline_head; idx != METRICS_NONE; idx = metrics.meta[idx].next) {
+        if (now >= metrics.meta[idx].exipred_at) stats->items_expired++;
+        else stats->items_live++;
+    }
+    xSemaphoreGive(metrics.semphr);
+}
+
+#define STATS_MAX_ITEMS (48)
+
+// Stat `scaled / 10^precision` as a fixed-point item, as a float only if
+// too large for one
+static void metrics_stat(metric_t *item, const char *type, const char *name, const char *help,
+                         uint32_t scaled, uint8_t precision) {
+    *item = (metric_t) {
+        .name = (char*) name,
+        .help = (char*) help,
+        .type = (char*) type,
+        .precision = precision,
+    };
+    if (scaled <= INT32_MAX) {
+        item->fixed = true;
+        item->scaled = scaled;
+        return;
+    }
+    item->value = scaled;
+    for (uint8_t i = 0; i < precision; i++) item->value /= 10;
+}
+
+#define put_stat(T, N, H, V, P) {\
+    assert(items_len < STATS_MAX_ITEMS);\
+    metrics_stat(&items[items_len++], (T), (N), (H), (V), (P));\
+}
+
+// Scheduler job, durations are put in microseconds or milliseconds as
+// seconds with the precision of 6 or 3
+static void metrics_publish_stats(void *arg) {
+    static metric_t items[STATS_MAX_ITEMS];
+    size_t items_len = 0;
+    metrics_stats_t stats;
+    metrics_get_stats(&stats);
+    put_stat("counter", "espair_internal_metrics_writer_waits",
+             "Metric writes that waited for another writer", stats.writer_waits, 0);
+    put_stat("counter", "espair_internal_metrics_writer_wait_seconds",
+             "Time metric writes spent waiting for another writer", stats.writer_wait_us, 6);
+    put_stat("counter", "espair_internal_metrics_reader_retries",
+             "Metric reads retried due to a concurrent write", stats.reader_retries, 0);
+    put_stat("counter", "espair_internal_scrapes", "Requests served", stats.scrapes, 0);
+    put_stat("counter", "espair_internal_scrapes_not_modified",
+             "Requests answered 304 as the client had the page", stats.scrapes_not_modified, 0);
+    put_stat("gauge", "espair_internal_scrape_duration_seconds",
+             "Duration of the last scrape", stats.scrape_us, 6);
+    put_stat("gauge", "espair_internal_scrape_size_bytes",
+             "Response size of the last scrape", stats.scrape_bytes, 0);
+    put_stat("gauge", "espair_internal_metrics_items_live",
+             "Metric slots in use", stats.items_live, 0);
+    put_stat("gauge", "espair_internal_metrics_items_expired",
+             "Metric slots expired but not yet reused", stats.items_expired, 0);
+    put_stat("gauge", "espair_internal_metrics_items_max",
+             "Metric slots available", METRICS_MAX_NUM, 0);
+    put_stat("counter", "espair_internal_wifi_retries",
+             "Failed attempts to connect to the AP", stats.wifi_retries, 0);
+    put_stat("gauge", "espair_internal_wifi_outage_seconds",
+             "Duration of the last link loss, until an address was got again", stats.wifi_outage_us / 1000, 3);
+    put_stat("gauge", "espair_internal_wifi_first_scrape_seconds",
+             "Time from the last reconnect to the first scrape served", stats.wifi_first_scrape_us / 1000, 3);
+#ifdef CONFIG_METRICS_PUSH
+    put_stat("counter", "espair_internal_push_requests",
+             "Remote write requests sent, including retries", stats.push_requests, 0);
+    put_stat("counter", "espair_internal_push_failures",
+             "Remote write requests failed", stats.push_failures, 0);
+    put_stat("counter", "espair_internal_push_samples",
+             "Samples accepted by remote write", stats.push_samples, 0);
+#endif
+#ifdef CONFIG_METRICS_LOG
+    put_stat("counter", "espair_internal_log_written_bytes",
+             "Bytes written to the history log since boot", stats.log_bytes, 0);
+    put_stat("counter", "espair_internal_log_erases",
+             "Flash sectors erased by the history log since boot", stats.log_erases, 0);
+    put_stat("gauge", "espair_internal_log_replay_seconds",
+             "Time to find where the history log stopped at boot", stats.log_replay_us, 6);
+#endif
+    put_stat("gauge", "espair_internal_deflate_duration_seconds",
+             "Duration of the last page compression", stats.deflate_us, 6);
+    put_stat("gauge", "espair_internal_deflate_ratio",
+             "Compressed to plain size of the last page compressed",
+             stats.deflate_in > 0 ? (uint64_t) stats.deflate_out * 1000 / stats.deflate_in : 0, 3);
+    put_stat("gauge", "espair_internal_heap_free_bytes",
+             "Free heap", esp_get_free_heap_size(), 0);
+    put_stat("gauge", "espair_internal_heap_min_free_bytes",
+             "Minimum free heap since boot", esp_get_minimum_free_heap_size(), 0);
+    put_stat("gauge", "espair_internal_heap_largest_free_block_bytes",
+             "Largest block the heap can allocate, far below free if fragmented",
+             heap_caps_get_largest_free_block(MALLOC_CAP_8BIT), 0);
+#ifdef CONFIG_METRICS_ARENA
+    multi_heap_info_t arena_info;
+    multi_heap_get_info(arena, &arena_info);
+    put_stat("gauge", "espair_internal_arena_free_bytes",
+             "Free bytes of the buffer arena", arena_info.total_free_bytes, 0);
+    put_stat("gauge", "espair_internal_arena_min_free_bytes",
+             "Minimum free bytes of the buffer arena since boot", arena_info.minimum_free_bytes, 0);
+    put_stat("gauge", "espair_internal_arena_largest_free_block_bytes",
+             "Largest block the buffer arena can allocate", arena_info.largest_free_block, 0);
+#endif
+
+    // Stack never touched by each task running firmware code, to size them
+    // by. The scheduler reports its own. Tasks are looked up until found,
+    // they are never deleted.
+    static const char *TASKS[] = {
+        "httpd", "metrics_log", "metrics_push", "esp_timer", "sys_evt", "nimble_host", "modbus",
+    };
+    static TaskHandle_t task_handles[sizeof(TASKS) / sizeof(TASKS[0])] = {};
+    static const char *task_labels[sizeof(TASKS) / sizeof(TASKS[0])] = {};
+    for (size_t i = 0; i < sizeof(TASKS) / sizeof(TASKS[0]); i++) {
+        if (task_handles[i] == NULL) task_handles[i] = xTaskGetHandle(TASKS[i]);
+        if (task_handles[i] == NULL) continue;
+        if (task_labels[i] == NULL) {
+            metric_label_t label = { "task", TASKS[i] };
+            task_labels[i] = metrics_labels(&label, 1);
+        }
+        put_stat("gauge", "espair_internal_task_stack_free_min_bytes",
+                 "Stack left at the deepest use since boot", uxTaskGetStackHighWaterMark(task_handles[i]), 0);
+        items[items_len - 1].labels = task_labels[i];
+    }
+    metrics_put_quiet(items, items_len, STATS_VALID_MILLIS);
+}
+
+void metrics_init(const metric_schema_t *schema, size_t schema_len) {
+    uint8_t mac[6];
+    ESP_ERROR_CHECK(esp_read_mac(mac, ESP_MAC_WIFI_STA));
+    snprintf(mac_str, sizeof(mac_str), "%02x%02x%02x%02x%02x%02x",
+             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+
+#ifdef CONFIG_METRICS_ARENA
+    arena = multi_heap_register(arena_buf, sizeof(arena_buf));
+    assert(arena != NULL);
+    multi_heap_set_lock(arena, &arena_lock);
+#endif
     metrics_list_init(&metrics);
+    metrics_schema_register(&metrics, schema, schema_len);
+    boot_id = esp_random();
+#ifdef CONFIG_METRICS_LOG
+    metrics_log_init();
+#endif
+    init_wifi();
+#if defined(CONFIG_METRICS_HISTORY) || defined(CONFIG_METRICS_PUSH)
+    // History & pushed samples carry wall-clock time, so collectors can merge them
+    esp_sntp_setoperatingmode(ESP_SNTP_OPMODE_POLL);
+    esp_sntp_setservername(0, NTP_SERVER);
+    esp_sntp_init();
+#endif
+#ifdef CONFIG_METRICS_PUSH
+    static StaticTask_t push_task_buf;
+    static StackType_t push_task_stack[PUSH_TASK_STACK_SIZE];
+    xTaskCreateStatic(metrics_push_task, "metrics_push", PUSH_TASK_STACK_SIZE, NULL, 5,
+                      push_task_stack, &push_task_buf);
+#endif
+
+    scheduler_job_t *stats_job = scheduler_add("metrics_stats", STATS_INTERVAL_MILLIS, metrics_publish_stats, NULL);
+    assert(stats_job != NULL);
 }
 
 void metrics_list_init(metric_list_t *list) {
     list->len = 0;
-    list->semphr = xSemaphoreCreateMutex();
-    assert(list->semphr != NULL);
+    list->families_len = 0;
+    list->schema_len = 0;
+    list->names_len = 0;
+    list->labels_count = 0;
+    list->free_head = METRICS_NONE;
+    list->deadline_head = METRICS_NONE;
+    list->deadline_tail = METRICS_NONE;
+    list->histograms_len = 0;
+    list->buckets_len = 0;
+#ifdef CONFIG_METRICS_HISTORY
+    for (size_t i = 0; i < METRICS_HISTORY_PAGES; i++) {
+        list->history[i].seq = 0;
+        metrics_history_page_reset(&list->history[i], METRICS_NONE, NULL, METRICS_NONE, 0);
+    }
+    list->history_next = 0;
+    memset(list->history_open, 0xff, sizeof(list->history_open));
+    memset(list->history_at, 0, sizeof(list->history_at));
+#endif
+    list->generation = 0;
+    list->changed_at = 0;
+    list->render = NULL;
+    list->writer_waits = 0;
+    list->writer_wait_us = 0;
+    list->reader_retries = 0;
+    list->scrapes = 0;
+    list->scrapes_not_modified = 0;
+    list->scrape_us = 0;
+    list->scrape_bytes = 0;
+    list->push_requests = 0;
+    list->push_failures = 0;
+    list->push_samples = 0;
+    list->deflate_us = 0;
+    list->deflate_in = 0;
+    list->deflate_out = 0;
+    memset(list->families, 0, sizeof(list->families));
+    memset(list->meta, 0, sizeof(list->meta));
+    memset(list->index, 0xff, sizeof(list->index));
+    memset(list->family_index, 0xff, sizeof(list->family_index));
+    memset(list->labels_index, 0xff, sizeof(list->labels_index));
+    list->semphr = xSemaphoreCreateMutexStatic(&list->semphr_buf);
+    list->render_semphr = xSemaphoreCreateMutexStatic(&list->render_semphr_buf);
 }
 
-void metrics_list_update_at(metric_list_t *list, size_t idx, metric_t *item, uint32_t exipred_at) {
+// Guarding `idx` is up to the caller.
+void metrics_list_update_at(metric_list_t *list, size_t idx, metric_t *item, int64_t exipred_at) {
+    if (list->meta[idx].exipred_at != 0) metrics_deadline_unlink(list, idx);
     list->items[idx] = *item;
     list->meta[idx].exipred_at = exipred_at;
-    list->meta[idx].buf_size = 80 + strlen(item->name) * 4 + sizeof(HOSTNAME);
-    if (item->help != NULL) list->meta[idx].buf_size += strlen(item->help);
+    metrics_deadline_link(list, idx);
 }
 
-#define put_into_then_return(i) {\
-    size_t idx = (i);\
-    ESP_LOGD(TAG, "Put %s to pos %d", metric->name, idx);\
-    metrics_list_update_at(&metrics, idx, metric, now + expire_in_mllis);\
-    xSemaphoreGive(metrics.semphr);\
-    return;\
+// Whether `a` and `b` render the same, or only differ in value unless `values`
+static bool metric_equals(const metric_t *a, const metric_t *b, bool values) {
+    return a->name == b->name && a->help == b->help && a->type == b->type &&
+           a->unit == b->unit && a->labels == b->labels && a->fixed == b->fixed && a->precision == b->precision &&
+           (!values || (a->fixed ? a->scaled == b->scaled : a->value == b->value));
 }
 
-void metrics_put(metric_t* metric, uint32_t expire_in_mllis) {
-    int64_t now = esp_timer_get_time() / 1000;
+static size_t metrics_label_escape(char *buf, size_t size, const char *str) {
+    size_t len = 0;
+    for (; *str; str++) {
+        char c = *str;
+        bool escape = c == '\\' || c == '"' || c == '\n';
+        if (len + escape + 1 >= size) return size;
+        if (escape) buf[len++] = '\\';
+        buf[len++] = c == '\n' ? 'n' : c;
+    }
+    return len;
+}
+
+static void metrics_writer_lock() {
+    if (xSemaphoreTake(metrics.semphr, 0) == pdTRUE) return;
+    int64_t started = esp_timer_get_time();
+    __atomic_add_fetch(&metrics.writer_waits, 1, __ATOMIC_RELAXED);
     xSemaphoreTake(metrics.semphr, portMAX_DELAY);
+    __atomic_add_fetch(&metrics.writer_wait_us, esp_timer_get_time() - started, __ATOMIC_RELAXED);
+}
 
-    // Update existing item
-    for (size_t i = 0; i < metrics.len; i++)
-        if (metrics.items[i].name == metric->name)
-            put_into_then_return(i);
+const char* metrics_labels(const metric_label_t *labels, size_t count) {
+    char buf[METRICS_LABELS_MAX_LEN];
+    size_t len = 0;
+    for (size_t i = 0; i < count; i++) {
+        int n = snprintf(&buf[len], sizeof(buf) - len, "%s%s=\"", i > 0 ? "," : "", labels[i].key);
+        if (n < 0 || len + n >= sizeof(buf)) goto too_long;
+        len += n;
+        size_t escaped = metrics_label_escape(&buf[len], sizeof(buf) - len, labels[i].value);
+        if (escaped >= sizeof(buf) - len) goto too_long;
+        len += escaped;
+        if (len + 2 > sizeof(buf)) goto too_long;
+        buf[len++] = '"';
+    }
+    buf[len] = '\0';
+    if (len == 0) return NULL;
+
+    metrics_writer_lock();
+    char *copy = metrics_labels_intern(&metrics, buf, metrics_hash(buf));
+    xSemaphoreGive(metrics.semphr);
+    if (copy == NULL) ESP_LOGE(TAG, "Metric name arena full, ignore labels %s", buf);
+    return copy;
 
-    // Replace expired item
-    for (size_t i = 0; i < metrics.len; i++)
-        if (now >= metrics.meta[i].exipred_at)
-            put_into_then_return(i);
+too_long:
+    ESP_LOGE(TAG, "Labels longer than %d bytes", METRICS_LABELS_MAX_LEN);
+    return NULL;
+}
 
-    // Append to end
-    if (metrics.len >= METRICS_MAX_NUM) {
-        ESP_LOGE(TAG, "Maximum metrics number reached, ignore %s", metric->name);
+metric_histogram_t* metrics_histogram(const metric_t *metric, const float *bounds, size_t bounds_len) {
+    if (bounds_len < 1 || bounds_len > METRICS_MAX_BOUNDS) {
+        ESP_LOGE(TAG, "Histogram %s needs 1 to %d bounds", metric->name, METRICS_MAX_BOUNDS);
+        return NULL;
+    }
+    metrics_writer_lock();
+    if (metrics.histograms_len >= METRICS_MAX_HISTOGRAMS ||
+            metrics.buckets_len + bounds_len + 1 > METRICS_MAX_BUCKETS) {
         xSemaphoreGive(metrics.semphr);
-        return;
+        ESP_LOGE(TAG, "Maximum histograms reached, ignore %s", metric->name);
+        return NULL;
+    }
+    size_t id = metrics.histograms_len;
+    metric_histogram_t *h = &metrics.histograms[id];
+    h->metric = *metric;
+    h->bounds = bounds;
+    h->bounds_len = bounds_len;
+    h->counts = &metrics.buckets[metrics.buckets_len];
+    h->sum_bits = 0;
+    h->next = METRICS_NONE;
+    h->first = true;
+    memset(h->counts, 0, (bounds_len + 1) * sizeof(uint32_t));
+    metrics.buckets_len += bounds_len + 1;
+
+    // Chain to histograms of the same name, they share HELP/UNIT/TYPE
+    for (size_t i = 0; i < id; i++) {
+        if (metrics.histograms[i].next == METRICS_NONE &&
+                strcmp(metrics.histograms[i].metric.name, metric->name) == 0) {
+            h->first = false;
+            __atomic_store_n(&metrics.histograms[i].next, id, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    __atomic_store_n(&metrics.histograms_len, id + 1, __ATOMIC_RELEASE);
+    metrics_list_changed(&metrics);
+    xSemaphoreGive(metrics.semphr);
+    return h;
+}
+
+void metrics_observe(metric_histogram_t *h, float value) {
+    size_t i = 0;
+    while (i < h->bounds_len && value > h->bounds[i]) i++;
+    __atomic_add_fetch(&h->counts[i], 1, __ATOMIC_RELAXED);
+
+    uint32_t old_bits = __atomic_load_n(&h->sum_bits, __ATOMIC_RELAXED);
+    uint32_t new_bits;
+    do {
+        float sum;
+        memcpy(&sum, &old_bits, sizeof(sum));
+        sum += value;
+        memcpy(&new_bits, &sum, sizeof(sum));
+    } while (!__atomic_compare_exchange_n(&h->sum_bits, &old_bits, new_bits, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    metrics_list_changed(&metrics);
+}
+
+// Put one metric with `metrics.semphr` held. Return whether the rendered
+// page changes, not counting new values if `quiet` unless the page is older
+// than STATS_MAX_AGE_MILLIS, which bounds how stale quiet values get.
+static bool metrics_put_locked(metric_t* metric, int64_t now, time_t wall, uint32_t expire_in_mllis,
+                               bool quiet) {
+    bool has_labels = metric->labels != NULL && metric->labels[0] != '\0';
+    uint32_t labels_hash = has_labels ? metrics_hash(metric->labels) : 0;
+    bool changed = false;
+    metric_t schema_metric;
+    uint32_t family_hash;
+    uint16_t f;
+
+    if (metric->name == NULL) { // Declared in the schema, no lookup by name
+        if (metric->id >= metrics.schema_len) {
+            ESP_LOGE(TAG, "No metric %d in schema", metric->id);
+            return false;
+        }
+        f = metric->id;
+        family_hash = metrics.families[f].hash;
+        const metric_schema_t *schema = metrics.families[f].schema;
+        schema_metric = *metric;
+        schema_metric.name = (char*) schema->name;
+        schema_metric.help = (char*) schema->help;
+        schema_metric.unit = (char*) schema->unit;
+        schema_metric.type = (char*) schema->type;
+        schema_metric.precision = schema->precision;
+        metric = &schema_metric;
+    } else {
+        family_hash = metrics_hash(metric->name);
+        f = metrics_family_get(&metrics, metric, family_hash);
+    }
+    if (metric->fixed && metric->precision > METRICS_MAX_PRECISION) {
+        ESP_LOGE(TAG, "Precision of %s too large for a scaled value", metric->name);
+        return false;
+    }
+    char *labels = NULL;
+    if (has_labels) labels = metrics_labels_intern(&metrics, metric->labels, labels_hash);
+    if (f == METRICS_NONE || (has_labels && labels == NULL)) {
+        ESP_LOGE(TAG, "Metric families or name arena full, ignore %s", metric->name);
+        return false;
+    }
+    metric_family_t *family = &metrics.families[f];
+    if (family->help != metric->help || family->unit != metric->unit || family->type != metric->type) {
+        metrics_seq_write_begin(&family->seq);
+        family->help = metric->help;
+        family->unit = metric->unit;
+        family->type = metric->type;
+        metrics_seq_write_end(&family->seq);
+        changed = true;
     }
-    put_into_then_return(metrics.len++);
+
+    uint32_t hash = family_hash * 31 + labels_hash;
+    size_t bucket = metrics_index_find(&metrics, f, labels, hash);
+    uint16_t idx = metrics.index[bucket];
+    if (idx == METRICS_NONE) {
+        if (metrics.free_head != METRICS_NONE) { // Reuse expired item
+            idx = metrics.free_head;
+            metrics.free_head = metrics.meta[idx].next;
+        } else if (metrics.len < METRICS_MAX_NUM) { // Append to end
+            idx = metrics.len++;
+        } else {
+            ESP_LOGE(TAG, "Maximum metrics number reached, ignore %s", metric->name);
+            return changed;
+        }
+        metrics.index[bucket] = idx;
+    }
+
+    metric_t item = *metric;
+    item.name = family->name;
+    item.labels = labels;
+    metric_meta_t *meta = &metrics.meta[idx];
+    ESP_LOGD(TAG, "Put %s to pos %d", item.name, idx);
+    uint32_t age = (uint32_t) now - __atomic_load_n(&metrics.changed_at, __ATOMIC_RELAXED);
+    bool values = !quiet || age >= STATS_MAX_AGE_MILLIS;
+    changed |= meta->exipred_at == 0 || !metric_equals(&metrics.items[idx], &item, values);
+    metrics_seq_write_begin(&meta->seq);
+    meta->quiet = quiet;
+    if (meta->exipred_at == 0) {
+        meta->hash = hash;
+        meta->family = f;
+        metrics_family_link(&metrics, idx);
+    }
+    metrics_list_update_at(&metrics, idx, &item, now + expire_in_mllis);
+    metrics_seq_write_end(&meta->seq);
+#ifdef CONFIG_METRICS_HISTORY
+    // Self-instrumentation would take history and log space from sensors
+    if (!quiet) metrics_history_record(&metrics, idx, &item, wall);
+#endif
+    return changed;
+}
+
+void metrics_put(metric_t* metric, uint32_t expire_in_mllis) {
+    int64_t now = esp_timer_get_time() / 1000;
+    time_t wall = time(NULL);
+    metrics_writer_lock();
+    metrics_list_sweep(&metrics, now);
+    if (metrics_put_locked(metric, now, wall, expire_in_mllis, false)) metrics_list_changed(&metrics);
+    xSemaphoreGive(metrics.semphr);
+}
+
+static void metrics_put_batch(metric_t *items, size_t count, uint32_t expire_in_mllis, bool quiet) {
+    int64_t now = esp_timer_get_time() / 1000;
+    time_t wall = time(NULL);
+    bool changed = false;
+    metrics_writer_lock();
+    metrics_list_sweep(&metrics, now);
+    // Pages rendered meanwhile are not cached, see metrics_render()
+    metrics_seq_write_begin(&metrics.batch_seq);
+    for (size_t i = 0; i < count; i++)
+        changed |= metrics_put_locked(&items[i], now, wall, expire_in_mllis, quiet);
+    metrics_seq_write_end(&metrics.batch_seq);
+    if (changed) metrics_list_changed(&metrics);
+    xSemaphoreGive(metrics.semphr);
+}
+
+void metrics_put_many(metric_t *items, size_t count, uint32_t expire_in_mllis) {
+    metrics_put_batch(items, count, expire_in_mllis, false);
+}
+
+void metrics_put_quiet(metric_t *items, size_t count, uint32_t expire_in_mllis) {
+    metrics_put_batch(items, count, expire_in_mllis, true);
 }
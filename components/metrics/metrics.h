@@ -2,36 +2,245 @@
 #define _LIB_METRICS_H_
 
 #include "freertos/semphr.h"
+#include "metrics_history.h"
+#include "metrics_format.h"
 
 #define METRICS_MAX_NUM (CONFIG_METRICS_MAX_ITEMS)
+#define METRICS_RENDER_BLOCK_SIZE (CONFIG_METRICS_RENDER_BLOCK_SIZE)
+#define METRICS_NAMES_SIZE (CONFIG_METRICS_NAMES_SIZE)
+#define METRICS_MAX_FAMILIES (CONFIG_METRICS_MAX_FAMILIES)
+#define METRICS_INDEX_SIZE (METRICS_MAX_NUM * 2 + 1)
+#define METRICS_FAMILY_INDEX_SIZE (METRICS_MAX_FAMILIES * 2 + 1)
+#define METRICS_LABELS_MAX_LEN (128)
+#define METRICS_MAX_HISTOGRAMS (CONFIG_METRICS_MAX_HISTOGRAMS)
+#define METRICS_MAX_BUCKETS (CONFIG_METRICS_MAX_BUCKETS)
+#define METRICS_MAX_BOUNDS (32)
+#define METRICS_NONE (0xffff)
 
 typedef struct {
-    char* name;
+    char* name;          // NULL to put family `id` of the schema instead
+    uint16_t id;
     char* help;
     char* type;
     char* unit;
+    const char* labels;  // From metrics_labels(), or NULL for none
     float value;
+    int32_t scaled;      // Value times 10^precision, used instead if `fixed`
+    bool fixed;
     uint8_t precision;
 } metric_t;
 
 typedef struct {
-    int64_t exipred_at;
-    size_t buf_size;
+    const char *key;
+    const char *value;
+} metric_label_t;
+
+// Each item and family is guarded by a sequence lock: writers, serialized
+// by `metric_list_t.semphr`, make `seq` odd while modifying it; readers
+// copy it without any lock and retry if `seq` changed meanwhile.
+typedef struct {
+    uint32_t seq;
+    int64_t exipred_at;  // 0 if the item is free
+    uint32_t hash;       // Hash of family name and labels
+    uint16_t prev;       // Neighbours in expiry order, or next free item
+    uint16_t next;
+    uint16_t family;
+    uint16_t family_prev;
+    uint16_t family_next;
+    bool quiet;          // Put by metrics_put_quiet()
 } metric_meta_t;
 
+// Family declared at build time, see METRICS_SCHEMA_ENTRY(). Its metadata
+// lines and the start of its sample lines are rendered by the preprocessor.
+typedef struct {
+    const char *name;
+    const char *help;
+    const char *type;
+    const char *unit;
+    const char *meta;      // `# HELP`, `# UNIT` & `# TYPE` lines
+    const char *prefix;    // Sample name and labels up to the MAC address
+    uint16_t meta_len;
+    uint16_t prefix_len;
+    uint8_t precision;
+} metric_schema_t;
+
+#define METRICS_SUFFIX_gauge ""
+#define METRICS_SUFFIX_counter "_total"
+#define METRICS_PREFIX(N, T) N METRICS_SUFFIX_##T "{host=\"" CONFIG_METRICS_HOSTNAME "\",mac=\""
+
+// Schema entry of gauge or counter `T` with unit `U`, `P` digits after
+// the point and help `H`. All but `T` must be string literals.
+#define METRICS_SCHEMA_ENTRY(N, T, U, P, H) {\
+    N, H, #T, U,\
+    "# HELP " N " " H "\n# UNIT " N " " U "\n# TYPE " N " " #T "\n", METRICS_PREFIX(N, T),\
+    sizeof("# HELP " N " " H "\n# UNIT " N " " U "\n# TYPE " N " " #T "\n") - 1,\
+    sizeof(METRICS_PREFIX(N, T)) - 1, P,\
+}
+
+// Schema entry without unit
+#define METRICS_SCHEMA_ENTRY_PLAIN(N, T, P, H) {\
+    N, H, #T, NULL,\
+    "# HELP " N " " H "\n# TYPE " N " " #T "\n", METRICS_PREFIX(N, T),\
+    sizeof("# HELP " N " " H "\n# TYPE " N " " #T "\n") - 1,\
+    sizeof(METRICS_PREFIX(N, T)) - 1, P,\
+}
+
+// Items sharing the same name. HELP, UNIT & TYPE are printed once for all.
+typedef struct {
+    uint32_t seq;
+    char *name;  // Interned, or from the schema
+    char *help;
+    char *type;
+    char *unit;
+    const metric_schema_t *schema;  // NULL if registered at runtime
+    uint32_t hash;
+    uint16_t head;
+    uint16_t tail;
+} metric_family_t;
+
+// Histogram or summary with a bucket layout fixed at registration.
+// Observations only touch atomic counters; readers derive the total count
+// from the buckets, so it always matches the +Inf bucket.
+typedef struct {
+    metric_t metric;      // Type "histogram" or "summary", `value` unused
+    const float *bounds;  // Ascending upper bounds, the +Inf bucket is implied
+    size_t bounds_len;
+    uint32_t *counts;     // Observations per bucket, `bounds_len + 1` entries
+    uint32_t sum_bits;    // Sum of observations, bits of a float
+    uint16_t next;        // Next histogram with the same name, or METRICS_NONE
+    bool first;           // First histogram registered with its name
+} metric_histogram_t;
+
+typedef struct metric_render_block {
+    struct metric_render_block *next;
+    size_t len;
+    char data[METRICS_RENDER_BLOCK_SIZE];
+} metric_render_block_t;
+
+// Rendered OpenMetrics page shared between concurrent scrapes, kept as a
+// list of fixed-size blocks that are sent as HTTP chunks.
+// Reference counted, `refs` and the list's `render` are protected by
+// `render_semphr`.
+typedef struct {
+    uint32_t refs;
+    uint32_t generation;
+    int64_t exipred_at;  // When the first printed item expires
+    metric_render_block_t *head;
+    metric_render_block_t *deflated;  // Page as raw deflate, built for the first client accepting it
+    size_t deflated_len;
+    size_t len;          // Bytes of the plain page
+    uint32_t crc32;
+    uint32_t adler32;
+} metric_render_t;
+
 typedef struct {
     metric_t items[METRICS_MAX_NUM];
     metric_meta_t meta[METRICS_MAX_NUM];
     size_t len;
-    SemaphoreHandle_t semphr;
+    uint16_t index[METRICS_INDEX_SIZE];        // Hash table of items by family & labels
+    metric_family_t families[METRICS_MAX_FAMILIES];
+    size_t families_len;
+    size_t schema_len;                         // Leading families, declared in the schema
+    uint16_t family_index[METRICS_FAMILY_INDEX_SIZE];
+    char names[METRICS_NAMES_SIZE];            // Arena of family names & encoded labels
+    size_t names_len;
+    size_t labels_count;
+    uint16_t labels_index[METRICS_INDEX_SIZE]; // Hash table of label sets in `names`
+    uint16_t free_head;                        // Expired items ready for reuse
+    uint16_t deadline_head;                    // Live items ordered by `exipred_at`
+    uint16_t deadline_tail;
+    metric_histogram_t histograms[METRICS_MAX_HISTOGRAMS];
+    size_t histograms_len;
+    uint32_t buckets[METRICS_MAX_BUCKETS];     // Pool of `metric_histogram_t.counts`
+    size_t buckets_len;
+#ifdef CONFIG_METRICS_HISTORY
+    metric_history_page_t history[METRICS_HISTORY_PAGES];
+    uint16_t history_next;                     // Oldest page, reused next
+    uint16_t history_open[METRICS_MAX_NUM];    // Page each item appends to
+    uint32_t history_at[METRICS_MAX_NUM];      // Unix time each item last appended
+#endif
+    SemaphoreHandle_t semphr;         // Serializes writers, never taken by readers
+    SemaphoreHandle_t render_semphr;  // Guards `render`, taken by readers only
+    StaticSemaphore_t semphr_buf;
+    StaticSemaphore_t render_semphr_buf;
+    uint32_t generation;      // Bumped whenever rendered output would change
+    uint32_t changed_at;      // Uptime in ms `generation` was last bumped at, wraps
+    uint32_t batch_seq;       // Odd while metrics_put_many() is writing
+    metric_render_t *render;  // Cache of the page for `generation`, or NULL
+    uint32_t writer_waits;
+    uint32_t writer_wait_us;
+    uint32_t reader_retries;
+    uint32_t scrapes;
+    uint32_t scrapes_not_modified;
+    uint32_t scrape_us;       // Duration of the last scrape
+    uint32_t scrape_bytes;    // Response size of the last scrape
+    uint32_t push_requests;
+    uint32_t push_failures;
+    uint32_t push_samples;
+    uint32_t deflate_us;      // Duration of the last page compression
+    uint32_t deflate_in;      // Bytes of the last page compressed
+    uint32_t deflate_out;     // ...and its compressed size
 } metric_list_t;
 
-void metrics_init();
+typedef struct {
+    uint32_t writer_waits;    // Writes that found another writer holding the list
+    uint32_t writer_wait_us;  // Total time spent waiting for the list
+    uint32_t reader_retries;  // Item reads repeated due to a concurrent write
+    uint32_t scrapes;
+    uint32_t scrapes_not_modified; // Scrapes answered 304, the client had the page
+    uint32_t scrape_us;       // Duration of the last scrape
+    uint32_t scrape_bytes;    // Response size of the last scrape
+    uint16_t items_live;      // Slots holding a metric, out of METRICS_MAX_NUM
+    uint16_t items_expired;   // Live slots past their deadline, not yet freed
+    uint32_t wifi_retries;    // Failed connection attempts since boot
+    uint32_t wifi_outage_us;  // Last link loss until an address was got again
+    uint32_t wifi_first_scrape_us; // Last reconnect until a scrape was served
+    uint32_t push_requests;   // Remote write requests, including retries
+    uint32_t push_failures;   // Remote write requests not accepted
+    uint32_t push_samples;    // Samples accepted by remote write
+    uint32_t deflate_us;      // Duration of the last page compression
+    uint32_t deflate_in;      // Bytes of the last page compressed
+    uint32_t deflate_out;     // ...and its compressed size
+    uint32_t log_bytes;       // Written to the history log since boot
+    uint32_t log_erases;      // Sectors erased by the history log since boot
+    uint32_t log_replay_us;   // Time to open the history log at boot
+} metrics_stats_t;
+
+// Families of `schema` take ids 0 to `schema_len - 1`, in order. Stats of
+// the exporter are published by a job, call scheduler_init() first.
+void metrics_init(const metric_schema_t *schema, size_t schema_len);
 
 void metrics_put(metric_t *metric, uint32_t expire_in_mllis);
 
+// Put metrics of one reading at once, all stamped with the same time. A
+// scrape sees either none or all of them updated.
+void metrics_put_many(metric_t *metrics, size_t count, uint32_t expire_in_mllis);
+
+// Put self-instrumentation, such as scrape durations, like
+// metrics_put_many(). New series change the page, new values alone do not
+// unless the page is older than a minute: a cached page keeps its values
+// and ETag, so scrapers keep getting 304 for it until something else
+// changes or it ages. Expiry of these does not end the cached page either.
+// They are not kept in the history.
+void metrics_put_quiet(metric_t *metrics, size_t count, uint32_t expire_in_mllis);
+
+// Register a histogram (or summary, according to `metric->type`) with
+// upper bounds `bounds`. Strings and `bounds` must outlive the program.
+// Return NULL if no more histograms fit.
+metric_histogram_t* metrics_histogram(const metric_t *metric, const float *bounds, size_t bounds_len);
+
+// Record one observation. Lock-free, may be called from any task.
+void metrics_observe(metric_histogram_t *histogram, float value);
+
+// Encode labels once for `metric_t.labels`, e.g. `sensor="s8-1"`.
+// The returned string is kept for the lifetime of the program.
+// Return NULL if `count` is zero or on failure.
+const char* metrics_labels(const metric_label_t *labels, size_t count);
+
+void metrics_get_stats(metrics_stats_t *stats);
+
 void metrics_list_init(metric_list_t *list);
 
-void metrics_list_update_at(metric_list_t *list, size_t idx, metric_t *item, uint32_t exipred_at);
+void metrics_list_update_at(metric_list_t *list, size_t idx, metric_t *item, int64_t exipred_at);
 
 #endif /* _LIB_METRICS_H_ */
@@ -0,0 +1,217 @@
+#include "string.h"
+#include "metrics_deflate.h"
+
+#define HASH_BITS   (12)
+#define MIN_MATCH   (3)
+#define MAX_MATCH   (258)
+#define WINDOW_SIZE (32768)
+
+typedef struct {
+    uint8_t *p;
+    uint32_t bits;
+    uint8_t count;
+} bit_writer_t;
+
+static const uint16_t LENGTH_BASE[] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+static const uint8_t LENGTH_EXTRA[] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+static const uint16_t DIST_BASE[] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+static const uint8_t DIST_EXTRA[] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+static void bits_put(bit_writer_t *w, uint32_t value, uint8_t n) {
+    w->bits |= value << w->count;
+    w->count += n;
+    while (w->count >= 8) {
+        *w->p++ = w->bits;
+        w->bits >>= 8;
+        w->count -= 8;
+    }
+}
+
+// Huffman codes are packed starting from their most significant bit
+static void code_put(bit_writer_t *w, uint32_t code, uint8_t n) {
+    uint32_t reversed = 0;
+    for (uint8_t i = 0; i < n; i++) reversed |= ((code >> i) & 1) << (n - 1 - i);
+    bits_put(w, reversed, n);
+}
+
+// Fixed literal/length code, RFC 1951 3.2.6
+static void symbol_put(bit_writer_t *w, uint16_t symbol) {
+    if (symbol < 144) code_put(w, 0x30 + symbol, 8);
+    else if (symbol < 256) code_put(w, 0x190 + symbol - 144, 9);
+    else if (symbol < 280) code_put(w, symbol - 256, 7);
+    else code_put(w, 0xc0 + symbol - 280, 8);
+}
+
+static void match_put(bit_writer_t *w, size_t len, size_t dist) {
+    uint8_t i = 0;
+    while (i + 1 < sizeof(LENGTH_BASE) / sizeof(LENGTH_BASE[0]) && LENGTH_BASE[i + 1] <= len) i++;
+    symbol_put(w, 257 + i);
+    if (LENGTH_EXTRA[i] > 0) bits_put(w, len - LENGTH_BASE[i], LENGTH_EXTRA[i]);
+    i = 0;
+    while (i + 1 < sizeof(DIST_BASE) / sizeof(DIST_BASE[0]) && DIST_BASE[i + 1] <= dist) i++;
+    code_put(w, i, 5);
+    if (DIST_EXTRA[i] > 0) bits_put(w, dist - DIST_BASE[i], DIST_EXTRA[i]);
+}
+
+// Position in the input, as segment & offset within it
+typedef struct {
+    size_t seg;
+    size_t off;
+} position_t;
+
+// Move `pos` on by one byte, past the end of the segment into the next
+// non-empty one. Stream offsets of the segments entered are recorded.
+static inline void position_next(metrics_deflate_state_t *state, const metrics_deflate_segment_t *segments,
+                                 size_t count, position_t *pos, uint32_t offset) {
+    if (++pos->off < segments[pos->seg].len) return;
+    while (pos->seg < count && pos->off >= segments[pos->seg].len) {
+        pos->seg++;
+        pos->off = 0;
+        if (pos->seg < count) state->start[pos->seg & (METRICS_DEFLATE_SEGMENTS - 1)] = offset;
+    }
+}
+
+static inline uint32_t hash3(const uint8_t *p) {
+    return ((p[0] | p[1] << 8 | p[2] << 16) * 0x9e3779b1) >> (32 - HASH_BITS);
+}
+
+// Hash of the 3 bytes at `pos`, which must not be past the last 3 bytes
+static inline uint32_t hash_at(const metrics_deflate_segment_t *segments, position_t pos) {
+    const metrics_deflate_segment_t *s = &segments[pos.seg];
+    if (pos.off + MIN_MATCH <= s->len) return hash3(&s->data[pos.off]);
+    // Spread over segments, gathered first
+    uint8_t bytes[MIN_MATCH];
+    for (int i = 0; i < MIN_MATCH; i++) {
+        while (pos.off >= s->len) {
+            s++;
+            pos.off = 0;
+        }
+        bytes[i] = s->data[pos.off++];
+    }
+    return hash3(bytes);
+}
+
+// Length of the match of up to `max` bytes between earlier `a` and `b`,
+// a run at a time where both are contiguous
+static size_t match_len(const metrics_deflate_segment_t *segments, position_t a, position_t b, size_t max) {
+    size_t n = 0;
+    while (n < max) {
+        while (a.off >= segments[a.seg].len) {
+            a.seg++;
+            a.off = 0;
+        }
+        while (b.off >= segments[b.seg].len) {
+            b.seg++;
+            b.off = 0;
+        }
+        size_t run = segments[a.seg].len - a.off;
+        if (segments[b.seg].len - b.off < run) run = segments[b.seg].len - b.off;
+        if (max - n < run) run = max - n;
+        const uint8_t *x = &segments[a.seg].data[a.off], *y = &segments[b.seg].data[b.off];
+        size_t k = 0;
+        while (k < run && x[k] == y[k]) k++;
+        n += k;
+        if (k < run) break;
+        a.off += run;
+        b.off += run;
+    }
+    return n;
+}
+
+// Pass the whole bytes written so far on to the sink
+static bool out_flush(metrics_deflate_state_t *state, bit_writer_t *w, metrics_deflate_sink_t sink, void *arg,
+                      size_t *total) {
+    size_t len = w->p - state->out;
+    w->p = state->out;
+    *total += len;
+    return len == 0 || sink(state->out, len, arg);
+}
+
+size_t metrics_deflate(metrics_deflate_state_t *state, const metrics_deflate_segment_t *segments, size_t count,
+                       metrics_deflate_sink_t sink, void *arg) {
+    bit_writer_t w = { .p = state->out };
+    size_t total = 0;
+    uint32_t len = 0;
+    for (size_t i = 0; i < count; i++) len += segments[i].len;
+
+    // Positions are kept as segment << 16 | offset, plus one, zero for none
+    memset(state->head, 0, sizeof(state->head));
+    state->start[0] = 0;
+    position_t pos = { 0, 0 };
+    while (pos.seg < count && segments[pos.seg].len == 0)
+        state->start[++pos.seg & (METRICS_DEFLATE_SEGMENTS - 1)] = 0;
+    bits_put(&w, 1, 1); // BFINAL
+    bits_put(&w, 1, 2); // BTYPE: fixed Huffman
+    for (uint32_t i = 0; i < len;) {
+        size_t match = 0;
+        size_t dist = 0;
+        if (i + MIN_MATCH <= len) {
+            uint32_t h = hash_at(segments, pos);
+            uint32_t candidate = state->head[h];
+            state->head[h] = (pos.seg << 16 | pos.off) + 1;
+            position_t c = { (candidate - 1) >> 16, (candidate - 1) & 0xffff };
+            if (candidate > 0 && pos.seg - c.seg < METRICS_DEFLATE_SEGMENTS) {
+                dist = i - (state->start[c.seg & (METRICS_DEFLATE_SEGMENTS - 1)] + c.off);
+                if (dist <= WINDOW_SIZE)
+                    match = match_len(segments, c, pos, len - i < MAX_MATCH ? len - i : MAX_MATCH);
+            }
+        }
+        if (match >= MIN_MATCH) {
+            match_put(&w, match, dist);
+            // Index positions within the match too, lines repeat in parts
+            uint32_t end = i + match;
+            position_next(state, segments, count, &pos, ++i);
+            while (i < end) {
+                // Positions with their 3 bytes in this segment are hashed in place
+                const metrics_deflate_segment_t *s = &segments[pos.seg];
+                uint32_t run = s->len >= pos.off + MIN_MATCH ? s->len - pos.off - (MIN_MATCH - 1) : 0;
+                if (run > end - i) run = end - i;
+                for (uint32_t k = 0; k < run; k++)
+                    state->head[hash3(&s->data[pos.off + k])] = (pos.seg << 16 | (pos.off + k)) + 1;
+                if (run > 0) {
+                    pos.off += run - 1;
+                    i += run - 1;
+                } else if (i + MIN_MATCH <= len) {
+                    state->head[hash_at(segments, pos)] = (pos.seg << 16 | pos.off) + 1;
+                }
+                position_next(state, segments, count, &pos, ++i);
+            }
+        } else {
+            symbol_put(&w, segments[pos.seg].data[pos.off]);
+            position_next(state, segments, count, &pos, ++i);
+        }
+        if (w.p - state->out > METRICS_DEFLATE_OUT_SIZE - 8 && !out_flush(state, &w, sink, arg, &total))
+            return 0;
+    }
+    symbol_put(&w, 256); // End of block
+    if (w.count > 0) bits_put(&w, 0, 8 - w.count);
+    return out_flush(state, &w, sink, arg, &total) ? total : 0;
+}
+
+uint32_t metrics_adler32(uint32_t adler, const uint8_t *src, size_t len) {
+    uint32_t a = adler & 0xffff, b = adler >> 16;
+    while (len > 0) {
+        // Largest run before `b` may overflow
+        size_t n = len < 5552 ? len : 5552;
+        len -= n;
+        while (n-- > 0) {
+            a += *src++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return b << 16 | a;
+}
@@ -0,0 +1,42 @@
+#ifndef _LIB_METRICS_DEFLATE_H_
+#define _LIB_METRICS_DEFLATE_H_
+
+#include "stddef.h"
+#include "stdint.h"
+#include "stdbool.h"
+
+// Recent segments matches may reach back into, a power of 2
+#define METRICS_DEFLATE_SEGMENTS (256)
+
+// Output staged before it is passed on, see metrics_deflate_sink_t
+#define METRICS_DEFLATE_OUT_SIZE (256)
+
+// Part of the input, such as one render block of a page
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+} metrics_deflate_segment_t;
+
+// Receives the compressed stream in pieces of at most
+// METRICS_DEFLATE_OUT_SIZE bytes. Return false to give up.
+typedef bool (*metrics_deflate_sink_t)(const uint8_t *data, size_t len, void *arg);
+
+// Scratch space of metrics_deflate(), kept off the stack
+typedef struct {
+    uint32_t head[1 << 12];                      // Latest position of each hash, plus one
+    uint32_t start[METRICS_DEFLATE_SEGMENTS];    // Stream offset of recent segments
+    uint8_t out[METRICS_DEFLATE_OUT_SIZE];
+} metrics_deflate_state_t;
+
+// Compress the concatenation of `count` segments into one raw deflate
+// block (RFC 1951) with fixed Huffman codes, without joining them: matches
+// reach back across segments within the 32 KiB window, and the output goes
+// to `sink` as it is produced. Segments must be shorter than 64 KiB.
+// Return the compressed length, or 0 if `sink` gave up.
+size_t metrics_deflate(metrics_deflate_state_t *state, const metrics_deflate_segment_t *segments, size_t count,
+                       metrics_deflate_sink_t sink, void *arg);
+
+// Continue the checksum `adler` over `len` bytes of `src`, starting from 1
+uint32_t metrics_adler32(uint32_t adler, const uint8_t *src, size_t len);
+
+#endif /* _LIB_METRICS_DEFLATE_H_ */
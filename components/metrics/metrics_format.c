@@ -0,0 +1,84 @@
+#include "stdio.h"
+#include "string.h"
+#include "math.h"
+#include "metrics_format.h"
+
+static const double POW10[METRICS_MAX_PRECISION + 1] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+};
+
+size_t metrics_format_fixed(char *buf, int32_t scaled, uint8_t precision) {
+    char digits[12 + METRICS_MAX_PRECISION];
+    size_t n = 0;
+    size_t len = 0;
+    uint32_t v = scaled < 0 ? -(uint32_t) scaled : (uint32_t) scaled;
+    if (precision > METRICS_MAX_PRECISION) precision = METRICS_MAX_PRECISION;
+
+    // Least significant first, zero padded to a leading digit before the point
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0 || n <= precision);
+    if (scaled < 0) buf[len++] = '-';
+    while (n > 0) {
+        if (n == precision) buf[len++] = '.';
+        buf[len++] = digits[--n];
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+size_t metrics_format_float(char *buf, float value, uint8_t precision) {
+    if (!isfinite(value)) {
+        const char *str = isnan(value) ? "NaN" : value > 0 ? "+Inf" : "-Inf";
+        strcpy(buf, str);
+        return strlen(str);
+    }
+    if (precision <= METRICS_MAX_PRECISION) {
+        // Round half to even like printf
+        double scaled = rint((double) value * POW10[precision]);
+        // Negative values rounding to zero keep their sign, "-0.00"
+        if (scaled == 0 && signbit(value)) {
+            buf[0] = '-';
+            return 1 + metrics_format_fixed(&buf[1], 0, precision);
+        }
+        if (scaled > -INT32_MAX && scaled < INT32_MAX)
+            return metrics_format_fixed(buf, (int32_t) scaled, precision);
+    }
+    int n = snprintf(buf, METRICS_VALUE_MAX_LEN, "%.*f", precision, value);
+    return n < 0 ? 0 : n < METRICS_VALUE_MAX_LEN ? n : METRICS_VALUE_MAX_LEN - 1;
+}
+
+size_t metrics_format_sample(char *buf, size_t size, const char *prefix, size_t prefix_len,
+                             const char *mac, const char *labels, const char *value, size_t value_len,
+                             uint64_t timestamp) {
+    char ts[20];
+    size_t ts_len = 0;
+    for (uint64_t t = timestamp; t > 0; t /= 10) ts[sizeof(ts) - ++ts_len] = '0' + t % 10;
+    size_t mac_len = strlen(mac);
+    size_t labels_len = labels != NULL ? strlen(labels) : 0;
+    // Quote, comma, brace, space, space & newline at most
+    if (prefix_len + mac_len + labels_len + value_len + ts_len + 6 > size) return 0;
+
+    size_t len = prefix_len;
+    memcpy(buf, prefix, prefix_len);
+    memcpy(&buf[len], mac, mac_len);
+    len += mac_len;
+    buf[len++] = '"';
+    if (labels_len > 0) {
+        buf[len++] = ',';
+        memcpy(&buf[len], labels, labels_len);
+        len += labels_len;
+    }
+    buf[len++] = '}';
+    buf[len++] = ' ';
+    memcpy(&buf[len], value, value_len);
+    len += value_len;
+    if (ts_len > 0) {
+        buf[len++] = ' ';
+        memcpy(&buf[len], &ts[sizeof(ts) - ts_len], ts_len);
+        len += ts_len;
+    }
+    buf[len++] = '\n';
+    return len;
+}
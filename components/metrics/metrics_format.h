@@ -0,0 +1,32 @@
+#ifndef _LIB_METRICS_FORMAT_H_
+#define _LIB_METRICS_FORMAT_H_
+
+#include "stddef.h"
+#include "stdint.h"
+
+// Size of buffers values are formatted into, the terminator included
+#define METRICS_VALUE_MAX_LEN (48)
+
+// Largest precision of scaled integers, 10^9 still fits in int32_t
+#define METRICS_MAX_PRECISION (9)
+
+// Format `scaled / 10^precision` in decimal, e.g. 2150 with precision 2 as
+// "21.50", the same as "%.*f" would. Return the length.
+size_t metrics_format_fixed(char *buf, int32_t scaled, uint8_t precision);
+
+// Format like "%.*f", through metrics_format_fixed() unless the value is
+// too large for it. Non-finite values are spelled NaN, +Inf and -Inf as
+// OpenMetrics does. Return the length.
+size_t metrics_format_float(char *buf, float value, uint8_t precision);
+
+// Print the sample line `<prefix><mac>"[,<labels>]} <value>[ <timestamp>]\n`
+// into `buf` of `size` bytes, not terminated. `prefix` holds the name and
+// labels up to the MAC address, see metric_schema_t. The timestamp is in
+// the unit of the format, seconds for OpenMetrics and milliseconds for the
+// Prometheus text format, and left out if zero. Return the length, or 0 if
+// the line does not fit.
+size_t metrics_format_sample(char *buf, size_t size, const char *prefix, size_t prefix_len,
+                             const char *mac, const char *labels, const char *value, size_t value_len,
+                             uint64_t timestamp);
+
+#endif /* _LIB_METRICS_FORMAT_H_ */
@@ -0,0 +1,142 @@
+#include "string.h"
+#include "metrics_history.h"
+
+// Worst case of one sample: '1111' + 32 bits of time, '11' + 5 + 5 + 32 bits of value
+#define SAMPLE_MAX_BITS (4 + 32 + 2 + 10 + 32)
+
+static void bits_write(uint8_t *data, uint16_t *pos, uint32_t value, uint8_t n) {
+    while (n > 0) {
+        n--;
+        uint8_t bit = (value >> n) & 1;
+        uint8_t mask = 0x80 >> (*pos & 7);
+        if (bit) data[*pos >> 3] |= mask;
+        else data[*pos >> 3] &= ~mask;
+        (*pos)++;
+    }
+}
+
+static uint32_t bits_read(const uint8_t *data, uint16_t *pos, uint8_t n) {
+    uint32_t value = 0;
+    while (n > 0) {
+        n--;
+        value = (value << 1) | ((data[*pos >> 3] >> (7 - (*pos & 7))) & 1);
+        (*pos)++;
+    }
+    return value;
+}
+
+void metrics_history_page_reset(metric_history_page_t *page, uint16_t family,
+                                const char *labels, uint16_t slot, uint8_t precision) {
+    page->family = family;
+    page->labels = labels;
+    page->slot = slot;
+    page->precision = precision;
+    page->leading = 0xff;
+    page->trailing = 0;
+    page->count = 0;
+    page->bits = 0;
+    page->start = 0;
+    page->last = 0;
+    page->delta = 0;
+    page->value = 0;
+}
+
+bool metrics_history_page_append(metric_history_page_t *page, uint32_t time, float value) {
+    if (page->bits + SAMPLE_MAX_BITS > METRICS_HISTORY_PAGE_SIZE * 8) return false;
+    uint32_t value_bits;
+    memcpy(&value_bits, &value, sizeof(value_bits));
+
+    if (page->count == 0) {
+        page->start = time;
+        bits_write(page->data, &page->bits, value_bits, 32);
+    } else {
+        int32_t delta = (int32_t) (time - page->last);
+        int32_t dod = delta - page->delta;
+        if (dod == 0) {
+            bits_write(page->data, &page->bits, 0b0, 1);
+        } else if (dod >= -63 && dod <= 64) {
+            bits_write(page->data, &page->bits, 0b10, 2);
+            bits_write(page->data, &page->bits, dod + 63, 7);
+        } else if (dod >= -255 && dod <= 256) {
+            bits_write(page->data, &page->bits, 0b110, 3);
+            bits_write(page->data, &page->bits, dod + 255, 9);
+        } else if (dod >= -2047 && dod <= 2048) {
+            bits_write(page->data, &page->bits, 0b1110, 4);
+            bits_write(page->data, &page->bits, dod + 2047, 12);
+        } else {
+            bits_write(page->data, &page->bits, 0b1111, 4);
+            bits_write(page->data, &page->bits, (uint32_t) dod, 32);
+        }
+        page->delta = delta;
+
+        uint32_t xor = value_bits ^ page->value;
+        if (xor == 0) {
+            bits_write(page->data, &page->bits, 0b0, 1);
+        } else {
+            uint8_t leading = __builtin_clz(xor);
+            uint8_t trailing = __builtin_ctz(xor);
+            if (leading > 31) leading = 31;
+            if (page->leading != 0xff && leading >= page->leading && trailing >= page->trailing) {
+                // Fits in the previous window
+                bits_write(page->data, &page->bits, 0b10, 2);
+                bits_write(page->data, &page->bits, xor >> page->trailing,
+                           32 - page->leading - page->trailing);
+            } else {
+                uint8_t len = 32 - leading - trailing;
+                bits_write(page->data, &page->bits, 0b11, 2);
+                bits_write(page->data, &page->bits, leading, 5);
+                bits_write(page->data, &page->bits, len - 1, 5);
+                bits_write(page->data, &page->bits, xor >> trailing, len);
+                page->leading = leading;
+                page->trailing = trailing;
+            }
+        }
+    }
+    page->last = time;
+    page->value = value_bits;
+    page->count++;
+    return true;
+}
+
+void metrics_history_iter_init(metric_history_iter_t *it, const metric_history_page_t *page) {
+    it->page = page;
+    it->pos = 0;
+    it->count = 0;
+    it->leading = 0xff;
+    it->trailing = 0;
+    it->time = page->start;
+    it->delta = 0;
+    it->value = 0;
+}
+
+bool metrics_history_iter_next(metric_history_iter_t *it, uint32_t *time, float *value) {
+    const uint8_t *data = it->page->data;
+    if (it->count >= it->page->count) return false;
+
+    if (it->count == 0) {
+        it->value = bits_read(data, &it->pos, 32);
+    } else {
+        int32_t dod;
+        if (bits_read(data, &it->pos, 1) == 0) dod = 0;
+        else if (bits_read(data, &it->pos, 1) == 0) dod = (int32_t) bits_read(data, &it->pos, 7) - 63;
+        else if (bits_read(data, &it->pos, 1) == 0) dod = (int32_t) bits_read(data, &it->pos, 9) - 255;
+        else if (bits_read(data, &it->pos, 1) == 0) dod = (int32_t) bits_read(data, &it->pos, 12) - 2047;
+        else dod = (int32_t) bits_read(data, &it->pos, 32);
+        it->delta += dod;
+        it->time += it->delta;
+
+        if (bits_read(data, &it->pos, 1) == 1) {
+            if (bits_read(data, &it->pos, 1) == 1) {
+                it->leading = bits_read(data, &it->pos, 5);
+                uint8_t len = bits_read(data, &it->pos, 5) + 1;
+                it->trailing = 32 - it->leading - len;
+            }
+            uint8_t len = 32 - it->leading - it->trailing;
+            it->value ^= bits_read(data, &it->pos, len) << it->trailing;
+        }
+    }
+    it->count++;
+    *time = it->time;
+    memcpy(value, &it->value, sizeof(*value));
+    return true;
+}
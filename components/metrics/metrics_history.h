@@ -0,0 +1,52 @@
+#ifndef _LIB_METRICS_HISTORY_H_
+#define _LIB_METRICS_HISTORY_H_
+
+#include "stdint.h"
+#include "stdbool.h"
+#include "sdkconfig.h"
+
+#define METRICS_HISTORY_PAGE_SIZE (CONFIG_METRICS_HISTORY_PAGE_SIZE)
+#define METRICS_HISTORY_PAGES (CONFIG_METRICS_HISTORY_SIZE / CONFIG_METRICS_HISTORY_PAGE_SIZE)
+
+// Samples of one series compressed in the style of Gorilla: timestamps as
+// delta-of-delta, values XORed with the previous one. The encoder state
+// is kept in the page, so pages decode independently of each other.
+typedef struct {
+    uint32_t seq;             // Sequence lock, see `metric_meta_t`
+    uint16_t family;          // Series key, METRICS_NONE if the page is unused
+    const char *labels;
+    uint16_t slot;            // Item that appends to this page
+    uint8_t precision;
+    uint8_t leading;          // Window of the last XOR, 0xff for none
+    uint8_t trailing;
+    uint16_t count;
+    uint16_t bits;            // Bits used in `data`
+    uint32_t start;           // Unix time of the first sample, in seconds
+    uint32_t last;            // Unix time of the last sample
+    int32_t delta;            // Between the last two samples
+    uint32_t value;           // Bits of the last value
+    uint8_t data[METRICS_HISTORY_PAGE_SIZE];
+} metric_history_page_t;
+
+typedef struct {
+    const metric_history_page_t *page;
+    uint16_t pos;
+    uint16_t count;
+    uint8_t leading;
+    uint8_t trailing;
+    uint32_t time;
+    int32_t delta;
+    uint32_t value;
+} metric_history_iter_t;
+
+void metrics_history_page_reset(metric_history_page_t *page, uint16_t family,
+                                const char *labels, uint16_t slot, uint8_t precision);
+
+// Return false if the page is full, it is left unchanged then.
+bool metrics_history_page_append(metric_history_page_t *page, uint32_t time, float value);
+
+void metrics_history_iter_init(metric_history_iter_t *it, const metric_history_page_t *page);
+
+bool metrics_history_iter_next(metric_history_iter_t *it, uint32_t *time, float *value);
+
+#endif /* _LIB_METRICS_HISTORY_H_ */
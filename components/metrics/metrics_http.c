@@ -0,0 +1,45 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "strings.h"
+#include "inttypes.h"
+#include "metrics_http.h"
+
+bool metrics_http_encoding_accepted(const char *header, const char *coding) {
+    size_t len = strlen(coding);
+    for (const char *p = header; *p != '\0';) {
+        while (*p == ' ' || *p == ',') p++;
+        const char *end = p;
+        while (*end != '\0' && *end != ',') end++;
+        if (strncasecmp(p, coding, len) == 0 && (p[len] == ';' || p[len] == ' ' || &p[len] == end)) {
+            const char *q = strstr(p, "q=");
+            if (q == NULL || q > end) return true;
+            return strtof(q + 2, NULL) > 0;
+        }
+        p = end;
+    }
+    return false;
+}
+
+bool metrics_http_etag_listed(const char *header, const char *etag) {
+    size_t len = strlen(etag);
+    for (const char *p = header; *p != '\0';) {
+        while (*p == ' ' || *p == ',') p++;
+        const char *end = p;
+        while (*end != '\0' && *end != ',') end++;
+        const char *last = end;
+        while (last > p && last[-1] == ' ') last--;
+        if (last - p == 1 && *p == '*') return true;
+        if (last - p > 2 && p[0] == 'W' && p[1] == '/') p += 2;
+        if ((size_t) (last - p) == len && memcmp(p, etag, len) == 0) return true;
+        p = end;
+    }
+    return false;
+}
+
+size_t metrics_http_etag(char *buf, size_t size, uint32_t boot_id, uint32_t generation, int64_t expired_at,
+                         const char *encoding) {
+    int n = snprintf(buf, size, "\"%08" PRIx32 "-%" PRIx32 "-%" PRIx64 "%s\"", boot_id, generation,
+                     (uint64_t) expired_at, encoding);
+    return n < 0 ? 0 : (size_t) n < size ? (size_t) n : size - 1;
+}
@@ -0,0 +1,26 @@
+#ifndef _LIB_METRICS_HTTP_H_
+#define _LIB_METRICS_HTTP_H_
+
+#include "stddef.h"
+#include "stdint.h"
+#include "stdbool.h"
+
+// Longest ETag of metrics_http_etag(), the terminator included
+#define METRICS_HTTP_ETAG_MAX_LEN (48)
+
+// Whether `coding` is listed in the `Accept-Encoding` value `header`
+// without q=0. Codings are compared case-insensitively.
+bool metrics_http_encoding_accepted(const char *header, const char *coding);
+
+// Whether the `If-None-Match` value `header` is `*` or lists `etag`,
+// compared weakly: a W/ prefix is ignored.
+bool metrics_http_etag_listed(const char *header, const char *etag);
+
+// Print the quoted ETag of a page into `buf` and return its length. The
+// same boot, generation and first expiry mean the same items were
+// printed, so the page is identified without hashing it. `encoding` tells
+// compressed bodies apart, e.g. "-gz", or "" for none.
+size_t metrics_http_etag(char *buf, size_t size, uint32_t boot_id, uint32_t generation, int64_t expired_at,
+                         const char *encoding);
+
+#endif /* _LIB_METRICS_HTTP_H_ */
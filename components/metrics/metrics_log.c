@@ -0,0 +1,226 @@
+#include "stddef.h"
+#include "string.h"
+#include "metrics_log.h"
+#include "metrics_deflate.h"
+
+#define SECTOR_MAGIC (0x32474c4d) // "MLG2", records of "MLOG" had an unchecked count
+#define RECORD_END   (0xffff)     // Length of erased flash
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;             // One more than the sector written before
+} sector_header_t;
+
+// Followed by the series name, its labels and the page data, padded to 4
+typedef struct {
+    uint32_t check;           // Adler-32 of the record past this field
+    uint16_t len;             // Bytes past this header, RECORD_END past the last record
+    uint16_t count;           // Samples in the page
+    uint32_t start;
+    uint32_t last;
+    uint16_t bits;
+    uint8_t precision;
+    uint8_t name_len;
+    uint8_t labels_len;
+    uint8_t reserved[3];
+} record_header_t;
+
+#define RECORD_MAX_LEN (sizeof(record_header_t) + 2 * METRICS_LOG_NAME_MAX_LEN + METRICS_HISTORY_PAGE_SIZE)
+
+// Any page must fit a sector, see the range of METRICS_HISTORY_PAGE_SIZE
+_Static_assert(RECORD_MAX_LEN <= METRICS_LOG_SECTOR_SIZE - sizeof(sector_header_t),
+               "History pages too large for log sectors");
+
+static uint32_t record_check(const record_header_t *r, const char *name, const char *labels,
+                             const uint8_t *data, size_t data_len) {
+    const size_t from = offsetof(record_header_t, check) + sizeof(r->check);
+    uint32_t adler = metrics_adler32(1, (const uint8_t*) r + from, sizeof(*r) - from);
+    adler = metrics_adler32(adler, (const uint8_t*) name, r->name_len);
+    adler = metrics_adler32(adler, (const uint8_t*) labels, r->labels_len);
+    return metrics_adler32(adler, data, data_len);
+}
+
+// Nothing written yet, as opposed to a header torn before its length
+static bool record_erased(const record_header_t *r) {
+    const uint8_t *p = (const uint8_t*) r;
+    for (size_t i = 0; i < sizeof(*r); i++)
+        if (p[i] != 0xff) return false;
+    return true;
+}
+
+static bool sector_header_read(const metrics_log_t *log, uint32_t sector, sector_header_t *h) {
+    if (!log->flash->read(log->flash->ctx, sector * METRICS_LOG_SECTOR_SIZE, h, sizeof(*h))) return false;
+    return h->magic == SECTOR_MAGIC;
+}
+
+static bool sector_start(metrics_log_t *log, uint32_t sector, uint32_t seq) {
+    const metrics_log_flash_t *flash = log->flash;
+    sector_header_t h = { .magic = SECTOR_MAGIC, .seq = seq };
+    log->head = sector;
+    log->head_seq = seq;
+    log->offset = METRICS_LOG_SECTOR_SIZE; // Full until the header is in place
+    log->last[sector] = 0;
+    if (!flash->erase(flash->ctx, sector * METRICS_LOG_SECTOR_SIZE, METRICS_LOG_SECTOR_SIZE)) return false;
+    log->erases++;
+    if (!flash->write(flash->ctx, sector * METRICS_LOG_SECTOR_SIZE, &h, sizeof(h))) return false;
+    log->bytes += sizeof(h);
+    log->offset = sizeof(h);
+    return true;
+}
+
+bool metrics_log_open(metrics_log_t *log, const metrics_log_flash_t *flash) {
+    log->flash = flash;
+    log->sectors = flash->size / METRICS_LOG_SECTOR_SIZE;
+    if (log->sectors > METRICS_LOG_MAX_SECTORS) log->sectors = METRICS_LOG_MAX_SECTORS;
+    log->records = 0;
+    log->bytes = 0;
+    log->erases = 0;
+    if (log->sectors < 2) return false;
+
+    bool found = false;
+    for (uint32_t s = 0; s < log->sectors; s++) {
+        sector_header_t h;
+        log->last[s] = 0;
+        if (!sector_header_read(log, s, &h)) continue;
+        // Serial number arithmetic, the sequence may wrap
+        if (!found || (int32_t) (h.seq - log->head_seq) > 0) {
+            log->head = s;
+            log->head_seq = h.seq;
+            found = true;
+        }
+    }
+    if (!found) return sector_start(log, 0, 1);
+
+    for (uint32_t s = 0; s < log->sectors; s++) {
+        sector_header_t h;
+        if (!sector_header_read(log, s, &h)) continue;
+        uint32_t offset = sizeof(h);
+        record_header_t r;
+        while (offset + sizeof(r) <= METRICS_LOG_SECTOR_SIZE) {
+            if (!flash->read(flash->ctx, s * METRICS_LOG_SECTOR_SIZE + offset, &r, sizeof(r))) return false;
+            if (r.len == RECORD_END && record_erased(&r)) break;
+            if (r.len == RECORD_END || offset + sizeof(r) + r.len > METRICS_LOG_SECTOR_SIZE) {
+                // Torn, nothing can be written past it before an erase
+                offset = METRICS_LOG_SECTOR_SIZE;
+                break;
+            }
+            if (r.last > log->last[s]) log->last[s] = r.last;
+            offset += sizeof(r) + r.len;
+        }
+        if (s == log->head) log->offset = offset;
+    }
+    return true;
+}
+
+bool metrics_log_append(metrics_log_t *log, const char *name, const char *labels,
+                        const metric_history_page_t *page) {
+    // The header and key are staged, the page data is written from where
+    // it is, so the stack does not grow with METRICS_HISTORY_PAGE_SIZE
+    uint8_t buf[sizeof(record_header_t) + 2 * METRICS_LOG_NAME_MAX_LEN];
+    uint32_t padding = 0;
+    record_header_t r = {
+        .count = page->count,
+        .start = page->start,
+        .last = page->last,
+        .bits = page->bits,
+        .precision = page->precision,
+    };
+    size_t name_len = strlen(name);
+    size_t labels_len = labels != NULL ? strlen(labels) : 0;
+    size_t data_len = (page->bits + 7) / 8;
+    if (name_len >= METRICS_LOG_NAME_MAX_LEN || labels_len >= METRICS_LOG_NAME_MAX_LEN) return false;
+    r.name_len = name_len;
+    r.labels_len = labels_len;
+    r.len = (name_len + labels_len + data_len + 3) & ~3;
+    size_t total = sizeof(r) + r.len;
+    if (sizeof(sector_header_t) + total > METRICS_LOG_SECTOR_SIZE) return false;
+
+    if (log->offset + total > METRICS_LOG_SECTOR_SIZE &&
+            !sector_start(log, (log->head + 1) % log->sectors, log->head_seq + 1))
+        return false;
+
+    r.check = record_check(&r, name, labels, page->data, data_len);
+    memcpy(buf, &r, sizeof(r));
+    size_t len = sizeof(r);
+    memcpy(&buf[len], name, name_len);
+    len += name_len;
+    if (labels_len > 0) memcpy(&buf[len], labels, labels_len);
+    len += labels_len;
+
+    const metrics_log_flash_t *flash = log->flash;
+    size_t at = log->head * METRICS_LOG_SECTOR_SIZE + log->offset;
+    // Whatever happens, do not write over the same bytes again. The header
+    // goes first, a record torn after it fails its check and is skipped.
+    log->offset += total;
+    if (!flash->write(flash->ctx, at, buf, len)) return false;
+    if (data_len > 0 && !flash->write(flash->ctx, at + len, page->data, data_len)) return false;
+    len += data_len;
+    if (total > len && !flash->write(flash->ctx, at + len, &padding, total - len)) return false;
+    if (page->last > log->last[log->head]) log->last[log->head] = page->last;
+    log->records++;
+    log->bytes += total;
+    return true;
+}
+
+void metrics_log_iter_init(const metrics_log_t *log, metrics_log_iter_t *it) {
+    it->head = log->head;
+    it->sector = 0;
+    it->seq = 0;
+    it->offset = 0;
+}
+
+bool metrics_log_iter_next(const metrics_log_t *log, metrics_log_iter_t *it, uint32_t since,
+                           metric_log_entry_t *entry) {
+    const metrics_log_flash_t *flash = log->flash;
+    while (it->sector < log->sectors) {
+        uint32_t s = (it->head + 1 + it->sector) % log->sectors;
+        sector_header_t h;
+        if (it->offset == 0) {
+            if (!sector_header_read(log, s, &h) || log->last[s] == 0 || log->last[s] < since) {
+                it->sector++;
+                continue;
+            }
+            it->seq = h.seq;
+            it->offset = sizeof(h);
+        }
+
+        record_header_t r;
+        size_t at = s * METRICS_LOG_SECTOR_SIZE + it->offset;
+        if (it->offset + sizeof(r) > METRICS_LOG_SECTOR_SIZE || !flash->read(flash->ctx, at, &r, sizeof(r)) ||
+                r.len == RECORD_END || it->offset + sizeof(r) + r.len > METRICS_LOG_SECTOR_SIZE) {
+            it->sector++;
+            it->offset = 0;
+            continue;
+        }
+        it->offset += sizeof(r) + r.len;
+        size_t data_len = (r.bits + 7) / 8;
+        if (r.last < since || r.name_len >= METRICS_LOG_NAME_MAX_LEN ||
+                r.labels_len >= METRICS_LOG_NAME_MAX_LEN || data_len > METRICS_HISTORY_PAGE_SIZE ||
+                r.name_len + r.labels_len + data_len > r.len)
+            continue;
+
+        at += sizeof(r);
+        metric_history_page_t *page = &entry->page;
+        if (!flash->read(flash->ctx, at, entry->name, r.name_len) ||
+                !flash->read(flash->ctx, at + r.name_len, entry->labels, r.labels_len) ||
+                !flash->read(flash->ctx, at + r.name_len + r.labels_len, page->data, data_len))
+            continue;
+        // The sector may have been erased and reused meanwhile
+        if (!sector_header_read(log, s, &h) || h.seq != it->seq) {
+            it->sector++;
+            it->offset = 0;
+            continue;
+        }
+        if (record_check(&r, entry->name, entry->labels, page->data, data_len) != r.check) continue;
+
+        entry->name[r.name_len] = '\0';
+        entry->labels[r.labels_len] = '\0';
+        metrics_history_page_reset(page, 0, r.labels_len > 0 ? entry->labels : NULL, 0, r.precision);
+        page->count = r.count;
+        page->bits = r.bits;
+        page->start = r.start;
+        page->last = r.last;
+        return true;
+    }
+    return false;
+}
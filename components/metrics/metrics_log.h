@@ -0,0 +1,71 @@
+#ifndef _LIB_METRICS_LOG_H_
+#define _LIB_METRICS_LOG_H_
+
+#include "stddef.h"
+#include "stdint.h"
+#include "stdbool.h"
+#include "metrics_history.h"
+
+#define METRICS_LOG_SECTOR_SIZE (4096)
+#define METRICS_LOG_MAX_SECTORS (256)
+#define METRICS_LOG_NAME_MAX_LEN (128)
+
+// Flash the log lives on, e.g. a partition. Offsets are relative to it and
+// erases are whole sectors. Writes may only clear bits of erased bytes.
+typedef struct {
+    bool (*read)(void *ctx, size_t offset, void *buf, size_t len);
+    bool (*write)(void *ctx, size_t offset, const void *buf, size_t len);
+    bool (*erase)(void *ctx, size_t offset, size_t len);
+    void *ctx;
+    size_t size;
+} metrics_log_flash_t;
+
+// Sectors are written in turn, each erased only when the log comes around
+// to it again, so wear is spread evenly. Each starts with a sequence number
+// telling the newest one, then holds records, one compressed history page
+// of one series each.
+typedef struct {
+    const metrics_log_flash_t *flash;
+    uint32_t sectors;
+    uint32_t head;            // Sector being written
+    uint32_t head_seq;
+    uint32_t offset;          // Where the next record goes in `head`
+    uint32_t last[METRICS_LOG_MAX_SECTORS]; // Latest sample of each sector, 0 if none
+    uint32_t records;         // Records written since open
+    uint32_t bytes;           // Bytes written since open, headers included
+    uint32_t erases;
+} metrics_log_t;
+
+// Series key and samples of one record
+typedef struct {
+    char name[METRICS_LOG_NAME_MAX_LEN];   // With its suffix, e.g. `_total`
+    char labels[METRICS_LOG_NAME_MAX_LEN]; // As encoded by metrics_labels()
+    metric_history_page_t page;            // Only the samples are filled
+} metric_log_entry_t;
+
+typedef struct {
+    uint32_t head;            // Newest sector when started
+    uint32_t sector;          // Counted from the oldest
+    uint32_t seq;             // Of the sector when entered
+    uint32_t offset;
+} metrics_log_iter_t;
+
+// Find the newest sector and where writing stopped, formatting the flash
+// if it holds no log. Only record headers are read. Return false on flash
+// errors.
+bool metrics_log_open(metrics_log_t *log, const metrics_log_flash_t *flash);
+
+// Append the samples of `page` as one record, moving on to the next sector
+// if they do not fit. Return false on flash errors, or if the record would
+// not fit in a sector.
+bool metrics_log_append(metrics_log_t *log, const char *name, const char *labels,
+                        const metric_history_page_t *page);
+
+void metrics_log_iter_init(const metrics_log_t *log, metrics_log_iter_t *it);
+
+// Read the next record, oldest first, that has samples since `since`.
+// Records overwritten meanwhile or torn by a power loss are skipped.
+bool metrics_log_iter_next(const metrics_log_t *log, metrics_log_iter_t *it, uint32_t since,
+                           metric_log_entry_t *entry);
+
+#endif /* _LIB_METRICS_LOG_H_ */
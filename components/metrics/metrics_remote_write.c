@@ -0,0 +1,201 @@
+#include "string.h"
+#include "metrics_remote_write.h"
+
+#define PB_LEN(field)    (((field) << 3) | 2)
+#define PB_FIXED64(field) (((field) << 3) | 1)
+#define PB_VARINT(field) (((field) << 3) | 0)
+
+#define SNAPPY_HASH_BITS (10)
+
+_Static_assert(sizeof(((metrics_snappy_state_t*) 0)->table) == sizeof(uint16_t) << SNAPPY_HASH_BITS,
+               "Snappy table size mismatch");
+#define SNAPPY_MAX_COPY  (64)
+
+static size_t varint_size(uint64_t value) {
+    size_t n = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static uint8_t* varint_put(uint8_t *p, uint64_t value) {
+    while (value >= 0x80) {
+        *p++ = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    *p++ = value;
+    return p;
+}
+
+static uint8_t* string_put(uint8_t *p, uint8_t tag, const char *str, size_t len) {
+    *p++ = tag;
+    p = varint_put(p, len);
+    memcpy(p, str, len);
+    return p + len;
+}
+
+void metrics_pb_init(metrics_pb_t *pb, uint8_t *buf, size_t size) {
+    pb->buf = buf;
+    pb->size = size;
+    pb->len = 0;
+    pb->series = 0;
+}
+
+bool metrics_pb_add_series(metrics_pb_t *pb, const metric_label_t *labels, size_t count,
+                           double value, int64_t timestamp_ms) {
+    // message TimeSeries { repeated Label labels = 1; repeated Sample samples = 2; }
+    // message Label { string name = 1; string value = 2; }
+    // message Sample { double value = 1; int64 timestamp = 2; }
+    size_t series_len = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t key_len = strlen(labels[i].key);
+        size_t value_len = strlen(labels[i].value);
+        size_t label_len = 1 + varint_size(key_len) + key_len + 1 + varint_size(value_len) + value_len;
+        series_len += 1 + varint_size(label_len) + label_len;
+    }
+    size_t sample_len = 1 + 8 + 1 + varint_size((uint64_t) timestamp_ms);
+    series_len += 1 + varint_size(sample_len) + sample_len;
+    if (pb->len + 1 + varint_size(series_len) + series_len > pb->size) return false;
+
+    // message WriteRequest { repeated TimeSeries timeseries = 1; }
+    uint8_t *p = &pb->buf[pb->len];
+    *p++ = PB_LEN(1);
+    p = varint_put(p, series_len);
+    for (size_t i = 0; i < count; i++) {
+        size_t key_len = strlen(labels[i].key);
+        size_t value_len = strlen(labels[i].value);
+        *p++ = PB_LEN(1);
+        p = varint_put(p, 1 + varint_size(key_len) + key_len + 1 + varint_size(value_len) + value_len);
+        p = string_put(p, PB_LEN(1), labels[i].key, key_len);
+        p = string_put(p, PB_LEN(2), labels[i].value, value_len);
+    }
+    *p++ = PB_LEN(2);
+    p = varint_put(p, sample_len);
+    *p++ = PB_FIXED64(1);
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    for (int i = 0; i < 8; i++) *p++ = bits >> (i * 8);
+    *p++ = PB_VARINT(2);
+    p = varint_put(p, (uint64_t) timestamp_ms);
+
+    pb->len = p - pb->buf;
+    pb->series++;
+    return true;
+}
+
+bool metrics_pb_add_batched(metrics_pb_t *pb, size_t max_series, metrics_pb_flush_cb_t flush, void *arg,
+                            const metric_label_t *labels, size_t count, double value, int64_t timestamp_ms) {
+    if (pb->series < max_series && metrics_pb_add_series(pb, labels, count, value, timestamp_ms))
+        return true;
+    if (pb->series > 0) {
+        flush(pb, arg);
+        metrics_pb_init(pb, pb->buf, pb->size);
+    }
+    return metrics_pb_add_series(pb, labels, count, value, timestamp_ms);
+}
+
+void metrics_pb_sort_labels(metric_label_t *labels, size_t count) {
+    for (size_t i = 2; i < count; i++) {
+        metric_label_t label = labels[i];
+        size_t j = i;
+        for (; j > 1 && strcmp(labels[j - 1].key, label.key) > 0; j--)
+            labels[j] = labels[j - 1];
+        labels[j] = label;
+    }
+}
+
+int metrics_labels_decode(const char *labels, char *buf, size_t size, metric_label_t *out, size_t max) {
+    size_t len = 0;
+    size_t count = 0;
+    const char *p = labels;
+    while (*p != '\0') {
+        if (count >= max) return -1;
+        out[count].key = &buf[len];
+        for (; *p != '=' && *p != '\0'; p++) {
+            if (len + 1 >= size) return -1;
+            buf[len++] = *p;
+        }
+        buf[len++] = '\0';
+        if (p[0] != '=' || p[1] != '"') return -1;
+        p += 2;
+        out[count].value = &buf[len];
+        for (; *p != '"' && *p != '\0'; p++) {
+            if (len + 1 >= size) return -1;
+            if (*p == '\\' && p[1] != '\0') {
+                p++;
+                buf[len++] = *p == 'n' ? '\n' : *p;
+            } else {
+                buf[len++] = *p;
+            }
+        }
+        if (len >= size || *p != '"') return -1;
+        buf[len++] = '\0';
+        p++;
+        if (*p == ',') p++;
+        count++;
+    }
+    return count;
+}
+
+static uint32_t load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint8_t* snappy_literal(uint8_t *p, const uint8_t *src, size_t len) {
+    if (len == 0) return p;
+    size_t n = len - 1;
+    if (n < 60) {
+        *p++ = n << 2;
+    } else if (n < 0x100) {
+        *p++ = 60 << 2;
+        *p++ = n;
+    } else {
+        *p++ = 61 << 2;
+        *p++ = n;
+        *p++ = n >> 8;
+    }
+    memcpy(p, src, len);
+    return p + len;
+}
+
+static uint8_t* snappy_copy(uint8_t *p, size_t offset, size_t len) {
+    while (len > 0) {
+        size_t n = len > SNAPPY_MAX_COPY ? SNAPPY_MAX_COPY : len;
+        *p++ = ((n - 1) << 2) | 2;
+        *p++ = offset;
+        *p++ = offset >> 8;
+        len -= n;
+    }
+    return p;
+}
+
+size_t metrics_snappy_compress(metrics_snappy_state_t *state, const uint8_t *src, size_t len, uint8_t *dst) {
+    uint16_t *table = state->table;
+    uint8_t *p = varint_put(dst, len);
+    size_t literal = 0;
+    size_t i = 0;
+
+    memset(state->table, 0, sizeof(state->table));
+    while (i + 4 <= len) {
+        uint32_t v = load32(&src[i]);
+        uint32_t h = (v * 0x1e35a7bd) >> (32 - SNAPPY_HASH_BITS);
+        size_t candidate = table[h];
+        table[h] = i;
+        if (candidate >= i || load32(&src[candidate]) != v) {
+            i++;
+            continue;
+        }
+        size_t match = 4;
+        while (i + match < len && src[candidate + match] == src[i + match]) match++;
+        p = snappy_literal(p, &src[literal], i - literal);
+        p = snappy_copy(p, i - candidate, match);
+        i += match;
+        literal = i;
+    }
+    p = snappy_literal(p, &src[literal], len - literal);
+    return p - dst;
+}
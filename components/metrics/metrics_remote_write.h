@@ -0,0 +1,54 @@
+#ifndef _LIB_METRICS_REMOTE_WRITE_H_
+#define _LIB_METRICS_REMOTE_WRITE_H_
+
+#include "stddef.h"
+#include "stdint.h"
+#include "stdbool.h"
+#include "metrics.h"
+
+// Prometheus remote_write `WriteRequest` protobuf, built in place
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    size_t series;
+} metrics_pb_t;
+
+// Called with a batch to send, which is cleared on return
+typedef void (*metrics_pb_flush_cb_t)(const metrics_pb_t *pb, void *arg);
+
+void metrics_pb_init(metrics_pb_t *pb, uint8_t *buf, size_t size);
+
+// Append a `TimeSeries` holding a single sample. `labels` must be sorted
+// by key and include `__name__`. Return false if it does not fit, `pb` is
+// left unchanged then.
+bool metrics_pb_add_series(metrics_pb_t *pb, const metric_label_t *labels, size_t count,
+                           double value, int64_t timestamp_ms);
+
+// Same as metrics_pb_add_series(), but when `pb` already holds `max_series`
+// or has no room for the series, pass it to `flush` first and start a new
+// batch. Return false if the series does not fit even an empty batch.
+bool metrics_pb_add_batched(metrics_pb_t *pb, size_t max_series, metrics_pb_flush_cb_t flush, void *arg,
+                            const metric_label_t *labels, size_t count, double value, int64_t timestamp_ms);
+
+// Sort `labels` by key, except the first one, `__name__`, which stays first
+void metrics_pb_sort_labels(metric_label_t *labels, size_t count);
+
+// Split labels encoded by metrics_labels() back into `out`, with values
+// unescaped into `buf`. Return the number of labels, or -1 if they do not fit.
+int metrics_labels_decode(const char *labels, char *buf, size_t size, metric_label_t *out, size_t max);
+
+// Worst case of compressing `len` bytes
+#define METRICS_SNAPPY_MAX_LEN(len) (32 + (len) + (len) / 6)
+
+// Hash table of metrics_snappy_compress(), kept off the stack
+typedef struct {
+    uint16_t table[1 << 10];
+} metrics_snappy_state_t;
+
+// Compress `len` bytes of `src`, which must be shorter than 64 KiB, in the
+// snappy block format. `dst` must hold METRICS_SNAPPY_MAX_LEN(len) bytes.
+// Return the compressed length.
+size_t metrics_snappy_compress(metrics_snappy_state_t *state, const uint8_t *src, size_t len, uint8_t *dst);
+
+#endif /* _LIB_METRICS_REMOTE_WRITE_H_ */
@@ -0,0 +1,217 @@
+#include "string.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "scheduler.h"
+
+#define MAX_JOBS    (CONFIG_SCHEDULER_MAX_JOBS)
+#define STACK_SIZE  (CONFIG_SCHEDULER_STACK_SIZE)
+#define PRIORITY    (CONFIG_SCHEDULER_PRIORITY)
+#define TICK_US     (50 * 1000)
+#define WHEEL_SLOTS (256) // Power of 2, one turn takes 12.8s
+#define WHEEL_MASK  (WHEEL_SLOTS - 1)
+
+#if CONFIG_FREERTOS_UNICORE
+#define WORKER_CORE (tskNO_AFFINITY)
+#else
+#define WORKER_CORE (APP_CPU_NUM) // Wi-Fi & BLE run on PRO_CPU
+#endif
+
+static const char *TAG = "scheduler";
+
+struct scheduler_job {
+    scheduler_cb_t cb;
+    void *arg;
+    int64_t deadline_us;
+    uint64_t deadline_tick;
+    bool woken;
+    bool queued;
+    bool taken;                // Collected to run in the current round
+    scheduler_job_t *next;     // Next in the same wheel slot
+    scheduler_job_stats_t stats;
+};
+
+static struct {
+    SemaphoreHandle_t semphr;  // Guards jobs & wheel, never held by a running job
+    StaticSemaphore_t semphr_buf;
+    TaskHandle_t worker;
+    StaticTask_t worker_buf;
+    StackType_t stack[STACK_SIZE];
+    scheduler_job_t jobs[MAX_JOBS];
+    size_t jobs_len;
+    // Hashed timer wheel, jobs due at tick `t` are chained in slot `t % WHEEL_SLOTS`
+    scheduler_job_t *wheel[WHEEL_SLOTS];
+    uint64_t tick;             // Oldest tick not fully visited
+    uint32_t wakeups;
+} sched = {};
+
+static void wheel_insert(scheduler_job_t *job) {
+    job->deadline_tick = job->deadline_us / TICK_US;
+    // Never behind the wheel, or a turn would pass before it is visited
+    if (job->deadline_tick < sched.tick) job->deadline_tick = sched.tick;
+    scheduler_job_t **slot = &sched.wheel[job->deadline_tick & WHEEL_MASK];
+    job->next = *slot;
+    *slot = job;
+    job->queued = true;
+}
+
+// Unlink and return the jobs of one slot due by `now_us`
+static scheduler_job_t* wheel_take(size_t slot, int64_t now_us) {
+    scheduler_job_t *due = NULL;
+    scheduler_job_t **p = &sched.wheel[slot];
+    while (*p != NULL) {
+        scheduler_job_t *job = *p;
+        if (job->deadline_us > now_us) { // Later in the tick, or a later turn
+            p = &job->next;
+            continue;
+        }
+        *p = job->next;
+        job->queued = false;
+        job->next = due;
+        due = job;
+    }
+    return due;
+}
+
+// Earliest deadline within one turn of the wheel, or a turn from now
+static int64_t wheel_next_deadline(int64_t now_us) {
+    for (uint64_t t = sched.tick; t < sched.tick + WHEEL_SLOTS; t++) {
+        int64_t earliest = INT64_MAX;
+        for (scheduler_job_t *job = sched.wheel[t & WHEEL_MASK]; job != NULL; job = job->next)
+            if (job->deadline_tick == t && job->deadline_us < earliest) earliest = job->deadline_us;
+        if (earliest != INT64_MAX) return earliest;
+    }
+    return now_us + (int64_t) WHEEL_SLOTS * TICK_US;
+}
+
+static void job_run(scheduler_job_t *job, int64_t deadline_us) {
+    int64_t started = esp_timer_get_time();
+    job->cb(job->arg);
+    int64_t finished = esp_timer_get_time();
+
+    scheduler_job_stats_t *s = &job->stats;
+    uint32_t late = started > deadline_us ? started - deadline_us : 0;
+    uint32_t took = finished - started;
+    s->runs++;
+    s->late_sum_us += late;
+    if (late > s->late_max_us) s->late_max_us = late;
+    s->run_sum_us += took;
+    if (took > s->run_max_us) s->run_max_us = took;
+}
+
+static void scheduler_task(void *pvParameters) {
+    scheduler_job_t *due[MAX_JOBS];
+    int64_t deadlines[MAX_JOBS];
+
+    while (true) {
+        size_t n = 0;
+        int64_t now_us = esp_timer_get_time();
+        uint64_t now_tick = now_us / TICK_US;
+
+        xSemaphoreTake(sched.semphr, portMAX_DELAY);
+        // Visit each slot at most once even if the worker was held up for turns
+        uint64_t first = now_tick - sched.tick > WHEEL_MASK ? now_tick - WHEEL_MASK : sched.tick;
+        for (uint64_t t = first; t <= now_tick; t++) {
+            scheduler_job_t *job = wheel_take(t & WHEEL_MASK, now_us);
+            while (job != NULL) {
+                scheduler_job_t *next = job->next;
+                job->taken = true;
+                deadlines[n] = job->deadline_us;
+                due[n++] = job;
+                // Next deadline keeps to the period, skip those already missed
+                job->deadline_us += job->stats.period_ms * 1000LL;
+                while (job->deadline_us <= now_us) {
+                    job->deadline_us += job->stats.period_ms * 1000LL;
+                    job->stats.overruns++;
+                }
+                job = next;
+            }
+        }
+        // The current tick is visited again, more of its deadlines may be ahead
+        sched.tick = now_tick;
+        for (size_t i = 0; i < sched.jobs_len; i++) {
+            scheduler_job_t *job = &sched.jobs[i];
+            if (!__atomic_exchange_n(&job->woken, false, __ATOMIC_ACQ_REL)) continue;
+            if (job->taken) continue; // Due from the wheel too, runs once
+            job->taken = true;
+            deadlines[n] = now_us; // Woken, late from now on
+            due[n++] = job;
+        }
+        xSemaphoreGive(sched.semphr);
+
+        // Each job is taken at most once, n <= jobs_len
+        for (size_t i = 0; i < n; i++) job_run(due[i], deadlines[i]);
+
+        xSemaphoreTake(sched.semphr, portMAX_DELAY);
+        for (size_t i = 0; i < n; i++) {
+            due[i]->taken = false;
+            if (due[i]->stats.period_ms > 0 && !due[i]->queued) wheel_insert(due[i]);
+        }
+        now_us = esp_timer_get_time();
+        int64_t wait_us = wheel_next_deadline(now_us) - now_us;
+        xSemaphoreGive(sched.semphr);
+
+        if (wait_us > 0) {
+            // Round up, waking before the deadline would only cost another wakeup
+            TickType_t ticks = (wait_us + portTICK_PERIOD_MS * 1000 - 1) / (portTICK_PERIOD_MS * 1000);
+            ulTaskNotifyTake(pdTRUE, ticks);
+            sched.wakeups++;
+        }
+    }
+}
+
+void scheduler_init() {
+    sched.semphr = xSemaphoreCreateMutexStatic(&sched.semphr_buf);
+    sched.tick = esp_timer_get_time() / TICK_US;
+    sched.worker = xTaskCreateStaticPinnedToCore(scheduler_task, "scheduler", STACK_SIZE, NULL,
+                                                 PRIORITY, sched.stack, &sched.worker_buf, WORKER_CORE);
+}
+
+scheduler_job_t* scheduler_add(const char *name, uint32_t period_ms, scheduler_cb_t cb, void *arg) {
+    if (sched.semphr == NULL) {
+        ESP_LOGE(TAG, "Scheduler uninitialized, call scheduler_init() first");
+        return NULL;
+    }
+    xSemaphoreTake(sched.semphr, portMAX_DELAY);
+    if (sched.jobs_len >= MAX_JOBS) {
+        xSemaphoreGive(sched.semphr);
+        ESP_LOGE(TAG, "Too many jobs, %s not added", name);
+        return NULL;
+    }
+    scheduler_job_t *job = &sched.jobs[sched.jobs_len];
+    memset(job, 0, sizeof(*job));
+    job->cb = cb;
+    job->arg = arg;
+    job->stats.name = name;
+    job->stats.period_ms = period_ms;
+    if (period_ms > 0) {
+        job->deadline_us = esp_timer_get_time() + period_ms * 1000LL;
+        wheel_insert(job);
+    }
+    sched.jobs_len++;
+    xSemaphoreGive(sched.semphr);
+    // Let the worker sleep until the new deadline if earlier
+    xTaskNotifyGive(sched.worker);
+    return job;
+}
+
+void scheduler_wake(scheduler_job_t *job) {
+    if (job == NULL) return;
+    __atomic_store_n(&job->woken, true, __ATOMIC_RELEASE);
+    xTaskNotifyGive(sched.worker);
+}
+
+void scheduler_get_stats(scheduler_stats_t *stats) {
+    stats->wakeups = sched.wakeups;
+    stats->stack_free_min = uxTaskGetStackHighWaterMark(sched.worker);
+    stats->jobs = sched.jobs_len;
+}
+
+bool scheduler_get_job_stats(size_t i, scheduler_job_stats_t *stats) {
+    if (i >= sched.jobs_len) return false;
+    *stats = sched.jobs[i].stats;
+    return true;
+}
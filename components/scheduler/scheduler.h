@@ -0,0 +1,44 @@
+#ifndef _LIB_SCHEDULER_H_
+#define _LIB_SCHEDULER_H_
+
+#include "stdint.h"
+#include "stdbool.h"
+#include "stddef.h"
+
+typedef void (*scheduler_cb_t)(void *arg);
+
+typedef struct scheduler_job scheduler_job_t;
+
+typedef struct {
+    const char *name;
+    uint32_t period_ms;
+    uint32_t runs;
+    uint32_t overruns;         // Deadlines skipped, the worker was busy past them
+    uint32_t late_max_us;      // Latest start after a deadline
+    uint64_t late_sum_us;      // Mean lateness is late_sum_us / runs
+    uint32_t run_max_us;
+    uint64_t run_sum_us;
+} scheduler_job_stats_t;
+
+typedef struct {
+    uint32_t wakeups;          // Worker wakeups, timed or woken
+    uint32_t stack_free_min;   // Bytes never used of the worker stack
+    size_t jobs;
+} scheduler_stats_t;
+
+// Start the worker, pinned to the app core if there is one
+void scheduler_init();
+
+// Run `cb` every `period_ms` on the worker, the first run one period from
+// now. With a period of 0, run only when woken. Return NULL if out of jobs.
+scheduler_job_t* scheduler_add(const char *name, uint32_t period_ms, scheduler_cb_t cb, void *arg);
+
+// Run `job` as soon as the worker is free, from any task. NULL is ignored.
+void scheduler_wake(scheduler_job_t *job);
+
+void scheduler_get_stats(scheduler_stats_t *stats);
+
+// Stats of the i-th job added, return false past the last one
+bool scheduler_get_job_stats(size_t i, scheduler_job_stats_t *stats);
+
+#endif /* _LIB_SCHEDULER_H_ */
@@ -0,0 +1,129 @@
+#include "string.h"
+#include "esp_log.h"
+
+#include "modbus.h"
+
+#define RX_TIMEOUT_SYMBOLS (4)  // 3.5-character gap, rounded up to whole symbols
+#define TASK_PRIORITY      (12) // Above the scheduler, it only passes events on
+
+static const char *TAG = "MODBUS";
+
+// Waits for the UART driver so that jobs do not have to
+static void modbus_event_task(void *arg) {
+    modbus_master_t *master = arg;
+    uart_event_t event;
+    while (true) {
+        if (!xQueueReceive(master->events, &event, portMAX_DELAY)) continue;
+        switch (event.type) {
+        case UART_DATA:
+            if (!event.timeout_flag) continue; // More of the frame to come
+            __atomic_store_n(&master->gap, true, __ATOMIC_RELEASE);
+            break;
+        case UART_FIFO_OVF:
+        case UART_BUFFER_FULL:
+        case UART_FRAME_ERR:
+        case UART_PARITY_ERR:
+            ESP_LOGW(TAG, "UART error event %d", event.type);
+            __atomic_store_n(&master->error, true, __ATOMIC_RELEASE);
+            break;
+        default:
+            continue;
+        }
+        scheduler_wake(master->on_event);
+    }
+}
+
+// Runs on the esp_timer task once the response is overdue
+static void modbus_timeout(void *arg) {
+    modbus_master_t *master = arg;
+    scheduler_wake(master->on_event);
+}
+
+void modbus_master_init(modbus_master_t *master, uart_port_t port, QueueHandle_t events,
+                        scheduler_job_t *on_event) {
+    master->port = port;
+    master->events = events;
+    master->on_event = on_event;
+    master->req = NULL;
+    master->len = 0;
+    master->gap = false;
+    master->error = false;
+    memset(&master->stats, 0, sizeof(master->stats));
+    ESP_ERROR_CHECK(uart_set_rx_timeout(port, RX_TIMEOUT_SYMBOLS));
+    const esp_timer_create_args_t timer_args = {
+        .callback = modbus_timeout,
+        .arg = master,
+        .name = "modbus_timeout",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &master->timer));
+    master->task = xTaskCreateStatic(modbus_event_task, "modbus", MODBUS_TASK_STACK_SIZE, master,
+                                     TASK_PRIORITY, master->stack, &master->task_buf);
+}
+
+esp_err_t modbus_master_send(modbus_master_t *master, modbus_request_t *req, uint32_t timeout_ms) {
+    if (master->req != NULL) return ESP_ERR_INVALID_STATE;
+    req->exception = 0;
+    if (req->func != MODBUS_WRITE_SINGLE_REGISTER &&
+            (req->count == 0 || req->count > MODBUS_MAX_REGISTERS)) {
+        req->result = ESP_ERR_INVALID_ARG;
+        return req->result;
+    }
+    // Drop leftovers of an earlier, timed out response
+    uart_flush_input(master->port);
+    __atomic_store_n(&master->gap, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&master->error, false, __ATOMIC_RELEASE);
+    master->len = 0;
+
+    // Without a TX buffer the driver copies to the FIFO, which holds the
+    // whole request, and returns at once
+    uint8_t frame[8];
+    size_t len = modbus_build_request(req, frame);
+    if (uart_write_bytes(master->port, frame, len) != len) {
+        ESP_LOGE(TAG, "Failed to write UART");
+        master->stats.uart_errors++;
+        req->result = ESP_FAIL;
+        return req->result;
+    }
+    master->req = req;
+    master->deadline_us = esp_timer_get_time() + timeout_ms * 1000LL;
+    esp_timer_start_once(master->timer, timeout_ms * 1000LL);
+    return ESP_OK;
+}
+
+static modbus_request_t* modbus_master_done(modbus_master_t *master) {
+    modbus_request_t *req = master->req;
+    esp_timer_stop(master->timer); // Not running if it woke us
+    master->req = NULL;
+    return req;
+}
+
+modbus_request_t* modbus_master_receive(modbus_master_t *master) {
+    modbus_request_t *req = master->req;
+    if (req == NULL) return NULL;
+    if (__atomic_exchange_n(&master->error, false, __ATOMIC_ACQ_REL)) {
+        master->stats.uart_errors++;
+        uart_flush_input(master->port);
+        req->result = ESP_FAIL;
+        return modbus_master_done(master);
+    }
+    // Taken before reading, all bytes up to the gap are buffered by then
+    bool gap = __atomic_exchange_n(&master->gap, false, __ATOMIC_ACQ_REL);
+    size_t buffered = 0;
+    uart_get_buffered_data_len(master->port, &buffered);
+    if (buffered > MODBUS_MAX_FRAME - master->len) buffered = MODBUS_MAX_FRAME - master->len;
+    if (buffered > 0) {
+        int read = uart_read_bytes(master->port, &master->frame[master->len], buffered, 0);
+        if (read > 0) master->len += read;
+    }
+
+    bool overdue = esp_timer_get_time() >= master->deadline_us;
+    if (master->len == 0 || (!gap && !overdue)) {
+        if (!overdue) return NULL;
+        master->stats.timeouts++;
+        req->result = ESP_ERR_TIMEOUT;
+        return modbus_master_done(master);
+    }
+    // Overdue without a gap, the gap event was lost: take what arrived
+    req->result = modbus_parse_response(req, master->frame, master->len, &master->stats);
+    return modbus_master_done(master);
+}
@@ -1,9 +1,11 @@
 #include "stdint.h"
 #include "stdbool.h"
-#include "endian.h"
+#include "stdlib.h"
 #include "esp_log.h"
 #include "driver/uart.h"
 #include "driver/gpio.h"
+#include "freertos/queue.h"
+#include "scheduler.h"
 
 #include "sense_air_s8.h"
 #include "modbus.h"
@@ -13,11 +15,78 @@
 #define BAUD_RATE        (9600)
 #define RXD_PIN          (CONFIG_SENSE_AIR_S8_UART_RXD)
 #define TXD_PIN          (CONFIG_SENSE_AIR_S8_UART_TXD)
+#define ADDRESSES        (CONFIG_SENSE_AIR_S8_ADDRESSES)
+#define INTERVAL_MILLIS  (CONFIG_SENSE_AIR_S8_INTERVAL_MILLIS)
 #define MAX_WAIT_MILLIS  (500)
+#define EVENT_QUEUE_LEN  (8)
+
+// Input registers IR1..IR4, read in one transaction
+#define REG_METER_STATUS   (0x0000)
+#define REG_COUNT          (4)
 
 static const char *TAG = "SENSE_AIR_S8";
 
-void sense_air_s8_init() {
+static modbus_master_t master = {};
+static uint8_t addresses[SENSE_AIR_S8_MAX_SENSORS];
+static size_t addresses_len = 0;
+static QueueHandle_t data_queue = NULL;
+static StaticQueue_t data_queue_buf;
+static uint8_t data_queue_storage[SENSE_AIR_S8_MAX_SENSORS * sizeof(sense_air_s8_data_t)];
+static scheduler_job_t *listener = NULL;
+
+// Sensors are read one after another, a round every INTERVAL_MILLIS
+static struct {
+    modbus_request_t req;
+    uint16_t values[REG_COUNT];
+    size_t next;               // Of `addresses`, to be read next
+} round = {};
+
+// Send the request of the next sensor of the round, if any
+static void sense_air_s8_send_next() {
+    while (round.next < addresses_len) {
+        round.req = (modbus_request_t) {
+            .addr = addresses[round.next++],
+            .func = MODBUS_READ_INPUT_REGISTERS,
+            .reg = REG_METER_STATUS,
+            .count = REG_COUNT,
+            .values = round.values,
+        };
+        if (modbus_master_send(&master, &round.req, MAX_WAIT_MILLIS) == ESP_OK) return;
+    }
+}
+
+static void sense_air_s8_request(void *arg) {
+    // Sensors silent for MAX_WAIT_MILLIS each may hold a round up past the
+    // interval, let it finish
+    if (round.next < addresses_len || master.req != NULL) {
+        ESP_LOGD(TAG, "Round still running, skipped");
+        return;
+    }
+    round.next = 0;
+    sense_air_s8_send_next();
+}
+
+// Woken by the master as a response arrives or times out
+static void sense_air_s8_response(void *arg) {
+    modbus_request_t *req = modbus_master_receive(&master);
+    if (req == NULL) return;
+    if (req->result == ESP_OK) {
+        sense_air_s8_data_t data = {
+            .addr = req->addr,
+            .meter_status = round.values[0],
+            .alarm_status = round.values[1],
+            .output_status = round.values[2],
+            .co2 = (int16_t) round.values[3],
+        };
+        xQueueSend(data_queue, &data, 0);
+        scheduler_wake(listener);
+    } else {
+        ESP_LOGD(TAG, "Read from %d failed: %s", req->addr, esp_err_to_name(req->result));
+    }
+    sense_air_s8_send_next();
+}
+
+void sense_air_s8_init(scheduler_job_t *on_data) {
     uart_config_t uart_config = {
         .baud_rate = BAUD_RATE,
         .data_bits = UART_DATA_8_BITS,
@@ -27,50 +96,51 @@ void sense_air_s8_init() {
         .source_clk = UART_SCLK_APB,
     };
     int intr_alloc_flags = 0;
+    QueueHandle_t events;
 
-    ESP_ERROR_CHECK(uart_driver_install(PORT_NUM, SOC_UART_FIFO_LEN * 2, 0, 0, NULL, intr_alloc_flags));
+    ESP_ERROR_CHECK(uart_driver_install(PORT_NUM, SOC_UART_FIFO_LEN * 2, 0, EVENT_QUEUE_LEN, &events, intr_alloc_flags));
     ESP_ERROR_CHECK(uart_param_config(PORT_NUM, &uart_config));
     ESP_ERROR_CHECK(uart_set_pin(PORT_NUM, TXD_PIN, RXD_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
-}
 
-static const uint8_t MODBUS_READ_CO2[] = {
-    0xfe, // Address: any
-    0x04, // Function: read input registers
-    0x00, 0x03, // Register num: space CO2
-    0x00, 0x01, // Quantity of registers
-    0xd5, 0xc5, // CRC checksum
-};
-
-int16_t sense_air_s8_read() {
-    s8_modbus_response_t resp;
-    int len;
-
-    len = uart_write_bytes(PORT_NUM, MODBUS_READ_CO2, sizeof(MODBUS_READ_CO2));
-    if (len != sizeof(MODBUS_READ_CO2)) {
-        ESP_LOGE(TAG, "Failed to write UART");
-        return ESP_FAIL;
-    }
-    len = uart_read_bytes(PORT_NUM, &resp, sizeof(resp), MAX_WAIT_MILLIS / portTICK_PERIOD_MS);
-    if (len < 0) {
-        ESP_LOGW(TAG, "UART read failed, return %d", len);
-        return ESP_FAIL;
-    }
-    if (len == 0) {
-        ESP_LOGD(TAG, "UART read nothing");
-        return ESP_FAIL;
+    // Comma separated slave addresses, e.g. "254" or "104,105"
+    const char *p = ADDRESSES;
+    while (*p != '\0' && addresses_len < SENSE_AIR_S8_MAX_SENSORS) {
+        char *end;
+        long addr = strtol(p, &end, 0);
+        if (end == p || addr < 1 || addr > 0xfe) {
+            ESP_LOGE(TAG, "Invalid address list: %s", ADDRESSES);
+            break;
+        }
+        addresses[addresses_len++] = addr;
+        p = *end == ',' ? end + 1 : end;
     }
-    if (len < sizeof(resp)) {
-        ESP_LOGW(TAG, "UART insufficed bytes read (%d < %d)", len, sizeof(resp));
-        return ESP_FAIL;
-    }
-    if (crc16((uint8_t*) &resp, sizeof(resp)) != 0x0000) {
-        ESP_LOGW(TAG, "Wrong CRC-16 checksum");
-        return ESP_FAIL;
-    }
-    if (resp.addr != 0xfe || resp.func != 0x04 || resp.size != 2) {
-        ESP_LOGW(TAG, "Wrong response header: %x %x %x",
-                 resp.addr, resp.func, resp.size);
-        return ESP_FAIL;
+    round.next = addresses_len; // No round running yet
+
+    data_queue = xQueueCreateStatic(SENSE_AIR_S8_MAX_SENSORS, sizeof(sense_air_s8_data_t),
+                                    data_queue_storage, &data_queue_buf);
+    listener = on_data;
+    scheduler_job_t *response = scheduler_add("sense_air_s8_response", 0, sense_air_s8_response, NULL);
+    scheduler_job_t *request = scheduler_add("sense_air_s8_request", INTERVAL_MILLIS,
+                                             sense_air_s8_request, NULL);
+    assert(response != NULL && request != NULL);
+    modbus_master_init(&master, PORT_NUM, events, response);
+}
+
+bool sense_air_s8_read_data(sense_air_s8_data_t* data, TickType_t xTicksToWait) {
+    if (data_queue == NULL) {
+        ESP_LOGE(TAG, "Queue uninitialized, call sense_air_s8_init() first");
+        return false;
     }
-    return be16toh(resp.value_be);
-}
\ No newline at end of file
+    return xQueueReceive(data_queue, data, xTicksToWait) == pdTRUE;
+}
+
+void sense_air_s8_get_stats(sense_air_s8_stats_t* out) {
+    const modbus_stats_t *stats = &master.stats;
+    out->reads = stats->responses - stats->exceptions;
+    out->read_errors = stats->uart_errors;
+    out->timeouts = stats->timeouts;
+    out->short_reads = stats->short_frames;
+    out->checksum_errors = stats->crc_errors;
+    out->header_errors = stats->header_errors;
+    out->exceptions = stats->exceptions;
+}
@@ -4,17 +4,46 @@
 #include "stdint.h"
 #include "stdbool.h"
 #include "freertos/FreeRTOS.h"
+#include "scheduler.h"
+
+#define SENSE_AIR_S8_MAX_SENSORS (8)
+
+// Meter status bits, 0 means no error
+#define SENSE_AIR_S8_FATAL_ERROR      (1 << 0)
+#define SENSE_AIR_S8_OFFSET_REGULATION_ERROR (1 << 1)
+#define SENSE_AIR_S8_ALGORITHM_ERROR  (1 << 2)
+#define SENSE_AIR_S8_OUTPUT_ERROR     (1 << 3)
+#define SENSE_AIR_S8_SELF_DIAG_ERROR  (1 << 4)
+#define SENSE_AIR_S8_OUT_OF_RANGE     (1 << 5)
+#define SENSE_AIR_S8_MEMORY_ERROR     (1 << 6)
 
 typedef struct {
     uint8_t addr;
-    uint8_t func;
-    uint8_t size;
-    uint16_t value_be;
-    uint16_t crc32_le;
-} __attribute__((packed)) s8_modbus_response_t;
+    uint16_t meter_status;
+    uint16_t alarm_status;
+    uint16_t output_status;
+    int16_t co2;               // ppm
+} sense_air_s8_data_t;
+
+typedef struct {
+    uint32_t reads;            // Successful reads
+    uint32_t read_errors;      // UART write or read failed
+    uint32_t timeouts;         // No response at all
+    uint32_t short_reads;      // Response shorter than expected
+    uint32_t checksum_errors;
+    uint32_t header_errors;
+    uint32_t exceptions;       // Requests refused by the sensor
+} sense_air_s8_stats_t;
+
+// Read status & CO2 registers of all configured sensors every
+// CONFIG_SENSE_AIR_S8_INTERVAL_MILLIS on the scheduler, one after another
+// and without waiting for responses. Wake `on_data` (may be NULL) whenever
+// a reading is queued.
+void sense_air_s8_init(scheduler_job_t *on_data);
 
-void sense_air_s8_init();
+// Reading of one sensor, oldest first
+bool sense_air_s8_read_data(sense_air_s8_data_t* data, TickType_t xTicksToWait);
 
-int16_t sense_air_s8_read();
+void sense_air_s8_get_stats(sense_air_s8_stats_t* stats);
 
 #endif /* _LIB_SENSE_AIR_S8_H_ */
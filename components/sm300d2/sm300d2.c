@@ -1,13 +1,14 @@
 #include "stdint.h"
 #include "stdbool.h"
 #include "string.h"
-#include "endian.h"
+#include "stddef.h"
+#include "math.h"
 #include "esp_log.h"
-#include "esp_timer.h"
 #include "driver/uart.h"
 #include "driver/gpio.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "scheduler.h"
 
 #include "sm300d2.h"
 
@@ -15,129 +16,308 @@
 #define PORT_NUM         (CONFIG_SM300D2_UART_PORT_NUM)
 #define BAUD_RATE        (9600)
 #define RXD_PIN          (CONFIG_SM300D2_UART_RXD)
-#define TASK_STACK_SIZE  (CONFIG_SM300D2_TASK_STACK_SIZE)
 #define AGGREGATION_SECS (CONFIG_SM300D2_AGGREGATION_SECS)
+#define POLL_MILLIS      (1000) // One frame per second, the UART buffer holds many more
+#define RING_SIZE        (64) // Power of 2, holds at least two frames
+#define FRAME_SIZE       (sizeof(sm300d2_packet_t))
 
 static const char *TAG = "SM300D2";
 
 static QueueHandle_t data_queue = NULL;
+static StaticQueue_t data_queue_buf;
+static uint8_t data_queue_storage[sizeof(sm300d2_window_t)];
+static scheduler_job_t *listener = NULL;
+static sm300d2_stats_t stats = {};
 
-bool sm300d2_check_packet(sm300d2_packet_t* packet) {
-    uint8_t sum = 0x00;
-    for (uint8_t i = 0; i < sizeof(*packet) - 1; i++)
-    {
-        sum += ((uint8_t*) packet)[i];
+// P-square streaming quantile estimator (Jain & Chlamtac, 1985)
+typedef struct {
+    float p;
+    float q[5];   // Marker heights
+    float np[5];  // Desired marker positions
+    int n[5];     // Actual marker positions
+    uint32_t count;
+} p2_quantile_t;
+
+// Running statistics of one channel within the aggregation window
+typedef struct {
+    uint32_t count;
+    float min;
+    float max;
+    float mean;
+    float m2;     // Sum of squared deviations from mean (Welford)
+    p2_quantile_t p50;
+    p2_quantile_t p95;
+} channel_acc_t;
+
+static channel_acc_t channels[SM300D2_CHANNELS];
+
+static void p2_init(p2_quantile_t* e, float p) {
+    e->p = p;
+    e->count = 0;
+}
+
+static int float_cmp(const void* a, const void* b) {
+    float x = *(const float*) a, y = *(const float*) b;
+    return (x > y) - (x < y);
+}
+
+static float p2_parabolic(p2_quantile_t* e, int i, int d) {
+    float *q = e->q;
+    int *n = e->n;
+    return q[i] + (float) d / (n[i + 1] - n[i - 1]) * (
+        (n[i] - n[i - 1] + d) * (q[i + 1] - q[i]) / (n[i + 1] - n[i]) +
+        (n[i + 1] - n[i] - d) * (q[i] - q[i - 1]) / (n[i] - n[i - 1]));
+}
+
+static void p2_add(p2_quantile_t* e, float x) {
+    float *q = e->q;
+    int *n = e->n;
+    if (e->count < 5) {
+        q[e->count++] = x;
+        if (e->count == 5) {
+            qsort(q, 5, sizeof(float), float_cmp);
+            for (int i = 0; i < 5; i++) n[i] = i + 1;
+            e->np[0] = 1;
+            e->np[1] = 1 + 2 * e->p;
+            e->np[2] = 1 + 4 * e->p;
+            e->np[3] = 3 + 2 * e->p;
+            e->np[4] = 5;
+        }
+        return;
     }
-    return sum == packet->checksum;
+
+    int k;
+    if (x < q[0]) {
+        q[0] = x;
+        k = 0;
+    } else if (x >= q[4]) {
+        q[4] = x;
+        k = 3;
+    } else {
+        for (k = 0; x >= q[k + 1]; k++);
+    }
+    for (int i = k + 1; i < 5; i++) n[i]++;
+    e->np[1] += e->p / 2;
+    e->np[2] += e->p;
+    e->np[3] += (1 + e->p) / 2;
+    e->np[4] += 1;
+
+    for (int i = 1; i < 4; i++) {
+        float d = e->np[i] - n[i];
+        if ((d >= 1 && n[i + 1] - n[i] > 1) || (d <= -1 && n[i - 1] - n[i] < -1)) {
+            int s = d > 0 ? 1 : -1;
+            float qp = p2_parabolic(e, i, s);
+            if (q[i - 1] < qp && qp < q[i + 1]) q[i] = qp;
+            else q[i] += s * (q[i + s] - q[i]) / (n[i + s] - n[i]);
+            n[i] += s;
+        }
+    }
+    e->count++;
 }
 
-void sm300d2_parse_data(sm300d2_packet_t* packet, sm300d2_data_t* data) {
-    data->e_co2 = be16toh(packet->e_co2_be);
-    data->e_ch2o = be16toh(packet->e_ch2o_be);
-    data->tvoc = be16toh(packet->tvoc_be);
-    data->pm2_5 = be16toh(packet->pm2_5_be);
-    data->pm10 = be16toh(packet->pm10_be);
-    data->temp_centi = packet->temp_int * 100 + packet->temp_frac;
-    data->humi_centi = packet->humi_int * 100 + packet->humi_frac;
-    ESP_LOGD(TAG, "CO2=%d CH2O=%d TVOC=%d PM2.5=%d PM10=%d T=%d H=%d",
-             data->e_co2, data->e_ch2o, data->tvoc, data->pm2_5,
-             data->pm10, data->temp_centi, data->humi_centi);
+static float p2_get(p2_quantile_t* e) {
+    if (e->count == 0) return NAN;
+    if (e->count >= 5) return e->q[2];
+    // Too few points for markers, take the nearest rank
+    float sorted[5];
+    memcpy(sorted, e->q, e->count * sizeof(float));
+    qsort(sorted, e->count, sizeof(float), float_cmp);
+    return sorted[(size_t) lroundf(e->p * (e->count - 1))];
 }
 
-void sm300d2_init() {
-    uart_config_t uart_config = {
-        .baud_rate = BAUD_RATE,
-        .data_bits = UART_DATA_8_BITS,
-        .parity = UART_PARITY_DISABLE,
-        .stop_bits = UART_STOP_BITS_1,
-        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
-        .source_clk = UART_SCLK_APB,
-    };
-    int intr_alloc_flags = 0;
+static void channel_reset(channel_acc_t* acc) {
+    acc->count = 0;
+    acc->min = INFINITY;
+    acc->max = -INFINITY;
+    acc->mean = 0;
+    acc->m2 = 0;
+    p2_init(&acc->p50, 0.50f);
+    p2_init(&acc->p95, 0.95f);
+}
 
-    ESP_ERROR_CHECK(uart_driver_install(PORT_NUM, SOC_UART_FIFO_LEN * 2, 0, 0, NULL, intr_alloc_flags));
-    ESP_ERROR_CHECK(uart_param_config(PORT_NUM, &uart_config));
-    ESP_ERROR_CHECK(uart_set_pin(PORT_NUM, UART_PIN_NO_CHANGE, RXD_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+static void channel_add(channel_acc_t* acc, float x) {
+    acc->count++;
+    if (x < acc->min) acc->min = x;
+    if (x > acc->max) acc->max = x;
+    float delta = x - acc->mean;
+    acc->mean += delta / acc->count;
+    acc->m2 += delta * (x - acc->mean);
+    p2_add(&acc->p50, x);
+    p2_add(&acc->p95, x);
+}
+
+static void channel_summarize(channel_acc_t* acc, sm300d2_dist_t* dist) {
+    dist->min = acc->min;
+    dist->max = acc->max;
+    dist->mean = acc->mean;
+    dist->stddev = acc->count > 1 ? sqrtf(acc->m2 / (acc->count - 1)) : 0;
+    dist->p50 = p2_get(&acc->p50);
+    dist->p95 = p2_get(&acc->p95);
+}
+
+// Received bytes not yet parsed, starting at `head`
+typedef struct {
+    uint8_t buf[RING_SIZE];
+    size_t head;
+    size_t len;
+} sm300d2_ring_t;
+
+static sm300d2_ring_t ring = {};
 
-    data_queue = xQueueCreate(1, sizeof(sm300d2_data_t));
-    assert(data_queue != 0);
+#define ring_at(ring, i) ((ring)->buf[((ring)->head + (i)) & (RING_SIZE - 1)])
 
-    BaseType_t ret = xTaskCreate(sm300d2_receive_task, "sensor_receive_task", TASK_STACK_SIZE, NULL, 10, NULL);
-    assert(ret == pdPASS);
+// Copy the first `n` bytes out of the ring, joining a wrapped frame
+static void ring_copy(sm300d2_ring_t* ring, void* dst, size_t n) {
+    size_t first = RING_SIZE - ring->head;
+    if (first > n) first = n;
+    memcpy(dst, &ring->buf[ring->head], first);
+    memcpy((uint8_t*) dst + first, ring->buf, n - first);
 }
 
-void sm300d2_receive_task(void * pvParameters) {
-    sm300d2_packet_t pkt;
-    sm300d2_data_t data;
-    sm300d2_data_t pts_sum = {};
-    size_t pts_count = 0;
-    int64_t pts_since_ms = esp_timer_get_time() / 1000;
+static void ring_skip(sm300d2_ring_t* ring, size_t n) {
+    ring->head = (ring->head + n) & (RING_SIZE - 1);
+    ring->len -= n;
+}
 
-    assert(data_queue != NULL);
-    ESP_LOGI(TAG, "Listening sensor data...");
+// Fill the ring with what is buffered by the UART driver, or wait up to
+// `ticks` for at least one byte.
+static int ring_receive(sm300d2_ring_t* ring, TickType_t ticks) {
+    size_t tail = (ring->head + ring->len) & (RING_SIZE - 1);
+    size_t space = RING_SIZE - ring->len;
+    if (space > RING_SIZE - tail) space = RING_SIZE - tail;
+    size_t buffered = 0;
+    uart_get_buffered_data_len(PORT_NUM, &buffered);
+    if (buffered < 1) buffered = 1;
+    if (buffered > space) buffered = space;
+    int len = uart_read_bytes(PORT_NUM, &ring->buf[tail], buffered, ticks);
+    if (len > 0) ring->len += len;
+    return len;
+}
 
-    while (true) {
-        int64_t now_ms = esp_timer_get_time() / 1000;
-        int64_t wait_ms = AGGREGATION_SECS * 1000 + (pts_since_ms - now_ms);
-        if (wait_ms <= 1) { // Aggregation period passed
-            ESP_LOGD(TAG, "Aggregating %d data points", pts_count);
-            if (pts_count > 0) { // Data for send exist
-                pts_sum.e_co2 /= pts_count;
-                pts_sum.e_ch2o /= pts_count;
-                pts_sum.tvoc /= pts_count;
-                pts_sum.pm2_5 /= pts_count;
-                pts_sum.pm10 /= pts_count;
-                pts_sum.temp_centi /= pts_count;
-                pts_sum.humi_centi /= pts_count;
-                xQueueOverwrite(data_queue, &pts_sum);
-            }
-            pts_count = 0;
-            memset(&pts_sum, 0, sizeof(pts_sum));
-            pts_since_ms = esp_timer_get_time() / 1000;
+// Validate the frame at the head of ring, parse it into `data`. Skip over
+// garbage until a frame is found or more bytes are needed.
+static bool ring_parse_frame(sm300d2_ring_t* ring, sm300d2_data_t* data) {
+    sm300d2_packet_t packet;
+    while (ring->len > 0) {
+        if (ring_at(ring, 0) != SM300D2_ADDRESS) {
+            ring_skip(ring, 1);
+            stats.bytes_skipped++;
             continue;
         }
+        if (ring->len < FRAME_SIZE) return false;
 
-        ESP_LOGD(TAG, "Read UART, wait for %llims", wait_ms);
-        int len = uart_read_bytes(PORT_NUM, &pkt, sizeof(pkt), wait_ms / portTICK_PERIOD_MS);
-        ESP_LOGD(TAG, "UART read %d", len);
-        if (len < 0) {
-            ESP_LOGW(TAG, "UART read failed, return %d", len);
+        ring_copy(ring, &packet, FRAME_SIZE);
+        if (!sm300d2_check_packet(&packet)) {
+            // May be a false header within data, resync from next byte
+            ESP_LOGD(TAG, "Frame with wrong checksum");
+            stats.checksum_errors++;
+            stats.bytes_skipped++;
+            ring_skip(ring, 1);
             continue;
         }
-        if (len == 0) continue;
-        if (len < sizeof(pkt)) {
-            ESP_LOGW(TAG, "UART insufficed bytes read (%d < %d)", len, sizeof(pkt));
+        if (packet.version != SM300D2_VERSION) {
+            ESP_LOGW(TAG, "Unsupport version: %d", packet.version);
+            stats.version_errors++;
+            ring_skip(ring, FRAME_SIZE);
             continue;
         }
-        if (pkt.address != SM300D2_ADDRESS) {
-            ESP_LOGW(TAG, "Frame with wrong header address %x", pkt.address);
-            continue;
-        }
-        if (!sm300d2_check_packet(&pkt)) {
-            ESP_LOGW(TAG, "Frame with wrong checksum");
-            continue;
+
+        sm300d2_parse_data(&packet, data);
+        ring_skip(ring, FRAME_SIZE);
+        stats.frames++;
+        return true;
+    }
+    return false;
+}
+
+// Parse what arrived since the last poll, without waiting
+static void sm300d2_poll(void *arg) {
+    sm300d2_data_t data;
+    while (true) {
+        int len = ring_receive(&ring, 0);
+        if (len < 0) {
+            ESP_LOGW(TAG, "UART read failed, return %d", len);
+            stats.read_errors++;
+            return;
         }
-        if (pkt.version != SM300D2_VERSION) {
-            ESP_LOGW(TAG, "Unsupport version: %d", pkt.version);
-            continue;
+        while (ring_parse_frame(&ring, &data)) {
+            channel_add(&channels[SM300D2_E_CO2], data.e_co2);
+            channel_add(&channels[SM300D2_E_CH2O], data.e_ch2o);
+            channel_add(&channels[SM300D2_TVOC], data.tvoc);
+            channel_add(&channels[SM300D2_PM2_5], data.pm2_5);
+            channel_add(&channels[SM300D2_PM10], data.pm10);
+            channel_add(&channels[SM300D2_TEMP], data.temp_centi / 100.0f);
+            channel_add(&channels[SM300D2_HUMI], data.humi_centi / 100.0f);
         }
-        sm300d2_parse_data(&pkt, &data);
-        pts_sum.e_co2 += data.e_co2;
-        pts_sum.e_ch2o += data.e_ch2o;
-        pts_sum.tvoc += data.tvoc;
-        pts_sum.pm2_5 += data.pm2_5;
-        pts_sum.pm10 += data.pm10;
-        pts_sum.temp_centi += data.temp_centi;
-        pts_sum.humi_centi += data.humi_centi;
-        pts_count++;
+        if (len == 0) return;
     }
 }
 
-bool sm300d2_read_data(sm300d2_data_t* data, TickType_t xTicksToWait) {
+static void sm300d2_aggregate(void *arg) {
+    sm300d2_window_t window;
+    // Take the frames still buffered into this window
+    sm300d2_poll(NULL);
+    window.count = channels[0].count;
+    ESP_LOGD(TAG, "Aggregating %lu data points", window.count);
+    if (window.count > 0) { // Data for send exist
+        for (size_t i = 0; i < SM300D2_CHANNELS; i++)
+            channel_summarize(&channels[i], &window.dist[i]);
+        xQueueOverwrite(data_queue, &window);
+        scheduler_wake(listener);
+    } else {
+        stats.timeouts++;
+    }
+    for (size_t i = 0; i < SM300D2_CHANNELS; i++) channel_reset(&channels[i]);
+}
+
+void sm300d2_init(scheduler_job_t *on_window) {
+    uart_config_t uart_config = {
+        .baud_rate = BAUD_RATE,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        .source_clk = UART_SCLK_APB,
+    };
+    int intr_alloc_flags = 0;
+
+    ESP_ERROR_CHECK(uart_driver_install(PORT_NUM, SOC_UART_FIFO_LEN * 2, 0, 0, NULL, intr_alloc_flags));
+    ESP_ERROR_CHECK(uart_param_config(PORT_NUM, &uart_config));
+    ESP_ERROR_CHECK(uart_set_pin(PORT_NUM, UART_PIN_NO_CHANGE, RXD_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+
+    data_queue = xQueueCreateStatic(1, sizeof(sm300d2_window_t), data_queue_storage, &data_queue_buf);
+    listener = on_window;
+
+    ESP_LOGI(TAG, "Listening sensor data...");
+    for (size_t i = 0; i < SM300D2_CHANNELS; i++) channel_reset(&channels[i]);
+    scheduler_job_t *poll = scheduler_add("sm300d2_poll", POLL_MILLIS, sm300d2_poll, NULL);
+    scheduler_job_t *aggregate = scheduler_add("sm300d2_aggregate", AGGREGATION_SECS * 1000,
+                                               sm300d2_aggregate, NULL);
+    assert(poll != NULL && aggregate != NULL);
+}
+
+void sm300d2_get_stats(sm300d2_stats_t* out) {
+    *out = stats;
+}
+
+bool sm300d2_read_window(sm300d2_window_t* window, TickType_t xTicksToWait) {
     if (data_queue == NULL) {
         ESP_LOGE(TAG, "Queue uninitialized, call sm300d2_init() first");
         return false;
     }
-    BaseType_t ret = xQueueReceive(data_queue, data, xTicksToWait);
+    BaseType_t ret = xQueueReceive(data_queue, window, xTicksToWait);
     return ret == pdTRUE;
+}
+
+bool sm300d2_read_data(sm300d2_data_t* data, TickType_t xTicksToWait) {
+    sm300d2_window_t window;
+    if (!sm300d2_read_window(&window, xTicksToWait)) return false;
+    data->e_co2 = lroundf(window.dist[SM300D2_E_CO2].mean);
+    data->e_ch2o = lroundf(window.dist[SM300D2_E_CH2O].mean);
+    data->tvoc = lroundf(window.dist[SM300D2_TVOC].mean);
+    data->pm2_5 = lroundf(window.dist[SM300D2_PM2_5].mean);
+    data->pm10 = lroundf(window.dist[SM300D2_PM10].mean);
+    data->temp_centi = lroundf(window.dist[SM300D2_TEMP].mean * 100);
+    data->humi_centi = lroundf(window.dist[SM300D2_HUMI].mean * 100);
+    return true;
 }
\ No newline at end of file
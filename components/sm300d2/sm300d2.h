@@ -4,6 +4,7 @@
 #include "stdint.h"
 #include "stdbool.h"
 #include "freertos/FreeRTOS.h"
+#include "scheduler.h"
 
 #define SM300D2_ADDRESS (0x3c)
 #define SM300D2_VERSION (0x02)
@@ -34,15 +35,55 @@ typedef struct
     uint32_t humi_centi;
 } sm300d2_data_t;
 
+// Channels of sm300d2_window_t, temperature in celsius and humidity in %
+enum {
+    SM300D2_E_CO2,
+    SM300D2_E_CH2O,
+    SM300D2_TVOC,
+    SM300D2_PM2_5,
+    SM300D2_PM10,
+    SM300D2_TEMP,
+    SM300D2_HUMI,
+    SM300D2_CHANNELS,
+};
+
+typedef struct {
+    float min;
+    float max;
+    float mean;
+    float stddev;
+    float p50;  // Approximate quantiles
+    float p95;
+} sm300d2_dist_t;
+
+// Distribution of readings within one aggregation period
+typedef struct {
+    uint32_t count;
+    sm300d2_dist_t dist[SM300D2_CHANNELS];
+} sm300d2_window_t;
+
+typedef struct {
+    uint32_t frames;           // Valid frames received
+    uint32_t bytes_skipped;    // Bytes dropped while looking for a frame
+    uint32_t checksum_errors;
+    uint32_t version_errors;
+    uint32_t read_errors;      // UART read failed
+    uint32_t timeouts;         // Aggregation periods without a valid frame
+} sm300d2_stats_t;
+
 bool sm300d2_check_packet(sm300d2_packet_t* packet);
 
 void sm300d2_parse_data(sm300d2_packet_t* packet, sm300d2_data_t* data);
 
-void sm300d2_init();
-
-void sm300d2_receive_task(void * pvParameters);
+// Poll & aggregate on the scheduler, wake `on_window` (may be NULL) when a
+// window is ready to read
+void sm300d2_init(scheduler_job_t *on_window);
 
 bool sm300d2_read_data(sm300d2_data_t* data, TickType_t xTicksToWait);
 
+bool sm300d2_read_window(sm300d2_window_t* window, TickType_t xTicksToWait);
+
+void sm300d2_get_stats(sm300d2_stats_t* stats);
+
 
 #endif /* _LIB_SM300D2_H_ */
@@ -0,0 +1,30 @@
+#include "stdint.h"
+#include "stdbool.h"
+#include "endian.h"
+#include "esp_log.h"
+
+#include "sm300d2.h"
+
+static const char *TAG = "SM300D2";
+
+bool sm300d2_check_packet(sm300d2_packet_t* packet) {
+    uint8_t sum = 0x00;
+    for (uint8_t i = 0; i < sizeof(*packet) - 1; i++)
+    {
+        sum += ((uint8_t*) packet)[i];
+    }
+    return sum == packet->checksum;
+}
+
+void sm300d2_parse_data(sm300d2_packet_t* packet, sm300d2_data_t* data) {
+    data->e_co2 = be16toh(packet->e_co2_be);
+    data->e_ch2o = be16toh(packet->e_ch2o_be);
+    data->tvoc = be16toh(packet->tvoc_be);
+    data->pm2_5 = be16toh(packet->pm2_5_be);
+    data->pm10 = be16toh(packet->pm10_be);
+    data->temp_centi = packet->temp_int * 100 + packet->temp_frac;
+    data->humi_centi = packet->humi_int * 100 + packet->humi_frac;
+    ESP_LOGD(TAG, "CO2=%d CH2O=%d TVOC=%d PM2.5=%d PM10=%d T=%d H=%d",
+             data->e_co2, data->e_ch2o, data->tvoc, data->pm2_5,
+             data->pm10, data->temp_centi, data->humi_centi);
+}
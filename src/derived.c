@@ -0,0 +1,128 @@
+#include "math.h"
+#include "esp_timer.h"
+
+#include "derived.h"
+#include "metrics_schema.h"
+#include "sense_air_s8.h"
+
+#define MAX_INPUTS (2)
+#define MAX_SERIES (1 + SENSE_AIR_S8_MAX_SENSORS) // Unlabelled, then one per label
+
+typedef float (*derived_fn_t)(const float *in);
+
+typedef struct {
+    uint16_t id;                  // Published as, from metrics_schema.inc
+    uint16_t inputs[MAX_INPUTS];
+    uint8_t inputs_len;
+    derived_fn_t fn;              // NAN to publish nothing
+} derived_t;
+
+// Magnus formula with the coefficients of Sonntag (1990)
+static float dew_point(const float *in) {
+    float t = in[0], rh = in[1];
+    if (rh <= 0) return NAN;
+    float gamma = logf(rh / 100) + 17.62f * t / (243.12f + t);
+    return 243.12f * gamma / (17.62f - gamma);
+}
+
+// Grams of water vapour per cubic metre
+static float abs_humidity(const float *in) {
+    float t = in[0], rh = in[1];
+    return 6.112f * expf(17.67f * t / (t + 243.5f)) * rh * 2.1674f / (273.15f + t);
+}
+
+// Mean weighted by the inverse variance of each sensor. Senseair S8 is
+// specified to ±40 ppm ±3%; eCO2 of SM300D2 is only estimated from VOCs.
+#define S8_SIGMA(ppm) (40 + 0.03f * (ppm))
+#define ECO2_SIGMA    (200.0f)
+static float co2_fused(const float *in) {
+    float w_s8 = 1 / (S8_SIGMA(in[0]) * S8_SIGMA(in[0]));
+    float w_eco2 = 1 / (ECO2_SIGMA * ECO2_SIGMA);
+    return (in[0] * w_s8 + in[1] * w_eco2) / (w_s8 + w_eco2);
+}
+
+static const derived_t DERIVED[] = {
+    { METRIC_DERIVED_DEW_POINT, { METRIC_SM300D2_TEMP_MEAN, METRIC_SM300D2_HUMI_MEAN }, 2, dew_point },
+    { METRIC_DERIVED_ABS_HUMI, { METRIC_SM300D2_TEMP_MEAN, METRIC_SM300D2_HUMI_MEAN }, 2, abs_humidity },
+    { METRIC_DERIVED_CO2, { METRIC_S8_CO2, METRIC_SM300D2_CO2_MEAN }, 2, co2_fused },
+};
+#define DERIVED_LEN (sizeof(DERIVED) / sizeof(DERIVED[0]))
+
+// Series of one derived metric, with the labels of its labelled input.
+// Unlabelled inputs, such as SM300D2 readings, are fed to every series.
+typedef struct {
+    const char *labels;             // From metrics_labels(), NULL for the first
+    float in[MAX_INPUTS];
+    int64_t expires_at[MAX_INPUTS]; // 0 until put
+    bool changed;
+    bool touched;
+    float out;
+} series_t;
+
+static struct {
+    series_t series[MAX_SERIES];
+    size_t series_len;
+} state[DERIVED_LEN] = {};
+
+static float input_value(const metric_t *m) {
+    return m->fixed ? m->scaled / powf(10, METRICS_SCHEMA[m->id].precision) : m->value;
+}
+
+static void series_input(series_t *s, size_t i, float value, int64_t now, uint32_t expire_in_millis) {
+    s->changed |= s->expires_at[i] <= now || value != s->in[i];
+    s->in[i] = value;
+    s->expires_at[i] = now + expire_in_millis;
+    s->touched = true;
+}
+
+// Series of `labels`, interned so compared by address. A new one starts
+// with the unlabelled inputs of the first. NULL if all are taken.
+static series_t* series_get(size_t d, const char *labels) {
+    for (size_t k = 0; k < state[d].series_len; k++)
+        if (state[d].series[k].labels == labels) return &state[d].series[k];
+    if (state[d].series_len == 0) state[d].series_len = 1; // The unlabelled one is first
+    if (labels == NULL) return &state[d].series[0];
+    if (state[d].series_len >= MAX_SERIES) return NULL;
+    series_t *s = &state[d].series[state[d].series_len++];
+    *s = state[d].series[0];
+    s->labels = labels;
+    s->changed = true;
+    return s;
+}
+
+void derived_update(const metric_t *metrics, size_t count, uint32_t expire_in_millis) {
+    int64_t now = esp_timer_get_time() / 1000;
+    for (size_t d = 0; d < DERIVED_LEN; d++) {
+        const derived_t *derived = &DERIVED[d];
+        for (size_t j = 0; j < count; j++) {
+            const metric_t *m = &metrics[j];
+            if (m->name != NULL) continue;
+            for (size_t i = 0; i < derived->inputs_len; i++) {
+                if (derived->inputs[i] != m->id) continue;
+                float value = input_value(m);
+                series_t *s = series_get(d, m->labels);
+                if (s == NULL) continue;
+                series_input(s, i, value, now, expire_in_millis);
+                if (m->labels != NULL) continue;
+                for (size_t k = 1; k < state[d].series_len; k++)
+                    series_input(&state[d].series[k], i, value, now, expire_in_millis);
+            }
+        }
+
+        for (size_t k = 0; k < state[d].series_len; k++) {
+            series_t *s = &state[d].series[k];
+            if (!s->touched) continue;
+            s->touched = false;
+            int64_t expires_at = INT64_MAX;
+            for (size_t i = 0; i < derived->inputs_len; i++)
+                if (s->expires_at[i] < expires_at) expires_at = s->expires_at[i];
+            if (expires_at <= now) continue; // Waiting for the other inputs
+            if (s->changed) s->out = derived->fn(s->in);
+            s->changed = false;
+            if (isnan(s->out)) continue;
+            // Put again even if unchanged, to extend its expiry
+            metric_t metric = { .id = derived->id, .labels = s->labels, .value = s->out };
+            metrics_put(&metric, expires_at - now);
+        }
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef _DERIVED_H_
+#define _DERIVED_H_
+
+#include "metrics.h"
+
+// Feed metrics just put to the derived series declared in derived.c, and
+// put those whose inputs are all live. They are computed again only when
+// an input changed, and expire with their first input to expire. Inputs
+// are series of the schema. A labelled input, such as the CO2 of one of
+// several Senseair S8 on the bus, is derived from separately, under its
+// labels, along with the unlabelled inputs. Not thread safe, call it from
+// scheduler jobs only, which run one at a time.
+void derived_update(const metric_t *metrics, size_t count, uint32_t expire_in_millis);
+
+#endif /* _DERIVED_H_ */
@@ -5,71 +5,176 @@
 #include "sense_air_s8.h"
 #include "lywsd02.h"
 #include "metrics.h"
+#include "scheduler.h"
+#include "metrics_schema.h"
+#include "derived.h"
 
-#define TASK_STACK_SIZE     (2048)
 #define METRIC_VALID_MILLIS (1000 * 30)
+#define STATS_INTERVAL_MILLIS (1000 * 10)
 
 
 static const char* TAG = "main";
 
+static metric_histogram_t *co2_observed = NULL;
+static metric_histogram_t *temp_observed = NULL;
+static const char* lywsd02_labels[LYWSD02_MAX_DEVICES] = {};
 
-#define put_metric(V, N, U) {\
-    metric.name = (N);\
-    metric.unit = (U);\
+
+// Metrics are declared in metrics_schema.inc, put them by id. Integers
+// are put scaled by 10^precision of the schema, e.g. centidegrees for a
+// precision of 2, and formatted without going through floats. Stats of
+// the firmware itself are put quietly, so they do not defeat 304s.
+#define put_fixed(V, ID) {\
+    metric.id = (ID);\
+    metric.fixed = true;\
+    metric.scaled = (V);\
+    metrics_put_quiet(&metric, 1, METRIC_VALID_MILLIS);\
+}
+
+// Append to `batch`, to be put at once with metrics_put_many()
+#define batch_metric(V, ID) {\
+    metric.id = (ID);\
+    metric.fixed = false;\
     metric.value = (V);\
-    metrics_put(&metric, METRIC_VALID_MILLIS);\
+    batch[batch_len++] = metric;\
 }
 
-void task_sm300d2(void * pvParameters) {
-    sm300d2_data_t data;
-    metric_t metric = {
-        .type = "gauge",
-    };
-    while (true) {
-        if (!sm300d2_read_data(&data, portMAX_DELAY))
-            continue;
-        ESP_LOGD(TAG, "SM300D2 CO2=%d CH2O=...", data.e_co2);
-        metric.precision = 0;
-        put_metric(data.e_co2, "espair_sm300d2_co2_ppm", "ppm");
-        put_metric(data.e_ch2o, "espair_sm300d2_ch2o_ug_m3", "ug_m3");
-        put_metric(data.tvoc, "espair_sm300d2_tvoc_ug_m3", "ug_m3");
-        put_metric(data.pm2_5, "espair_sm300d2_pm25_ug_m3", "ug_m3");
-        put_metric(data.pm10, "espair_sm300d2_pm10_ug_m3", "ug_m3");
-        metric.precision = 2;
-        put_metric(data.temp_centi / 100.0f, "espair_sm300d2_temp_celsius", "celsius");
-        put_metric(data.humi_centi / 100.0f, "espair_sm300d2_humi_precent", "precent");
+#define batch_fixed(V, ID) {\
+    metric.id = (ID);\
+    metric.fixed = true;\
+    metric.scaled = (V);\
+    batch[batch_len++] = metric;\
+}
+
+// First of the six metrics of each channel's distribution
+static const uint16_t SM300D2_METRICS[SM300D2_CHANNELS] = {
+    [SM300D2_E_CO2]  = METRIC_SM300D2_CO2_MEAN,
+    [SM300D2_E_CH2O] = METRIC_SM300D2_CH2O_MEAN,
+    [SM300D2_TVOC]   = METRIC_SM300D2_TVOC_MEAN,
+    [SM300D2_PM2_5]  = METRIC_SM300D2_PM25_MEAN,
+    [SM300D2_PM10]   = METRIC_SM300D2_PM10_MEAN,
+    [SM300D2_TEMP]   = METRIC_SM300D2_TEMP_MEAN,
+    [SM300D2_HUMI]   = METRIC_SM300D2_HUMI_MEAN,
+};
+
+// Publish jobs run on the scheduler worker, sensor jobs wake them with data
+void job_sm300d2(void *arg) {
+    sm300d2_window_t window;
+    metric_t metric = {};
+    metric_t batch[SM300D2_CHANNELS * 6];
+    while (sm300d2_read_window(&window, 0)) {
+        ESP_LOGD(TAG, "SM300D2 %lu points, CO2=%.1f CH2O=...",
+                 window.count, window.dist[SM300D2_E_CO2].mean);
+        size_t batch_len = 0;
+        for (size_t i = 0; i < SM300D2_CHANNELS; i++) {
+            uint16_t id = SM300D2_METRICS[i];
+            const sm300d2_dist_t *d = &window.dist[i];
+            batch_metric(d->mean, id + DIST_MEAN);
+            batch_metric(d->min, id + DIST_MIN);
+            batch_metric(d->max, id + DIST_MAX);
+            batch_metric(d->stddev, id + DIST_STDDEV);
+            batch_metric(d->p50, id + DIST_P50);
+            batch_metric(d->p95, id + DIST_P95);
+        }
+        metrics_put_many(batch, batch_len, METRIC_VALID_MILLIS);
+        derived_update(batch, batch_len, METRIC_VALID_MILLIS);
     }
 }
 
-void task_sense_air_s8(void * pvParameters) {
-    metric_t metric = {
-        .name = "espair_senseairs8_co2_ppm",
-        .type = "gauge",
-        .unit = "ppm",
-        .precision = 0,
-    };
-    while (true) {
-        int16_t value = sense_air_s8_read();
-        ESP_LOGD(TAG, "SenseAir S8 CO2=%d", value);
-        if (value == -1) continue;
-        metric.value = value;
-        metrics_put(&metric, METRIC_VALID_MILLIS);
-        vTaskDelay(5000 / portTICK_PERIOD_MS);
+static const float CO2_BOUNDS[] = { 400, 600, 800, 1000, 1200, 1500, 2000, 3000, 5000 };
+static const float TEMP_BOUNDS[] = {
+    10, 14, 16, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 30, 32, 35,
+};
+
+void job_sense_air_s8(void *arg) {
+    metric_t metric = { .id = METRIC_S8_CO2, .fixed = true };
+    metric_t status = { .id = METRIC_S8_STATUS, .fixed = true };
+    sense_air_s8_data_t data;
+    while (sense_air_s8_read_data(&data, 0)) {
+        ESP_LOGD(TAG, "SenseAir S8 #%d CO2=%d status=%x", data.addr, data.co2, data.meter_status);
+        // Tell sensors apart only if addressed individually
+        char addr[4];
+        snprintf(addr, sizeof(addr), "%d", data.addr);
+        metric_label_t label = { "addr", addr };
+        const char *labels = data.addr != 0xfe ? metrics_labels(&label, 1) : NULL;
+        metric_t batch[2] = { status, metric };
+        batch[0].labels = labels;
+        batch[0].scaled = data.meter_status;
+        if (data.meter_status & SENSE_AIR_S8_FATAL_ERROR) {
+            metrics_put(&batch[0], METRIC_VALID_MILLIS);
+            continue;
+        }
+        batch[1].labels = labels;
+        batch[1].scaled = data.co2;
+        metrics_put_many(batch, 2, METRIC_VALID_MILLIS);
+        derived_update(batch, 2, METRIC_VALID_MILLIS);
+        if (co2_observed != NULL) metrics_observe(co2_observed, data.co2);
     }
 }
 
-void task_lywsd02(void * pvParameters) {
+void job_lywsd02(void *arg) {
     lywsd02_data_t data;
-    metric_t metric = {
-        .type = "gauge",
-    };
-    while (true) {
-        if (!lywsd02_read_data(&data, portMAX_DELAY))
-            continue;
-        metric.precision = 2;
-        put_metric(data.temp_centi / 100.0f, "espair_lywsd02_temp_celsius", "celsius");
-        metric.precision = 0;
-        put_metric(data.humi, "espair_lywsd02_humi_precent", "precent");
+    metric_t metric = {};
+    metric_t batch[3];
+    while (lywsd02_read_data(&data, 0)) {
+        size_t batch_len = 0;
+        metric.labels = lywsd02_labels[data.device];
+        batch_fixed(data.temp_centi, METRIC_LYWSD02_TEMP);
+        batch_fixed(data.humi, METRIC_LYWSD02_HUMI);
+        if (data.battery >= 0) batch_fixed(data.battery, METRIC_LYWSD02_BATTERY);
+        metrics_put_many(batch, batch_len, METRIC_VALID_MILLIS);
+        if (temp_observed != NULL) metrics_observe(temp_observed, data.temp_centi / 100.0f);
+    }
+}
+
+void job_internal(void *arg) {
+    static const char* job_labels[CONFIG_SCHEDULER_MAX_JOBS] = {};
+    sm300d2_stats_t sm300d2;
+    sense_air_s8_stats_t s8;
+    lywsd02_stats_t lywsd02;
+    scheduler_stats_t sched;
+    scheduler_job_stats_t job;
+    metric_t metric = {};
+    sm300d2_get_stats(&sm300d2);
+    put_fixed(sm300d2.frames, METRIC_SM300D2_FRAMES);
+    put_fixed(sm300d2.bytes_skipped, METRIC_SM300D2_SKIPPED);
+    put_fixed(sm300d2.checksum_errors, METRIC_SM300D2_CHECKSUM_ERRORS);
+    put_fixed(sm300d2.version_errors, METRIC_SM300D2_VERSION_ERRORS);
+    put_fixed(sm300d2.read_errors, METRIC_SM300D2_READ_ERRORS);
+    put_fixed(sm300d2.timeouts, METRIC_SM300D2_TIMEOUTS);
+
+    sense_air_s8_get_stats(&s8);
+    put_fixed(s8.reads, METRIC_S8_READS);
+    put_fixed(s8.read_errors, METRIC_S8_READ_ERRORS);
+    put_fixed(s8.timeouts, METRIC_S8_TIMEOUTS);
+    put_fixed(s8.short_reads, METRIC_S8_SHORT_READS);
+    put_fixed(s8.checksum_errors, METRIC_S8_CHECKSUM_ERRORS);
+    put_fixed(s8.header_errors, METRIC_S8_HEADER_ERRORS);
+    put_fixed(s8.exceptions, METRIC_S8_EXCEPTIONS);
+
+    lywsd02_get_stats(&lywsd02);
+    put_fixed(lywsd02.connects, METRIC_LYWSD02_CONNECTS);
+    put_fixed(lywsd02.connect_errors, METRIC_LYWSD02_CONNECT_ERRORS);
+    put_fixed(lywsd02.disconnects, METRIC_LYWSD02_DISCONNECTS);
+    put_fixed(lywsd02.notifications, METRIC_LYWSD02_NOTIFICATIONS);
+    put_fixed(lywsd02.advertisements, METRIC_LYWSD02_ADVERTISEMENTS);
+
+    scheduler_get_stats(&sched);
+    put_fixed(sched.wakeups, METRIC_SCHEDULER_WAKEUPS);
+    put_fixed(sched.stack_free_min, METRIC_SCHEDULER_STACK_FREE);
+    for (size_t i = 0; scheduler_get_job_stats(i, &job); i++) {
+        if (job_labels[i] == NULL) {
+            metric_label_t label = { "job", job.name };
+            job_labels[i] = metrics_labels(&label, 1);
+        }
+        metric.labels = job_labels[i];
+        put_fixed(job.runs, METRIC_JOB_RUNS);
+        put_fixed(job.overruns, METRIC_JOB_OVERRUNS);
+        // Jitter of sampling, how late jobs start after their deadlines. In
+        // microseconds, seconds with the precision of 6.
+        put_fixed(job.late_max_us, METRIC_JOB_LATE_MAX);
+        put_fixed(job.runs > 0 ? job.late_sum_us / job.runs : 0, METRIC_JOB_LATE_MEAN);
+        put_fixed(job.run_max_us, METRIC_JOB_RUN_MAX);
     }
 }
 
@@ -82,14 +187,42 @@ void init_nvs() {
     ESP_ERROR_CHECK(ret);
 }
 
+void init_observed() {
+    metric_t co2 = {
+        .name = "espair_senseairs8_co2_observed_ppm",
+        .help = "Distribution of CO2 readings since boot",
+        .type = "histogram",
+        .unit = "ppm",
+        .precision = 0,
+    };
+    metric_t temp = {
+        .name = "espair_lywsd02_temp_observed_celsius",
+        .help = "Quantiles of temperature readings since boot",
+        .type = "summary",
+        .unit = "celsius",
+        .precision = 2,
+    };
+    co2_observed = metrics_histogram(&co2, CO2_BOUNDS, sizeof(CO2_BOUNDS) / sizeof(CO2_BOUNDS[0]));
+    temp_observed = metrics_histogram(&temp, TEMP_BOUNDS, sizeof(TEMP_BOUNDS) / sizeof(TEMP_BOUNDS[0]));
+
+    // Tell clocks apart only if more than one is watched
+    for (size_t i = 0; i < lywsd02_devices() && lywsd02_devices() > 1; i++) {
+        metric_label_t label = { "sensor", lywsd02_device_name(i) };
+        lywsd02_labels[i] = metrics_labels(&label, 1);
+    }
+}
+
 void app_main() {
     init_nvs();
-    sm300d2_init();
-    sense_air_s8_init();
-    lywsd02_init();
-    metrics_init();
-
-    xTaskCreate(task_sm300d2, "task_sm300d2", TASK_STACK_SIZE, NULL, 10, NULL);
-    xTaskCreate(task_sense_air_s8, "task_sense_air_s8", TASK_STACK_SIZE, NULL, 10, NULL);
-    xTaskCreate(task_lywsd02, "task_lywsd02", TASK_STACK_SIZE, NULL, 10, NULL);
+    scheduler_init();
+    scheduler_job_t *sm300d2 = scheduler_add("sm300d2", 0, job_sm300d2, NULL);
+    scheduler_job_t *lywsd02 = scheduler_add("lywsd02", 0, job_lywsd02, NULL);
+    scheduler_job_t *sense_air_s8 = scheduler_add("sense_air_s8", 0, job_sense_air_s8, NULL);
+    sm300d2_init(sm300d2);
+    sense_air_s8_init(sense_air_s8);
+    lywsd02_init(lywsd02);
+    metrics_init(METRICS_SCHEMA, METRICS_SCHEMA_LEN);
+    init_observed();
+
+    scheduler_add("internal", STATS_INTERVAL_MILLIS, job_internal, NULL);
 }
@@ -0,0 +1,15 @@
+#include "metrics_schema.h"
+
+#define METRIC(ID, N, T, U, P, H) [METRIC_##ID] = METRICS_SCHEMA_ENTRY(N, T, U, P, H),
+#define METRIC_PLAIN(ID, N, T, P, H) [METRIC_##ID] = METRICS_SCHEMA_ENTRY_PLAIN(N, T, P, H),
+#define DIST(ID, N, U, P, W) \
+    [METRIC_##ID##_MEAN] = METRICS_SCHEMA_ENTRY(N "_" U, gauge, U, P, "Mean " W " within the aggregation period"), \
+    [METRIC_##ID##_MIN] = METRICS_SCHEMA_ENTRY(N "_min_" U, gauge, U, P, "Minimum " W " within the aggregation period"), \
+    [METRIC_##ID##_MAX] = METRICS_SCHEMA_ENTRY(N "_max_" U, gauge, U, P, "Maximum " W " within the aggregation period"), \
+    [METRIC_##ID##_STDDEV] = METRICS_SCHEMA_ENTRY(N "_stddev_" U, gauge, U, P, "Standard deviation of " W " within the aggregation period"), \
+    [METRIC_##ID##_P50] = METRICS_SCHEMA_ENTRY(N "_p50_" U, gauge, U, P, "Median " W " within the aggregation period"), \
+    [METRIC_##ID##_P95] = METRICS_SCHEMA_ENTRY(N "_p95_" U, gauge, U, P, "95th percentile of " W " within the aggregation period"),
+
+const metric_schema_t METRICS_SCHEMA[METRICS_SCHEMA_LEN] = {
+#include "metrics_schema.inc"
+};
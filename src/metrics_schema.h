@@ -0,0 +1,24 @@
+#ifndef _METRICS_SCHEMA_H_
+#define _METRICS_SCHEMA_H_
+
+#include "metrics.h"
+
+#define METRIC(ID, N, T, U, P, H) METRIC_##ID,
+#define METRIC_PLAIN(ID, N, T, P, H) METRIC_##ID,
+#define DIST(ID, N, U, P, W) \
+    METRIC_##ID##_MEAN, METRIC_##ID##_MIN, METRIC_##ID##_MAX, \
+    METRIC_##ID##_STDDEV, METRIC_##ID##_P50, METRIC_##ID##_P95,
+enum {
+#include "metrics_schema.inc"
+    METRICS_SCHEMA_LEN,
+};
+#undef METRIC
+#undef METRIC_PLAIN
+#undef DIST
+
+// Offsets within the six metrics of a DIST()
+enum { DIST_MEAN, DIST_MIN, DIST_MAX, DIST_STDDEV, DIST_P50, DIST_P95 };
+
+extern const metric_schema_t METRICS_SCHEMA[METRICS_SCHEMA_LEN];
+
+#endif /* _METRICS_SCHEMA_H_ */
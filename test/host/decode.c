@@ -0,0 +1,170 @@
+#include "string.h"
+
+#include "decode.h"
+
+long snappy_decode(const uint8_t *src, size_t len, uint8_t *dst, size_t size) {
+    size_t pos = 0;
+    uint64_t expected = 0;
+    for (int shift = 0;; shift += 7) {
+        if (pos >= len || shift > 28) return -1;
+        uint8_t b = src[pos++];
+        expected |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) break;
+    }
+    if (expected > size) return -1;
+
+    size_t out = 0;
+    while (pos < len) {
+        uint8_t tag = src[pos++];
+        size_t n, offset;
+        switch (tag & 3) {
+        case 0:  // Literal, length - 1 in the tag or in 1 to 4 bytes after it
+            n = tag >> 2;
+            if (n >= 60) {
+                size_t bytes = n - 59;
+                if (pos + bytes > len) return -1;
+                n = 0;
+                for (size_t i = 0; i < bytes; i++) n |= (size_t) src[pos++] << (8 * i);
+            }
+            n++;
+            if (pos + n > len || out + n > expected) return -1;
+            memcpy(&dst[out], &src[pos], n);
+            pos += n;
+            out += n;
+            continue;
+        case 1:  // Copy of 4 to 11 bytes, 11-bit offset
+            if (pos + 1 > len) return -1;
+            n = 4 + ((tag >> 2) & 7);
+            offset = (size_t) (tag >> 5) << 8 | src[pos++];
+            break;
+        case 2:  // Copy of 1 to 64 bytes, 16-bit offset
+            if (pos + 2 > len) return -1;
+            n = (tag >> 2) + 1;
+            offset = src[pos] | src[pos + 1] << 8;
+            pos += 2;
+            break;
+        default:  // Copy of 1 to 64 bytes, 32-bit offset
+            if (pos + 4 > len) return -1;
+            n = (tag >> 2) + 1;
+            offset = src[pos] | src[pos + 1] << 8 | src[pos + 2] << 16 | (size_t) src[pos + 3] << 24;
+            pos += 4;
+            break;
+        }
+        if (offset == 0 || offset > out || out + n > expected) return -1;
+        // May overlap its own output, copied byte by byte
+        for (size_t i = 0; i < n; i++, out++) dst[out] = dst[out - offset];
+    }
+    return out == expected ? (long) out : -1;
+}
+
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+} reader_t;
+
+static bool read_varint(reader_t *r, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (r->p >= r->end) return false;
+        uint8_t b = *r->p++;
+        *value |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+// Read a length-delimited field after its key into `sub`
+static bool read_bytes(reader_t *r, reader_t *sub) {
+    uint64_t len;
+    if (!read_varint(r, &len) || len > (uint64_t) (r->end - r->p)) return false;
+    sub->p = r->p;
+    sub->end = r->p + len;
+    r->p += len;
+    return true;
+}
+
+static bool read_string(reader_t *r, char *str) {
+    reader_t sub;
+    if (!read_bytes(r, &sub) || sub.end - sub.p >= DECODE_MAX_STRING) return false;
+    memcpy(str, sub.p, sub.end - sub.p);
+    str[sub.end - sub.p] = '\0';
+    return true;
+}
+
+// message Label { string name = 1; string value = 2; }
+static bool read_label(reader_t r, decoded_series_t *series) {
+    if (series->labels >= DECODE_MAX_LABELS) return false;
+    char *name = series->name[series->labels];
+    char *value = series->value[series->labels];
+    name[0] = value[0] = '\0';
+    while (r.p < r.end) {
+        uint64_t key;
+        if (!read_varint(&r, &key)) return false;
+        if (key == (1 << 3 | 2)) {
+            if (!read_string(&r, name)) return false;
+        } else if (key == (2 << 3 | 2)) {
+            if (!read_string(&r, value)) return false;
+        } else {
+            return false;
+        }
+    }
+    series->labels++;
+    return true;
+}
+
+// message Sample { double value = 1; int64 timestamp = 2; }
+static bool read_sample(reader_t r, decoded_series_t *series) {
+    while (r.p < r.end) {
+        uint64_t key;
+        if (!read_varint(&r, &key)) return false;
+        if (key == (1 << 3 | 1)) {
+            if (r.end - r.p < 8) return false;
+            uint64_t bits = 0;
+            for (int i = 0; i < 8; i++) bits |= (uint64_t) *r.p++ << (8 * i);
+            memcpy(&series->sample_value, &bits, sizeof(bits));
+        } else if (key == (2 << 3 | 0)) {
+            uint64_t ts;
+            if (!read_varint(&r, &ts)) return false;
+            series->sample_timestamp = (int64_t) ts;
+        } else {
+            return false;
+        }
+    }
+    series->samples++;
+    return true;
+}
+
+// message TimeSeries { repeated Label labels = 1; repeated Sample samples = 2; }
+static bool read_series(reader_t r, decoded_series_t *series) {
+    memset(series, 0, sizeof(*series));
+    while (r.p < r.end) {
+        uint64_t key;
+        reader_t sub;
+        if (!read_varint(&r, &key) || (key & 7) != 2 || !read_bytes(&r, &sub)) return false;
+        if (key >> 3 == 1) {
+            if (!read_label(sub, series)) return false;
+        } else if (key >> 3 == 2) {
+            if (!read_sample(sub, series)) return false;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// message WriteRequest { repeated TimeSeries timeseries = 1; }
+long write_request_decode(const uint8_t *buf, size_t len,
+                          void (*cb)(const decoded_series_t *series, void *arg), void *arg) {
+    reader_t r = { buf, buf + len };
+    decoded_series_t series;
+    long count = 0;
+    while (r.p < r.end) {
+        uint64_t key;
+        reader_t sub;
+        if (!read_varint(&r, &key) || key != (1 << 3 | 2) || !read_bytes(&r, &sub)) return -1;
+        if (!read_series(sub, &series)) return -1;
+        if (cb != NULL) cb(&series, arg);
+        count++;
+    }
+    return count;
+}
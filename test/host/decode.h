@@ -0,0 +1,33 @@
+#ifndef _TEST_DECODE_H_
+#define _TEST_DECODE_H_
+
+// Reference decoders of what the exporter sends, written from the format
+// specifications rather than from the encoders they check
+
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+
+// Decode a snappy block (format_description.txt of google/snappy) into
+// `dst` of `size` bytes. Return the length, or -1 if the block is invalid.
+long snappy_decode(const uint8_t *src, size_t len, uint8_t *dst, size_t size);
+
+#define DECODE_MAX_LABELS (16)
+#define DECODE_MAX_STRING (128)
+
+typedef struct {
+    char name[DECODE_MAX_LABELS][DECODE_MAX_STRING];
+    char value[DECODE_MAX_LABELS][DECODE_MAX_STRING];
+    size_t labels;
+    size_t samples;
+    double sample_value;       // Of the last sample
+    int64_t sample_timestamp;
+} decoded_series_t;
+
+// Decode a Prometheus remote_write `WriteRequest`, calling `cb` for every
+// `TimeSeries`. Return the number of series, or -1 if the message is
+// invalid, including unknown fields.
+long write_request_decode(const uint8_t *buf, size_t len,
+                          void (*cb)(const decoded_series_t *series, void *arg), void *arg);
+
+#endif /* _TEST_DECODE_H_ */
@@ -0,0 +1,5 @@
+// Host stand-in of the ESP-IDF header, types only
+#pragma once
+#include "esp_err.h"
+
+typedef int uart_port_t;
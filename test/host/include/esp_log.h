@@ -0,0 +1,9 @@
+// Host stand-in of the ESP-IDF header, logging compiled out
+#pragma once
+#include "esp_err.h"
+
+#define ESP_LOGE(tag, ...) ((void) (tag))
+#define ESP_LOGW(tag, ...) ((void) (tag))
+#define ESP_LOGI(tag, ...) ((void) (tag))
+#define ESP_LOGD(tag, ...) ((void) (tag))
+#define ESP_LOGV(tag, ...) ((void) (tag))
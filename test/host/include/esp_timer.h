@@ -0,0 +1,7 @@
+// Host stand-in of the ESP-IDF header, the clock is left to the test
+#pragma once
+#include "stdint.h"
+
+typedef struct esp_timer *esp_timer_handle_t;
+
+int64_t esp_timer_get_time(void);
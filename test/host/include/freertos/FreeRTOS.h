@@ -0,0 +1,13 @@
+// Host stand-in of the FreeRTOS header, types only
+#pragma once
+#include "stdint.h"
+#include "esp_err.h"
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+
+#define portMAX_DELAY     ((TickType_t) 0xffffffff)
+#define portTICK_PERIOD_MS (1)
+#define pdMS_TO_TICKS(ms) ((TickType_t) (ms))
+#define pdTRUE            (1)
+#define pdFALSE           (0)
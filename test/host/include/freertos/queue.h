@@ -0,0 +1,5 @@
+// Host stand-in of the FreeRTOS header, types only
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+typedef struct QueueDefinition *QueueHandle_t;
@@ -0,0 +1,8 @@
+// Host stand-in of the FreeRTOS header, types only
+#pragma once
+#include "freertos/queue.h"
+
+typedef QueueHandle_t SemaphoreHandle_t;
+typedef struct {
+    void *data[20];
+} StaticSemaphore_t;
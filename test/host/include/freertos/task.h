@@ -0,0 +1,9 @@
+// Host stand-in of the FreeRTOS header, types only
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+typedef struct tskTaskControlBlock *TaskHandle_t;
+typedef uint8_t StackType_t;
+typedef struct {
+    void *data[90];
+} StaticTask_t;
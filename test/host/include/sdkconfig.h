@@ -0,0 +1,18 @@
+// Configuration of the host test build, in place of the one generated by
+// menuconfig. Only the options the tested sources read are set.
+#pragma once
+
+#define CONFIG_METRICS_HOSTNAME "espair"
+#define CONFIG_METRICS_MAX_ITEMS 160
+#define CONFIG_METRICS_MAX_FAMILIES 128
+#define CONFIG_METRICS_MAX_HISTOGRAMS 8
+#define CONFIG_METRICS_MAX_BUCKETS 128
+#define CONFIG_METRICS_NAMES_SIZE 4096
+#define CONFIG_METRICS_RENDER_BLOCK_SIZE 512
+#define CONFIG_METRICS_HISTORY 1
+#define CONFIG_METRICS_HISTORY_SIZE 32768
+#define CONFIG_METRICS_HISTORY_PAGE_SIZE 256
+#define CONFIG_METRICS_PUSH 1
+#define CONFIG_METRICS_PUSH_BATCH_SIZE 64
+#define CONFIG_METRICS_PUSH_BUFFER_SIZE 8192
+#define CONFIG_METRICS_PUSH_MAX_LABELS 8
@@ -0,0 +1,241 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "zlib.h"
+
+#include "sdkconfig.h"
+#include "metrics_deflate.h"
+#include "unit.h"
+
+#define PAGE_MAX (64 * 1024)
+
+static metrics_deflate_state_t state;
+
+// A /metrics page like the exporter's, families of a few series each
+static size_t make_page(char *page, size_t size) {
+    static const char *FAMILIES[] = {
+        "senseairs8_co2_ppm", "sm300d2_co2_ppm", "sm300d2_ch2o_ug_per_m3", "sm300d2_tvoc_ug_per_m3",
+        "sm300d2_pm2_5_ug_per_m3", "sm300d2_pm10_ug_per_m3", "sm300d2_temp_celsius", "sm300d2_humi_percent",
+        "lywsd02_temp_celsius", "lywsd02_humi_percent", "lywsd02_battery_percent", "derived_dew_point_celsius",
+        "internal_scrapes", "internal_wifi_rssi_dbm", "internal_heap_free_bytes", "internal_uptime_seconds",
+    };
+    size_t len = 0;
+    srand(5);
+    for (size_t f = 0; f < sizeof(FAMILIES) / sizeof(FAMILIES[0]); f++) {
+        len += snprintf(&page[len], size - len, "# HELP espair_%s Reading of %s\n# TYPE espair_%s gauge\n",
+                        FAMILIES[f], FAMILIES[f], FAMILIES[f]);
+        for (int device = 0; device < 4; device++) {
+            for (int q = 0; q < 3; q++) {
+                len += snprintf(&page[len], size - len,
+                                "espair_%s{host=\"espair\",mac=\"24:0a:c4:00:11:22\",device=\"%d\","
+                                "quantile=\"%s\"} %d.%02d\n", FAMILIES[f], device,
+                                (const char*[]) { "0.5", "0.95", "0.99" }[q], rand() % 1000, rand() % 100);
+            }
+        }
+    }
+    len += snprintf(&page[len], size - len, "# EOF\n");
+    return len;
+}
+
+// Split `src` into segments of `size` bytes, or random sizes up to 600
+// bytes including empty ones if 0
+static size_t split(const uint8_t *src, size_t len, size_t size, metrics_deflate_segment_t *segments) {
+    size_t count = 0;
+    for (size_t pos = 0; pos < len;) {
+        size_t n = size > 0 ? size : (size_t) rand() % 600;
+        if (n > len - pos) n = len - pos;
+        segments[count++] = (metrics_deflate_segment_t) { &src[pos], n };
+        pos += n;
+    }
+    return count;
+}
+
+typedef struct {
+    uint8_t buf[PAGE_MAX * 2];
+    size_t len;
+    size_t pieces;
+    size_t max_piece;
+    size_t give_up_after;  // Pieces accepted before failing, 0 for never
+} sink_t;
+
+static bool collect(const uint8_t *data, size_t len, void *arg) {
+    sink_t *s = arg;
+    if (s->give_up_after > 0 && s->pieces == s->give_up_after) return false;
+    memcpy(&s->buf[s->len], data, len);
+    s->len += len;
+    s->pieces++;
+    if (len > s->max_piece) s->max_piece = len;
+    return true;
+}
+
+// Raw inflate with zlib, return the length or -1
+static long inflate_raw(const uint8_t *src, size_t len, uint8_t *dst, size_t size) {
+    z_stream z = {};
+    if (inflateInit2(&z, -15) != Z_OK) return -1;
+    z.next_in = (uint8_t*) src;
+    z.avail_in = len;
+    z.next_out = dst;
+    z.avail_out = size;
+    int ret = inflate(&z, Z_FINISH);
+    long out = ret == Z_STREAM_END && z.avail_in == 0 ? (long) z.total_out : -1;
+    inflateEnd(&z);
+    return out;
+}
+
+static sink_t sink;
+
+// Deflate the segments and inflate them back, return the compressed size
+static size_t check_round_trip(const uint8_t *src, size_t len, const metrics_deflate_segment_t *segments,
+                               size_t count) {
+    static uint8_t out[PAGE_MAX * 2];
+    memset(&sink, 0, sizeof(sink));
+    size_t n = metrics_deflate(&state, segments, count, collect, &sink);
+    CHECK_EQ_INT(n, sink.len);
+    CHECK(sink.max_piece <= METRICS_DEFLATE_OUT_SIZE);
+    CHECK(n <= len + len / 8 + 16);
+    long inflated = inflate_raw(sink.buf, sink.len, out, sizeof(out));
+    CHECK_EQ_INT(inflated, len);
+    if (inflated >= 0) CHECK_EQ_MEM(out, (size_t) inflated, src, len);
+    return n;
+}
+
+static void test_empty() {
+    check_round_trip(NULL, 0, NULL, 0);
+    metrics_deflate_segment_t empty[] = { { (const uint8_t*) "", 0 }, { (const uint8_t*) "", 0 } };
+    check_round_trip(NULL, 0, empty, 2);
+}
+
+static void test_page_one_segment() {
+    static char page[PAGE_MAX];
+    size_t len = make_page(page, sizeof(page));
+    metrics_deflate_segment_t segment = { (const uint8_t*) page, len };
+    size_t n = check_round_trip((const uint8_t*) page, len, &segment, 1);
+    CHECK(n < len / 4);
+}
+
+static void test_page_segmented() {
+    static char page[PAGE_MAX];
+    static metrics_deflate_segment_t segments[PAGE_MAX];
+    size_t len = make_page(page, sizeof(page));
+    metrics_deflate_segment_t whole = { (const uint8_t*) page, len };
+    size_t whole_len = check_round_trip((const uint8_t*) page, len, &whole, 1);
+
+    // Segments of at least 128 bytes keep the whole window, the same
+    // matches are found however the page is split
+    size_t sizes[] = { 128, 500, 512, 4096 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        size_t count = split((const uint8_t*) page, len, sizes[i], segments);
+        CHECK_EQ_INT(check_round_trip((const uint8_t*) page, len, segments, count), whole_len);
+    }
+    // Tiny segments shorten the window, still valid
+    size_t tiny[] = { 1, 3, 7 };
+    for (size_t i = 0; i < sizeof(tiny) / sizeof(tiny[0]); i++) {
+        size_t count = split((const uint8_t*) page, len, tiny[i], segments);
+        check_round_trip((const uint8_t*) page, len, segments, count);
+    }
+    srand(6);
+    for (int i = 0; i < 20; i++) {
+        size_t count = split((const uint8_t*) page, len, 0, segments);
+        check_round_trip((const uint8_t*) page, len, segments, count);
+    }
+}
+
+static void test_random_data() {
+    static uint8_t buf[20000];
+    static metrics_deflate_segment_t segments[1000];
+    srand(7);
+    for (size_t i = 0; i < sizeof(buf); i++) buf[i] = rand();
+    size_t count = split(buf, sizeof(buf), 512, segments);
+    check_round_trip(buf, sizeof(buf), segments, count);
+}
+
+static void test_long_runs() {
+    // Matches of 258 bytes at distance 1, overlapping themselves and
+    // crossing segments
+    static uint8_t buf[40000];
+    static metrics_deflate_segment_t segments[1000];
+    memset(buf, 'a', sizeof(buf));
+    size_t count = split(buf, sizeof(buf), 333, segments);
+    CHECK(check_round_trip(buf, sizeof(buf), segments, count) < 400);
+}
+
+static void test_window_end() {
+    // Random bytes repeated after a run, 32768 bytes back, the farthest
+    // distance deflate has
+    static uint8_t buf[32768 + 1000];
+    static metrics_deflate_segment_t segments[1000];
+    srand(8);
+    for (size_t i = 0; i < 1000; i++) buf[i] = rand();
+    memset(&buf[1000], 0, 32768 - 1000);
+    memcpy(&buf[32768], buf, 1000);
+    size_t count = split(buf, sizeof(buf), 512, segments);
+    CHECK(check_round_trip(buf, sizeof(buf), segments, count) < 1300);
+    // One byte farther is out of the window, sent as literals
+    static uint8_t far[32769 + 1000];
+    memcpy(far, buf, 1000);
+    memset(&far[1000], 0, 32769 - 1000);
+    memcpy(&far[32769], buf, 1000);
+    count = split(far, sizeof(far), 512, segments);
+    CHECK(check_round_trip(far, sizeof(far), segments, count) > 2000);
+}
+
+static void test_sink_gives_up() {
+    static char page[PAGE_MAX];
+    size_t len = make_page(page, sizeof(page));
+    metrics_deflate_segment_t segment = { (const uint8_t*) page, len };
+    sink_t *s = malloc(sizeof(sink_t));
+    memset(s, 0, sizeof(*s));
+    s->give_up_after = 2;
+    CHECK_EQ_INT(metrics_deflate(&state, &segment, 1, collect, s), 0);
+    CHECK_EQ_INT(s->pieces, 2);
+    free(s);
+}
+
+static void test_adler32() {
+    static char page[PAGE_MAX];
+    size_t len = make_page(page, sizeof(page));
+    CHECK_EQ_INT(metrics_adler32(1, (const uint8_t*) page, len), adler32(1, (const uint8_t*) page, len));
+    // Continued over segments
+    uint32_t a = metrics_adler32(1, (const uint8_t*) page, 1000);
+    a = metrics_adler32(a, (const uint8_t*) &page[1000], len - 1000);
+    CHECK_EQ_INT(a, adler32(1, (const uint8_t*) page, len));
+    CHECK_EQ_INT(metrics_adler32(1, NULL, 0), 1);
+}
+
+static bool discard(const uint8_t *data, size_t len, void *arg) {
+    unit_sink += len;
+    return true;
+}
+
+static void bench() {
+    static char page[PAGE_MAX];
+    static metrics_deflate_segment_t segments[PAGE_MAX];
+    static uint8_t copy[PAGE_MAX], zout[PAGE_MAX * 2];
+    size_t len = make_page(page, sizeof(page));
+    size_t count = split((const uint8_t*) page, len, CONFIG_METRICS_RENDER_BLOCK_SIZE, segments);
+    size_t n = metrics_deflate(&state, segments, count, discard, NULL);
+    uLongf zlen1 = sizeof(zout), zlen6 = sizeof(zout);
+    compress2(zout, &zlen1, (const uint8_t*) page, len, 1);
+    compress2(zout, &zlen6, (const uint8_t*) page, len, 6);
+    printf("Page of %zu bytes in %zu blocks: deflate %zu bytes (%.1f%%), zlib -1 %lu, zlib -6 %lu\n",
+           len, count, n, 100.0 * n / len, zlen1, zlen6);
+    BENCH("metrics_deflate (page, render blocks)", 2000, len,
+          unit_sink += metrics_deflate(&state, segments, count, discard, NULL));
+    BENCH("metrics_adler32 (page)", 20000, len, unit_sink += metrics_adler32(1, (const uint8_t*) page, len));
+    // What the uncompressed path costs per page, copying it out once
+    BENCH("memcpy (page, uncompressed)", 200000, len,
+          memcpy(copy, page, len); unit_sink += copy[len / 2]);
+}
+
+int main(int argc, char **argv) {
+    test_empty();
+    test_page_one_segment();
+    test_page_segmented();
+    test_random_data();
+    test_long_runs();
+    test_window_end();
+    test_sink_gives_up();
+    test_adler32();
+    if (unit_bench_requested(argc, argv)) bench();
+    return unit_report(argv[0]);
+}
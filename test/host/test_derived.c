@@ -0,0 +1,112 @@
+#include "math.h"
+#include "stdlib.h"
+
+#include "derived.h"
+#include "metrics_schema.h"
+#include "unit.h"
+
+#define VALID_MILLIS (30 * 1000)
+
+static int64_t now_us;
+static metric_t put_metric[16];
+static uint32_t put_expire[16];
+static size_t put_len;
+
+int64_t esp_timer_get_time(void) {
+    return now_us;
+}
+
+void metrics_put(metric_t *metric, uint32_t expire_in_mllis) {
+    if (put_len < 16) {
+        put_expire[put_len] = expire_in_mllis;
+        put_metric[put_len++] = *metric;
+    }
+}
+
+// Interned like metrics_labels() does, equal labels at the same address
+static const char *ADDR_1 = "addr=\"1\"";
+static const char *ADDR_2 = "addr=\"2\"";
+
+static void put_s8(const char *labels, int16_t co2) {
+    metric_t m = { .id = METRIC_S8_CO2, .fixed = true, .scaled = co2, .labels = labels };
+    derived_update(&m, 1, VALID_MILLIS);
+}
+
+static void put_sm300d2(float eco2, float temp, float humi) {
+    metric_t batch[3] = {
+        { .id = METRIC_SM300D2_CO2_MEAN, .value = eco2 },
+        { .id = METRIC_SM300D2_TEMP_MEAN, .value = temp },
+        { .id = METRIC_SM300D2_HUMI_MEAN, .value = humi },
+    };
+    derived_update(batch, 3, VALID_MILLIS);
+}
+
+// The derived CO2 put under `labels` since the last reset, NAN if none
+static float fused(const char *labels) {
+    for (size_t i = 0; i < put_len; i++)
+        if (put_metric[i].id == METRIC_DERIVED_CO2 && put_metric[i].labels == labels) return put_metric[i].value;
+    return NAN;
+}
+
+static size_t fused_count() {
+    size_t n = 0;
+    for (size_t i = 0; i < put_len; i++) n += put_metric[i].id == METRIC_DERIVED_CO2;
+    return n;
+}
+
+static void test_labelled_s8() {
+    // S8 readings of two addressed sensors come first, nothing to fuse yet
+    now_us = 1000000;
+    put_len = 0;
+    put_s8(ADDR_1, 600);
+    put_s8(ADDR_2, 1000);
+    CHECK_EQ_INT(fused_count(), 0);
+
+    // eCO2 fuses with each of them, under its labels, not unlabelled
+    put_len = 0;
+    put_sm300d2(800, 21, 50);
+    CHECK_EQ_INT(fused_count(), 2);
+    CHECK(fabsf(fused(ADDR_1) - 600) < 30);
+    CHECK(fused(ADDR_1) > 600);
+    CHECK(fabsf(fused(ADDR_2) - 1000) < 30);
+    CHECK(fused(ADDR_2) < 1000);
+    CHECK(isnan(fused(NULL)));
+    // Dew point has no labelled input, it stays unlabelled
+    bool dew_point = false;
+    for (size_t i = 0; i < put_len; i++)
+        if (put_metric[i].id == METRIC_DERIVED_DEW_POINT) dew_point = put_metric[i].labels == NULL;
+    CHECK(dew_point);
+
+    // A new reading of one sensor puts only its own series again
+    now_us += 4000000;
+    put_len = 0;
+    put_s8(ADDR_1, 700);
+    CHECK_EQ_INT(fused_count(), 1);
+    CHECK(fused(ADDR_1) > 700 && fused(ADDR_1) < 730);
+    // Expiring with the eCO2 put 4 seconds before
+    CHECK_EQ_INT(put_expire[0], VALID_MILLIS - 4000);
+
+    // Once eCO2 expired, nothing is fused until it comes again
+    now_us += VALID_MILLIS * 1000LL;
+    put_len = 0;
+    put_s8(ADDR_2, 900);
+    CHECK_EQ_INT(fused_count(), 0);
+    put_sm300d2(900, 21, 50);
+    CHECK_EQ_INT(fused_count(), 1);
+    CHECK(fabsf(fused(ADDR_2) - 900) < 0.01f);
+}
+
+static void test_unlabelled_s8() {
+    // A single sensor reached by broadcast, unlabelled
+    now_us += 100 * 1000000LL;
+    put_len = 0;
+    put_s8(NULL, 500);
+    put_sm300d2(500, 21, 50);
+    CHECK(fabsf(fused(NULL) - 500) < 0.01f);
+}
+
+int main(int argc, char **argv) {
+    test_labelled_s8();
+    test_unlabelled_s8();
+    return unit_report(argv[0]);
+}
@@ -0,0 +1,198 @@
+#include "math.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+#include "metrics_format.h"
+#include "unit.h"
+
+#define PREFIX "espair_sm300d2_co2_ppm{host=\"espair\",mac=\""
+#define MAC "24:0a:c4:00:11:22"
+
+static const char* fixed(char *buf, int32_t scaled, uint8_t precision) {
+    size_t len = metrics_format_fixed(buf, scaled, precision);
+    CHECK_EQ_INT(len, strlen(buf));
+    return buf;
+}
+
+static const char* fmt_float(char *buf, float value, uint8_t precision) {
+    size_t len = metrics_format_float(buf, value, precision);
+    buf[len] = '\0';
+    return buf;
+}
+
+static void test_fixed() {
+    char buf[METRICS_VALUE_MAX_LEN];
+    CHECK_EQ_STR(fixed(buf, 2150, 2), "21.50");
+    CHECK_EQ_STR(fixed(buf, 612, 0), "612");
+    CHECK_EQ_STR(fixed(buf, 0, 0), "0");
+    CHECK_EQ_STR(fixed(buf, 0, 2), "0.00");
+    CHECK_EQ_STR(fixed(buf, 5, 2), "0.05");
+    CHECK_EQ_STR(fixed(buf, 100, 2), "1.00");
+}
+
+static void test_fixed_negative() {
+    char buf[METRICS_VALUE_MAX_LEN];
+    CHECK_EQ_STR(fixed(buf, -2150, 2), "-21.50");
+    CHECK_EQ_STR(fixed(buf, -5, 2), "-0.05");
+    CHECK_EQ_STR(fixed(buf, -1, 0), "-1");
+    CHECK_EQ_STR(fixed(buf, INT32_MIN, 0), "-2147483648");
+    CHECK_EQ_STR(fixed(buf, INT32_MIN, 9), "-2.147483648");
+}
+
+static void test_fixed_precision_limits() {
+    char buf[METRICS_VALUE_MAX_LEN];
+    CHECK_EQ_STR(fixed(buf, INT32_MAX, 9), "2.147483647");
+    CHECK_EQ_STR(fixed(buf, 1, 9), "0.000000001");
+    CHECK_EQ_STR(fixed(buf, INT32_MAX, 0), "2147483647");
+    // Clamped to METRICS_MAX_PRECISION
+    CHECK_EQ_STR(fixed(buf, 1, 12), "0.000000001");
+}
+
+static void test_float_rounding_to_zero() {
+    char buf[METRICS_VALUE_MAX_LEN];
+    CHECK_EQ_STR(fmt_float(buf, -0.001f, 2), "-0.00");
+    CHECK_EQ_STR(fmt_float(buf, -0.4f, 0), "-0");
+    CHECK_EQ_STR(fmt_float(buf, -0.0f, 1), "-0.0");
+    CHECK_EQ_STR(fmt_float(buf, 0.004f, 2), "0.00");
+    CHECK_EQ_STR(fmt_float(buf, 0.0f, 0), "0");
+}
+
+static void test_float_negative() {
+    char buf[METRICS_VALUE_MAX_LEN];
+    CHECK_EQ_STR(fmt_float(buf, -21.5f, 2), "-21.50");
+    CHECK_EQ_STR(fmt_float(buf, -0.05f, 2), "-0.05");
+    CHECK_EQ_STR(fmt_float(buf, -40.0f, 0), "-40");
+}
+
+static void test_float_rounds_half_to_even() {
+    char buf[METRICS_VALUE_MAX_LEN];
+    CHECK_EQ_STR(fmt_float(buf, 0.5f, 0), "0");
+    CHECK_EQ_STR(fmt_float(buf, 1.5f, 0), "2");
+    CHECK_EQ_STR(fmt_float(buf, 2.5f, 0), "2");
+    CHECK_EQ_STR(fmt_float(buf, 0.125f, 2), "0.12");
+    CHECK_EQ_STR(fmt_float(buf, -0.375f, 2), "-0.38");
+}
+
+static void test_float_snprintf_fallback() {
+    char buf[METRICS_VALUE_MAX_LEN];
+    // Scaled past int32_t
+    CHECK_EQ_STR(fmt_float(buf, 3e9f, 0), "3000000000");
+    CHECK_EQ_STR(fmt_float(buf, -3e9f, 0), "-3000000000");
+    CHECK_EQ_STR(fmt_float(buf, 2147483.75f, 3), "2147483.750");
+    CHECK_EQ_STR(fmt_float(buf, 3.0f, 9), "3.000000000");
+    CHECK_EQ_STR(fmt_float(buf, 1e30f, 0), "1000000015047466219876688855040");
+    // Precision past METRICS_MAX_PRECISION
+    CHECK_EQ_STR(fmt_float(buf, 0.5f, 12), "0.500000000000");
+    // Cut to the buffer rather than overflowing it
+    CHECK_EQ_INT(metrics_format_float(buf, 3e38f, 9), METRICS_VALUE_MAX_LEN - 1);
+}
+
+static void test_float_non_finite() {
+    char buf[METRICS_VALUE_MAX_LEN];
+    CHECK_EQ_STR(fmt_float(buf, NAN, 2), "NaN");
+    CHECK_EQ_STR(fmt_float(buf, INFINITY, 2), "+Inf");
+    CHECK_EQ_STR(fmt_float(buf, -INFINITY, 0), "-Inf");
+}
+
+static void test_float_matches_snprintf() {
+    // Any value and precision formats the same as "%.*f"
+    char buf[METRICS_VALUE_MAX_LEN], expected[METRICS_VALUE_MAX_LEN + 16];
+    srand(1);
+    for (int i = 0; i < 200000; i++) {
+        float value = (rand() - RAND_MAX / 2) / powf(10, rand() % 8);
+        uint8_t precision = rand() % (METRICS_MAX_PRECISION + 1);
+        snprintf(expected, sizeof(expected), "%.*f", precision, value);
+        fmt_float(buf, value, precision);
+        if (strcmp(buf, expected) != 0) {
+            CHECK_EQ_STR(buf, expected);
+            break;
+        }
+    }
+}
+
+// Format a sample into a terminated string
+static const char* sample(char *buf, size_t size, const char *labels, const char *value, uint64_t timestamp) {
+    size_t len = metrics_format_sample(buf, size - 1, PREFIX, strlen(PREFIX), MAC, labels, value,
+                                       strlen(value), timestamp);
+    buf[len] = '\0';
+    return buf;
+}
+
+static void test_sample_line() {
+    char buf[256];
+    CHECK_EQ_STR(sample(buf, sizeof(buf), NULL, "612", 0),
+                 PREFIX MAC "\"} 612\n");
+    CHECK_EQ_STR(sample(buf, sizeof(buf), "", "612", 0),
+                 PREFIX MAC "\"} 612\n");
+    CHECK_EQ_STR(sample(buf, sizeof(buf), "addr=\"104\"", "612", 0),
+                 PREFIX MAC "\",addr=\"104\"} 612\n");
+    CHECK_EQ_STR(sample(buf, sizeof(buf), "device=\"a\",quantile=\"0.95\"", "-3.25", 0),
+                 PREFIX MAC "\",device=\"a\",quantile=\"0.95\"} -3.25\n");
+}
+
+static void test_sample_timestamp() {
+    char buf[256];
+    CHECK_EQ_STR(sample(buf, sizeof(buf), NULL, "21.50", 1700000000),
+                 PREFIX MAC "\"} 21.50 1700000000\n");
+    CHECK_EQ_STR(sample(buf, sizeof(buf), NULL, "1", 7), PREFIX MAC "\"} 1 7\n");
+    // Unsigned, past 2038
+    CHECK_EQ_STR(sample(buf, sizeof(buf), NULL, "1", 4294967295u), PREFIX MAC "\"} 1 4294967295\n");
+    // Milliseconds of the Prometheus text format
+    CHECK_EQ_STR(sample(buf, sizeof(buf), NULL, "1", 4294967295000ull), PREFIX MAC "\"} 1 4294967295000\n");
+}
+
+static void test_sample_too_long() {
+    char buf[256];
+    const char *expected = PREFIX MAC "\",addr=\"104\"} 612 1700000000\n";
+    size_t len = strlen(expected);
+    CHECK_EQ_INT(metrics_format_sample(buf, len - 1, PREFIX, strlen(PREFIX), MAC, "addr=\"104\"", "612", 3,
+                                       1700000000), 0);
+    CHECK_EQ_INT(metrics_format_sample(buf, len, PREFIX, strlen(PREFIX), MAC, "addr=\"104\"", "612", 3,
+                                       1700000000), len);
+    CHECK_EQ_MEM(buf, len, expected, len);
+    CHECK_EQ_INT(metrics_format_sample(buf, 8, PREFIX, strlen(PREFIX), MAC, NULL, "612", 3, 0), 0);
+}
+
+static void bench() {
+    char value[METRICS_VALUE_MAX_LEN];
+    BENCH("metrics_format_fixed (2150, 2)", 10000000, 0, unit_sink += metrics_format_fixed(value, 2150, 2));
+    BENCH("snprintf %.2f (21.50f)", 10000000, 0,
+          unit_sink += snprintf(value, sizeof(value), "%.*f", 2, 2150 / 100.0f));
+    BENCH("metrics_format_float (21.5f, 2)", 10000000, 0, unit_sink += metrics_format_float(value, 21.5f, 2));
+    BENCH("metrics_format_float (3e9f, 0), fallback", 1000000, 0,
+          unit_sink += metrics_format_float(value, 3e9f, 0));
+    BENCH("metrics_format_fixed (-123456789, 9)", 10000000, 0,
+          unit_sink += metrics_format_fixed(value, -123456789, 9));
+    BENCH("snprintf %.9f (-0.123456789)", 10000000, 0,
+          unit_sink += snprintf(value, sizeof(value), "%.*f", 9, -0.123456789));
+
+    char buf[256];
+    const char *labels = "device=\"a\",quantile=\"0.95\"";
+    size_t len = sample(buf, sizeof(buf), labels, "1234.56", 1700000000) - buf + strlen(buf);
+    BENCH("metrics_format_sample", 5000000, len,
+          unit_sink += metrics_format_sample(buf, sizeof(buf), PREFIX, strlen(PREFIX), MAC, labels,
+                                             "1234.56", 7, 1700000000));
+    // The printf based line of the writer before metrics_format_sample()
+    BENCH("snprintf sample line", 5000000, len,
+          unit_sink += snprintf(buf, sizeof(buf), "%s%s{host=\"%s\",mac=\"%s\"%s%s} %s %lu\n",
+                                "espair_sm300d2_co2", "_ppm", "espair", MAC, ",", labels, "1234.56",
+                                1700000000ul));
+}
+
+int main(int argc, char **argv) {
+    test_fixed();
+    test_fixed_negative();
+    test_fixed_precision_limits();
+    test_float_rounding_to_zero();
+    test_float_negative();
+    test_float_rounds_half_to_even();
+    test_float_snprintf_fallback();
+    test_float_non_finite();
+    test_float_matches_snprintf();
+    test_sample_line();
+    test_sample_timestamp();
+    test_sample_too_long();
+    if (unit_bench_requested(argc, argv)) bench();
+    return unit_report(argv[0]);
+}
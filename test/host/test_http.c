@@ -0,0 +1,73 @@
+#include "metrics_http.h"
+#include "unit.h"
+
+static void test_encoding_accepted() {
+    CHECK(metrics_http_encoding_accepted("gzip", "gzip"));
+    CHECK(metrics_http_encoding_accepted("gzip, deflate, br", "deflate"));
+    CHECK(metrics_http_encoding_accepted("GZIP", "gzip"));
+    CHECK(metrics_http_encoding_accepted("br;q=1.0, gzip;q=0.8, *;q=0.1", "gzip"));
+    CHECK(metrics_http_encoding_accepted("deflate ;q=0.5", "deflate"));
+    CHECK(!metrics_http_encoding_accepted("", "gzip"));
+    CHECK(!metrics_http_encoding_accepted("identity", "gzip"));
+    CHECK(!metrics_http_encoding_accepted("gzip;q=0", "gzip"));
+    CHECK(!metrics_http_encoding_accepted("gzip;q=0.0, deflate", "gzip"));
+    CHECK(metrics_http_encoding_accepted("gzip;q=0.0, deflate", "deflate"));
+    // Only whole codings count, and q of the next one is not taken
+    CHECK(!metrics_http_encoding_accepted("x-gzip", "gzip"));
+    CHECK(!metrics_http_encoding_accepted("gzipped", "gzip"));
+    CHECK(metrics_http_encoding_accepted("gzip, br;q=0", "gzip"));
+}
+
+static void test_etag() {
+    char etag[METRICS_HTTP_ETAG_MAX_LEN];
+    CHECK_EQ_INT(metrics_http_etag(etag, sizeof(etag), 0x1234abcd, 42, 0x18c0ffee, "-gz"), 25);
+    CHECK_EQ_STR(etag, "\"1234abcd-2a-18c0ffee-gz\"");
+    metrics_http_etag(etag, sizeof(etag), 7, 0, 0, "");
+    CHECK_EQ_STR(etag, "\"00000007-0-0\"");
+    // The longest tag fits, INT64_MAX for pages without expiring items
+    size_t n = metrics_http_etag(etag, sizeof(etag), UINT32_MAX, UINT32_MAX, INT64_MAX, "-df");
+    CHECK(n < sizeof(etag));
+    CHECK_EQ_STR(etag, "\"ffffffff-ffffffff-7fffffffffffffff-df\"");
+    // Truncated, not overrun
+    CHECK_EQ_INT(metrics_http_etag(etag, 8, 1, 2, 3, ""), 7);
+    CHECK_EQ_STR(etag, "\"000000");
+}
+
+static void test_etag_listed() {
+    const char *etag = "\"1234abcd-2a-18c0ffee\"";
+    CHECK(metrics_http_etag_listed("\"1234abcd-2a-18c0ffee\"", etag));
+    CHECK(metrics_http_etag_listed("W/\"1234abcd-2a-18c0ffee\"", etag));
+    CHECK(metrics_http_etag_listed("\"x\", \"1234abcd-2a-18c0ffee\" ", etag));
+    CHECK(metrics_http_etag_listed("*", etag));
+    CHECK(metrics_http_etag_listed(" * ", etag));
+    CHECK(!metrics_http_etag_listed("", etag));
+    CHECK(!metrics_http_etag_listed("\"x\"", etag));
+    // Compressed encodings are tagged apart and must not match the plain tag
+    CHECK(!metrics_http_etag_listed("\"1234abcd-2a-18c0ffee-gz\"", etag));
+    CHECK(!metrics_http_etag_listed("\"1234abcd-2a-18c0ffee-gz\"", "\"1234abcd-2a-18c0ffee\""));
+    CHECK(!metrics_http_etag_listed("\"1234abcd-2a-18c0ffee\"", "\"1234abcd-2a-18c0ffee-gz\""));
+    // Another generation, and a tag cut short by a truncated header
+    CHECK(!metrics_http_etag_listed("\"1234abcd-2b-18c0ffee\"", etag));
+    CHECK(!metrics_http_etag_listed("\"x\", \"1234abcd-2a-18c0f", etag));
+    CHECK(!metrics_http_etag_listed("\"*\"", etag));
+}
+
+static void bench() {
+    char etag[METRICS_HTTP_ETAG_MAX_LEN];
+    BENCH("metrics_http_encoding_accepted (Prometheus)", 1000000, 0,
+          unit_sink += metrics_http_encoding_accepted("gzip", "gzip"));
+    BENCH("metrics_http_encoding_accepted (browser)", 1000000, 0,
+          unit_sink += metrics_http_encoding_accepted("br;q=1.0, deflate;q=0.9, gzip;q=0.8, *;q=0.1", "gzip"));
+    BENCH("metrics_http_etag", 1000000, 0,
+          unit_sink += metrics_http_etag(etag, sizeof(etag), 0x1234abcd, unit_sink, 0x18c0ffee, "-gz"));
+    BENCH("metrics_http_etag_listed", 1000000, 0,
+          unit_sink += metrics_http_etag_listed("\"1234abcd-2a-18c0ffee-gz\"", "\"1234abcd-2a-18c0ffee-gz\""));
+}
+
+int main(int argc, char **argv) {
+    test_encoding_accepted();
+    test_etag();
+    test_etag_listed();
+    if (unit_bench_requested(argc, argv)) bench();
+    return unit_report(argv[0]);
+}
@@ -0,0 +1,388 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+#include "sdkconfig.h"
+#include "metrics_log.h"
+#include "unit.h"
+
+#define SECTORS (8)
+#define PARTITION_SECTORS (64)  // The "metrics" partition of partitions.csv
+#define SECTOR_HEADER_LEN (8)
+#define RECORD_HEADER_LEN (24)
+#define COUNT_OFFSET (6)         // Of the sample count in the record header
+
+// NOR flash in RAM: writes only clear bits, erases set whole sectors. A
+// write budget simulates a power loss, cutting a write off mid-way.
+typedef struct {
+    uint8_t mem[PARTITION_SECTORS * METRICS_LOG_SECTOR_SIZE];
+    uint32_t erases[PARTITION_SECTORS];
+    size_t budget;            // Bytes written before power is lost
+    bool lost;
+    size_t written;
+    size_t reads;
+    size_t read_bytes;
+    int overwrites;           // Bytes written that were not erased
+} fake_flash_t;
+
+static bool fake_read(void *ctx, size_t offset, void *buf, size_t len) {
+    fake_flash_t *f = ctx;
+    if (f->lost) return false;
+    memcpy(buf, &f->mem[offset], len);
+    f->reads++;
+    f->read_bytes += len;
+    return true;
+}
+
+static bool fake_write(void *ctx, size_t offset, const void *buf, size_t len) {
+    fake_flash_t *f = ctx;
+    const uint8_t *src = buf;
+    for (size_t i = 0; i < len; i++) {
+        if (f->budget == 0) f->lost = true;
+        if (f->lost) return false;
+        if (f->mem[offset + i] != 0xff) f->overwrites++;
+        f->mem[offset + i] &= src[i];
+        f->budget--;
+        f->written++;
+    }
+    return true;
+}
+
+static bool fake_erase(void *ctx, size_t offset, size_t len) {
+    fake_flash_t *f = ctx;
+    if (f->lost) return false;
+    CHECK_EQ_INT(offset % METRICS_LOG_SECTOR_SIZE, 0);
+    CHECK_EQ_INT(len, METRICS_LOG_SECTOR_SIZE);
+    memset(&f->mem[offset], 0xff, len);
+    f->erases[offset / METRICS_LOG_SECTOR_SIZE]++;
+    return true;
+}
+
+static fake_flash_t fake;
+static metrics_log_flash_t flash;
+
+static void fake_init(size_t sectors) {
+    memset(&fake, 0, sizeof(fake));
+    memset(fake.mem, 0xff, sizeof(fake.mem));
+    fake.budget = SIZE_MAX;
+    flash = (metrics_log_flash_t) {
+        .read = fake_read,
+        .write = fake_write,
+        .erase = fake_erase,
+        .ctx = &fake,
+        .size = sectors * METRICS_LOG_SECTOR_SIZE,
+    };
+}
+
+// Power comes back, whatever was cut off stays as it is
+static void fake_reboot() {
+    fake.lost = false;
+    fake.budget = SIZE_MAX;
+}
+
+// Page `n` of a series, `samples` samples a minute apart from n * 10^5 on
+static void make_page(metric_history_page_t *page, uint32_t n, int samples) {
+    metrics_history_page_reset(page, 0, NULL, 0, 2);
+    for (int i = 0; i < samples; i++)
+        metrics_history_page_append(page, 1700000000 + n * 100000 + i * 60, 20 + (n + i * 7) % 50 / 10.0f);
+}
+
+static uint32_t page_number(const metric_history_page_t *page) {
+    return (page->start - 1700000000) / 100000;
+}
+
+// Samples of `entry` are those of make_page(n)
+static void check_entry(const metric_log_entry_t *entry, uint32_t n, int samples) {
+    static metric_history_page_t expected;
+    make_page(&expected, n, samples);
+    CHECK_EQ_STR(entry->name, "espair_sm300d2_temp_celsius");
+    CHECK_EQ_INT(entry->page.count, samples);
+    CHECK_EQ_INT(entry->page.start, expected.start);
+    CHECK_EQ_INT(entry->page.last, expected.last);
+    metric_history_iter_t a, b;
+    uint32_t ta, tb;
+    float va, vb;
+    metrics_history_iter_init(&a, &entry->page);
+    metrics_history_iter_init(&b, &expected);
+    while (metrics_history_iter_next(&b, &tb, &vb)) {
+        CHECK(metrics_history_iter_next(&a, &ta, &va));
+        CHECK_EQ_INT(ta, tb);
+        CHECK(va == vb);
+    }
+    CHECK(!metrics_history_iter_next(&a, &ta, &va));
+}
+
+static bool append(metrics_log_t *log, uint32_t n, int samples) {
+    static metric_history_page_t page;
+    char labels[32];
+    snprintf(labels, sizeof(labels), "device=\"%u\"", n % 4);
+    make_page(&page, n, samples);
+    return metrics_log_append(log, "espair_sm300d2_temp_celsius", labels, &page);
+}
+
+// Page numbers of all records since `since`, oldest first
+static size_t replay(const metrics_log_t *log, uint32_t since, uint32_t *numbers, size_t size) {
+    static metric_log_entry_t entry;
+    metrics_log_iter_t it;
+    size_t count = 0;
+    metrics_log_iter_init(log, &it);
+    while (metrics_log_iter_next(log, &it, since, &entry)) {
+        if (count < size) numbers[count] = page_number(&entry.page);
+        count++;
+    }
+    return count;
+}
+
+static void test_open_blank() {
+    metrics_log_t log;
+    uint32_t numbers[1];
+    fake_init(SECTORS);
+    CHECK(metrics_log_open(&log, &flash));
+    CHECK_EQ_INT(log.sectors, SECTORS);
+    CHECK_EQ_INT(log.head, 0);
+    CHECK_EQ_INT(log.head_seq, 1);
+    CHECK_EQ_INT(log.erases, 1);
+    CHECK_EQ_INT(replay(&log, 0, numbers, 1), 0);
+    // Formatted once, not again on the next boot
+    CHECK(metrics_log_open(&log, &flash));
+    CHECK_EQ_INT(log.erases, 0);
+    fake_init(1);
+    CHECK(!metrics_log_open(&log, &flash));
+}
+
+static void test_round_trip() {
+    static metric_log_entry_t entry;
+    metrics_log_t log;
+    metrics_log_iter_t it;
+    fake_init(SECTORS);
+    CHECK(metrics_log_open(&log, &flash));
+    CHECK(append(&log, 1, 10));
+    CHECK(append(&log, 2, 1));
+    CHECK(append(&log, 3, 30));
+    metrics_log_iter_init(&log, &it);
+    CHECK(metrics_log_iter_next(&log, &it, 0, &entry));
+    check_entry(&entry, 1, 10);
+    CHECK_EQ_STR(entry.labels, "device=\"1\"");
+    CHECK(metrics_log_iter_next(&log, &it, 0, &entry));
+    check_entry(&entry, 2, 1);
+    CHECK(metrics_log_iter_next(&log, &it, 0, &entry));
+    check_entry(&entry, 3, 30);
+    CHECK(!metrics_log_iter_next(&log, &it, 0, &entry));
+    // Records ending before `since` are skipped
+    uint32_t numbers[4];
+    CHECK_EQ_INT(replay(&log, 1700000000 + 2 * 100000, numbers, 4), 2);
+    CHECK_EQ_INT(numbers[0], 2);
+    CHECK_EQ_INT(fake.overwrites, 0);
+}
+
+static void test_too_long_key() {
+    static metric_history_page_t page;
+    char name[METRICS_LOG_NAME_MAX_LEN + 1];
+    metrics_log_t log;
+    fake_init(SECTORS);
+    CHECK(metrics_log_open(&log, &flash));
+    memset(name, 'a', sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    make_page(&page, 1, 5);
+    CHECK(!metrics_log_append(&log, name, NULL, &page));
+    CHECK_EQ_INT(log.records, 0);
+}
+
+static void test_wrap_around() {
+    static uint32_t numbers[4000];
+    metrics_log_t log;
+    fake_init(SECTORS);
+    CHECK(metrics_log_open(&log, &flash));
+    // About 25 records a sector, three times around the log
+    uint32_t n = 0;
+    for (; log.erases < 3 * SECTORS; n++) CHECK(append(&log, n, 20));
+    size_t count = replay(&log, 0, numbers, 4000);
+    // The oldest sector is the one erased last, all others are whole
+    CHECK(count >= (SECTORS - 1) * 20);
+    CHECK(count < n);
+    for (size_t i = 0; i < count; i++) CHECK_EQ_INT(numbers[i], n - count + i);
+    // Wear is even
+    for (int s = 0; s < SECTORS; s++) CHECK(fake.erases[s] >= 3 && fake.erases[s] <= 4);
+    CHECK_EQ_INT(fake.overwrites, 0);
+}
+
+static void test_reopen() {
+    static uint32_t numbers[400];
+    metrics_log_t log, again;
+    fake_init(SECTORS);
+    CHECK(metrics_log_open(&log, &flash));
+    for (uint32_t n = 0; n < 150; n++) CHECK(append(&log, n, 20));
+    CHECK(metrics_log_open(&again, &flash));
+    CHECK_EQ_INT(again.head, log.head);
+    CHECK_EQ_INT(again.head_seq, log.head_seq);
+    CHECK_EQ_INT(again.offset, log.offset);
+    CHECK_EQ_MEM(again.last, sizeof(again.last[0]) * SECTORS, log.last, sizeof(log.last[0]) * SECTORS);
+    // Writing carries on where it stopped, on no byte written before
+    CHECK(append(&again, 150, 20));
+    CHECK_EQ_INT(replay(&again, 0, numbers, 400), 151);
+    CHECK_EQ_INT(numbers[150], 150);
+    CHECK_EQ_INT(fake.overwrites, 0);
+}
+
+static void test_sequence_wrap() {
+    metrics_log_t log, again;
+    fake_init(SECTORS);
+    CHECK(metrics_log_open(&log, &flash));
+    log.head_seq = UINT32_MAX - 1;
+    for (uint32_t n = 0; log.head_seq != 2; n++) CHECK(append(&log, n, 20));
+    CHECK(metrics_log_open(&again, &flash));
+    CHECK_EQ_INT(again.head, log.head);
+    CHECK_EQ_INT(again.head_seq, 2);
+}
+
+static void test_bad_check() {
+    metrics_log_t log;
+    uint32_t numbers[4];
+    fake_init(SECTORS);
+    CHECK(metrics_log_open(&log, &flash));
+    CHECK(append(&log, 1, 10));
+    uint32_t second = log.offset;
+    CHECK(append(&log, 2, 10));
+    CHECK(append(&log, 3, 10));
+    // A bit of the samples of the second record flips, past its header,
+    // name and labels
+    fake.mem[log.head * METRICS_LOG_SECTOR_SIZE + second + RECORD_HEADER_LEN + 27 + 10 + 5] ^= 0x01;
+    CHECK_EQ_INT(replay(&log, 0, numbers, 4), 2);
+    CHECK_EQ_INT(numbers[0], 1);
+    CHECK_EQ_INT(numbers[1], 3);
+}
+
+static void test_bad_count() {
+    metrics_log_t log;
+    uint32_t numbers[4];
+    fake_init(SECTORS);
+    CHECK(metrics_log_open(&log, &flash));
+    CHECK(append(&log, 1, 10));
+    uint32_t second = log.offset;
+    CHECK(append(&log, 2, 10));
+    CHECK(append(&log, 3, 10));
+    // The sample count of the second record loses a bit, its samples would
+    // decode as garbage
+    fake.mem[log.head * METRICS_LOG_SECTOR_SIZE + second + COUNT_OFFSET] ^= 0x02;
+    CHECK_EQ_INT(replay(&log, 0, numbers, 4), 2);
+    CHECK_EQ_INT(numbers[0], 1);
+    CHECK_EQ_INT(numbers[1], 3);
+}
+
+// Log of records 0 to 9, with the sector then padded with short records of
+// 72 bytes at most if `fill`, so that record 10 starts the next sector.
+// Return the records in it.
+static size_t power_loss_setup(metrics_log_t *log, bool fill) {
+    static uint32_t numbers[400];
+    fake_init(SECTORS);
+    CHECK(metrics_log_open(log, &flash));
+    for (uint32_t n = 0; n < 10; n++) CHECK(append(log, n, 20));
+    uint32_t head = log->head;
+    for (uint32_t n = 1000; fill && log->offset + 72 <= METRICS_LOG_SECTOR_SIZE; n++) CHECK(append(log, n, 1));
+    CHECK_EQ_INT(log->head, head);
+    return replay(log, 0, numbers, 400);
+}
+
+// Bytes of writes that appending record 10 needs before it reads back
+// whole: all but its padding and trailing bytes left erased (0xff)
+static size_t power_loss_needed(bool fill) {
+    static metric_history_page_t page;
+    metrics_log_t log;
+    power_loss_setup(&log, fill);
+    size_t written = fake.written;
+    uint32_t head = log.head;
+    CHECK(append(&log, 10, 20));
+    CHECK_EQ_INT(log.head != head, fill);
+    make_page(&page, 10, 20);
+    size_t checked = RECORD_HEADER_LEN + strlen("espair_sm300d2_temp_celsius") + strlen("device=\"2\"") +
+                     (page.bits + 7) / 8;
+    size_t total = fake.written - written;
+    const uint8_t *record = &fake.mem[log.head * METRICS_LOG_SECTOR_SIZE + log.offset - (total - (fill ? SECTOR_HEADER_LEN : 0))];
+    while (checked > 0 && record[checked - 1] == 0xff) checked--;
+    return (fill ? SECTOR_HEADER_LEN : 0) + checked;
+}
+
+// Power is lost `budget` bytes into appending record 10, then the device
+// boots again and appends record 11
+static void check_power_loss(size_t budget, bool fill, size_t needed) {
+    static uint32_t numbers[400];
+    metrics_log_t log, again;
+    size_t before = power_loss_setup(&log, fill);
+    fake.budget = budget;
+    bool appended = append(&log, 10, 20);
+    fake_reboot();
+
+    CHECK(metrics_log_open(&again, &flash));
+    CHECK(append(&again, 11, 20));
+    size_t count = replay(&again, 0, numbers, 400);
+    // Records before are all there, the torn one only if it reads back
+    // whole, the one after always
+    CHECK_EQ_INT(count, budget >= needed ? before + 2 : before + 1);
+    CHECK_EQ_INT(numbers[count - 1], 11);
+    if (budget >= needed) CHECK_EQ_INT(numbers[count - 2], 10);
+    if (appended) CHECK(budget >= needed);
+    CHECK_EQ_INT(fake.overwrites, 0);
+}
+
+static void test_power_loss() {
+    // Every byte of the record, and of the sector header before it
+    for (int fill = 0; fill < 2; fill++) {
+        size_t needed = power_loss_needed(fill);
+        CHECK(needed > RECORD_HEADER_LEN && needed < 200);
+        for (size_t budget = 0; budget < 200; budget++) check_power_loss(budget, fill, needed);
+    }
+}
+
+static void bench() {
+    static uint32_t numbers[8000];
+    metrics_log_t log;
+    size_t series = 40, per_hour = 60;
+
+    // Write amplification of a day of hourly flushes of 40 series sampled
+    // every minute, each flush writing the samples of the last hour
+    fake_init(PARTITION_SECTORS);
+    metrics_log_open(&log, &flash);
+    size_t written = fake.written;
+    size_t payload = 0;
+    for (uint32_t hour = 0; hour < 24; hour++) {
+        for (uint32_t s = 0; s < series; s++) {
+            static metric_history_page_t page;
+            make_page(&page, hour * series + s, per_hour);
+            payload += (page.bits + 7) / 8;
+            metrics_log_append(&log, "espair_sm300d2_temp_celsius", "device=\"1\"", &page);
+        }
+    }
+    written = fake.written - written;
+    uint32_t erases = 0;
+    for (int s = 0; s < PARTITION_SECTORS; s++) erases += fake.erases[s];
+    printf("Day of 40 series: %zu bytes of samples, %zu written (x%.2f), %u sector erases, "
+           "%.1f days per round of the partition\n", payload, written, (double) written / payload, erases,
+           (double) PARTITION_SECTORS * METRICS_LOG_SECTOR_SIZE / written);
+
+    // Boot replay of a full partition
+    while (log.erases < PARTITION_SECTORS + 1) append(&log, 0, per_hour);
+    fake.reads = fake.read_bytes = 0;
+    metrics_log_open(&log, &flash);
+    size_t reads = fake.reads, read_bytes = fake.read_bytes;
+    fake.reads = fake.read_bytes = 0;
+    size_t records = replay(&log, 0, numbers, 8000);
+    printf("Full partition of %zu records: open reads %zu bytes in %zu reads, replay %zu bytes in %zu reads\n",
+           records, read_bytes, reads, fake.read_bytes, fake.reads);
+    BENCH("metrics_log_open (full partition)", 2000, 0, metrics_log_open(&log, &flash));
+    BENCH("replay (full partition, all records)", 200, 0, unit_sink += replay(&log, 0, numbers, 8000));
+    BENCH("metrics_log_append (60 samples)", 20000, 0, unit_sink += append(&log, 0, per_hour));
+}
+
+int main(int argc, char **argv) {
+    test_open_blank();
+    test_round_trip();
+    test_too_long_key();
+    test_wrap_around();
+    test_reopen();
+    test_sequence_wrap();
+    test_bad_check();
+    test_bad_count();
+    test_power_loss();
+    if (unit_bench_requested(argc, argv)) bench();
+    return unit_report(argv[0]);
+}
@@ -0,0 +1,120 @@
+#include "lywsd02.h"
+#include "unit.h"
+
+static void test_notification() {
+    const uint8_t value[] = { 0x0f, 0x09, 0x2d };  // 23.19 C, 45 %
+    lywsd02_data_t data;
+    CHECK(lywsd02_parse_data(value, sizeof(value), &data));
+    CHECK_EQ_INT(data.temp_centi, 2319);
+    CHECK_EQ_INT(data.humi, 45);
+    CHECK_EQ_INT(data.battery, -1);
+}
+
+static void test_notification_negative() {
+    const uint8_t value[] = { 0x0e, 0xfc, 0x50 };  // -10.10 C, 80 %
+    lywsd02_data_t data;
+    CHECK(lywsd02_parse_data(value, sizeof(value), &data));
+    CHECK_EQ_INT(data.temp_centi, -1010);
+    CHECK_EQ_INT(data.humi, 80);
+}
+
+static void test_notification_wrong_length() {
+    const uint8_t value[] = { 0x0f, 0x09, 0x2d, 0x00 };
+    lywsd02_data_t data;
+    CHECK(!lywsd02_parse_data(value, 2, &data));
+    CHECK(!lywsd02_parse_data(value, 4, &data));
+    CHECK(!lywsd02_parse_data(value, 0, &data));
+}
+
+// Frame control (MAC & object), product 0x045b, counter, MAC, then the object
+#define HEADER 0x50, 0x20, 0x5b, 0x04, 0x17, 0xef, 0xbe, 0xad, 0xde, 0x23, 0x01
+
+static void test_mibeacon_temp_humi() {
+    const uint8_t value[] = { HEADER, 0x0d, 0x10, 0x04, 0xe6, 0x00, 0x90, 0x01 };
+    lywsd02_adv_t adv;
+    CHECK(lywsd02_parse_mibeacon(value, sizeof(value), &adv));
+    CHECK(adv.has_temp && adv.has_humi && !adv.has_battery);
+    CHECK_EQ_INT(adv.temp_centi, 2300);
+    CHECK_EQ_INT(adv.humi_deci, 400);
+}
+
+static void test_mibeacon_single_objects() {
+    lywsd02_adv_t adv;
+    const uint8_t temp[] = { HEADER, 0x04, 0x10, 0x02, 0x9c, 0xff };  // -10.0 C
+    CHECK(lywsd02_parse_mibeacon(temp, sizeof(temp), &adv));
+    CHECK(adv.has_temp && !adv.has_humi);
+    CHECK_EQ_INT(adv.temp_centi, -1000);
+
+    const uint8_t humi[] = { HEADER, 0x06, 0x10, 0x02, 0xc3, 0x01 };
+    CHECK(lywsd02_parse_mibeacon(humi, sizeof(humi), &adv));
+    CHECK(adv.has_humi && !adv.has_temp);
+    CHECK_EQ_INT(adv.humi_deci, 451);
+
+    const uint8_t battery[] = { HEADER, 0x0a, 0x10, 0x01, 0x55 };
+    CHECK(lywsd02_parse_mibeacon(battery, sizeof(battery), &adv));
+    CHECK(adv.has_battery && !adv.has_temp);
+    CHECK_EQ_INT(adv.battery, 85);
+}
+
+static void test_mibeacon_capability() {
+    // Capability byte with the I/O flag is followed by 2 more bytes
+    const uint8_t value[] = {
+        0x70, 0x20, 0x5b, 0x04, 0x17, 0xef, 0xbe, 0xad, 0xde, 0x23, 0x01, 0x28, 0x00, 0x00,
+        0x0a, 0x10, 0x01, 0x64,
+    };
+    lywsd02_adv_t adv;
+    CHECK(lywsd02_parse_mibeacon(value, sizeof(value), &adv));
+    CHECK_EQ_INT(adv.battery, 100);
+}
+
+static void test_mibeacon_rejected() {
+    lywsd02_adv_t adv;
+    const uint8_t encrypted[] = { 0x58, 0x20, 0x5b, 0x04, 0x17, 0xef, 0xbe, 0xad, 0xde, 0x23, 0x01,
+                                  0x0a, 0x10, 0x01, 0x55 };
+    CHECK(!lywsd02_parse_mibeacon(encrypted, sizeof(encrypted), &adv));
+
+    const uint8_t no_object[] = { 0x10, 0x20, 0x5b, 0x04, 0x17, 0xef, 0xbe, 0xad, 0xde, 0x23, 0x01 };
+    CHECK(!lywsd02_parse_mibeacon(no_object, sizeof(no_object), &adv));
+
+    // Object of an unknown type, or a known type of the wrong size
+    const uint8_t unknown[] = { HEADER, 0x07, 0x10, 0x03, 0x00, 0x00, 0x00 };
+    CHECK(!lywsd02_parse_mibeacon(unknown, sizeof(unknown), &adv));
+    const uint8_t wrong_size[] = { HEADER, 0x04, 0x10, 0x01, 0x9c };
+    CHECK(!lywsd02_parse_mibeacon(wrong_size, sizeof(wrong_size), &adv));
+    CHECK(!adv.has_temp && !adv.has_humi && !adv.has_battery);
+}
+
+static void test_mibeacon_truncated() {
+    const uint8_t value[] = { HEADER, 0x0d, 0x10, 0x04, 0xe6, 0x00, 0x90, 0x01 };
+    lywsd02_adv_t adv;
+    // Every prefix of a valid advertisement is refused
+    for (size_t len = 0; len < sizeof(value); len++)
+        CHECK(!lywsd02_parse_mibeacon(value, len, &adv));
+
+    const uint8_t cap_cut[] = { 0x70, 0x20, 0x5b, 0x04, 0x17, 0xef, 0xbe, 0xad, 0xde, 0x23, 0x01 };
+    CHECK(!lywsd02_parse_mibeacon(cap_cut, sizeof(cap_cut), &adv));
+}
+
+static void bench() {
+    const uint8_t value[] = { 0x0f, 0x09, 0x2d };
+    lywsd02_data_t data;
+    BENCH("lywsd02_parse_data", 10000000, sizeof(value),
+          unit_sink += lywsd02_parse_data(value, sizeof(value), &data) + data.temp_centi);
+    const uint8_t adv_value[] = { HEADER, 0x0d, 0x10, 0x04, 0xe6, 0x00, 0x90, 0x01 };
+    lywsd02_adv_t adv;
+    BENCH("lywsd02_parse_mibeacon", 10000000, sizeof(adv_value),
+          unit_sink += lywsd02_parse_mibeacon(adv_value, sizeof(adv_value), &adv) + adv.temp_centi);
+}
+
+int main(int argc, char **argv) {
+    test_notification();
+    test_notification_negative();
+    test_notification_wrong_length();
+    test_mibeacon_temp_humi();
+    test_mibeacon_single_objects();
+    test_mibeacon_capability();
+    test_mibeacon_rejected();
+    test_mibeacon_truncated();
+    if (unit_bench_requested(argc, argv)) bench();
+    return unit_report(argv[0]);
+}
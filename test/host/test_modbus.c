@@ -0,0 +1,195 @@
+#include "string.h"
+
+#include "modbus.h"
+#include "unit.h"
+
+// Append the CRC, low byte first, return the frame length
+static size_t with_crc(uint8_t *frame, size_t len) {
+    uint16_t crc = crc16(frame, len);
+    frame[len] = crc & 0xff;
+    frame[len + 1] = crc >> 8;
+    return len + 2;
+}
+
+// Reading IR1..IR4 of the S8 as sense_air_s8.c does
+static modbus_request_t s8_request(uint8_t addr, uint16_t *values) {
+    return (modbus_request_t) {
+        .addr = addr,
+        .func = MODBUS_READ_INPUT_REGISTERS,
+        .reg = 0x0000,
+        .count = 4,
+        .values = values,
+    };
+}
+
+// Status 0, alarms 0, output 0, CO2 612 ppm
+static size_t s8_response(uint8_t addr, uint8_t *frame) {
+    const uint8_t body[] = { addr, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x64 };
+    memcpy(frame, body, sizeof(body));
+    return with_crc(frame, sizeof(body));
+}
+
+static void test_crc16_vectors() {
+    // Examples of the Modbus & Senseair specifications
+    const uint8_t read_holding[] = { 0x01, 0x03, 0x00, 0x00, 0x00, 0x0a };
+    CHECK_EQ_INT(crc16(read_holding, sizeof(read_holding)), 0xcdc5);
+    const uint8_t read_co2[] = { 0xfe, 0x04, 0x00, 0x03, 0x00, 0x01 };
+    CHECK_EQ_INT(crc16(read_co2, sizeof(read_co2)), 0xc5d5);
+    CHECK_EQ_INT(crc16(NULL, 0), 0xffff);
+}
+
+static void test_crc16_residue() {
+    // CRC over a frame with its CRC appended is 0
+    uint8_t frame[16] = { 0x68, 0x04, 0x02, 0x01, 0x90 };
+    size_t len = with_crc(frame, 5);
+    CHECK_EQ_INT(crc16(frame, len), 0x0000);
+}
+
+static void test_build_request() {
+    modbus_request_t req = { .addr = 0xfe, .func = MODBUS_READ_INPUT_REGISTERS, .reg = 0x0003, .count = 1 };
+    uint8_t frame[8];
+    const uint8_t expected[] = { 0xfe, 0x04, 0x00, 0x03, 0x00, 0x01, 0xd5, 0xc5 };
+    CHECK_EQ_MEM(frame, modbus_build_request(&req, frame), expected, sizeof(expected));
+}
+
+static void test_parse_good() {
+    uint16_t values[4] = {};
+    modbus_request_t req = s8_request(0x68, values);
+    modbus_stats_t stats = {};
+    uint8_t frame[MODBUS_MAX_FRAME];
+    size_t len = s8_response(0x68, frame);
+    CHECK_EQ_INT(modbus_parse_response(&req, frame, len, &stats), ESP_OK);
+    CHECK_EQ_INT(values[0], 0);
+    CHECK_EQ_INT(values[3], 612);
+    CHECK_EQ_INT(stats.responses, 1);
+    CHECK_EQ_INT(stats.crc_errors + stats.short_frames + stats.header_errors + stats.exceptions, 0);
+}
+
+static void test_parse_any_address() {
+    // 0xfe addresses any S8, which answers with its own address
+    uint16_t values[4] = {};
+    modbus_request_t req = s8_request(0xfe, values);
+    modbus_stats_t stats = {};
+    uint8_t frame[MODBUS_MAX_FRAME];
+    size_t len = s8_response(0x68, frame);
+    CHECK_EQ_INT(modbus_parse_response(&req, frame, len, &stats), ESP_OK);
+    CHECK_EQ_INT(values[3], 612);
+}
+
+static void test_parse_bad_crc() {
+    uint16_t values[4] = {};
+    modbus_request_t req = s8_request(0x68, values);
+    modbus_stats_t stats = {};
+    uint8_t frame[MODBUS_MAX_FRAME];
+    size_t len = s8_response(0x68, frame);
+    frame[len - 1] ^= 0x80;
+    CHECK_EQ_INT(modbus_parse_response(&req, frame, len, &stats), ESP_ERR_INVALID_CRC);
+    CHECK_EQ_INT(stats.crc_errors, 1);
+    CHECK_EQ_INT(stats.responses, 0);
+
+    len = s8_response(0x68, frame);
+    frame[10] ^= 0x01;
+    CHECK_EQ_INT(modbus_parse_response(&req, frame, len, &stats), ESP_ERR_INVALID_CRC);
+    CHECK_EQ_INT(stats.crc_errors, 2);
+}
+
+static void test_parse_truncated() {
+    uint16_t values[4] = {};
+    modbus_request_t req = s8_request(0x68, values);
+    modbus_stats_t stats = {};
+    uint8_t frame[MODBUS_MAX_FRAME];
+
+    // Shorter than any response
+    s8_response(0x68, frame);
+    CHECK_EQ_INT(modbus_parse_response(&req, frame, 4, &stats), ESP_ERR_INVALID_SIZE);
+    CHECK_EQ_INT(modbus_parse_response(&req, frame, 0, &stats), ESP_ERR_INVALID_SIZE);
+    CHECK_EQ_INT(stats.short_frames, 2);
+
+    // Valid CRC but fewer registers than requested
+    const uint8_t body[] = { 0x68, 0x04, 0x04, 0x00, 0x00, 0x00, 0x00 };
+    memcpy(frame, body, sizeof(body));
+    size_t len = with_crc(frame, sizeof(body));
+    CHECK_EQ_INT(modbus_parse_response(&req, frame, len, &stats), ESP_ERR_INVALID_SIZE);
+    CHECK_EQ_INT(stats.short_frames, 3);
+}
+
+static void test_parse_byte_count_mismatch() {
+    // Right length, but the byte count field disagrees with the request
+    uint16_t values[4] = {};
+    modbus_request_t req = s8_request(0x68, values);
+    modbus_stats_t stats = {};
+    uint8_t frame[MODBUS_MAX_FRAME];
+    const uint8_t body[] = { 0x68, 0x04, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x64 };
+    memcpy(frame, body, sizeof(body));
+    size_t len = with_crc(frame, sizeof(body));
+    CHECK_EQ_INT(modbus_parse_response(&req, frame, len, &stats), ESP_ERR_INVALID_RESPONSE);
+    CHECK_EQ_INT(stats.header_errors, 1);
+}
+
+static void test_parse_exception() {
+    uint16_t values[4] = {};
+    modbus_request_t req = s8_request(0x68, values);
+    modbus_stats_t stats = {};
+    uint8_t frame[MODBUS_MAX_FRAME] = { 0x68, 0x84, 0x02 };  // Illegal data address
+    size_t len = with_crc(frame, 3);
+    CHECK_EQ_INT(modbus_parse_response(&req, frame, len, &stats), ESP_ERR_NOT_SUPPORTED);
+    CHECK_EQ_INT(req.exception, 0x02);
+    CHECK_EQ_INT(stats.exceptions, 1);
+    CHECK_EQ_INT(stats.responses, 1);
+}
+
+static void test_parse_wrong_header() {
+    uint16_t values[4] = {};
+    modbus_request_t req = s8_request(0x68, values);
+    modbus_stats_t stats = {};
+    uint8_t frame[MODBUS_MAX_FRAME];
+
+    size_t len = s8_response(0x69, frame);
+    CHECK_EQ_INT(modbus_parse_response(&req, frame, len, &stats), ESP_ERR_INVALID_RESPONSE);
+
+    const uint8_t body[] = { 0x68, 0x03, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x64 };
+    memcpy(frame, body, sizeof(body));
+    len = with_crc(frame, sizeof(body));
+    CHECK_EQ_INT(modbus_parse_response(&req, frame, len, &stats), ESP_ERR_INVALID_RESPONSE);
+    CHECK_EQ_INT(stats.header_errors, 2);
+    CHECK_EQ_INT(stats.responses, 0);
+}
+
+static void test_parse_write_echo() {
+    modbus_request_t req = { .addr = 0x68, .func = MODBUS_WRITE_SINGLE_REGISTER, .reg = 0x0001, .count = 0x7c06 };
+    modbus_stats_t stats = {};
+    uint8_t frame[MODBUS_MAX_FRAME];
+    size_t len = modbus_build_request(&req, frame);
+    CHECK_EQ_INT(modbus_parse_response(&req, frame, len, &stats), ESP_OK);
+    CHECK_EQ_INT(modbus_parse_response(&req, frame, 6, &stats), ESP_ERR_INVALID_CRC);
+}
+
+static void bench() {
+    uint8_t frame[MODBUS_MAX_FRAME];
+    for (size_t i = 0; i < sizeof(frame); i++) frame[i] = i * 7;
+    BENCH("crc16 (8 bytes)", 10000000, 8, unit_sink += crc16(frame, 8));
+    BENCH("crc16 (256 bytes)", 1000000, 256, unit_sink += crc16(frame, 256));
+
+    uint16_t values[4];
+    modbus_request_t req = s8_request(0x68, values);
+    modbus_stats_t stats = {};
+    size_t len = s8_response(0x68, frame);
+    BENCH("modbus_parse_response (S8, 4 registers)", 10000000, len,
+          unit_sink += modbus_parse_response(&req, frame, len, &stats) + values[3]);
+}
+
+int main(int argc, char **argv) {
+    test_crc16_vectors();
+    test_crc16_residue();
+    test_build_request();
+    test_parse_good();
+    test_parse_any_address();
+    test_parse_bad_crc();
+    test_parse_truncated();
+    test_parse_byte_count_mismatch();
+    test_parse_exception();
+    test_parse_wrong_header();
+    test_parse_write_echo();
+    if (unit_bench_requested(argc, argv)) bench();
+    return unit_report(argv[0]);
+}
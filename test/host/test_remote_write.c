@@ -0,0 +1,267 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+#include "metrics_remote_write.h"
+#include "decode.h"
+#include "unit.h"
+
+static metrics_snappy_state_t state;
+
+// Compress then decode `len` bytes, which must come back unchanged
+static void check_snappy_round_trip(const uint8_t *src, size_t len) {
+    static uint8_t compressed[METRICS_SNAPPY_MAX_LEN(65535)];
+    static uint8_t decoded[65536];
+    size_t n = metrics_snappy_compress(&state, src, len, compressed);
+    CHECK(n <= METRICS_SNAPPY_MAX_LEN(len));
+    long out = snappy_decode(compressed, n, decoded, sizeof(decoded));
+    CHECK_EQ_INT(out, len);
+    if (out >= 0) CHECK_EQ_MEM(decoded, (size_t) out, src, len);
+}
+
+static void test_snappy_small() {
+    check_snappy_round_trip((const uint8_t*) "", 0);
+    check_snappy_round_trip((const uint8_t*) "a", 1);
+    check_snappy_round_trip((const uint8_t*) "abcd", 4);
+    check_snappy_round_trip((const uint8_t*) "abcdabcd", 8);
+}
+
+static void test_snappy_literals() {
+    // Random bytes do not compress, literals of every length encoding
+    static uint8_t buf[8192];
+    srand(2);
+    for (size_t i = 0; i < sizeof(buf); i++) buf[i] = rand();
+    size_t sizes[] = { 59, 60, 61, 255, 256, 257, 4096, sizeof(buf) };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        check_snappy_round_trip(buf, sizes[i]);
+}
+
+static void test_snappy_copies() {
+    // Runs longer than one copy, and overlapping copies
+    static uint8_t buf[20000];
+    memset(buf, 'x', sizeof(buf));
+    check_snappy_round_trip(buf, sizeof(buf));
+    for (size_t i = 0; i < sizeof(buf); i++) buf[i] = "espair_sm300d2_"[i % 15];
+    check_snappy_round_trip(buf, sizeof(buf));
+    // Far matches, past the 11-bit offsets
+    srand(3);
+    for (size_t i = 0; i < 10000; i++) buf[i] = rand();
+    memcpy(&buf[10000], buf, 10000);
+    check_snappy_round_trip(buf, sizeof(buf));
+}
+
+static void test_snappy_max_input() {
+    static uint8_t buf[65535];
+    srand(4);
+    for (size_t i = 0; i < sizeof(buf); i++) buf[i] = rand() % 4 == 0 ? rand() : 'a' + i % 7;
+    check_snappy_round_trip(buf, sizeof(buf));
+}
+
+static void collect_series(const decoded_series_t *series, void *arg) {
+    *(decoded_series_t*) arg = *series;
+}
+
+static void test_pb_series() {
+    uint8_t buf[256];
+    metrics_pb_t pb;
+    metrics_pb_init(&pb, buf, sizeof(buf));
+    metric_label_t labels[] = {
+        { "__name__", "espair_sm300d2_co2_ppm" },
+        { "host", "espair" },
+        { "mac", "24:0a:c4:00:11:22" },
+    };
+    CHECK(metrics_pb_add_series(&pb, labels, 3, 612.5, 1700000000123));
+    CHECK_EQ_INT(pb.series, 1);
+
+    decoded_series_t series;
+    CHECK_EQ_INT(write_request_decode(pb.buf, pb.len, collect_series, &series), 1);
+    CHECK_EQ_INT(series.labels, 3);
+    CHECK_EQ_STR(series.name[0], "__name__");
+    CHECK_EQ_STR(series.value[0], "espair_sm300d2_co2_ppm");
+    CHECK_EQ_STR(series.name[2], "mac");
+    CHECK_EQ_STR(series.value[2], "24:0a:c4:00:11:22");
+    CHECK_EQ_INT(series.samples, 1);
+    CHECK(series.sample_value == 612.5);
+    CHECK_EQ_INT(series.sample_timestamp, 1700000000123);
+}
+
+static void test_pb_full() {
+    uint8_t buf[100];
+    metrics_pb_t pb;
+    metrics_pb_init(&pb, buf, sizeof(buf));
+    metric_label_t labels[] = { { "__name__", "espair_sm300d2_co2_ppm" }, { "host", "espair" } };
+    CHECK(metrics_pb_add_series(&pb, labels, 2, 1, 1));
+    size_t len = pb.len;
+    // Left unchanged when the next series does not fit
+    CHECK(!metrics_pb_add_series(&pb, labels, 2, 1, 1));
+    CHECK_EQ_INT(pb.len, len);
+    CHECK_EQ_INT(pb.series, 1);
+    CHECK_EQ_INT(write_request_decode(pb.buf, pb.len, NULL, NULL), 1);
+}
+
+static void test_labels_sorted() {
+    char decoded[METRICS_LABELS_MAX_LEN];
+    metric_label_t labels[3 + 8] = {
+        { "__name__", "espair_sm300d2_co2_ppm" },
+        { "host", "espair" },
+        { "mac", "24:0a:c4:00:11:22" },
+    };
+    int n = metrics_labels_decode("quantile=\"0.95\",device=\"a\\\"b\\\\c\\nd\",addr=\"104\"", decoded,
+                                  sizeof(decoded), &labels[3], 8);
+    CHECK_EQ_INT(n, 3);
+    metrics_pb_sort_labels(labels, 3 + n);
+    const char *keys[] = { "__name__", "addr", "device", "host", "mac", "quantile" };
+    for (int i = 0; i < 6; i++) CHECK_EQ_STR(labels[i].key, keys[i]);
+    CHECK_EQ_STR(labels[2].value, "a\"b\\c\nd");
+
+    // Sorted on the wire as well, the way remote_write receivers require
+    uint8_t buf[512];
+    metrics_pb_t pb;
+    metrics_pb_init(&pb, buf, sizeof(buf));
+    CHECK(metrics_pb_add_series(&pb, labels, 3 + n, 1, 1));
+    decoded_series_t series;
+    CHECK_EQ_INT(write_request_decode(pb.buf, pb.len, collect_series, &series), 1);
+    for (size_t i = 1; i < series.labels; i++) CHECK(strcmp(series.name[i - 1], series.name[i]) < 0);
+    CHECK_EQ_STR(series.value[2], "a\"b\\c\nd");
+}
+
+static void test_labels_decode_rejected() {
+    char decoded[16];
+    metric_label_t labels[2];
+    CHECK_EQ_INT(metrics_labels_decode("a=\"1\",b=\"2\",c=\"3\"", decoded, sizeof(decoded), labels, 2), -1);
+    CHECK_EQ_INT(metrics_labels_decode("device=\"0123456789\"", decoded, sizeof(decoded), labels, 2), -1);
+    CHECK_EQ_INT(metrics_labels_decode("device", decoded, sizeof(decoded), labels, 2), -1);
+    CHECK_EQ_INT(metrics_labels_decode("a=\"1", decoded, sizeof(decoded), labels, 2), -1);
+    CHECK_EQ_INT(metrics_labels_decode("", decoded, sizeof(decoded), labels, 2), 0);
+}
+
+// What a receiver got: batches of series, each checked on arrival
+typedef struct {
+    size_t batches;
+    size_t series;
+    size_t max_batch_series;
+    size_t max_batch_len;
+    int64_t next_timestamp;   // Series are numbered by timestamp, must arrive in order
+    bool invalid;
+} receiver_t;
+
+static void receive_series(const decoded_series_t *series, void *arg) {
+    receiver_t *r = arg;
+    if (series->sample_timestamp != r->next_timestamp++) r->invalid = true;
+    r->series++;
+}
+
+// Flush callback of the batches, a stand-in for the HTTP request
+static void receive(const metrics_pb_t *pb, void *arg) {
+    static uint8_t compressed[METRICS_SNAPPY_MAX_LEN(4096)];
+    static uint8_t body[4096];
+    receiver_t *r = arg;
+    size_t len = metrics_snappy_compress(&state, pb->buf, pb->len, compressed);
+    long n = snappy_decode(compressed, len, body, sizeof(body));
+    if (n < 0 || write_request_decode(body, n, receive_series, r) != (long) pb->series) r->invalid = true;
+    r->batches++;
+    if (pb->series > r->max_batch_series) r->max_batch_series = pb->series;
+    if (pb->len > r->max_batch_len) r->max_batch_len = pb->len;
+}
+
+static void push(size_t buffer_size, size_t max_series, size_t total, receiver_t *r) {
+    uint8_t buf[4096];
+    metrics_pb_t pb;
+    metrics_pb_init(&pb, buf, buffer_size);
+    metric_label_t labels[] = {
+        { "__name__", "espair_sm300d2_co2_ppm" },
+        { "host", "espair" },
+        { "mac", "24:0a:c4:00:11:22" },
+    };
+    for (size_t i = 0; i < total; i++)
+        CHECK(metrics_pb_add_batched(&pb, max_series, receive, r, labels, 3, i, i));
+    if (pb.series > 0) receive(&pb, r);
+}
+
+static void test_batch_split_on_count() {
+    receiver_t r = {};
+    push(4096, 5, 23, &r);
+    CHECK(!r.invalid);
+    CHECK_EQ_INT(r.series, 23);
+    CHECK_EQ_INT(r.batches, 5);
+    CHECK_EQ_INT(r.max_batch_series, 5);
+}
+
+static void test_batch_split_on_full() {
+    // 93 bytes per series, 3 fit in 300 bytes
+    receiver_t r = {};
+    push(300, 64, 23, &r);
+    CHECK(!r.invalid);
+    CHECK_EQ_INT(r.series, 23);
+    CHECK_EQ_INT(r.batches, 8);
+    CHECK_EQ_INT(r.max_batch_series, 3);
+    CHECK(r.max_batch_len <= 300);
+}
+
+static void test_batch_series_too_large() {
+    receiver_t r = {};
+    uint8_t buf[64];
+    metrics_pb_t pb;
+    metrics_pb_init(&pb, buf, sizeof(buf));
+    metric_label_t small[] = { { "__name__", "a" } };
+    metric_label_t large[] = { { "__name__", "espair_sm300d2_co2_ppm" }, { "mac", "24:0a:c4:00:11:22" },
+                               { "host", "espair" } };
+    CHECK(metrics_pb_add_batched(&pb, 64, receive, &r, small, 1, 0, 0));
+    // Sends what was batched, then gives up on the series alone
+    CHECK(!metrics_pb_add_batched(&pb, 64, receive, &r, large, 3, 1, 1));
+    CHECK_EQ_INT(r.batches, 1);
+    CHECK_EQ_INT(r.series, 1);
+    CHECK_EQ_INT(pb.series, 0);
+    CHECK(metrics_pb_add_batched(&pb, 64, receive, &r, small, 1, 1, 1));
+    CHECK(!r.invalid);
+}
+
+static void bench() {
+    static uint8_t buf[CONFIG_METRICS_PUSH_BUFFER_SIZE];
+    static uint8_t compressed[METRICS_SNAPPY_MAX_LEN(CONFIG_METRICS_PUSH_BUFFER_SIZE)];
+    metrics_pb_t pb;
+    char name[64], device[16];
+    metric_label_t labels[] = {
+        { "__name__", name },
+        { "device", device },
+        { "host", "espair" },
+        { "mac", "24:0a:c4:00:11:22" },
+    };
+    metrics_pb_init(&pb, buf, sizeof(buf));
+    for (int i = 0; metrics_pb_add_series(&pb, labels, 4, 400 + i * 0.25, 1700000000000 + i); i++) {
+        snprintf(name, sizeof(name), "espair_%s_%s", i % 3 ? "sm300d2" : "lywsd02", i % 2 ? "temp_celsius" : "humi_percent");
+        snprintf(device, sizeof(device), "%d", i % 8);
+    }
+    size_t len = metrics_snappy_compress(&state, pb.buf, pb.len, compressed);
+    printf("WriteRequest of %zu series: %zu bytes, snappy %zu bytes (%.1f%%)\n", pb.series, pb.len, len,
+           100.0 * len / pb.len);
+    BENCH("metrics_snappy_compress (WriteRequest)", 20000, pb.len,
+          unit_sink += metrics_snappy_compress(&state, pb.buf, pb.len, compressed));
+    metrics_pb_t one;
+    uint8_t one_buf[256];
+    BENCH("metrics_pb_add_series (4 labels)", 5000000, 0,
+          metrics_pb_init(&one, one_buf, sizeof(one_buf));
+          unit_sink += metrics_pb_add_series(&one, labels, 4, 21.5, 1700000000000));
+    metric_label_t sorted[3 + 8] = { { "__name__", "x" }, { "host", "espair" }, { "mac", "m" } };
+    char decoded[METRICS_LABELS_MAX_LEN];
+    BENCH("metrics_labels_decode + sort (3 labels)", 5000000, 0,
+          int n = metrics_labels_decode("quantile=\"0.95\",device=\"a\",addr=\"104\"", decoded,
+                                        sizeof(decoded), &sorted[3], 8);
+          metrics_pb_sort_labels(sorted, 3 + n); unit_sink += n);
+}
+
+int main(int argc, char **argv) {
+    test_snappy_small();
+    test_snappy_literals();
+    test_snappy_copies();
+    test_snappy_max_input();
+    test_pb_series();
+    test_pb_full();
+    test_labels_sorted();
+    test_labels_decode_rejected();
+    test_batch_split_on_count();
+    test_batch_split_on_full();
+    test_batch_series_too_large();
+    if (unit_bench_requested(argc, argv)) bench();
+    return unit_report(argv[0]);
+}
@@ -0,0 +1,108 @@
+#include "string.h"
+
+#include "sm300d2.h"
+#include "unit.h"
+
+// CO2 400, CH2O 5, TVOC 10, PM2.5 12, PM10 18, 23.05 C, 45.03 %
+static const uint8_t GOOD[] = {
+    0x3c, 0x02, 0x01, 0x90, 0x00, 0x05, 0x00, 0x0a, 0x00, 0x0c, 0x00, 0x12, 0x17, 0x05, 0x2d, 0x03, 0x48,
+};
+
+static sm300d2_packet_t packet_of(const uint8_t *bytes) {
+    sm300d2_packet_t packet;
+    memcpy(&packet, bytes, sizeof(packet));
+    return packet;
+}
+
+static void test_packet_layout() {
+    CHECK_EQ_INT(sizeof(sm300d2_packet_t), sizeof(GOOD));
+}
+
+static void test_check_good() {
+    sm300d2_packet_t packet = packet_of(GOOD);
+    CHECK(sm300d2_check_packet(&packet));
+}
+
+static void test_check_bad_checksum() {
+    uint8_t bytes[sizeof(GOOD)];
+    memcpy(bytes, GOOD, sizeof(bytes));
+    bytes[16] ^= 0x01;
+    sm300d2_packet_t packet = packet_of(bytes);
+    CHECK(!sm300d2_check_packet(&packet));
+
+    // A flipped payload bit is caught the same way
+    memcpy(bytes, GOOD, sizeof(bytes));
+    bytes[3] ^= 0x10;
+    packet = packet_of(bytes);
+    CHECK(!sm300d2_check_packet(&packet));
+}
+
+static void test_check_truncated() {
+    // Frame cut after 12 bytes, the rest of the buffer from the next frame
+    uint8_t bytes[sizeof(GOOD)];
+    memcpy(bytes, GOOD, 12);
+    memcpy(&bytes[12], GOOD, sizeof(bytes) - 12);
+    sm300d2_packet_t packet = packet_of(bytes);
+    CHECK(!sm300d2_check_packet(&packet));
+
+    // Read started one byte late
+    uint8_t shifted[sizeof(GOOD)];
+    memcpy(shifted, &GOOD[1], sizeof(GOOD) - 1);
+    shifted[sizeof(GOOD) - 1] = GOOD[0];
+    packet = packet_of(shifted);
+    CHECK(!sm300d2_check_packet(&packet));
+}
+
+static void test_check_checksum_wraps() {
+    // Sum past 0xff only keeps the low byte
+    uint8_t bytes[sizeof(GOOD)];
+    memset(bytes, 0xff, sizeof(bytes));
+    bytes[16] = (uint8_t) (16 * 0xff);
+    sm300d2_packet_t packet = packet_of(bytes);
+    CHECK(sm300d2_check_packet(&packet));
+}
+
+static void test_parse_data() {
+    sm300d2_packet_t packet = packet_of(GOOD);
+    sm300d2_data_t data;
+    sm300d2_parse_data(&packet, &data);
+    CHECK_EQ_INT(data.e_co2, 400);
+    CHECK_EQ_INT(data.e_ch2o, 5);
+    CHECK_EQ_INT(data.tvoc, 10);
+    CHECK_EQ_INT(data.pm2_5, 12);
+    CHECK_EQ_INT(data.pm10, 18);
+    CHECK_EQ_INT(data.temp_centi, 2305);
+    CHECK_EQ_INT(data.humi_centi, 4503);
+}
+
+static void test_parse_data_big_endian() {
+    uint8_t bytes[sizeof(GOOD)];
+    memcpy(bytes, GOOD, sizeof(bytes));
+    bytes[2] = 0x12;
+    bytes[3] = 0x34;
+    sm300d2_packet_t packet = packet_of(bytes);
+    sm300d2_data_t data;
+    sm300d2_parse_data(&packet, &data);
+    CHECK_EQ_INT(data.e_co2, 0x1234);
+}
+
+static void bench() {
+    sm300d2_packet_t packet = packet_of(GOOD);
+    sm300d2_data_t data;
+    BENCH("sm300d2_check_packet", 10000000, sizeof(GOOD),
+          unit_sink += sm300d2_check_packet(&packet));
+    BENCH("sm300d2_parse_data", 10000000, sizeof(GOOD),
+          sm300d2_parse_data(&packet, &data); unit_sink += data.e_co2);
+}
+
+int main(int argc, char **argv) {
+    test_packet_layout();
+    test_check_good();
+    test_check_bad_checksum();
+    test_check_truncated();
+    test_check_checksum_wraps();
+    test_parse_data();
+    test_parse_data_big_endian();
+    if (unit_bench_requested(argc, argv)) bench();
+    return unit_report(argv[0]);
+}
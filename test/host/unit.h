@@ -0,0 +1,85 @@
+#ifndef _TEST_UNIT_H_
+#define _TEST_UNIT_H_
+
+// Minimal test & benchmark harness of the host tests, one test program per
+// source file. A program runs its tests, and with `--bench` its benchmarks
+// too, and exits non-zero if a check failed.
+
+#include "stdint.h"
+#include "stdio.h"
+#include "string.h"
+#include "time.h"
+
+static int unit_failures;
+static int unit_checks;
+
+#define CHECK(cond) do { \
+    unit_checks++; \
+    if (!(cond)) { \
+        unit_failures++; \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    } \
+} while (0)
+
+#define CHECK_EQ_INT(actual, expected) do { \
+    long long _a = (long long) (actual), _e = (long long) (expected); \
+    unit_checks++; \
+    if (_a != _e) { \
+        unit_failures++; \
+        fprintf(stderr, "%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, _a, _e); \
+    } \
+} while (0)
+
+#define CHECK_EQ_STR(actual, expected) do { \
+    const char *_a = (actual), *_e = (expected); \
+    unit_checks++; \
+    if (strcmp(_a, _e) != 0) { \
+        unit_failures++; \
+        fprintf(stderr, "%s:%d: %s is \"%s\", expected \"%s\"\n", __FILE__, __LINE__, #actual, _a, _e); \
+    } \
+} while (0)
+
+#define CHECK_EQ_MEM(actual, actual_len, expected, expected_len) do { \
+    size_t _al = (actual_len), _el = (expected_len); \
+    unit_checks++; \
+    if (_al != _el || memcmp((actual), (expected), _el) != 0) { \
+        unit_failures++; \
+        fprintf(stderr, "%s:%d: %s (%zu bytes) differs from %s (%zu bytes)\n", __FILE__, __LINE__, \
+                #actual, _al, #expected, _el); \
+    } \
+} while (0)
+
+static inline uint64_t unit_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Keeps benchmarked results alive
+static volatile uint32_t unit_sink;
+
+// Time `iterations` runs of the statement `stmt` and print the mean. `bytes`
+// processed per run, if not 0, adds the throughput.
+#define BENCH(name, iterations, bytes, stmt) do { \
+    long _n = (iterations); \
+    uint64_t _start = unit_now_ns(); \
+    for (long _i = 0; _i < _n; _i++) { stmt; } \
+    double _ns = (double) (unit_now_ns() - _start) / _n; \
+    if ((bytes) > 0) \
+        printf("%-44s %10.1f ns/op %9.1f MB/s\n", (name), _ns, (bytes) * 1e3 / _ns); \
+    else \
+        printf("%-44s %10.1f ns/op\n", (name), _ns); \
+} while (0)
+
+static inline int unit_bench_requested(int argc, char **argv) {
+    for (int i = 1; i < argc; i++)
+        if (strcmp(argv[i], "--bench") == 0) return 1;
+    return 0;
+}
+
+static inline int unit_report(const char *program) {
+    printf("%s: %d checks, %d failed\n", program, unit_checks, unit_failures);
+    return unit_failures == 0 ? 0 : 1;
+}
+
+#endif /* _TEST_UNIT_H_ */
@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+"""Run the host build of the firmware against the emulated sensors, load it
+with scrape_load.py, and check that every reading made it to the scrapes.
+
+S8 and SM300D2 are given ptys, the LYWSD02 clocks advertise on UDP, see
+tools/sim/host/. Printed: each scrape_load.py report, then the firmware's
+own report of CPU, heap and stack use. Exits non-zero if a scrape got an
+error status, an announced value was missed or the firmware did not exit
+cleanly. Connections closed under the clients are failures too, unless
+there are more clients than the firmware keeps connections for: it then
+closes the least recently used ones by design.
+
+    cmake -S tools/sim/host -B build/sim && cmake --build build/sim
+    end_to_end.py build/sim/espair_sim --clients 1,4,16 --duration 60
+"""
+import argparse
+import json
+import os
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+
+def start_sensor(args, sensor, where, events, lock):
+    """Start an emulator, copy its events to `events` and return it with
+    its pty, if it has one."""
+    cmd = [sys.executable, os.path.join(HERE, 'sensors.py'), sensor, '--step', str(args.step)] + where
+    proc = subprocess.Popen(cmd, stdout=subprocess.PIPE, text=True)
+    pty = None
+    if '--pty' in where:
+        pty = json.loads(proc.stdout.readline())['pty']
+
+    def copy():
+        for line in proc.stdout:
+            with lock:
+                events.write(line)
+                events.flush()
+
+    threading.Thread(target=copy, daemon=True).start()
+    return proc, pty
+
+
+def wait_listening(port, proc, timeout):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        if proc.poll() is not None:
+            return False
+        try:
+            socket.create_connection(('localhost', port), timeout=1).close()
+            return True
+        except OSError:
+            time.sleep(0.1)
+    return False
+
+
+def run_scrape_load(args, url, events_path):
+    cmd = [sys.executable, os.path.join(HERE, 'scrape_load.py'), url, '--clients', args.clients,
+           '--duration', str(args.duration), '--events', events_path, '--settle', str(args.settle)]
+    out = subprocess.run(cmd, stdout=subprocess.PIPE, text=True, check=True).stdout
+    reports = []
+    decoder = json.JSONDecoder()
+    pos = 0
+    while pos < len(out.rstrip()):
+        report, pos = decoder.raw_decode(out, pos)
+        reports.append(report)
+        while pos < len(out) and out[pos].isspace():
+            pos += 1
+    return reports
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('sim', help='host build of the firmware, e.g. build/sim/espair_sim')
+    parser.add_argument('--clients', default='1,4,16', help='passed to scrape_load.py')
+    parser.add_argument('--duration', type=float, default=60, help='seconds, per scrape_load.py run')
+    parser.add_argument('--step', type=float, default=10, help='seconds between base changes of the sensors')
+    parser.add_argument('--settle', type=float, default=25,
+                        help='seconds for a value to show, SM300D2 takes up to two aggregation periods')
+    parser.add_argument('--warmup', type=float, default=15, help='seconds before the first run')
+    parser.add_argument('--max-clients', type=int, default=7,
+                        help='CONFIG_METRICS_HTTP_MAX_CLIENTS of the host build')
+    parser.add_argument('--http-port', type=int, default=8080)
+    parser.add_argument('--ble-port', type=int, default=9102)
+    args = parser.parse_args()
+
+    workdir = tempfile.mkdtemp(prefix='espair_e2e_')
+    events_path = os.path.join(workdir, 'events.jsonl')
+    events = open(events_path, 'w')
+    lock = threading.Lock()
+    sensors = []
+    sim = None
+    ok = False
+    try:
+        s8, s8_pty = start_sensor(args, 's8', ['--pty'], events, lock)
+        sm300d2, sm300d2_pty = start_sensor(args, 'sm300d2', ['--pty'], events, lock)
+        lywsd02, _ = start_sensor(args, 'lywsd02', ['--udp', str(args.ble_port)], events, lock)
+        sensors = [s8, sm300d2, lywsd02]
+
+        log = open(os.path.join(workdir, 'sim.log'), 'w')
+        sim = subprocess.Popen([args.sim, '--uart', '1=' + s8_pty, '--uart', '2=' + sm300d2_pty,
+                                '--http-port', str(args.http_port), '--ble-port', str(args.ble_port),
+                                '--flash', os.path.join(workdir, 'flash.bin')],
+                               stdout=subprocess.PIPE, stderr=log, text=True)
+        if not wait_listening(args.http_port, sim, 10):
+            print('Firmware did not start, see %s' % log.name, file=sys.stderr)
+            return 1
+        time.sleep(args.warmup)
+
+        url = 'http://localhost:%d/metrics' % args.http_port
+        ok = True
+        for report in run_scrape_load(args, url, events_path):
+            print(json.dumps(report, indent=2), flush=True)
+            statuses = [e for e in report['errors'] if e.isdigit()]
+            dropped = report['clients'] <= args.max_clients and len(statuses) < len(report['errors'])
+            if statuses or dropped or report['scrapes'] == 0 or report.get('sample_to_scrape_missed'):
+                ok = False
+
+        sim.send_signal(signal.SIGINT)
+        out, _ = sim.communicate(timeout=10)
+        print(out, end='', flush=True)
+        if sim.returncode != 0:
+            print('Firmware exited with %d, see %s' % (sim.returncode, log.name), file=sys.stderr)
+            ok = False
+        sim = None
+    finally:
+        if sim is not None:
+            sim.kill()
+        for proc in sensors:
+            proc.send_signal(signal.SIGINT)
+            proc.wait()
+    if not ok:
+        print('Failed, logs in %s' % workdir, file=sys.stderr)
+    return 0 if ok else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
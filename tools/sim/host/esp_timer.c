@@ -0,0 +1,137 @@
+// esp_timer on a task of its own, callbacks run one at a time
+#include "assert.h"
+#include "pthread.h"
+#include "stdlib.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "sim.h"
+
+#define TASK_STACK_SIZE (3584) // CONFIG_ESP_TIMER_TASK_STACK_SIZE
+
+struct esp_timer {
+    esp_timer_cb_t callback;
+    void *arg;
+    const char *name;
+    int64_t due_us;
+    bool active;
+    uint64_t period_us;  // 0 if one-shot
+    struct esp_timer *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static struct esp_timer *timers = NULL;
+
+int64_t esp_timer_get_time() {
+    return sim_uptime_us();
+}
+
+static void timer_task(void *arg) {
+    pthread_mutex_lock(&lock);
+    while (true) {
+        struct esp_timer *next = NULL;
+        for (struct esp_timer *t = timers; t != NULL; t = t->next)
+            if (t->active && (next == NULL || t->due_us < next->due_us)) next = t;
+        int64_t now = esp_timer_get_time();
+        if (next == NULL) {
+            pthread_cond_wait(&changed, &lock);
+            continue;
+        }
+        if (next->due_us > now) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            int64_t ns = deadline.tv_nsec + (next->due_us - now) * 1000;
+            deadline.tv_sec += ns / 1000000000;
+            deadline.tv_nsec = ns % 1000000000;
+            pthread_cond_timedwait(&changed, &lock, &deadline);
+            continue;
+        }
+        next->active = next->period_us > 0;
+        next->due_us += next->period_us;
+        esp_timer_cb_t callback = next->callback;
+        void *cb_arg = next->arg;
+        pthread_mutex_unlock(&lock);
+        callback(cb_arg);
+        pthread_mutex_lock(&lock);
+    }
+}
+
+static void timer_init() {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&changed, &attr);
+    pthread_condattr_destroy(&attr);
+    xTaskCreate(timer_task, "esp_timer", TASK_STACK_SIZE, NULL, 22, NULL);
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *out_handle) {
+    if (args == NULL || args->callback == NULL || out_handle == NULL) return ESP_ERR_INVALID_ARG;
+    pthread_once(&once, timer_init);
+    struct esp_timer *timer = calloc(1, sizeof(struct esp_timer));
+    if (timer == NULL) return ESP_ERR_NO_MEM;
+    timer->callback = args->callback;
+    timer->arg = args->arg;
+    timer->name = args->name;
+    pthread_mutex_lock(&lock);
+    timer->next = timers;
+    timers = timer;
+    pthread_mutex_unlock(&lock);
+    *out_handle = timer;
+    return ESP_OK;
+}
+
+static esp_err_t timer_start(esp_timer_handle_t timer, uint64_t timeout_us, uint64_t period_us) {
+    pthread_mutex_lock(&lock);
+    esp_err_t ret = ESP_ERR_INVALID_STATE;
+    if (!timer->active) {
+        timer->active = true;
+        timer->due_us = esp_timer_get_time() + timeout_us;
+        timer->period_us = period_us;
+        pthread_cond_signal(&changed);
+        ret = ESP_OK;
+    }
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+    return timer_start(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period) {
+    return timer_start(timer, period, period);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    pthread_mutex_lock(&lock);
+    esp_err_t ret = timer->active ? ESP_OK : ESP_ERR_INVALID_STATE;
+    timer->active = false;
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer) {
+    pthread_mutex_lock(&lock);
+    if (timer->active) {
+        pthread_mutex_unlock(&lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    struct esp_timer **p = &timers;
+    while (*p != timer) p = &(*p)->next;
+    *p = timer->next;
+    pthread_mutex_unlock(&lock);
+    free(timer);
+    return ESP_OK;
+}
+
+bool esp_timer_is_active(esp_timer_handle_t timer) {
+    pthread_mutex_lock(&lock);
+    bool active = timer->active;
+    pthread_mutex_unlock(&lock);
+    return active;
+}
@@ -0,0 +1,359 @@
+// FreeRTOS tasks, notifications & queues on POSIX threads
+#include "assert.h"
+#include "errno.h"
+#include "pthread.h"
+#include "stdlib.h"
+#include "string.h"
+#include "sys/mman.h"
+#include "time.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#include "sim.h"
+
+#define TASK_STACK_SIZE (256 * 1024) // Of each thread, way past any `stack_depth`
+#define STACK_FILL_BYTE (0xa5)       // As tskSTACK_FILL_BYTE, to find the deepest use
+
+struct tskTaskControlBlock {
+    pthread_t thread;
+    char name[configMAX_TASK_NAME_LEN];
+    TaskFunction_t fn;
+    void *arg;
+    uint32_t stack_depth;
+    uint8_t *stack;          // NULL for adopted threads
+    size_t stack_base;       // Taken by the thread before the task function, TLS & all
+    pthread_mutex_t lock;
+    pthread_cond_t notified;
+    uint32_t notifications;
+    bool allocated;          // Not in a StaticTask_t
+    struct tskTaskControlBlock *next;
+};
+
+struct QueueDefinition {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    uint8_t *storage;
+    size_t item_size;        // 0 for semaphores
+    size_t length;
+    size_t head;
+    size_t count;
+};
+
+_Static_assert(sizeof(struct tskTaskControlBlock) <= sizeof(StaticTask_t), "StaticTask_t too small");
+_Static_assert(sizeof(struct QueueDefinition) <= sizeof(StaticQueue_t), "StaticQueue_t too small");
+
+static const char *TAG = "freertos";
+
+static pthread_mutex_t tasks_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tskTaskControlBlock *tasks = NULL;
+static __thread struct tskTaskControlBlock *current = NULL;
+static struct timespec boot;
+static pthread_once_t boot_once = PTHREAD_ONCE_INIT;
+
+static void boot_init() {
+    clock_gettime(CLOCK_MONOTONIC, &boot);
+}
+
+int64_t sim_uptime_us() {
+    pthread_once(&boot_once, boot_init);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - boot.tv_sec) * 1000000LL + (now.tv_nsec - boot.tv_nsec) / 1000;
+}
+
+// Absolute CLOCK_MONOTONIC time `ticks` from now
+static struct timespec deadline_in(TickType_t ticks) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    uint64_t ns = t.tv_nsec + (uint64_t) ticks * portTICK_PERIOD_MS * 1000000;
+    t.tv_sec += ns / 1000000000;
+    t.tv_nsec = ns % 1000000000;
+    return t;
+}
+
+static void cond_init(pthread_cond_t *cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+// Wait on `cond` until `deadline`, forever if NULL. False once past it.
+static bool cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock, const struct timespec *deadline) {
+    if (deadline == NULL) return pthread_cond_wait(cond, lock) == 0;
+    return pthread_cond_timedwait(cond, lock, deadline) != ETIMEDOUT;
+}
+
+static void task_register(struct tskTaskControlBlock *task, const char *name, uint32_t stack_depth) {
+    snprintf(task->name, sizeof(task->name), "%s", name);
+    task->stack_depth = stack_depth;
+    pthread_mutex_init(&task->lock, NULL);
+    cond_init(&task->notified);
+    task->notifications = 0;
+    pthread_mutex_lock(&tasks_lock);
+    task->next = tasks;
+    tasks = task;
+    pthread_mutex_unlock(&tasks_lock);
+}
+
+static void* task_main(void *arg) {
+    current = arg;
+    current->stack_base = current->stack + TASK_STACK_SIZE - (uint8_t *) __builtin_frame_address(0);
+    current->fn(current->arg);
+    ESP_LOGE(TAG, "Task %s returned", current->name);
+    abort();  // As FreeRTOS asserts
+}
+
+static TaskHandle_t task_create(struct tskTaskControlBlock *task, TaskFunction_t fn, const char *name,
+                                uint32_t stack_depth, void *arg) {
+    pthread_once(&boot_once, boot_init);
+    task->fn = fn;
+    task->arg = arg;
+    task->stack = mmap(NULL, TASK_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK,
+                       -1, 0);
+    if (task->stack == MAP_FAILED) return NULL;
+    memset(task->stack, STACK_FILL_BYTE, TASK_STACK_SIZE);
+    task_register(task, name, stack_depth);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstack(&attr, task->stack, TASK_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int ret = pthread_create(&task->thread, &attr, task_main, task);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Failed to start task %s: %s", name, strerror(ret));
+        abort();
+    }
+    return task;
+}
+
+// The calling thread, adopted as task "main" if it was not started as one
+static struct tskTaskControlBlock* task_current() {
+    if (current == NULL) sim_task_adopt("main");
+    return current;
+}
+
+void sim_task_adopt(const char *name) {
+    struct tskTaskControlBlock *task = calloc(1, sizeof(struct tskTaskControlBlock));
+    assert(task != NULL);
+    task->thread = pthread_self();
+    task->allocated = true;
+    task_register(task, name, 0);
+    current = task;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack_depth, void *arg,
+                       UBaseType_t priority, TaskHandle_t *created) {
+    struct tskTaskControlBlock *task = calloc(1, sizeof(struct tskTaskControlBlock));
+    if (task == NULL) return pdFAIL;
+    task->allocated = true;
+    TaskHandle_t handle = task_create(task, fn, name, stack_depth, arg);
+    if (created != NULL) *created = handle;
+    return handle != NULL ? pdPASS : pdFAIL;
+}
+
+TaskHandle_t xTaskCreateStatic(TaskFunction_t fn, const char *name, uint32_t stack_depth, void *arg,
+                               UBaseType_t priority, StackType_t *stack, StaticTask_t *task_buf) {
+    struct tskTaskControlBlock *task = (struct tskTaskControlBlock*) task_buf;
+    memset(task, 0, sizeof(*task));
+    return task_create(task, fn, name, stack_depth, arg);
+}
+
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack_depth,
+                                           void *arg, UBaseType_t priority, StackType_t *stack,
+                                           StaticTask_t *task_buf, BaseType_t core) {
+    return xTaskCreateStatic(fn, name, stack_depth, arg, priority, stack, task_buf);
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    struct tskTaskControlBlock *self = task_current();
+    assert(task == NULL || task == self);
+    // Kept in the list, so that its CPU time is still reported
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks) {
+    struct timespec deadline = deadline_in(ticks);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {}
+}
+
+void vTaskDelayUntil(TickType_t *previous_wake, TickType_t increment) {
+    *previous_wake += increment;
+    TickType_t now = xTaskGetTickCount();
+    if ((int32_t) (*previous_wake - now) > 0) vTaskDelay(*previous_wake - now);
+}
+
+TickType_t xTaskGetTickCount() {
+    return sim_uptime_us() / 1000 / portTICK_PERIOD_MS;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+    return task_current();
+}
+
+TaskHandle_t xTaskGetHandle(const char *name) {
+    pthread_mutex_lock(&tasks_lock);
+    struct tskTaskControlBlock *task = tasks;
+    while (task != NULL && strcmp(task->name, name) != 0) task = task->next;
+    pthread_mutex_unlock(&tasks_lock);
+    return task;
+}
+
+const char* pcTaskGetName(TaskHandle_t task) {
+    return (task != NULL ? task : task_current())->name;
+}
+
+// Bytes of the thread stack ever touched by the task, the fill pattern is
+// gone there
+static size_t task_stack_used(const struct tskTaskControlBlock *task) {
+    if (task->stack == NULL) return 0;
+    size_t untouched = 0;
+    while (untouched < TASK_STACK_SIZE && task->stack[untouched] == STACK_FILL_BYTE) untouched++;
+    size_t used = TASK_STACK_SIZE - untouched;
+    return used > task->stack_base ? used - task->stack_base : 0;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+    if (task == NULL) task = task_current();
+    size_t used = task_stack_used(task);
+    return used < task->stack_depth ? task->stack_depth - used : 0;
+}
+
+void sim_tasks_report(FILE *out) {
+    pthread_mutex_lock(&tasks_lock);
+    for (struct tskTaskControlBlock *task = tasks; task != NULL; task = task->next) {
+        clockid_t clock;
+        struct timespec cpu = {};
+        if (pthread_getcpuclockid(task->thread, &clock) == 0) clock_gettime(clock, &cpu);
+        fprintf(out, "    \"%s\": {\"cpu_seconds\": %.3f, \"stack_depth\": %u, \"stack_used\": %zu}%s\n",
+                task->name, cpu.tv_sec + cpu.tv_nsec / 1e9, task->stack_depth, task_stack_used(task),
+                task->next != NULL ? "," : "");
+    }
+    pthread_mutex_unlock(&tasks_lock);
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+    pthread_mutex_lock(&task->lock);
+    task->notifications++;
+    pthread_cond_signal(&task->notified);
+    pthread_mutex_unlock(&task->lock);
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks) {
+    struct tskTaskControlBlock *task = task_current();
+    struct timespec deadline = deadline_in(ticks);
+    pthread_mutex_lock(&task->lock);
+    while (task->notifications == 0 && ticks > 0) {
+        if (!cond_wait(&task->notified, &task->lock, ticks == portMAX_DELAY ? NULL : &deadline)) break;
+    }
+    uint32_t value = task->notifications;
+    if (value > 0) task->notifications = clear_on_exit ? 0 : value - 1;
+    pthread_mutex_unlock(&task->lock);
+    return value;
+}
+
+static QueueHandle_t queue_init(struct QueueDefinition *queue, size_t length, size_t item_size,
+                                uint8_t *storage) {
+    pthread_mutex_init(&queue->lock, NULL);
+    cond_init(&queue->changed);
+    queue->storage = storage;
+    queue->item_size = item_size;
+    queue->length = length;
+    queue->head = 0;
+    queue->count = 0;
+    return queue;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    struct QueueDefinition *queue = malloc(sizeof(struct QueueDefinition) + length * item_size);
+    if (queue == NULL) return NULL;
+    return queue_init(queue, length, item_size, (uint8_t*) (queue + 1));
+}
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t length, UBaseType_t item_size, uint8_t *storage,
+                                 StaticQueue_t *queue_buf) {
+    return queue_init((struct QueueDefinition*) queue_buf, length, item_size, storage);
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks) {
+    struct timespec deadline = deadline_in(ticks);
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->length) {
+        if (ticks == 0 || !cond_wait(&queue->changed, &queue->lock, ticks == portMAX_DELAY ? NULL : &deadline)) {
+            pthread_mutex_unlock(&queue->lock);
+            return pdFALSE;
+        }
+    }
+    size_t tail = (queue->head + queue->count) % queue->length;
+    if (queue->item_size > 0) memcpy(&queue->storage[tail * queue->item_size], item, queue->item_size);
+    queue->count++;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    return pdTRUE;
+}
+
+BaseType_t xQueueSendToBack(QueueHandle_t queue, const void *item, TickType_t ticks) {
+    return xQueueSend(queue, item, ticks);
+}
+
+BaseType_t xQueueOverwrite(QueueHandle_t queue, const void *item) {
+    pthread_mutex_lock(&queue->lock);
+    assert(queue->length == 1);
+    memcpy(queue->storage, item, queue->item_size);
+    queue->head = 0;
+    queue->count = 1;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks) {
+    struct timespec deadline = deadline_in(ticks);
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0) {
+        if (ticks == 0 || !cond_wait(&queue->changed, &queue->lock, ticks == portMAX_DELAY ? NULL : &deadline)) {
+            pthread_mutex_unlock(&queue->lock);
+            return pdFALSE;
+        }
+    }
+    if (queue->item_size > 0) memcpy(item, &queue->storage[queue->head * queue->item_size], queue->item_size);
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    return pdTRUE;
+}
+
+BaseType_t xQueueReset(QueueHandle_t queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->head = 0;
+    queue->count = 0;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+    pthread_mutex_lock(&queue->lock);
+    UBaseType_t count = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+    SemaphoreHandle_t semphr = xQueueCreate(1, 0);
+    if (semphr != NULL) semphr->count = 1;
+    return semphr;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *semphr_buf) {
+    SemaphoreHandle_t semphr = queue_init((struct QueueDefinition*) semphr_buf, 1, 0, NULL);
+    semphr->count = 1;
+    return semphr;
+}
@@ -0,0 +1,394 @@
+// esp_http_server on POSIX sockets. As on the device, one task accepts
+// connections and serves requests one at a time, keeping connections open
+// up to `max_open_sockets` and closing the least recently used past that.
+#include "errno.h"
+#include "poll.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "strings.h"
+#include "unistd.h"
+#include "netinet/in.h"
+#include "netinet/tcp.h"
+#include "sys/socket.h"
+#include "esp_http_server.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "sim.h"
+
+#define RECV_BUF_SIZE (1024) // Request line & headers, 431 past that
+#define MAX_RESP_HEADERS (8)
+
+typedef struct {
+    int fd;                  // -1 if free
+    uint64_t used_at;        // Order of last use, for LRU purge
+    char buf[RECV_BUF_SIZE];
+    size_t len;
+} sim_session_t;
+
+typedef struct {
+    sim_session_t *session;
+    const char *headers;     // Header lines of the request, in the session buffer
+    const char *query;       // After '?' in the URI, or NULL
+    const char *status;
+    const char *type;
+    const char *fields[MAX_RESP_HEADERS];
+    const char *values[MAX_RESP_HEADERS];
+    size_t fields_len;
+    bool started;            // Status line sent
+    bool chunked;
+    bool failed;             // A send failed, the connection is closed
+} sim_req_aux_t;
+
+typedef struct {
+    httpd_config_t config;
+    int listen_fd;
+    httpd_uri_t *handlers;
+    size_t handlers_len;
+    sim_session_t *sessions;
+    uint64_t clock;
+} sim_httpd_t;
+
+static const char *TAG = "httpd";
+
+static bool send_all(sim_req_aux_t *aux, const char *buf, size_t len) {
+    while (len > 0 && !aux->failed) {
+        ssize_t ret = send(aux->session->fd, buf, len, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) {
+            aux->failed = true;
+            break;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return !aux->failed;
+}
+
+// Status line & headers, with the framing of the body
+static bool send_headers(sim_req_aux_t *aux, const char *framing) {
+    char head[512];
+    size_t len = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: %s\r\n%s\r\n",
+                          aux->status, aux->type, framing);
+    for (size_t i = 0; i < aux->fields_len && len < sizeof(head); i++)
+        len += snprintf(&head[len], sizeof(head) - len, "%s: %s\r\n", aux->fields[i], aux->values[i]);
+    if (len + 2 >= sizeof(head)) {
+        aux->failed = true;
+        return false;
+    }
+    len += snprintf(&head[len], sizeof(head) - len, "\r\n");
+    aux->started = true;
+    return send_all(aux, head, len);
+}
+
+esp_err_t httpd_resp_set_status(httpd_req_t *r, const char *status) {
+    ((sim_req_aux_t*) r->aux)->status = status;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type) {
+    ((sim_req_aux_t*) r->aux)->type = type;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t *r, const char *field, const char *value) {
+    sim_req_aux_t *aux = r->aux;
+    if (aux->fields_len == MAX_RESP_HEADERS) return ESP_ERR_HTTPD_RESP_HDR;
+    aux->fields[aux->fields_len] = field;
+    aux->values[aux->fields_len] = value;
+    aux->fields_len++;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t buf_len) {
+    sim_req_aux_t *aux = r->aux;
+    if (buf_len == HTTPD_RESP_USE_STRLEN) buf_len = buf != NULL ? strlen(buf) : 0;
+    char framing[40];
+    snprintf(framing, sizeof(framing), "Content-Length: %zd", buf_len);
+    if (!send_headers(aux, framing) || !send_all(aux, buf, buf_len)) return ESP_ERR_HTTPD_RESP_SEND;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t *r, const char *buf, ssize_t buf_len) {
+    sim_req_aux_t *aux = r->aux;
+    if (buf_len == HTTPD_RESP_USE_STRLEN) buf_len = buf != NULL ? strlen(buf) : 0;
+    if (!aux->started) {
+        aux->chunked = true;
+        if (!send_headers(aux, "Transfer-Encoding: chunked")) return ESP_ERR_HTTPD_RESP_SEND;
+    }
+    char size[16];
+    snprintf(size, sizeof(size), "%zx\r\n", buf_len);
+    if (!send_all(aux, size, strlen(size)) || !send_all(aux, buf, buf_len) || !send_all(aux, "\r\n", 2))
+        return ESP_ERR_HTTPD_RESP_SEND;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_err(httpd_req_t *req, httpd_err_code_t error, const char *msg) {
+    static const struct {
+        const char *status;
+        const char *msg;
+    } ERRORS[] = {
+        [HTTPD_400_BAD_REQUEST] = { "400 Bad Request", "Bad request syntax" },
+        [HTTPD_404_NOT_FOUND] = { "404 Not Found", "This URI does not exist" },
+        [HTTPD_405_METHOD_NOT_ALLOWED] = { "405 Method Not Allowed", "Request method for this URI is not handled by server" },
+        [HTTPD_431_REQ_HDR_FIELDS_TOO_LARGE] = { "431 Request Header Fields Too Large", "Header fields are too long" },
+        [HTTPD_500_INTERNAL_SERVER_ERROR] = { "500 Internal Server Error", "Server has encountered an unexpected error" },
+    };
+    sim_req_aux_t *aux = req->aux;
+    aux->status = ERRORS[error].status;
+    aux->type = "text/html";
+    aux->fields_len = 0;
+    return httpd_resp_send(req, msg != NULL ? msg : ERRORS[error].msg, HTTPD_RESP_USE_STRLEN);
+}
+
+// Value of header `field` of the request, not terminated
+static const char* header_find(const sim_req_aux_t *aux, const char *field, size_t *len) {
+    size_t field_len = strlen(field);
+    for (const char *line = aux->headers; *line != '\0'; ) {
+        const char *end = strstr(line, "\r\n");
+        if (strncasecmp(line, field, field_len) == 0 && line[field_len] == ':') {
+            const char *value = &line[field_len + 1];
+            while (*value == ' ' || *value == '\t') value++;
+            *len = end - value;
+            return value;
+        }
+        line = end + 2;
+    }
+    return NULL;
+}
+
+size_t httpd_req_get_hdr_value_len(httpd_req_t *r, const char *field) {
+    size_t len = 0;
+    return header_find(r->aux, field, &len) != NULL ? len : 0;
+}
+
+// Copy `len` bytes of `src` and terminate it, truncated to `size`
+static esp_err_t copy_value(char *dst, size_t size, const char *src, size_t len) {
+    if (size == 0) return ESP_ERR_INVALID_ARG;
+    size_t n = len < size - 1 ? len : size - 1;
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+    return n < len ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *r, const char *field, char *val, size_t val_size) {
+    size_t len = 0;
+    const char *value = header_find(r->aux, field, &len);
+    if (value == NULL) return ESP_ERR_NOT_FOUND;
+    return copy_value(val, val_size, value, len);
+}
+
+size_t httpd_req_get_url_query_len(httpd_req_t *r) {
+    const char *query = ((sim_req_aux_t*) r->aux)->query;
+    return query != NULL ? strlen(query) : 0;
+}
+
+esp_err_t httpd_req_get_url_query_str(httpd_req_t *r, char *buf, size_t buf_len) {
+    const char *query = ((sim_req_aux_t*) r->aux)->query;
+    if (query == NULL) return ESP_ERR_NOT_FOUND;
+    return copy_value(buf, buf_len, query, strlen(query));
+}
+
+esp_err_t httpd_query_key_value(const char *qry, const char *key, char *val, size_t val_size) {
+    size_t key_len = strlen(key);
+    for (const char *p = qry; p != NULL && *p != '\0'; ) {
+        const char *end = strchr(p, '&');
+        size_t len = end != NULL ? (size_t) (end - p) : strlen(p);
+        if (len > key_len && strncmp(p, key, key_len) == 0 && p[key_len] == '=')
+            return copy_value(val, val_size, &p[key_len + 1], len - key_len - 1);
+        p = end != NULL ? end + 1 : NULL;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+static void session_close(sim_session_t *session) {
+    close(session->fd);
+    session->fd = -1;
+    session->len = 0;
+}
+
+static int method_parse(const char *method) {
+    static const char *METHODS[] = {
+        [HTTP_DELETE] = "DELETE", [HTTP_GET] = "GET", [HTTP_HEAD] = "HEAD", [HTTP_POST] = "POST", [HTTP_PUT] = "PUT",
+    };
+    for (size_t i = 0; i < sizeof(METHODS) / sizeof(METHODS[0]); i++)
+        if (strcmp(method, METHODS[i]) == 0) return i;
+    return -1;
+}
+
+// Serve the request at the start of the session buffer, of `len` bytes up
+// to the end of the headers. False if the connection is to be closed.
+static bool session_serve(sim_httpd_t *server, sim_session_t *session, size_t len) {
+    httpd_req_t req = { .handle = server };
+    sim_req_aux_t aux = {
+        .session = session,
+        .status = HTTPD_200,
+        .type = "text/html",
+    };
+    req.aux = &aux;
+
+    char method[8];
+    char *uri = (char*) req.uri;
+    char line_end;
+    session->buf[len - 2] = '\0';  // After the last header line
+    if (sscanf(session->buf, "%7s %512s HTTP/1.%*c%c", method, uri, &line_end) != 3 || line_end != '\r') {
+        httpd_resp_send_err(&req, HTTPD_400_BAD_REQUEST, NULL);
+        return false;
+    }
+    aux.headers = strstr(session->buf, "\r\n") + 2;
+    char *query = strchr(uri, '?');
+    if (query != NULL) {
+        *query = '\0';
+        aux.query = query + 1;
+    }
+    size_t value_len = 0;
+    const char *connection = header_find(&aux, "Connection", &value_len);
+    bool keep_alive = connection == NULL || strncasecmp(connection, "close", value_len) != 0;
+    const char *content_len = header_find(&aux, "Content-Length", &value_len);
+    req.content_len = content_len != NULL ? strtoul(content_len, NULL, 10) : 0;
+    if (req.content_len > 0) {
+        // Bodies are not read by any handler
+        httpd_resp_send_err(&req, HTTPD_400_BAD_REQUEST, "Request body not supported");
+        return false;
+    }
+
+    int m = method_parse(method);
+    const httpd_uri_t *handler = NULL;
+    bool uri_known = false;
+    for (size_t i = 0; i < server->handlers_len; i++) {
+        if (strcmp(server->handlers[i].uri, uri) != 0) continue;
+        uri_known = true;
+        if ((int) server->handlers[i].method == m) handler = &server->handlers[i];
+    }
+    if (handler == NULL) {
+        httpd_resp_send_err(&req, uri_known ? HTTPD_405_METHOD_NOT_ALLOWED : HTTPD_404_NOT_FOUND, NULL);
+        return keep_alive && !aux.failed;
+    }
+    req.method = m;
+    req.user_ctx = handler->user_ctx;
+    esp_err_t ret = handler->handler(&req);
+    return ret == ESP_OK && keep_alive && !aux.failed;
+}
+
+// Read from a readable session and serve what requests are complete
+static void session_read(sim_httpd_t *server, sim_session_t *session) {
+    ssize_t ret = recv(session->fd, &session->buf[session->len], sizeof(session->buf) - 1 - session->len, 0);
+    if (ret <= 0) {
+        session_close(session);
+        return;
+    }
+    session->len += ret;
+    session->used_at = ++server->clock;
+    while (session->fd >= 0) {
+        session->buf[session->len] = '\0';
+        char *end = strstr(session->buf, "\r\n\r\n");
+        if (end == NULL) {
+            if (session->len == sizeof(session->buf) - 1) {
+                httpd_req_t req = { .handle = server };
+                sim_req_aux_t aux = { .session = session };
+                req.aux = &aux;
+                httpd_resp_send_err(&req, HTTPD_431_REQ_HDR_FIELDS_TOO_LARGE, NULL);
+                session_close(session);
+            }
+            return;
+        }
+        size_t len = end + 4 - session->buf;
+        if (!session_serve(server, session, len)) {
+            session_close(session);
+            return;
+        }
+        // Pipelined requests follow
+        memmove(session->buf, &session->buf[len], session->len - len);
+        session->len -= len;
+    }
+}
+
+static void session_accept(sim_httpd_t *server) {
+    int fd = accept(server->listen_fd, NULL, NULL);
+    if (fd < 0) return;
+    // Chunks go out as they are sent, as lwIP does with its small windows;
+    // Nagle's algorithm would hold them for the ACK of the last one
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    sim_session_t *free_session = NULL;
+    sim_session_t *lru = NULL;
+    for (size_t i = 0; i < server->config.max_open_sockets; i++) {
+        sim_session_t *s = &server->sessions[i];
+        if (s->fd < 0) {
+            free_session = s;
+            break;
+        }
+        if (lru == NULL || s->used_at < lru->used_at) lru = s;
+    }
+    if (free_session == NULL) {
+        if (!server->config.lru_purge_enable) {
+            close(fd);
+            return;
+        }
+        ESP_LOGD(TAG, "Closing least recently used connection");
+        session_close(lru);
+        free_session = lru;
+    }
+    free_session->fd = fd;
+    free_session->len = 0;
+    free_session->used_at = ++server->clock;
+}
+
+static void httpd_task(void *arg) {
+    sim_httpd_t *server = arg;
+    size_t max = server->config.max_open_sockets;
+    struct pollfd pfds[max + 1];
+    while (true) {
+        pfds[0] = (struct pollfd) { .fd = server->listen_fd, .events = POLLIN };
+        for (size_t i = 0; i < max; i++) pfds[i + 1] = (struct pollfd) { .fd = server->sessions[i].fd, .events = POLLIN };
+        if (poll(pfds, max + 1, -1) <= 0) continue;
+        for (size_t i = 0; i < max; i++)
+            if (pfds[i + 1].revents != 0 && server->sessions[i].fd == pfds[i + 1].fd)
+                session_read(server, &server->sessions[i]);
+        if (pfds[0].revents & POLLIN) session_accept(server);
+    }
+}
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config) {
+    sim_httpd_t *server = calloc(1, sizeof(sim_httpd_t));
+    if (server == NULL) return ESP_ERR_HTTPD_ALLOC_MEM;
+    server->config = *config;
+    server->handlers = calloc(config->max_uri_handlers, sizeof(httpd_uri_t));
+    server->sessions = calloc(config->max_open_sockets, sizeof(sim_session_t));
+    if (server->handlers == NULL || server->sessions == NULL) return ESP_ERR_HTTPD_ALLOC_MEM;
+    for (size_t i = 0; i < config->max_open_sockets; i++) server->sessions[i].fd = -1;
+
+    server->listen_fd = socket(AF_INET6, SOCK_STREAM, 0);
+    int one = 1;
+    int zero = 0;
+    setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(server->listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    struct sockaddr_in6 addr = {
+        .sin6_family = AF_INET6,
+        .sin6_addr = in6addr_any,
+        .sin6_port = htons(sim_options.http_port),
+    };
+    if (server->listen_fd < 0 || bind(server->listen_fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 ||
+            listen(server->listen_fd, config->backlog_conn) != 0) {
+        ESP_LOGE(TAG, "Failed to listen on port %u: %s", sim_options.http_port, strerror(errno));
+        return ESP_FAIL;
+    }
+    if (xTaskCreate(httpd_task, "httpd", config->stack_size, server, config->task_priority, NULL) != pdPASS)
+        return ESP_ERR_HTTPD_TASK;
+    ESP_LOGI(TAG, "Listening on port %u", sim_options.http_port);
+    *handle = server;
+    return ESP_OK;
+}
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t *uri_handler) {
+    sim_httpd_t *server = handle;
+    for (size_t i = 0; i < server->handlers_len; i++)
+        if (strcmp(server->handlers[i].uri, uri_handler->uri) == 0 &&
+                server->handlers[i].method == uri_handler->method)
+            return ESP_ERR_HTTPD_HANDLER_EXISTS;
+    if (server->handlers_len == server->config.max_uri_handlers) return ESP_ERR_HTTPD_HANDLERS_FULL;
+    server->handlers[server->handlers_len++] = *uri_handler;
+    return ESP_OK;
+}
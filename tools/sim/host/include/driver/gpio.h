@@ -0,0 +1,5 @@
+// Host stand-in of the ESP-IDF header, pins are not emulated
+#pragma once
+#include "esp_err.h"
+
+typedef int gpio_num_t;
@@ -0,0 +1,8 @@
+// Host stand-in of the ESP-IDF header, one kind of memory
+#pragma once
+#include "stddef.h"
+#include "stdint.h"
+
+#define MALLOC_CAP_8BIT (1 << 2)
+
+size_t heap_caps_get_largest_free_block(uint32_t caps);
@@ -0,0 +1,3 @@
+// Host stand-in of the ESP-IDF header. Empty, remote write is not built
+// in the host firmware.
+#pragma once
@@ -0,0 +1,14 @@
+// Host stand-in of the ESP-IDF header
+#pragma once
+#include "stdint.h"
+#include "esp_err.h"
+
+typedef enum {
+    ESP_MAC_WIFI_STA,
+    ESP_MAC_WIFI_SOFTAP,
+    ESP_MAC_BT,
+    ESP_MAC_ETH,
+} esp_mac_type_t;
+
+// The same locally administered address for every type
+esp_err_t esp_read_mac(uint8_t *mac, esp_mac_type_t type);
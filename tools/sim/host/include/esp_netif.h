@@ -0,0 +1,40 @@
+// Host stand-in of the ESP-IDF header, the host network is up already
+#pragma once
+#include "stdbool.h"
+#include "stdint.h"
+#include "esp_err.h"
+
+typedef struct {
+    uint32_t addr;  // Network byte order
+} esp_ip4_addr_t;
+
+typedef struct {
+    esp_ip4_addr_t ip;
+    esp_ip4_addr_t netmask;
+    esp_ip4_addr_t gw;
+} esp_netif_ip_info_t;
+
+typedef struct esp_netif_obj esp_netif_t;
+
+typedef struct {
+    esp_netif_t *esp_netif;
+    esp_netif_ip_info_t ip_info;
+    bool ip_changed;
+} ip_event_got_ip_t;
+
+typedef enum {
+    IP_EVENT_STA_GOT_IP,
+    IP_EVENT_STA_LOST_IP,
+} ip_event_t;
+
+#define esp_ip4_addr1_16(ipaddr) ((uint16_t) (((ipaddr)->addr >> 0) & 0xff))
+#define esp_ip4_addr2_16(ipaddr) ((uint16_t) (((ipaddr)->addr >> 8) & 0xff))
+#define esp_ip4_addr3_16(ipaddr) ((uint16_t) (((ipaddr)->addr >> 16) & 0xff))
+#define esp_ip4_addr4_16(ipaddr) ((uint16_t) (((ipaddr)->addr >> 24) & 0xff))
+#define IPSTR "%d.%d.%d.%d"
+#define IP2STR(ipaddr) esp_ip4_addr1_16(ipaddr), esp_ip4_addr2_16(ipaddr),\
+    esp_ip4_addr3_16(ipaddr), esp_ip4_addr4_16(ipaddr)
+
+esp_err_t esp_netif_init(void);
+esp_netif_t* esp_netif_create_default_wifi_sta(void);
+esp_err_t esp_netif_set_hostname(esp_netif_t *esp_netif, const char *hostname);
@@ -0,0 +1,5 @@
+// Host stand-in of the ESP-IDF header
+#pragma once
+#include "stdint.h"
+
+uint32_t esp_random(void);
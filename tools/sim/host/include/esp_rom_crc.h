@@ -0,0 +1,6 @@
+// Host stand-in of the ESP-IDF header
+#pragma once
+#include "stdint.h"
+
+// CRC-32 as of zlib, continued from `crc`
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len);
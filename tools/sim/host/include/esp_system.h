@@ -0,0 +1,10 @@
+// Host stand-in of the ESP-IDF header
+#pragma once
+#include "stdint.h"
+#include "esp_err.h"
+
+// Of the emulated heap, see tools/sim/host/system.c
+uint32_t esp_get_free_heap_size(void);
+uint32_t esp_get_minimum_free_heap_size(void);
+
+void esp_restart(void) __attribute__((noreturn));
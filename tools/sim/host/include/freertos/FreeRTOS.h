@@ -0,0 +1,32 @@
+// Host stand-in of the FreeRTOS header. Tasks are POSIX threads, ticks are
+// milliseconds since the program started. Priorities and cores are not
+// emulated, every task may run at once.
+#pragma once
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+#include "stdlib.h"
+#include "string.h"
+#include "esp_err.h"
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint8_t StackType_t;  // Stack depths are in bytes, as with ESP-IDF
+typedef void (*TaskFunction_t)(void *arg);
+
+#define configTICK_RATE_HZ        (1000)
+#define configMAX_TASK_NAME_LEN   (16)
+#define portMAX_DELAY             ((TickType_t) 0xffffffff)
+#define portTICK_PERIOD_MS        (1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms)         ((TickType_t) ((uint64_t) (ms) * configTICK_RATE_HZ / 1000))
+#define pdTRUE                    (1)
+#define pdFALSE                   (0)
+#define pdPASS                    (pdTRUE)
+#define pdFAIL                    (pdFALSE)
+#define tskNO_AFFINITY            (0x7fffffff)
+#define PRO_CPU_NUM               (0)
+#define APP_CPU_NUM               (1)
+
+#include "freertos/task.h"
+#include "freertos/queue.h"
@@ -0,0 +1,6 @@
+// Host stand-in of the FreeRTOS header, bits only
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+#define BIT0 (1 << 0)
+#define BIT1 (1 << 1)
@@ -0,0 +1,13 @@
+// Host stand-in of the FreeRTOS header. A mutex is a queue of one empty
+// item, as in FreeRTOS, without priority inheritance.
+#pragma once
+#include "freertos/queue.h"
+
+typedef QueueHandle_t SemaphoreHandle_t;
+typedef StaticQueue_t StaticSemaphore_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *semphr_buf);
+
+#define xSemaphoreTake(semphr, ticks) xQueueReceive((semphr), NULL, (ticks))
+#define xSemaphoreGive(semphr)        xQueueSend((semphr), NULL, 0)
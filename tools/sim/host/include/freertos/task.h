@@ -0,0 +1,37 @@
+// Host stand-in of the FreeRTOS header, see FreeRTOS.h
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+typedef struct tskTaskControlBlock *TaskHandle_t;
+
+// Room for the control block of a task, see freertos.c
+typedef struct {
+    void *data[64];
+} StaticTask_t;
+
+// `stack_depth` only sizes what uxTaskGetStackHighWaterMark() reports
+// against, threads run on a stack of their own
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack_depth, void *arg,
+                       UBaseType_t priority, TaskHandle_t *created);
+TaskHandle_t xTaskCreateStatic(TaskFunction_t fn, const char *name, uint32_t stack_depth, void *arg,
+                               UBaseType_t priority, StackType_t *stack, StaticTask_t *task_buf);
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack_depth,
+                                           void *arg, UBaseType_t priority, StackType_t *stack,
+                                           StaticTask_t *task_buf, BaseType_t core);
+// Only the calling task, `task` NULL, may be deleted
+void vTaskDelete(TaskHandle_t task);
+
+void vTaskDelay(TickType_t ticks);
+void vTaskDelayUntil(TickType_t *previous_wake, TickType_t increment);
+TickType_t xTaskGetTickCount(void);
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+TaskHandle_t xTaskGetHandle(const char *name);
+const char* pcTaskGetName(TaskHandle_t task);
+// Bytes of `stack_depth` the task never used, as measured on the host
+// stack. Host code takes more or less stack than the same code on the
+// ESP32, take it as an estimate.
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks);
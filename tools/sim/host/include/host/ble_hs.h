@@ -0,0 +1,143 @@
+// Host stand-in of the NimBLE header. There is no radio: advertisements
+// are injected over UDP, see nimble.c, and connections never complete,
+// they time out as with a peer out of range.
+#pragma once
+#include "stdbool.h"
+#include "stdint.h"
+#include "esp_log.h"
+#include "nimble/nimble_port.h"
+
+#define BLE_HS_EAGAIN      1
+#define BLE_HS_EALREADY    2
+#define BLE_HS_EINVAL      3
+#define BLE_HS_ENOTCONN    7
+#define BLE_HS_EAPP        9
+#define BLE_HS_EBADDATA    10
+#define BLE_HS_ETIMEOUT    13
+#define BLE_HS_EBUSY       15
+
+#define BLE_HS_FOREVER     INT32_MAX
+
+#define BLE_ERR_REM_USER_CONN_TERM 0x13
+
+#define BLE_OWN_ADDR_PUBLIC 0
+#define BLE_ADDR_PUBLIC     0
+
+#define BLE_HCI_SCAN_FILT_NO_WL  0
+#define BLE_HCI_SCAN_FILT_USE_WL 1
+
+#define BLE_HCI_ADV_RPT_EVTYPE_NONCONN_IND 3
+
+#define BLE_GAP_EVENT_CONNECT    0
+#define BLE_GAP_EVENT_DISCONNECT 1
+#define BLE_GAP_EVENT_DISC       7
+#define BLE_GAP_EVENT_DISC_COMPLETE 8
+#define BLE_GAP_EVENT_NOTIFY_RX  12
+
+#define MODLOG_DFLT(level, ...) esp_log_write(ESP_LOG_##level, "NimBLE", __VA_ARGS__)
+#define ESP_LOG_CRITICAL ESP_LOG_ERROR
+
+// Addresses are little-endian, `val[5]` is printed first
+typedef struct {
+    uint8_t type;
+    uint8_t val[6];
+} ble_addr_t;
+
+struct os_mbuf {
+    uint8_t *om_data;
+    uint16_t om_len;
+};
+
+struct ble_gap_conn_desc {
+    uint16_t conn_handle;
+    ble_addr_t peer_id_addr;
+};
+
+struct ble_gap_disc_desc {
+    uint8_t event_type;
+    uint8_t length_data;
+    ble_addr_t addr;
+    int8_t rssi;
+    const uint8_t *data;
+    ble_addr_t direct_addr;
+};
+
+struct ble_gap_event {
+    uint8_t type;
+    union {
+        struct {
+            int status;
+            uint16_t conn_handle;
+        } connect;
+        struct {
+            int reason;
+            struct ble_gap_conn_desc conn;
+        } disconnect;
+        struct ble_gap_disc_desc disc;
+        struct {
+            int reason;
+        } disc_complete;
+        struct {
+            struct os_mbuf *om;
+            uint16_t attr_handle;
+            uint16_t conn_handle;
+            uint8_t indication:1;
+        } notify_rx;
+    };
+};
+
+typedef int ble_gap_event_fn(struct ble_gap_event *event, void *arg);
+
+struct ble_gap_disc_params {
+    uint16_t itvl;
+    uint16_t window;
+    uint8_t filter_policy;
+    uint8_t limited:1;
+    uint8_t passive:1;
+    uint8_t filter_duplicates:1;
+};
+
+struct ble_gap_conn_params;
+struct ble_gatt_error;
+struct ble_gatt_attr;
+typedef int ble_gatt_attr_fn(uint16_t conn_handle, const struct ble_gatt_error *error,
+                             struct ble_gatt_attr *attr, void *arg);
+
+struct ble_store_status_event;
+typedef int ble_store_status_fn(struct ble_store_status_event *event, void *arg);
+
+struct ble_hs_cfg {
+    void (*reset_cb)(int reason);
+    void (*sync_cb)(void);
+    ble_store_status_fn *store_status_cb;
+    void *store_status_arg;
+};
+
+extern struct ble_hs_cfg ble_hs_cfg;
+
+// Only the fields the firmware reads are parsed
+struct ble_hs_adv_fields {
+    uint8_t flags;
+    const uint8_t *name;
+    uint8_t name_len;
+    uint8_t name_is_complete:1;
+    const uint8_t *svc_data_uuid16;
+    uint8_t svc_data_uuid16_len;
+};
+
+int ble_hs_adv_parse_fields(struct ble_hs_adv_fields *adv_fields, const uint8_t *src, uint8_t src_len);
+int ble_hs_id_infer_auto(int privacy, uint8_t *out_addr_type);
+int ble_store_util_status_rr(struct ble_store_status_event *event, void *arg);
+
+int ble_gap_wl_set(const ble_addr_t *addrs, uint8_t white_list_count);
+int ble_gap_disc(uint8_t own_addr_type, int32_t duration_ms, const struct ble_gap_disc_params *disc_params,
+                 ble_gap_event_fn *cb, void *cb_arg);
+int ble_gap_disc_cancel(void);
+int ble_gap_disc_active(void);
+int ble_gap_connect(uint8_t own_addr_type, const ble_addr_t *peer_addr, int32_t duration_ms,
+                    const struct ble_gap_conn_params *params, ble_gap_event_fn *cb, void *cb_arg);
+int ble_gap_conn_cancel(void);
+int ble_gap_conn_active(void);
+int ble_gap_terminate(uint16_t conn_handle, uint8_t hci_reason);
+int ble_gattc_write_flat(uint16_t conn_handle, uint16_t attr_handle, const void *data, uint16_t data_len,
+                         ble_gatt_attr_fn *cb, void *cb_arg);
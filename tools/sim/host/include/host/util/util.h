@@ -0,0 +1,4 @@
+// Host stand-in of the NimBLE header
+#pragma once
+
+int ble_hs_util_ensure_addr(int prefer_random);
@@ -0,0 +1,45 @@
+// Host stand-in of the NimBLE header. The host task runs callouts and GAP
+// events only, see nimble.c.
+#pragma once
+#include "stdbool.h"
+#include "stdint.h"
+#include "esp_err.h"
+
+typedef uint32_t ble_npl_time_t;
+typedef int ble_npl_error_t;
+
+struct ble_npl_event;
+typedef void ble_npl_event_fn(struct ble_npl_event *ev);
+
+struct ble_npl_event {
+    ble_npl_event_fn *fn;
+    void *arg;
+};
+
+struct ble_npl_eventq {
+    int unused;
+};
+
+struct ble_npl_callout {
+    struct ble_npl_event ev;
+    struct ble_npl_eventq *evq;
+    int64_t due_ms;   // Uptime to run at, if `active`
+    bool active;
+    struct ble_npl_callout *next;
+};
+
+esp_err_t nimble_port_init(void);
+esp_err_t nimble_port_deinit(void);
+// Run the host until nimble_port_stop(), on the calling task
+void nimble_port_run(void);
+int nimble_port_stop(void);
+struct ble_npl_eventq* nimble_port_get_dflt_eventq(void);
+
+void ble_npl_callout_init(struct ble_npl_callout *co, struct ble_npl_eventq *evq,
+                          ble_npl_event_fn *ev_cb, void *ev_arg);
+ble_npl_error_t ble_npl_callout_reset(struct ble_npl_callout *co, ble_npl_time_t ticks);
+void ble_npl_callout_stop(struct ble_npl_callout *co);
+bool ble_npl_callout_is_active(struct ble_npl_callout *co);
+void* ble_npl_event_get_arg(struct ble_npl_event *ev);
+// Ticks are milliseconds
+uint32_t ble_npl_time_ms_to_ticks32(uint32_t ms);
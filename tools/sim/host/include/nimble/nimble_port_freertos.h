@@ -0,0 +1,7 @@
+// Host stand-in of the NimBLE header
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+// Start the host task, "nimble_host", running `host_task_fn`
+void nimble_port_freertos_init(TaskFunction_t host_task_fn);
+void nimble_port_freertos_deinit(void);
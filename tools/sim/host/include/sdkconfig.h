@@ -0,0 +1,46 @@
+// Configuration of the host build of the firmware, in place of the one
+// generated by menuconfig. Defaults of the Kconfig files, except for the
+// sensors wired to the emulators of tools/sim/.
+#pragma once
+
+#define CONFIG_METRICS_HOSTNAME "espair-sim"
+#define CONFIG_METRICS_WIFI_SSID "sim"
+#define CONFIG_METRICS_WIFI_PSK ""
+#define CONFIG_METRICS_HTTP_PATH "/metrics"
+#define CONFIG_METRICS_HTTP_MAX_CLIENTS 7
+#define CONFIG_METRICS_MAX_ITEMS 160
+#define CONFIG_METRICS_MAX_FAMILIES 128
+#define CONFIG_METRICS_MAX_HISTOGRAMS 8
+#define CONFIG_METRICS_MAX_BUCKETS 128
+#define CONFIG_METRICS_NAMES_SIZE 4096
+#define CONFIG_METRICS_RENDER_BLOCK_SIZE 512
+#define CONFIG_METRICS_HISTORY 1
+#define CONFIG_METRICS_HISTORY_PATH "/history"
+#define CONFIG_METRICS_HISTORY_SIZE 32768
+#define CONFIG_METRICS_HISTORY_PAGE_SIZE 256
+#define CONFIG_METRICS_HISTORY_INTERVAL_SECS 60
+#define CONFIG_METRICS_LOG 1
+#define CONFIG_METRICS_LOG_PATH "/log"
+#define CONFIG_METRICS_LOG_FLUSH_SECS 3600
+#define CONFIG_METRICS_NTP_SERVER "pool.ntp.org"
+
+#define CONFIG_SCHEDULER_MAX_JOBS 16
+#define CONFIG_SCHEDULER_STACK_SIZE 4096
+#define CONFIG_SCHEDULER_PRIORITY 10
+
+#define CONFIG_SM300D2_UART_PORT_NUM 2
+#define CONFIG_SM300D2_UART_RXD 5
+#define CONFIG_SM300D2_AGGREGATION_SECS 10
+
+#define CONFIG_SENSE_AIR_S8_UART_PORT_NUM 1
+#define CONFIG_SENSE_AIR_S8_UART_RXD 16
+#define CONFIG_SENSE_AIR_S8_UART_TXD 17
+#define CONFIG_SENSE_AIR_S8_ADDRESSES "254"
+#define CONFIG_SENSE_AIR_S8_INTERVAL_MILLIS 4000
+
+// The two clocks `sensors.py lywsd02` advertises by default
+#define CONFIG_LYWSD02_MAC_ADDRS "01:23:de:ad:be:ef, 01:23:de:ad:be:f0"
+#define CONFIG_LYWSD02_ADV_TIMEOUT_SECS 300
+
+#define CONFIG_LWIP_MAX_SOCKETS 10
+#define CONFIG_FREERTOS_UNICORE 1
@@ -0,0 +1,4 @@
+// Host stand-in of the NimBLE header
+#pragma once
+
+int ble_svc_gap_device_name_set(const char *name);
@@ -0,0 +1,328 @@
+// NimBLE host without a controller. The host task runs callouts and
+// delivers advertisements received as UDP datagrams on --ble-port: the
+// advertiser's address, 6 bytes as printed, then the advertising data,
+// see `sensors.py lywsd02`. Connection attempts time out.
+#include "errno.h"
+#include "poll.h"
+#include "pthread.h"
+#include "string.h"
+#include "unistd.h"
+#include "netinet/in.h"
+#include "sys/socket.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "nimble/nimble_port.h"
+#include "nimble/nimble_port_freertos.h"
+#include "host/ble_hs.h"
+#include "host/util/util.h"
+#include "services/gap/ble_svc_gap.h"
+
+#include "sim.h"
+
+#define HOST_TASK_STACK_SIZE (4096) // CONFIG_BT_NIMBLE_HOST_TASK_STACK_SIZE
+#define WL_SIZE (8)
+#define ADV_MAX_LEN (31)
+
+#define AD_TYPE_FLAGS            (0x01)
+#define AD_TYPE_NAME_SHORT       (0x08)
+#define AD_TYPE_NAME_COMPLETE    (0x09)
+#define AD_TYPE_SVC_DATA_UUID16  (0x16)
+
+struct ble_hs_cfg ble_hs_cfg;
+
+static const char *TAG = "NimBLE";
+
+// GAP state, only touched by the host task like the rest of the stack
+static struct ble_npl_eventq dflt_eventq;
+static struct ble_npl_callout *callouts = NULL;
+static pthread_mutex_t callouts_lock = PTHREAD_MUTEX_INITIALIZER;
+static int wake_pipe[2] = { -1, -1 };
+static int adv_fd = -1;
+static volatile bool stopped = false;
+static ble_addr_t wl[WL_SIZE];
+static uint8_t wl_len = 0;
+static struct {
+    bool active;
+    uint8_t filter_policy;
+    ble_gap_event_fn *cb;
+    void *cb_arg;
+} disc;
+static struct {
+    bool active;
+    int64_t due_ms;
+    int status;              // Reported when due, BLE_HS_ETIMEOUT unless cancelled
+    ble_gap_event_fn *cb;
+    void *cb_arg;
+} conn;
+
+static int64_t now_ms() {
+    return sim_uptime_us() / 1000;
+}
+
+static void host_wake() {
+    if (wake_pipe[1] >= 0) (void) !write(wake_pipe[1], "", 1);
+}
+
+esp_err_t nimble_port_init() {
+    if (pipe(wake_pipe) != 0) return ESP_FAIL;
+    if (sim_options.ble_port == 0) return ESP_OK;
+    adv_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = htons(sim_options.ble_port),
+    };
+    if (adv_fd < 0 || bind(adv_fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        ESP_LOGE(TAG, "Failed to listen for advertisements on UDP %u: %s", sim_options.ble_port, strerror(errno));
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "Advertisements from UDP port %u", sim_options.ble_port);
+    return ESP_OK;
+}
+
+esp_err_t nimble_port_deinit() {
+    return ESP_OK;
+}
+
+int nimble_port_stop() {
+    stopped = true;
+    host_wake();
+    return 0;
+}
+
+struct ble_npl_eventq* nimble_port_get_dflt_eventq() {
+    return &dflt_eventq;
+}
+
+void ble_npl_callout_init(struct ble_npl_callout *co, struct ble_npl_eventq *evq,
+                          ble_npl_event_fn *ev_cb, void *ev_arg) {
+    memset(co, 0, sizeof(*co));
+    co->ev.fn = ev_cb;
+    co->ev.arg = ev_arg;
+    co->evq = evq;
+    pthread_mutex_lock(&callouts_lock);
+    co->next = callouts;
+    callouts = co;
+    pthread_mutex_unlock(&callouts_lock);
+}
+
+ble_npl_error_t ble_npl_callout_reset(struct ble_npl_callout *co, ble_npl_time_t ticks) {
+    pthread_mutex_lock(&callouts_lock);
+    co->due_ms = now_ms() + ticks;
+    co->active = true;
+    pthread_mutex_unlock(&callouts_lock);
+    host_wake();
+    return 0;
+}
+
+void ble_npl_callout_stop(struct ble_npl_callout *co) {
+    pthread_mutex_lock(&callouts_lock);
+    co->active = false;
+    pthread_mutex_unlock(&callouts_lock);
+}
+
+bool ble_npl_callout_is_active(struct ble_npl_callout *co) {
+    pthread_mutex_lock(&callouts_lock);
+    bool active = co->active;
+    pthread_mutex_unlock(&callouts_lock);
+    return active;
+}
+
+void* ble_npl_event_get_arg(struct ble_npl_event *ev) {
+    return ev->arg;
+}
+
+uint32_t ble_npl_time_ms_to_ticks32(uint32_t ms) {
+    return ms;
+}
+
+// Run the first due callout, return whether there was one. Sets `wait_ms`
+// to the time until the next one otherwise, or -1 if none is active.
+static bool callouts_run(int *wait_ms) {
+    int64_t now = now_ms();
+    struct ble_npl_callout *due = NULL;
+    *wait_ms = -1;
+    pthread_mutex_lock(&callouts_lock);
+    for (struct ble_npl_callout *co = callouts; co != NULL; co = co->next) {
+        if (!co->active) continue;
+        if (co->due_ms <= now) {
+            due = co;
+            break;
+        }
+        if (*wait_ms < 0 || co->due_ms - now < *wait_ms) *wait_ms = co->due_ms - now;
+    }
+    if (due != NULL) due->active = false;
+    pthread_mutex_unlock(&callouts_lock);
+    if (due != NULL) due->ev.fn(&due->ev);
+    return due != NULL;
+}
+
+static void conn_complete() {
+    struct ble_gap_event event = { .type = BLE_GAP_EVENT_CONNECT };
+    event.connect.status = conn.status;
+    event.connect.conn_handle = 0xffff;
+    conn.active = false;
+    conn.cb(&event, conn.cb_arg);
+}
+
+static void adv_receive() {
+    uint8_t datagram[6 + ADV_MAX_LEN];
+    ssize_t len = recv(adv_fd, datagram, sizeof(datagram), 0);
+    if (len < 6 || !disc.active) return;
+    struct ble_gap_event event = { .type = BLE_GAP_EVENT_DISC };
+    struct ble_gap_disc_desc *desc = &event.disc;
+    desc->event_type = BLE_HCI_ADV_RPT_EVTYPE_NONCONN_IND;
+    desc->addr.type = BLE_ADDR_PUBLIC;
+    for (size_t i = 0; i < 6; i++) desc->addr.val[i] = datagram[5 - i];
+    desc->rssi = -60;
+    desc->data = &datagram[6];
+    desc->length_data = len - 6;
+    if (disc.filter_policy == BLE_HCI_SCAN_FILT_USE_WL) {
+        bool listed = false;
+        for (size_t i = 0; i < wl_len && !listed; i++)
+            listed = memcmp(wl[i].val, desc->addr.val, sizeof(wl[i].val)) == 0;
+        if (!listed) return;
+    }
+    disc.cb(&event, disc.cb_arg);
+}
+
+void nimble_port_run() {
+    if (ble_hs_cfg.sync_cb != NULL) ble_hs_cfg.sync_cb();
+    while (!stopped) {
+        int wait_ms;
+        if (callouts_run(&wait_ms)) continue;
+        if (conn.active) {
+            int64_t left = conn.due_ms - now_ms();
+            if (left <= 0) {
+                conn_complete();
+                continue;
+            }
+            if (wait_ms < 0 || left < wait_ms) wait_ms = left;
+        }
+        struct pollfd pfds[2] = {
+            { .fd = wake_pipe[0], .events = POLLIN },
+            { .fd = adv_fd, .events = POLLIN },
+        };
+        if (poll(pfds, 2, wait_ms) <= 0) continue;
+        if (pfds[0].revents & POLLIN) {
+            char buf[16];
+            (void) !read(wake_pipe[0], buf, sizeof(buf));
+        }
+        if (pfds[1].revents & POLLIN) adv_receive();
+    }
+}
+
+void nimble_port_freertos_init(TaskFunction_t host_task_fn) {
+    xTaskCreate(host_task_fn, "nimble_host", HOST_TASK_STACK_SIZE, NULL, 21, NULL);
+}
+
+void nimble_port_freertos_deinit() {
+    vTaskDelete(NULL);
+}
+
+int ble_hs_util_ensure_addr(int prefer_random) {
+    return 0;
+}
+
+int ble_hs_id_infer_auto(int privacy, uint8_t *out_addr_type) {
+    *out_addr_type = BLE_OWN_ADDR_PUBLIC;
+    return 0;
+}
+
+int ble_svc_gap_device_name_set(const char *name) {
+    return 0;
+}
+
+int ble_store_util_status_rr(struct ble_store_status_event *event, void *arg) {
+    return 0;
+}
+
+int ble_hs_adv_parse_fields(struct ble_hs_adv_fields *adv_fields, const uint8_t *src, uint8_t src_len) {
+    memset(adv_fields, 0, sizeof(*adv_fields));
+    while (src_len > 0) {
+        uint8_t len = src[0];
+        if (len == 0 || len >= src_len) return len == 0 ? 0 : BLE_HS_EBADDATA;
+        uint8_t type = src[1];
+        const uint8_t *data = &src[2];
+        uint8_t data_len = len - 1;
+        if (type == AD_TYPE_FLAGS && data_len == 1) {
+            adv_fields->flags = data[0];
+        } else if (type == AD_TYPE_NAME_SHORT || type == AD_TYPE_NAME_COMPLETE) {
+            adv_fields->name = data;
+            adv_fields->name_len = data_len;
+            adv_fields->name_is_complete = type == AD_TYPE_NAME_COMPLETE;
+        } else if (type == AD_TYPE_SVC_DATA_UUID16) {
+            if (data_len < 2) return BLE_HS_EBADDATA;
+            adv_fields->svc_data_uuid16 = data;
+            adv_fields->svc_data_uuid16_len = data_len;
+        }
+        src += len + 1;
+        src_len -= len + 1;
+    }
+    return 0;
+}
+
+// Whitelisted scans and connections use the list
+int ble_gap_wl_set(const ble_addr_t *addrs, uint8_t white_list_count) {
+    if ((disc.active && disc.filter_policy == BLE_HCI_SCAN_FILT_USE_WL) || conn.active) return BLE_HS_EBUSY;
+    if (white_list_count > WL_SIZE) return BLE_HS_EINVAL;
+    memcpy(wl, addrs, white_list_count * sizeof(ble_addr_t));
+    wl_len = white_list_count;
+    return 0;
+}
+
+int ble_gap_disc(uint8_t own_addr_type, int32_t duration_ms, const struct ble_gap_disc_params *disc_params,
+                 ble_gap_event_fn *cb, void *cb_arg) {
+    if (disc.active) return BLE_HS_EALREADY;
+    if (conn.active) return BLE_HS_EBUSY;
+    // Scans run until cancelled, `duration_ms` is not emulated
+    disc.active = true;
+    disc.filter_policy = disc_params->filter_policy;
+    disc.cb = cb;
+    disc.cb_arg = cb_arg;
+    return 0;
+}
+
+int ble_gap_disc_cancel() {
+    if (!disc.active) return BLE_HS_EALREADY;
+    disc.active = false;
+    return 0;
+}
+
+int ble_gap_disc_active() {
+    return disc.active;
+}
+
+int ble_gap_connect(uint8_t own_addr_type, const ble_addr_t *peer_addr, int32_t duration_ms,
+                    const struct ble_gap_conn_params *params, ble_gap_event_fn *cb, void *cb_arg) {
+    if (conn.active) return BLE_HS_EALREADY;
+    if (disc.active) return BLE_HS_EBUSY;
+    conn.active = true;
+    conn.due_ms = now_ms() + (duration_ms > 0 ? duration_ms : 30000);
+    conn.status = BLE_HS_ETIMEOUT;
+    conn.cb = cb;
+    conn.cb_arg = cb_arg;
+    return 0;
+}
+
+// The connect event follows from the host task, as from the controller
+int ble_gap_conn_cancel() {
+    if (!conn.active) return BLE_HS_EALREADY;
+    conn.due_ms = now_ms();
+    conn.status = BLE_HS_EAPP;
+    return 0;
+}
+
+int ble_gap_conn_active() {
+    return conn.active;
+}
+
+int ble_gap_terminate(uint16_t conn_handle, uint8_t hci_reason) {
+    return BLE_HS_ENOTCONN;
+}
+
+int ble_gattc_write_flat(uint16_t conn_handle, uint16_t attr_handle, const void *data, uint16_t data_len,
+                         ble_gatt_attr_fn *cb, void *cb_arg) {
+    return BLE_HS_ENOTCONN;
+}
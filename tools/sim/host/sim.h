@@ -0,0 +1,30 @@
+// Glue between the shims and main() of the host firmware
+#pragma once
+#include "stdio.h"
+#include "stddef.h"
+#include "stdint.h"
+#include "driver/uart.h"
+
+// Set from the command line before app_main()
+typedef struct {
+    const char *uart_paths[UART_NUM_MAX];  // tty of each port, or NULL
+    uint16_t http_port;
+    uint16_t ble_port;       // UDP port advertisements are injected on, or 0
+    const char *flash_path;  // File backing the "metrics" partition, or NULL for RAM
+    size_t heap_size;        // Heap of the emulated device, in bytes
+} sim_options_t;
+
+extern sim_options_t sim_options;
+
+// Microseconds since the program started, the clock of ticks & esp_timer
+int64_t sim_uptime_us(void);
+
+// Adopt the calling thread, not started by xTaskCreate(), as task `name`
+void sim_task_adopt(const char *name);
+
+// Print CPU time and stack use of every task, as JSON members
+void sim_tasks_report(FILE *out);
+
+// Bytes the firmware holds on the heap, now and at most
+size_t sim_heap_used(void);
+size_t sim_heap_peak(void);
@@ -0,0 +1,122 @@
+// Host build of the firmware: app_main() of src/main.c on the shims of
+// this directory, until SIGINT or SIGTERM. Then a report of CPU time,
+// heap and stack use is printed as JSON on stdout, logs go to stderr.
+#include "getopt.h"
+#include "signal.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "pthread.h"
+#include "sys/resource.h"
+#include "esp_log.h"
+
+#include "sim.h"
+
+sim_options_t sim_options = {
+    .http_port = 8080,
+    .heap_size = 160 * 1024,
+};
+
+void app_main(void);
+
+static const char *USAGE =
+    "Usage: %s [options]\n"
+    "  --uart N=PATH     Wire UART N to the tty PATH, e.g. the pty of sensors.py;\n"
+    "                    Senseair S8 is on %d, SM300D2 on %d\n"
+    "  --http-port PORT  Serve HTTP on PORT, default %u\n"
+    "  --ble-port PORT   Receive BLE advertisements on UDP PORT of localhost\n"
+    "  --flash PATH      Keep the \"metrics\" partition in the file PATH, in RAM if not given\n"
+    "  --heap BYTES      Heap of the emulated device, default %zu\n"
+    "  --log-level L     none, error, warn, info (default), debug or verbose\n";
+
+static void usage(const char *argv0) {
+    fprintf(stderr, USAGE, argv0, CONFIG_SENSE_AIR_S8_UART_PORT_NUM, CONFIG_SM300D2_UART_PORT_NUM,
+            sim_options.http_port, sim_options.heap_size);
+    exit(2);
+}
+
+static void parse_options(int argc, char **argv) {
+    static const struct option OPTIONS[] = {
+        { "uart", required_argument, NULL, 'u' },
+        { "http-port", required_argument, NULL, 'p' },
+        { "ble-port", required_argument, NULL, 'b' },
+        { "flash", required_argument, NULL, 'f' },
+        { "heap", required_argument, NULL, 'm' },
+        { "log-level", required_argument, NULL, 'l' },
+        { "help", no_argument, NULL, 'h' },
+        {},
+    };
+    static const char *LEVELS[] = { "none", "error", "warn", "info", "debug", "verbose" };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", OPTIONS, NULL)) != -1) {
+        switch (opt) {
+        case 'u': {
+            char *path = strchr(optarg, '=');
+            int port = atoi(optarg);
+            if (path == NULL || port < 0 || port >= UART_NUM_MAX) usage(argv[0]);
+            sim_options.uart_paths[port] = path + 1;
+            break;
+        }
+        case 'p':
+            sim_options.http_port = atoi(optarg);
+            break;
+        case 'b':
+            sim_options.ble_port = atoi(optarg);
+            break;
+        case 'f':
+            sim_options.flash_path = optarg;
+            break;
+        case 'm':
+            sim_options.heap_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'l': {
+            size_t i = 0;
+            while (i < sizeof(LEVELS) / sizeof(LEVELS[0]) && strcmp(optarg, LEVELS[i]) != 0) i++;
+            if (i == sizeof(LEVELS) / sizeof(LEVELS[0])) usage(argv[0]);
+            esp_log_level_set("*", i);
+            break;
+        }
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind < argc) usage(argv[0]);
+}
+
+static void report() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("{\n");
+    printf("  \"uptime_seconds\": %.3f,\n", sim_uptime_us() / 1e6);
+    printf("  \"cpu_user_seconds\": %.3f,\n", usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6);
+    printf("  \"cpu_system_seconds\": %.3f,\n", usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6);
+    printf("  \"max_rss_bytes\": %ld,\n", usage.ru_maxrss * 1024);
+    printf("  \"heap_size_bytes\": %zu,\n", sim_options.heap_size);
+    printf("  \"heap_used_bytes\": %zu,\n", sim_heap_used());
+    printf("  \"heap_peak_bytes\": %zu,\n", sim_heap_peak());
+    printf("  \"tasks\": {\n");
+    sim_tasks_report(stdout);
+    printf("  }\n}\n");
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    parse_options(argc, argv);
+
+    // Tasks inherit the mask, the signals are only taken here
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // As the "main" task of ESP-IDF, which is deleted once app_main() returns
+    sim_task_adopt("main");
+    app_main();
+
+    int sig;
+    sigwait(&signals, &sig);
+    report();
+    return 0;
+}
@@ -0,0 +1,389 @@
+// The rest of ESP-IDF the firmware uses: logging, errors, the default event
+// loop with a station that connects at once, the heap & the flash partition
+#include "errno.h"
+#include "fcntl.h"
+#include "malloc.h"
+#include "pthread.h"
+#include "stdarg.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "unistd.h"
+#include "arpa/inet.h"
+#include "sys/mman.h"
+#include "sys/random.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_event.h"
+#include "esp_wifi.h"
+#include "esp_netif.h"
+#include "esp_mac.h"
+#include "esp_random.h"
+#include "esp_rom_crc.h"
+#include "esp_sntp.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "esp_partition.h"
+#include "nvs_flash.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+#include "sim.h"
+
+#define EVENT_TASK_STACK_SIZE (2304) // CONFIG_ESP_SYSTEM_EVENT_TASK_STACK_SIZE
+#define EVENT_QUEUE_LEN       (32)
+#define EVENT_DATA_SIZE       (64)
+#define MAX_HANDLERS          (8)
+#define PARTITION_SIZE        (0x40000) // "metrics" of partitions.csv
+#define SECTOR_SIZE           (4096)
+
+static const char *TAG = "sim";
+
+static esp_log_level_t log_level = ESP_LOG_INFO;
+
+void esp_log_level_set(const char *tag, esp_log_level_t level) {
+    if (strcmp(tag, "*") == 0) log_level = level;
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...) {
+    static const char LETTERS[] = "NEWIDV";
+    if (level > log_level) return;
+    // One write per line, lines of tasks do not interleave
+    char line[512];
+    int len = snprintf(line, sizeof(line), "%c (%lld) %s: ", LETTERS[level],
+                       (long long) (sim_uptime_us() / 1000), tag);
+    va_list args;
+    va_start(args, format);
+    len += vsnprintf(&line[len], sizeof(line) - len, format, args);
+    va_end(args);
+    if (len > (int) sizeof(line) - 2) len = sizeof(line) - 2;
+    if (line[len - 1] != '\n') line[len++] = '\n';
+    (void) !write(STDERR_FILENO, line, len);
+}
+
+const char* esp_err_to_name(esp_err_t code) {
+    switch (code) {
+    case ESP_OK: return "ESP_OK";
+    case ESP_FAIL: return "ESP_FAIL";
+    case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+    case ESP_ERR_INVALID_RESPONSE: return "ESP_ERR_INVALID_RESPONSE";
+    case ESP_ERR_INVALID_CRC: return "ESP_ERR_INVALID_CRC";
+    default: return "UNKNOWN ERROR";
+    }
+}
+
+void _esp_error_check_failed(esp_err_t rc, const char *file, int line, const char *function,
+                             const char *expression) {
+    fprintf(stderr, "ESP_ERROR_CHECK failed: esp_err_t 0x%x (%s) at %s:%d\nfile: \"%s\" line %d\nfunc: %s\nexpression: %s\n",
+            rc, esp_err_to_name(rc), file, line, file, line, function, expression);
+    abort();
+}
+
+void esp_restart() {
+    ESP_LOGE(TAG, "Restart requested, exiting");
+    exit(1);
+}
+
+// Default event loop
+
+esp_event_base_t const WIFI_EVENT = "WIFI_EVENT";
+esp_event_base_t const IP_EVENT = "IP_EVENT";
+
+typedef struct {
+    esp_event_base_t base;
+    int32_t id;
+    uint8_t data[EVENT_DATA_SIZE];
+} sim_event_t;
+
+static struct {
+    esp_event_base_t base;
+    int32_t id;
+    esp_event_handler_t handler;
+    void *arg;
+} handlers[MAX_HANDLERS];
+static size_t handlers_len = 0;
+static pthread_mutex_t handlers_lock = PTHREAD_MUTEX_INITIALIZER;
+static QueueHandle_t events = NULL;
+
+static void event_task(void *arg) {
+    sim_event_t event;
+    while (true) {
+        if (!xQueueReceive(events, &event, portMAX_DELAY)) continue;
+        pthread_mutex_lock(&handlers_lock);
+        size_t len = handlers_len;
+        pthread_mutex_unlock(&handlers_lock);
+        for (size_t i = 0; i < len; i++) {
+            if (handlers[i].base != event.base) continue;
+            if (handlers[i].id != ESP_EVENT_ANY_ID && handlers[i].id != event.id) continue;
+            handlers[i].handler(handlers[i].arg, event.base, event.id, event.data);
+        }
+    }
+}
+
+esp_err_t esp_event_loop_create_default() {
+    if (events != NULL) return ESP_ERR_INVALID_STATE;
+    events = xQueueCreate(EVENT_QUEUE_LEN, sizeof(sim_event_t));
+    if (events == NULL) return ESP_ERR_NO_MEM;
+    if (xTaskCreate(event_task, "sys_evt", EVENT_TASK_STACK_SIZE, NULL, 20, NULL) != pdPASS) return ESP_FAIL;
+    return ESP_OK;
+}
+
+esp_err_t esp_event_handler_instance_register(esp_event_base_t event_base, int32_t event_id,
+                                              esp_event_handler_t event_handler, void *event_handler_arg,
+                                              esp_event_handler_instance_t *instance) {
+    pthread_mutex_lock(&handlers_lock);
+    if (handlers_len == MAX_HANDLERS) {
+        pthread_mutex_unlock(&handlers_lock);
+        return ESP_ERR_NO_MEM;
+    }
+    size_t i = handlers_len;
+    handlers[i].base = event_base;
+    handlers[i].id = event_id;
+    handlers[i].handler = event_handler;
+    handlers[i].arg = event_handler_arg;
+    handlers_len++;
+    pthread_mutex_unlock(&handlers_lock);
+    if (instance != NULL) *instance = &handlers[i];
+    return ESP_OK;
+}
+
+esp_err_t esp_event_post(esp_event_base_t event_base, int32_t event_id, const void *event_data,
+                         size_t event_data_size, TickType_t ticks_to_wait) {
+    if (events == NULL) return ESP_ERR_INVALID_STATE;
+    if (event_data_size > EVENT_DATA_SIZE) return ESP_ERR_INVALID_ARG;
+    sim_event_t event = { .base = event_base, .id = event_id };
+    if (event_data != NULL) memcpy(event.data, event_data, event_data_size);
+    return xQueueSend(events, &event, ticks_to_wait) == pdTRUE ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+// Network, the host's own
+
+esp_err_t esp_netif_init() {
+    return ESP_OK;
+}
+
+esp_netif_t* esp_netif_create_default_wifi_sta() {
+    static int netif;
+    return (esp_netif_t*) &netif;
+}
+
+esp_err_t esp_netif_set_hostname(esp_netif_t *esp_netif, const char *hostname) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_init(const wifi_init_config_t *config) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_config(wifi_interface_t interface, wifi_config_t *conf) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_start() {
+    return esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_START, NULL, 0, portMAX_DELAY);
+}
+
+esp_err_t esp_wifi_connect() {
+    ip_event_got_ip_t got_ip = {
+        .esp_netif = esp_netif_create_default_wifi_sta(),
+        .ip_info.ip.addr = htonl(0x7f000001),
+        .ip_changed = true,
+    };
+    esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_CONNECTED, NULL, 0, portMAX_DELAY);
+    return esp_event_post(IP_EVENT, IP_EVENT_STA_GOT_IP, &got_ip, sizeof(got_ip), portMAX_DELAY);
+}
+
+void esp_sntp_setoperatingmode(esp_sntp_operatingmode_t operating_mode) {}
+
+void esp_sntp_setservername(uint8_t idx, const char *server) {}
+
+void esp_sntp_init() {}
+
+esp_err_t nvs_flash_init() {
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase() {
+    return ESP_OK;
+}
+
+esp_err_t esp_read_mac(uint8_t *mac, esp_mac_type_t type) {
+    static const uint8_t MAC[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+    memcpy(mac, MAC, sizeof(MAC));
+    return ESP_OK;
+}
+
+uint32_t esp_random() {
+    uint32_t value;
+    while (getrandom(&value, sizeof(value), 0) != sizeof(value)) {}
+    return value;
+}
+
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len) {
+    crc = ~crc;
+    for (uint32_t i = 0; i < len; i++) {
+        crc ^= buf[i];
+        for (int k = 0; k < 8; k++) crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+    }
+    return ~crc;
+}
+
+// Heap. Allocations of the firmware and the shims are counted against
+// --heap, the RAM left on the device once Wi-Fi & BLE are up, and fail
+// past it. The link wraps malloc() & co. with these, see CMakeLists.txt.
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+static size_t heap_used = 0;
+static size_t heap_peak = 0;
+
+static bool heap_take(size_t size) {
+    size_t used = __atomic_add_fetch(&heap_used, size, __ATOMIC_RELAXED);
+    if (used > sim_options.heap_size) {
+        __atomic_sub_fetch(&heap_used, size, __ATOMIC_RELAXED);
+        return false;
+    }
+    size_t peak = __atomic_load_n(&heap_peak, __ATOMIC_RELAXED);
+    while (used > peak && !__atomic_compare_exchange_n(&heap_peak, &peak, used, true,
+                                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+    return true;
+}
+
+static void* heap_account(void *ptr) {
+    if (ptr != NULL && !heap_take(malloc_usable_size(ptr))) {
+        __real_free(ptr);
+        return NULL;
+    }
+    return ptr;
+}
+
+void* __wrap_malloc(size_t size) {
+    return heap_account(__real_malloc(size));
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    return heap_account(__real_calloc(count, size));
+}
+
+void __wrap_free(void *ptr) {
+    if (ptr == NULL) return;
+    __atomic_sub_fetch(&heap_used, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+    __real_free(ptr);
+}
+
+void* __wrap_realloc(void *ptr, size_t size) {
+    void *moved = __wrap_malloc(size);
+    if (moved == NULL || ptr == NULL) return moved;
+    size_t old = malloc_usable_size(ptr);
+    memcpy(moved, ptr, old < size ? old : size);
+    __wrap_free(ptr);
+    return moved;
+}
+
+size_t sim_heap_used() {
+    return __atomic_load_n(&heap_used, __ATOMIC_RELAXED);
+}
+
+size_t sim_heap_peak() {
+    return __atomic_load_n(&heap_peak, __ATOMIC_RELAXED);
+}
+
+uint32_t esp_get_free_heap_size() {
+    return sim_options.heap_size - sim_heap_used();
+}
+
+uint32_t esp_get_minimum_free_heap_size() {
+    return sim_options.heap_size - sim_heap_peak();
+}
+
+// Fragmentation is not emulated
+size_t heap_caps_get_largest_free_block(uint32_t caps) {
+    return esp_get_free_heap_size();
+}
+
+// Flash partition
+
+static esp_partition_t partition = {
+    .type = ESP_PARTITION_TYPE_DATA,
+    .subtype = 0x40,
+    .address = 0x190000,
+    .size = PARTITION_SIZE,
+    .erase_size = SECTOR_SIZE,
+    .label = "metrics",
+};
+static uint8_t *flash = NULL;
+
+static bool flash_map() {
+    if (sim_options.flash_path == NULL) {
+        flash = mmap(NULL, PARTITION_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (flash == MAP_FAILED) return false;
+        memset(flash, 0xff, PARTITION_SIZE);  // Erased
+        return true;
+    }
+    int fd = open(sim_options.flash_path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        ESP_LOGE(TAG, "Failed to open %s: %s", sim_options.flash_path, strerror(errno));
+        return false;
+    }
+    off_t len = lseek(fd, 0, SEEK_END);
+    uint8_t erased[SECTOR_SIZE];
+    memset(erased, 0xff, sizeof(erased));
+    // A new or short file is erased flash past its end
+    while (len < PARTITION_SIZE) {
+        size_t n = PARTITION_SIZE - len < (off_t) sizeof(erased) ? PARTITION_SIZE - len : sizeof(erased);
+        if (pwrite(fd, erased, n, len) != (ssize_t) n) {
+            close(fd);
+            return false;
+        }
+        len += n;
+    }
+    flash = mmap(NULL, PARTITION_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return flash != MAP_FAILED;
+}
+
+const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                const char *label) {
+    if (type != partition.type || (subtype != ESP_PARTITION_SUBTYPE_ANY && subtype != partition.subtype))
+        return NULL;
+    if (label != NULL && strcmp(label, partition.label) != 0) return NULL;
+    if (flash == NULL && !flash_map()) {
+        flash = NULL;
+        return NULL;
+    }
+    return &partition;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *p, size_t src_offset, void *dst, size_t size) {
+    if (src_offset > p->size || size > p->size - src_offset) return ESP_ERR_INVALID_SIZE;
+    memcpy(dst, &flash[src_offset], size);
+    return ESP_OK;
+}
+
+// Bits only go from 1 to 0, as on NOR flash
+esp_err_t esp_partition_write(const esp_partition_t *p, size_t dst_offset, const void *src, size_t size) {
+    if (dst_offset > p->size || size > p->size - dst_offset) return ESP_ERR_INVALID_SIZE;
+    for (size_t i = 0; i < size; i++) flash[dst_offset + i] &= ((const uint8_t*) src)[i];
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *p, size_t offset, size_t size) {
+    if (offset > p->size || size > p->size - offset) return ESP_ERR_INVALID_SIZE;
+    if (offset % SECTOR_SIZE != 0 || size % SECTOR_SIZE != 0) return ESP_ERR_INVALID_ARG;
+    memset(&flash[offset], 0xff, size);
+    return ESP_OK;
+}
@@ -0,0 +1,227 @@
+// UART driver on ttys. A thread per port stands for the RX interrupt: it
+// moves bytes to the ring buffer and posts events the way the driver does.
+#include "errno.h"
+#include "fcntl.h"
+#include "poll.h"
+#include "pthread.h"
+#include "stdlib.h"
+#include "string.h"
+#include "termios.h"
+#include "unistd.h"
+#include "driver/uart.h"
+#include "esp_log.h"
+
+#include "sim.h"
+
+#define RX_FULL_THRESH (120)  // Bytes in the FIFO that raise an interrupt, as the driver sets
+
+typedef struct {
+    bool installed;
+    int fd;                   // -1 if nothing is wired to the port
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t received;
+    uint8_t *rx;              // Ring buffer
+    size_t rx_size;
+    size_t rx_head;
+    size_t rx_len;
+    QueueHandle_t events;
+    int baud_rate;
+    uint8_t rx_timeout;       // Symbols of silence that end a burst
+} sim_uart_t;
+
+static const char *TAG = "uart";
+
+static sim_uart_t uarts[UART_NUM_MAX];
+
+static void uart_post(sim_uart_t *uart, uart_event_type_t type, size_t size, bool timeout_flag) {
+    if (uart->events == NULL) return;
+    uart_event_t event = { .type = type, .size = size, .timeout_flag = timeout_flag };
+    // The driver drops events too when its queue is full
+    xQueueSend(uart->events, &event, 0);
+}
+
+// Time `symbols` characters take on the wire, at least a millisecond
+static int uart_symbols_ms(const sim_uart_t *uart, int symbols) {
+    int ms = symbols * 10 * 1000 / uart->baud_rate;
+    return ms > 0 ? ms : 1;
+}
+
+static void* uart_rx_thread(void *arg) {
+    sim_uart_t *uart = arg;
+    uint8_t fifo[SOC_UART_FIFO_LEN];
+    size_t pending = 0;  // Received since the last UART_DATA event
+    while (true) {
+        struct pollfd pfd = { .fd = uart->fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, pending > 0 ? uart_symbols_ms(uart, uart->rx_timeout) : -1);
+        if (ready == 0) {
+            // The line went idle, what the RX timeout interrupt tells
+            uart_post(uart, UART_DATA, pending, true);
+            pending = 0;
+            continue;
+        }
+        ssize_t len = ready > 0 ? read(uart->fd, fifo, sizeof(fifo)) : -1;
+        if (len <= 0) {
+            // The other end of a pty is gone until it is opened again
+            if (len < 0 && errno != EIO && errno != EAGAIN && errno != EINTR)
+                ESP_LOGE(TAG, "Failed to read port: %s", strerror(errno));
+            usleep(100 * 1000);
+            continue;
+        }
+        pthread_mutex_lock(&uart->lock);
+        size_t kept = 0;
+        for (; kept < (size_t) len && uart->rx_len < uart->rx_size; kept++) {
+            uart->rx[(uart->rx_head + uart->rx_len) % uart->rx_size] = fifo[kept];
+            uart->rx_len++;
+        }
+        pthread_cond_broadcast(&uart->received);
+        pthread_mutex_unlock(&uart->lock);
+        if (kept < (size_t) len) {
+            uart_post(uart, UART_BUFFER_FULL, 0, false);
+            continue;
+        }
+        pending += kept;
+        if (pending >= RX_FULL_THRESH) {
+            uart_post(uart, UART_DATA, pending, false);
+            pending = 0;
+        }
+    }
+    return NULL;
+}
+
+static sim_uart_t* uart_get(uart_port_t port) {
+    if (port < 0 || port >= UART_NUM_MAX || !uarts[port].installed) return NULL;
+    return &uarts[port];
+}
+
+esp_err_t uart_driver_install(uart_port_t port, int rx_buffer_size, int tx_buffer_size, int queue_size,
+                              QueueHandle_t *uart_queue, int intr_alloc_flags) {
+    if (port < 0 || port >= UART_NUM_MAX || rx_buffer_size <= SOC_UART_FIFO_LEN) return ESP_ERR_INVALID_ARG;
+    sim_uart_t *uart = &uarts[port];
+    if (uart->installed) return ESP_FAIL;
+    uart->rx = malloc(rx_buffer_size);
+    if (uart->rx == NULL) return ESP_ERR_NO_MEM;
+    uart->rx_size = rx_buffer_size;
+    uart->rx_head = uart->rx_len = 0;
+    uart->baud_rate = 115200;
+    uart->rx_timeout = 10;
+    pthread_mutex_init(&uart->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&uart->received, &attr);
+    pthread_condattr_destroy(&attr);
+    uart->events = NULL;
+    if (queue_size > 0 && uart_queue != NULL) {
+        uart->events = xQueueCreate(queue_size, sizeof(uart_event_t));
+        if (uart->events == NULL) return ESP_ERR_NO_MEM;
+        *uart_queue = uart->events;
+    }
+    uart->fd = -1;
+    const char *path = sim_options.uart_paths[port];
+    if (path != NULL) {
+        uart->fd = open(path, O_RDWR | O_NOCTTY);
+        if (uart->fd < 0) {
+            ESP_LOGE(TAG, "Failed to open %s for UART%d: %s", path, port, strerror(errno));
+            return ESP_FAIL;
+        }
+        struct termios tio;
+        if (tcgetattr(uart->fd, &tio) == 0) {
+            cfmakeraw(&tio);
+            tcsetattr(uart->fd, TCSANOW, &tio);
+        }
+        pthread_create(&uart->thread, NULL, uart_rx_thread, uart);
+        ESP_LOGI(TAG, "UART%d on %s", port, path);
+    }
+    uart->installed = true;
+    return ESP_OK;
+}
+
+static speed_t uart_speed(int baud_rate) {
+    switch (baud_rate) {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    default: return B115200;
+    }
+}
+
+// Only the baud rate matters, to time the RX timeout and for adapters
+// wired to real sensors
+esp_err_t uart_param_config(uart_port_t port, const uart_config_t *config) {
+    sim_uart_t *uart = uart_get(port);
+    if (uart == NULL || config->baud_rate <= 0) return ESP_ERR_INVALID_ARG;
+    uart->baud_rate = config->baud_rate;
+    struct termios tio;
+    if (uart->fd >= 0 && tcgetattr(uart->fd, &tio) == 0) {
+        cfsetspeed(&tio, uart_speed(config->baud_rate));
+        tcsetattr(uart->fd, TCSANOW, &tio);
+    }
+    return ESP_OK;
+}
+
+esp_err_t uart_set_pin(uart_port_t port, int tx_io_num, int rx_io_num, int rts_io_num, int cts_io_num) {
+    return uart_get(port) != NULL ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t uart_set_rx_timeout(uart_port_t port, uint8_t tout_thresh) {
+    sim_uart_t *uart = uart_get(port);
+    if (uart == NULL) return ESP_ERR_INVALID_ARG;
+    uart->rx_timeout = tout_thresh;
+    return ESP_OK;
+}
+
+int uart_read_bytes(uart_port_t port, void *buf, uint32_t length, TickType_t ticks_to_wait) {
+    sim_uart_t *uart = uart_get(port);
+    if (uart == NULL) return -1;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    uint64_t ns = deadline.tv_nsec + (uint64_t) ticks_to_wait * portTICK_PERIOD_MS * 1000000;
+    deadline.tv_sec += ns / 1000000000;
+    deadline.tv_nsec = ns % 1000000000;
+    pthread_mutex_lock(&uart->lock);
+    while (uart->rx_len < length && ticks_to_wait > 0) {
+        int ret = ticks_to_wait == portMAX_DELAY ? pthread_cond_wait(&uart->received, &uart->lock)
+                                                 : pthread_cond_timedwait(&uart->received, &uart->lock, &deadline);
+        if (ret == ETIMEDOUT) break;
+    }
+    size_t len = uart->rx_len < length ? uart->rx_len : length;
+    for (size_t i = 0; i < len; i++) ((uint8_t*) buf)[i] = uart->rx[(uart->rx_head + i) % uart->rx_size];
+    uart->rx_head = (uart->rx_head + len) % uart->rx_size;
+    uart->rx_len -= len;
+    pthread_mutex_unlock(&uart->lock);
+    return len;
+}
+
+int uart_write_bytes(uart_port_t port, const void *src, size_t size) {
+    sim_uart_t *uart = uart_get(port);
+    if (uart == NULL) return -1;
+    if (uart->fd < 0) return size;  // Nothing on the TX pin
+    size_t written = 0;
+    while (written < size) {
+        ssize_t ret = write(uart->fd, (const uint8_t*) src + written, size - written);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0) return -1;
+        written += ret;
+    }
+    return written;
+}
+
+esp_err_t uart_get_buffered_data_len(uart_port_t port, size_t *size) {
+    sim_uart_t *uart = uart_get(port);
+    if (uart == NULL) return ESP_ERR_INVALID_ARG;
+    pthread_mutex_lock(&uart->lock);
+    *size = uart->rx_len;
+    pthread_mutex_unlock(&uart->lock);
+    return ESP_OK;
+}
+
+esp_err_t uart_flush_input(uart_port_t port) {
+    sim_uart_t *uart = uart_get(port);
+    if (uart == NULL) return ESP_ERR_INVALID_ARG;
+    pthread_mutex_lock(&uart->lock);
+    uart->rx_head = uart->rx_len = 0;
+    pthread_mutex_unlock(&uart->lock);
+    return ESP_OK;
+}
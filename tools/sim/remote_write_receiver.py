@@ -0,0 +1,180 @@
+#!/usr/bin/env python3
+"""Stand in for a Prometheus remote_write receiver, and check what is pushed.
+
+Each request body is decoded from snappy and from the WriteRequest protobuf
+with decoders written from the format specifications, so neither
+python-snappy nor protobuf is needed. A request is refused with 400, and
+reported, if its headers are not the ones the spec requires, if it does not
+decode, or if any series has labels that are not sorted or are missing
+__name__. Accepted series are printed one per line as JSON. With --fail,
+that share of requests is answered 503 or 429 to exercise the retries.
+
+    remote_write_receiver.py --port 9201 > pushed.jsonl
+
+and set METRICS_PUSH_URL to http://<pc-address>:9201/api/v1/write.
+"""
+import argparse
+import http.server
+import json
+import random
+import struct
+import sys
+import threading
+
+
+def varint(buf, pos):
+    value = shift = 0
+    while True:
+        if pos >= len(buf) or shift > 63:
+            raise ValueError('truncated varint')
+        b = buf[pos]
+        pos += 1
+        value |= (b & 0x7f) << shift
+        shift += 7
+        if not b & 0x80:
+            return value, pos
+
+
+def snappy_decode(buf):
+    expected, pos = varint(buf, 0)
+    out = bytearray()
+    while pos < len(buf):
+        tag = buf[pos]
+        pos += 1
+        kind = tag & 3
+        if kind == 0:
+            n = tag >> 2
+            if n >= 60:
+                size = n - 59
+                n = int.from_bytes(buf[pos:pos + size], 'little')
+                pos += size
+            n += 1
+            if pos + n > len(buf):
+                raise ValueError('truncated literal')
+            out += buf[pos:pos + n]
+            pos += n
+            continue
+        if kind == 1:
+            n = 4 + ((tag >> 2) & 7)
+            offset = (tag >> 5) << 8 | buf[pos]
+            pos += 1
+        else:
+            size = 2 if kind == 2 else 4
+            n = (tag >> 2) + 1
+            offset = int.from_bytes(buf[pos:pos + size], 'little')
+            pos += size
+        if offset == 0 or offset > len(out):
+            raise ValueError('copy offset %d out of range' % offset)
+        for _ in range(n):  # May overlap its own output
+            out.append(out[-offset])
+    if len(out) != expected:
+        raise ValueError('decoded %d bytes, header says %d' % (len(out), expected))
+    return bytes(out)
+
+
+def fields(buf):
+    """Yield (field number, wire type, value) of a protobuf message."""
+    pos = 0
+    while pos < len(buf):
+        key, pos = varint(buf, pos)
+        number, wire = key >> 3, key & 7
+        if wire == 0:
+            value, pos = varint(buf, pos)
+        elif wire == 1:
+            value, pos = buf[pos:pos + 8], pos + 8
+        elif wire == 2:
+            n, pos = varint(buf, pos)
+            value, pos = buf[pos:pos + n], pos + n
+        else:
+            raise ValueError('unexpected wire type %d' % wire)
+        if pos > len(buf):
+            raise ValueError('truncated field %d' % number)
+        yield number, wire, value
+
+
+def decode_write_request(buf):
+    series = []
+    for number, wire, ts in fields(buf):
+        if (number, wire) != (1, 2):
+            raise ValueError('unknown WriteRequest field %d' % number)
+        labels, samples = [], []
+        for number, wire, value in fields(ts):
+            if (number, wire) == (1, 2):
+                label = dict((n, v.decode()) for n, w, v in fields(value) if w == 2)
+                labels.append((label.get(1, ''), label.get(2, '')))
+            elif (number, wire) == (2, 2):
+                sample = {n: v for n, w, v in fields(value)}
+                samples.append((struct.unpack('<d', sample.get(1, bytes(8)))[0], sample.get(2, 0)))
+            else:
+                raise ValueError('unknown TimeSeries field %d' % number)
+        names = [n for n, _ in labels]
+        if not names or names[0] != '__name__':
+            raise ValueError('series without __name__ first: %s' % names)
+        if names != sorted(names) or len(set(names)) != len(names):
+            raise ValueError('labels not sorted: %s' % names)
+        series.append({'labels': dict(labels), 'samples': samples})
+    return series
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def refuse(self, status, reason):
+        self.server.stats['refused'] += 1
+        print('refused: %s' % reason, file=sys.stderr)
+        self.reply(status, reason)
+
+    def reply(self, status, body=''):
+        data = body.encode()
+        self.send_response(status)
+        self.send_header('Content-Length', str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def do_POST(self):
+        body = self.rfile.read(int(self.headers.get('Content-Length', 0)))
+        stats = self.server.stats
+        with self.server.lock:
+            stats['requests'] += 1
+            if random.random() < self.server.args.fail:
+                stats['failed'] += 1
+                return self.reply(random.choice((429, 503)))
+            for header, value in (('Content-Encoding', 'snappy'), ('Content-Type', 'application/x-protobuf'),
+                                  ('X-Prometheus-Remote-Write-Version', '0.1.0')):
+                if self.headers.get(header) != value:
+                    return self.refuse(400, '%s is %r' % (header, self.headers.get(header)))
+            try:
+                series = decode_write_request(snappy_decode(body))
+            except (ValueError, IndexError, UnicodeDecodeError, struct.error) as e:
+                return self.refuse(400, str(e))
+            stats['series'] += len(series)
+            stats['bytes'] += len(body)
+            for s in series:
+                print(json.dumps(s), flush=True)
+        self.reply(204)
+
+    def log_message(self, fmt, *args):
+        if self.server.args.verbose:
+            super().log_message(fmt, *args)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--port', type=int, default=9201)
+    parser.add_argument('--fail', type=float, default=0, help='share of requests answered 429 or 503')
+    parser.add_argument('--verbose', action='store_true', help='log every request')
+    args = parser.parse_args()
+
+    server = http.server.ThreadingHTTPServer(('', args.port), Handler)
+    server.args = args
+    server.lock = threading.Lock()
+    server.stats = {'requests': 0, 'failed': 0, 'refused': 0, 'series': 0, 'bytes': 0}
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    print(json.dumps(server.stats), file=sys.stderr)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,184 @@
+#!/usr/bin/env python3
+"""Scrape the exporter from many clients at once and report how it copes.
+
+Each client keeps its connection open and scrapes in a loop, sending back
+the ETag it got like Prometheus does. Reported at the end: scrapes per
+second, latency percentiles, 304 ratio and errors. Given a list of client
+counts, one run is made and reported per count. With --events, the
+output of sensors.py, every base value it announced during the run is
+looked for in the scrapes, and the delay until it first showed is reported
+as the sample-to-scrape latency. Values announced less than --settle
+seconds before the end of a run are not looked for, they may be missed
+only because the run ended.
+
+    sensors.py s8 --port /dev/ttyUSB0 --step 30 > events.jsonl &
+    scrape_load.py http://espair-01/metrics --clients 4 --duration 600 --events events.jsonl
+    scrape_load.py http://espair-01/metrics --clients 1,4,16 --duration 60
+"""
+import argparse
+import http.client
+import json
+import re
+import threading
+import time
+import urllib.parse
+
+# Series carrying the emulated readings. Of SM300D2 that is the mean of
+# the aggregation period, see DIST() in src/metrics_schema.inc.
+WATCHED = {
+    's8': re.compile(rb'^espair_senseairs8_co2_ppm(?:\{[^}]*\})? (\S+)', re.M),
+    'sm300d2': re.compile(rb'^espair_sm300d2_co2_ppm(?:\{[^}]*\})? (\S+)', re.M),
+    'lywsd02': re.compile(rb'^espair_lywsd02_temp_celsius(?:\{[^}]*\})? (\S+)', re.M),
+}
+
+
+class Client(threading.Thread):
+    def __init__(self, url, args, stop, first_seen, lock):
+        super().__init__(daemon=True)
+        self.url = url
+        self.args = args
+        self.stop = stop
+        self.first_seen = first_seen
+        self.lock = lock
+        self.latencies = []
+        self.not_modified = 0
+        self.errors = {}
+        self.reconnects = 0
+
+    def connect(self):
+        self.reconnects += 1
+        cls = http.client.HTTPSConnection if self.url.scheme == 'https' else http.client.HTTPConnection
+        return cls(self.url.netloc, timeout=self.args.timeout)
+
+    def run(self):
+        conn = self.connect()
+        etag = None
+        path = self.url.path or '/'
+        while not self.stop.is_set():
+            headers = {'Accept-Encoding': self.args.encoding} if self.args.encoding else {}
+            if etag is not None and not self.args.no_etag:
+                headers['If-None-Match'] = etag
+            started = time.monotonic()
+            try:
+                conn.request('GET', path, headers=headers)
+                resp = conn.getresponse()
+                body = resp.read()
+            except (OSError, http.client.HTTPException) as e:
+                self.errors[type(e).__name__] = self.errors.get(type(e).__name__, 0) + 1
+                conn.close()
+                conn = self.connect()
+                time.sleep(self.args.interval or 0.1)
+                continue
+            seen_at = time.time()
+            self.latencies.append(time.monotonic() - started)
+            if resp.status == 304:
+                self.not_modified += 1
+            elif resp.status == 200:
+                etag = resp.getheader('ETag')
+                if not self.args.encoding:
+                    self.watch(body, seen_at)
+            else:
+                self.errors[resp.status] = self.errors.get(resp.status, 0) + 1
+            if resp.getheader('Connection', '').lower() == 'close':
+                conn.close()
+                conn = self.connect()
+            if self.args.interval > 0:
+                time.sleep(self.args.interval)
+
+    def watch(self, body, seen_at):
+        for sensor, pattern in WATCHED.items():
+            for value in pattern.findall(body):
+                key = (sensor, round(float(value)))
+                with self.lock:
+                    self.first_seen.setdefault(key, seen_at)
+
+
+def percentile(values, p):
+    if not values:
+        return float('nan')
+    values = sorted(values)
+    return values[min(len(values) - 1, int(p * len(values)))]
+
+
+def sample_to_scrape(events_path, first_seen, since, until):
+    delays = []
+    missed = 0
+    with open(events_path) as f:
+        for line in f:
+            event = json.loads(line)
+            if 'value' not in event or not since <= event['t'] < until:
+                continue
+            sensor = event['sensor'].split('/')[0]
+            seen = first_seen.get((sensor, event['value']))
+            if seen is None or seen < event['t']:
+                missed += 1
+            else:
+                delays.append(seen - event['t'])
+    return delays, missed
+
+
+def run(url, args, count):
+    stop = threading.Event()
+    first_seen = {}
+    lock = threading.Lock()
+    clients = [Client(url, args, stop, first_seen, lock) for _ in range(count)]
+    started = time.monotonic()
+    started_at = time.time()
+    for c in clients:
+        c.start()
+    try:
+        time.sleep(args.duration)
+    except KeyboardInterrupt:
+        pass
+    stop.set()
+    for c in clients:
+        c.join(args.timeout)
+    elapsed = time.monotonic() - started
+    ended_at = time.time()
+
+    latencies = [l for c in clients for l in c.latencies]
+    errors = {}
+    for c in clients:
+        for k, v in c.errors.items():
+            errors[str(k)] = errors.get(str(k), 0) + v
+    report = {
+        'clients': count,
+        'scrapes': len(latencies),
+        'scrapes_per_second': len(latencies) / elapsed,
+        'not_modified': sum(c.not_modified for c in clients),
+        'latency_p50': percentile(latencies, 0.50),
+        'latency_p95': percentile(latencies, 0.95),
+        'latency_max': max(latencies, default=float('nan')),
+        'reconnects': sum(c.reconnects - 1 for c in clients),
+        'errors': errors,
+    }
+    if args.events:
+        delays, missed = sample_to_scrape(args.events, first_seen, started_at, ended_at - args.settle)
+        report['sample_to_scrape_p50'] = percentile(delays, 0.50)
+        report['sample_to_scrape_max'] = max(delays, default=float('nan'))
+        report['sample_to_scrape_missed'] = missed
+    return report
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('url', help='exporter URL, e.g. http://espair-01/metrics')
+    parser.add_argument('--clients', default='1',
+                        help='concurrent clients, or a comma separated list to run in turn, e.g. 1,4,16')
+    parser.add_argument('--duration', type=float, default=60, help='seconds, per run')
+    parser.add_argument('--interval', type=float, default=0, help='seconds between scrapes of a client')
+    parser.add_argument('--timeout', type=float, default=10, help='seconds')
+    parser.add_argument('--encoding', help='Accept-Encoding to send, e.g. gzip')
+    parser.add_argument('--no-etag', action='store_true', help='do not send If-None-Match')
+    parser.add_argument('--events', help='output of sensors.py, for sample-to-scrape latency')
+    parser.add_argument('--settle', type=float, default=0,
+                        help='seconds before the end of a run from which events are not looked for')
+    args = parser.parse_args()
+
+    url = urllib.parse.urlsplit(args.url)
+    for count in (int(c) for c in args.clients.split(',')):
+        print(json.dumps(run(url, args, count), indent=2), flush=True)
+
+
+if __name__ == '__main__':
+    main()
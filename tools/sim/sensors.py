@@ -0,0 +1,252 @@
+#!/usr/bin/env python3
+"""Emulate SM300D2, Senseair S8 and LYWSD02, with injected faults.
+
+Each serial sensor talks on a pty, or on a USB-UART adapter wired to the RX
+(and TX for S8) pins of a board with no sensor attached. LYWSD02 clocks
+send their MiBeacon advertisements to the UDP port the host firmware of
+tools/sim/host/ takes them on, there is no radio. Readings wander around
+a base value. Every --step seconds the base changes to a value not used
+before, and a JSON line {"t", "sensor", "value"} is printed, so that
+scrape_load.py can tell how long the change took to be scraped. Keep
+--noise at 0 for that, or the announced values are never published as is.
+
+    sensors.py s8 --port /dev/ttyUSB0 --drop 0.001 --corrupt 0.05
+    sensors.py sm300d2 --pty --noise 0.02
+    sensors.py lywsd02 --udp 9102
+"""
+import argparse
+import json
+import os
+import random
+import select
+import socket
+import sys
+import termios
+import time
+import tty
+
+SM300D2_ADDRESS = 0x3c
+SM300D2_VERSION = 0x02
+MODBUS_READ_INPUT_REGISTERS = 0x04
+MODBUS_READ_HOLDING_REGISTERS = 0x03
+MIBEACON_UUID = 0xfe95
+MIBEACON_FRAME = 0x2050  # Version 2, has MAC & object, unencrypted
+LYWSD02_PRODUCT_ID = 0x045b
+MIBEACON_TEMP = 0x1004
+MIBEACON_HUMI = 0x1006
+MIBEACON_BATTERY = 0x100a
+
+
+def crc16(data):
+    crc = 0xffff
+    for b in data:
+        crc ^= b
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0xa001 if crc & 1 else crc >> 1
+    return crc
+
+
+def open_port(args):
+    if args.udp:
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sock.connect(('127.0.0.1', args.udp))
+        return sock.fileno(), sock
+    if args.pty:
+        master, slave = os.openpty()
+        tty.setraw(slave)
+        print(json.dumps({'pty': os.ttyname(slave)}), flush=True)
+        return master, None
+    fd = os.open(args.port, os.O_RDWR | os.O_NOCTTY)
+    tty.setraw(fd)
+    attrs = termios.tcgetattr(fd)
+    attrs[4] = attrs[5] = termios.B9600
+    termios.tcsetattr(fd, termios.TCSANOW, attrs)
+    return fd, None
+
+
+class Faults:
+    """Byte drops and corruption applied to each frame sent."""
+
+    def __init__(self, args):
+        self.drop = args.drop
+        self.corrupt = args.corrupt
+        self.noise = args.noise
+        self.sent = self.dropped = self.corrupted = 0
+
+    def value(self, base):
+        return base * (1 + random.gauss(0, self.noise)) if self.noise > 0 else base
+
+    def apply(self, frame):
+        frame = bytearray(frame)
+        if random.random() < self.corrupt:
+            frame[random.randrange(len(frame))] ^= 1 << random.randrange(8)
+            self.corrupted += 1
+        kept = bytearray(b for b in frame if random.random() >= self.drop)
+        self.dropped += len(frame) - len(kept)
+        self.sent += 1
+        return bytes(kept)
+
+
+class Stepper:
+    """Base value changing every `period` seconds, never to a value seen."""
+
+    def __init__(self, sensor, base, period):
+        self.sensor = sensor
+        self.base = base
+        self.period = period
+        self.seen = {base}
+        self.next_step = time.monotonic() + period if period > 0 else None
+        self.announce()
+
+    def announce(self):
+        print(json.dumps({'t': time.time(), 'sensor': self.sensor, 'value': self.base}), flush=True)
+
+    def get(self):
+        if self.next_step is not None and time.monotonic() >= self.next_step:
+            self.next_step += self.period
+            while self.base in self.seen:
+                self.base += random.choice((-1, 1)) * random.randint(1, 50)
+            self.seen.add(self.base)
+            self.announce()
+        return self.base
+
+
+def sm300d2_frame(faults, co2, temp):
+    temp_centi = round(faults.value(temp) * 100)
+    humi_centi = round(faults.value(45.0) * 100)
+    values = [round(faults.value(co2)), round(faults.value(12)), round(faults.value(40)),
+              round(faults.value(8)), round(faults.value(11))]
+    frame = bytearray([SM300D2_ADDRESS, SM300D2_VERSION])
+    for v in values:
+        frame += max(0, min(v, 0xffff)).to_bytes(2, 'big')
+    # Decoded as signed degrees * 100 + hundredths, see sm300d2_parse_data()
+    frame += bytes([(temp_centi // 100) & 0xff, temp_centi % 100, humi_centi // 100, humi_centi % 100])
+    frame.append(sum(frame) & 0xff)
+    return bytes(frame)
+
+
+def run_sm300d2(args, fd, faults):
+    stepper = Stepper('sm300d2', args.base or 600, args.step)
+    while True:
+        os.write(fd, faults.apply(sm300d2_frame(faults, stepper.get(), args.temp)))
+        time.sleep(1) # Sends one frame per second on its own
+
+
+def modbus_response(addr, regs):
+    frame = bytearray([addr, MODBUS_READ_INPUT_REGISTERS, len(regs) * 2])
+    for r in regs:
+        frame += (r & 0xffff).to_bytes(2, 'big')
+    return bytes(frame) + crc16(frame).to_bytes(2, 'little')
+
+
+def modbus_exception(addr, func, code):
+    frame = bytes([addr, func | 0x80, code])
+    return frame + crc16(frame).to_bytes(2, 'little')
+
+
+def run_s8(args, fd, faults):
+    addresses = [int(a, 0) for a in args.addresses.split(',')]
+    steppers = {a: Stepper('s8/%d' % a, (args.base or 800) + i * 1000, args.step)
+                for i, a in enumerate(addresses)}
+    buf = b''
+    while True:
+        r, _, _ = select.select([fd], [], [], 1)
+        if not r:
+            buf = b'' # Idle gap, the frame is over
+            continue
+        buf += os.read(fd, 256)
+        # Requests of functions 3, 4 & 6 are all 8 bytes, resync on CRC
+        while len(buf) >= 8:
+            req = buf[:8]
+            if crc16(req) != 0:
+                buf = buf[1:]
+                continue
+            buf = buf[8:]
+            addr, func = req[0], req[1]
+            reg, count = int.from_bytes(req[2:4], 'big'), int.from_bytes(req[4:6], 'big')
+            # 0xfe is "any address", the sensor replies with its own
+            target = addresses[0] if addr == 0xfe else addr
+            if target not in steppers:
+                continue
+            if func not in (MODBUS_READ_INPUT_REGISTERS, MODBUS_READ_HOLDING_REGISTERS):
+                resp = modbus_exception(target, func, 1)
+            elif reg + count > 4 or count == 0:
+                resp = modbus_exception(target, func, 2)
+            else:
+                co2 = round(faults.value(steppers[target].get()))
+                resp = modbus_response(target, [0, 0, 0, co2][reg:reg + count])
+            time.sleep(args.latency)
+            os.write(fd, faults.apply(resp))
+
+
+def mibeacon_adv(mac, counter, obj_type, obj):
+    frame = MIBEACON_FRAME.to_bytes(2, 'little') + LYWSD02_PRODUCT_ID.to_bytes(2, 'little')
+    frame += bytes([counter & 0xff]) + bytes(reversed(mac))
+    frame += obj_type.to_bytes(2, 'little') + bytes([len(obj)]) + obj
+    svc_data = MIBEACON_UUID.to_bytes(2, 'little') + frame
+    # Flags, then service data
+    return bytes([2, 0x01, 0x06, len(svc_data) + 1, 0x16]) + svc_data
+
+
+def run_lywsd02(args, fd, faults):
+    """Each clock advertises temperature and humidity in turn, and its
+    battery level now and then, as one datagram: its MAC, then the data."""
+    macs = [bytes.fromhex(a.replace(':', '')) for a in args.addresses.split(',')]
+    steppers = [Stepper('lywsd02/%s' % a.strip(), (args.base or 22) + i * 100, args.step)
+                for i, a in enumerate(args.addresses.split(','))]
+    counter = 0
+    while True:
+        for mac, stepper in zip(macs, steppers):
+            temp_deci = round(faults.value(stepper.get()) * 10)
+            humi_deci = round(faults.value(45.0) * 10)
+            objs = [(MIBEACON_TEMP, (temp_deci & 0xffff).to_bytes(2, 'little')),
+                    (MIBEACON_HUMI, humi_deci.to_bytes(2, 'little'))]
+            if counter % 10 == 0:
+                objs.append((MIBEACON_BATTERY, bytes([87])))
+            for obj_type, obj in objs:
+                adv = faults.apply(mibeacon_adv(mac, counter, obj_type, obj))
+                try:
+                    os.write(fd, mac + adv)
+                except ConnectionRefusedError:
+                    pass # Not scanning yet, like a clock out of range
+        counter += 1
+        time.sleep(1)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('sensor', choices=('sm300d2', 's8', 'lywsd02'))
+    where = parser.add_mutually_exclusive_group(required=True)
+    where.add_argument('--port', help='serial device, e.g. /dev/ttyUSB0')
+    where.add_argument('--pty', action='store_true', help='create a pty and print its name')
+    where.add_argument('--udp', type=int, help='LYWSD02 only, UDP port of the host firmware on localhost')
+    parser.add_argument('--addresses',
+                        help='S8 Modbus addresses (default 254) or LYWSD02 MACs '
+                             '(default 01:23:de:ad:be:ef,01:23:de:ad:be:f0), comma separated')
+    parser.add_argument('--base', type=int, help='CO2 in ppm, or LYWSD02 temperature in celsius, to start from')
+    parser.add_argument('--temp', type=float, default=22.5, help='SM300D2 temperature in celsius')
+    parser.add_argument('--step', type=float, default=60, help='seconds between base changes, 0 for never')
+    parser.add_argument('--noise', type=float, default=0, help='relative standard deviation of readings')
+    parser.add_argument('--drop', type=float, default=0, help='probability of dropping each byte')
+    parser.add_argument('--corrupt', type=float, default=0, help='probability of flipping a bit per frame')
+    parser.add_argument('--latency', type=float, default=0.02, help='S8 response delay in seconds')
+    parser.add_argument('--seed', type=int)
+    args = parser.parse_args()
+    if (args.sensor == 'lywsd02') != (args.udp is not None):
+        parser.error('LYWSD02 takes --udp, the others --port or --pty')
+    if args.addresses is None:
+        args.addresses = '01:23:de:ad:be:ef,01:23:de:ad:be:f0' if args.sensor == 'lywsd02' else '254'
+    random.seed(args.seed)
+
+    fd, _sock = open_port(args)
+    faults = Faults(args)
+    run = {'sm300d2': run_sm300d2, 's8': run_s8, 'lywsd02': run_lywsd02}[args.sensor]
+    try:
+        run(args, fd, faults)
+    except KeyboardInterrupt:
+        print(json.dumps({'frames': faults.sent, 'dropped_bytes': faults.dropped,
+                          'corrupted_frames': faults.corrupted}), file=sys.stderr)
+
+
+if __name__ == '__main__':
+    main()